@@ -0,0 +1,274 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include "dwc2_fifo_plan.h"
+
+#define DESC_TYPE_CONFIGURATION 0x02
+#define DESC_TYPE_ENDPOINT      0x05
+
+#define EP_TYPE_CONTROL         0x00
+#define EP_TYPE_ISOCHRONOUS     0x01
+#define EP_TYPE_BULK            0x02
+#define EP_TYPE_INTERRUPT       0x03
+
+#define BYTES_TO_WORDS(n)       (((n) + 3) / 4)
+
+typedef struct {
+    bool used;
+    uint8_t type;
+    uint16_t mps;
+} ep_info_t;
+
+typedef struct {
+    ep_info_t in[DWC2_FIFO_PLAN_TX_NUM];
+    uint16_t out_mask;
+    uint8_t out_num;
+    uint16_t out_max_mps;
+    bool too_many;
+} ep_summary_t;
+
+/* Bytes the FIFO has to hold for one (micro)frame's worth of packets of this endpoint */
+static uint16_t ep_packet_bytes(uint16_t w_max_packet_size)
+{
+    uint16_t mult = ((w_max_packet_size >> 11) & 0x3) + 1;
+    return (w_max_packet_size & 0x7ff) * mult;
+}
+
+static void collect_endpoint(ep_summary_t *summary, const uint8_t *ep_desc)
+{
+    uint8_t addr = ep_desc[2];
+    uint8_t num = addr & 0x0f;
+    uint8_t type = ep_desc[3] & 0x03;
+    uint16_t mps = ep_packet_bytes(ep_desc[4] | (ep_desc[5] << 8));
+
+    if (addr & 0x80) {
+        if (num >= DWC2_FIFO_PLAN_TX_NUM) {
+            summary->too_many = true;
+            return;
+        }
+        ep_info_t *ep = &summary->in[num];
+        if (!ep->used || mps > ep->mps) {
+            ep->mps = mps;
+        }
+        ep->used = true;
+        ep->type = type;
+    } else {
+        if (!(summary->out_mask & (1 << num))) {
+            summary->out_mask |= 1 << num;
+            summary->out_num++;
+        }
+        if (mps > summary->out_max_mps) {
+            summary->out_max_mps = mps;
+        }
+    }
+}
+
+static void collect_endpoints(ep_summary_t *summary, const uint8_t *desc, uint32_t len)
+{
+    uint32_t offset = 0;
+
+    while (offset + 2 <= len && desc[offset] != 0) {
+        uint8_t b_length = desc[offset];
+        if (desc[offset + 1] == DESC_TYPE_CONFIGURATION && b_length >= 4 && offset + 4 <= len) {
+            uint32_t total = desc[offset + 2] | (desc[offset + 3] << 8);
+            uint32_t end = offset + total;
+            uint32_t sub = offset + b_length;
+            if (end > len) {
+                end = len;
+            }
+            while (sub + 2 <= end && desc[sub] != 0) {
+                if (desc[sub + 1] == DESC_TYPE_ENDPOINT && desc[sub] >= 7 && sub + 7 <= end) {
+                    collect_endpoint(summary, &desc[sub]);
+                }
+                sub += desc[sub];
+            }
+            offset = end > offset + b_length ? end : offset + b_length;
+            continue;
+        }
+        offset += b_length;
+    }
+}
+
+/* RX FIFO for one control endpoint, per the DWC2 programming guide, with @p packets largest packets */
+static uint16_t rx_words_for(const ep_summary_t *summary, uint16_t ep0_mps, uint16_t packets)
+{
+    uint16_t largest = summary->out_max_mps > ep0_mps ? summary->out_max_mps : ep0_mps;
+
+    return (4 * 1 + 6) + packets * (BYTES_TO_WORDS(largest) + 1) + 2 * (summary->out_num + 1) + 1;
+}
+
+int dwc2_fifo_plan(const uint8_t *desc, uint32_t len, const dwc2_fifo_plan_limits_t *limits, struct dwc2_fifo_plan *plan)
+{
+    ep_summary_t summary;
+    struct dwc2_fifo_plan result;
+    uint32_t used;
+
+    if (desc == NULL || limits == NULL || plan == NULL || limits->tx_fifo_num == 0 || limits->tx_fifo_num > DWC2_FIFO_PLAN_TX_NUM) {
+        return -1;
+    }
+    memset(&summary, 0, sizeof(summary));
+    memset(&result, 0, sizeof(result));
+    collect_endpoints(&summary, desc, len);
+    if (summary.too_many) {
+        return -1;
+    }
+    for (int i = limits->tx_fifo_num; i < DWC2_FIFO_PLAN_TX_NUM; i++) {
+        if (summary.in[i].used) {
+            return -1;
+        }
+    }
+
+    // 最低要求：RX 单包，EP0 单包（不少于 16 字），其余 IN 端点单包
+    result.rx_words = rx_words_for(&summary, limits->ep0_mps, 1);
+    result.tx_words[0] = BYTES_TO_WORDS(limits->ep0_mps) < 16 ? 16 : BYTES_TO_WORDS(limits->ep0_mps);
+    used = result.rx_words + result.tx_words[0];
+    for (int i = 1; i < limits->tx_fifo_num; i++) {
+        if (summary.in[i].used) {
+            result.tx_words[i] = BYTES_TO_WORDS(summary.in[i].mps);
+            used += result.tx_words[i];
+        }
+    }
+    if (used > limits->total_words) {
+        return -1;
+    }
+
+    // 双缓冲：先等时，再批量
+    static const uint8_t double_buffer_order[] = { EP_TYPE_ISOCHRONOUS, EP_TYPE_BULK };
+    for (size_t k = 0; k < sizeof(double_buffer_order); k++) {
+        for (int i = 1; i < limits->tx_fifo_num; i++) {
+            if (!summary.in[i].used || summary.in[i].type != double_buffer_order[k]) {
+                continue;
+            }
+            uint16_t extra = BYTES_TO_WORDS(summary.in[i].mps);
+            if (used + extra <= limits->total_words) {
+                result.tx_words[i] += extra;
+                used += extra;
+            }
+        }
+    }
+
+    uint16_t rx_double = rx_words_for(&summary, limits->ep0_mps, 2);
+    if (used - result.rx_words + rx_double <= limits->total_words) {
+        used += rx_double - result.rx_words;
+        result.rx_words = rx_double;
+    }
+    result.rx_words += limits->total_words - used;
+
+    *plan = result;
+    return 0;
+}
+
+void dwc2_fifo_plan_dump(const struct dwc2_fifo_plan *plan, FILE *stream)
+{
+    uint32_t offset = 0;
+
+    fprintf(stream, "RX   offset %4u size %4u words\n", (unsigned)offset, plan->rx_words);
+    offset += plan->rx_words;
+    for (int i = 0; i < DWC2_FIFO_PLAN_TX_NUM; i++) {
+        if (plan->tx_words[i] == 0) {
+            continue;
+        }
+        fprintf(stream, "TX%d  offset %4u size %4u words\n", i, (unsigned)offset, plan->tx_words[i]);
+        offset += plan->tx_words[i];
+    }
+    fprintf(stream, "total %u words\n", (unsigned)offset);
+}
+
+#define HOST_EP0_MPS            64
+/* Smallest TX FIFO programmed, so the queue never has to be reprogrammed for a short packet */
+#define HOST_TX_MIN_WORDS       16
+
+int dwc2_host_fifo_plan(const dwc2_fifo_plan_ep_t *eps, uint32_t ep_num, uint16_t total_words, struct dwc2_host_fifo_plan *plan)
+{
+    struct dwc2_host_fifo_plan result;
+    uint16_t in_max = HOST_EP0_MPS;
+    uint16_t np_out_max = HOST_EP0_MPS;
+    uint16_t p_out_max = 0;
+    uint16_t np_in_num = 1;
+    bool in_stream = false;
+    bool np_out_stream = false;
+    bool p_out_stream = false;
+    uint32_t used;
+
+    if ((eps == NULL && ep_num > 0) || plan == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < ep_num; i++) {
+        uint8_t type = eps[i].type & 0x03;
+        uint16_t mps = ep_packet_bytes(eps[i].mps);
+
+        if (type == EP_TYPE_CONTROL) {
+            continue;
+        }
+        if (eps[i].addr & 0x80) {
+            if (mps > in_max) {
+                in_max = mps;
+            }
+            if (type == EP_TYPE_BULK) {
+                np_in_num++;
+            }
+            if (type == EP_TYPE_BULK || type == EP_TYPE_ISOCHRONOUS) {
+                in_stream = true;
+            }
+        } else if (type == EP_TYPE_BULK) {
+            if (mps > np_out_max) {
+                np_out_max = mps;
+            }
+            np_out_stream = true;
+        } else {
+            if (mps > p_out_max) {
+                p_out_max = mps;
+            }
+            if (type == EP_TYPE_ISOCHRONOUS) {
+                p_out_stream = true;
+            }
+        }
+    }
+
+    // 最低要求：RX 单包 + 状态字 + 传输完成字 + 每个控制/批量 IN 通道一个 NAK/NYET 位置
+    uint16_t rx_packet = BYTES_TO_WORDS(in_max);
+    uint16_t np_packet = BYTES_TO_WORDS(np_out_max);
+    uint16_t p_packet = BYTES_TO_WORDS(p_out_max);
+    result.rx_words = rx_packet + 1 + 1 + np_in_num;
+    result.nptx_words = np_packet < HOST_TX_MIN_WORDS ? HOST_TX_MIN_WORDS : np_packet;
+    result.ptx_words = p_packet < HOST_TX_MIN_WORDS ? HOST_TX_MIN_WORDS : p_packet;
+    used = result.rx_words + result.nptx_words + result.ptx_words;
+    if (used > total_words) {
+        return -1;
+    }
+
+    // 双缓冲：先 IN 数据流，再批量 OUT，最后等时 OUT
+    if (in_stream && used + rx_packet <= total_words) {
+        result.rx_words += rx_packet;
+        used += rx_packet;
+    }
+    if (np_out_stream && result.nptx_words < 2 * np_packet && used + np_packet <= total_words) {
+        result.nptx_words += np_packet;
+        used += np_packet;
+    }
+    if (p_out_stream && result.ptx_words < 2 * p_packet && used + p_packet <= total_words) {
+        result.ptx_words += p_packet;
+        used += p_packet;
+    }
+    if (np_out_stream && !in_stream) {
+        result.nptx_words += total_words - used;
+    } else {
+        result.rx_words += total_words - used;
+    }
+
+    *plan = result;
+    return 0;
+}
+
+void dwc2_host_fifo_plan_dump(const struct dwc2_host_fifo_plan *plan, FILE *stream)
+{
+    fprintf(stream, "RX   offset %4u size %4u words\n", 0u, plan->rx_words);
+    fprintf(stream, "NPTX offset %4u size %4u words\n", (unsigned)plan->rx_words, plan->nptx_words);
+    fprintf(stream, "PTX  offset %4u size %4u words\n", (unsigned)(plan->rx_words + plan->nptx_words), plan->ptx_words);
+    fprintf(stream, "total %u words\n", (unsigned)(plan->rx_words + plan->nptx_words + plan->ptx_words));
+}
@@ -0,0 +1,120 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* TX FIFOs addressable by the DWC2 port (TX0..TX8), indexed by IN endpoint number */
+#define DWC2_FIFO_PLAN_TX_NUM 9
+
+/**
+ * @brief FIFO partition, all sizes in 32-bit words
+ */
+struct dwc2_fifo_plan {
+    uint16_t rx_words;                          /*!< Shared RX FIFO */
+    uint16_t tx_words[DWC2_FIFO_PLAN_TX_NUM];   /*!< Dedicated TX FIFO of each IN endpoint number */
+};
+
+/**
+ * @brief Hardware limits the plan has to fit in
+ */
+typedef struct {
+    uint16_t total_words;   /*!< FIFO RAM available for RX and all TX FIFOs */
+    uint8_t tx_fifo_num;    /*!< Number of TX FIFOs including EP0, IN endpoint numbers must be below this */
+    uint16_t ep0_mps;       /*!< EP0 max packet size in bytes */
+} dwc2_fifo_plan_limits_t;
+
+/**
+ * @brief Compute a FIFO partition for a device descriptor set
+ *
+ * Walks every configuration descriptor found in @p desc (the same blob that is
+ * passed to usbd_desc_register(), terminated by a zero-length entry or @p len)
+ * and sizes the FIFOs from the endpoints it declares. The same endpoint in
+ * several alternate settings or configurations counts once with its largest
+ * packet size.
+ *
+ * Every IN endpoint first gets one packet. Bulk and isochronous IN endpoints
+ * are then raised to two packets, so the core can fill one while the other is
+ * on the bus, isochronous first. The RX FIFO gets room for two of the largest
+ * OUT packets if that still fits. Whatever is left goes to the RX FIFO.
+ *
+ * Pure function: does not touch hardware and has no side effects.
+ *
+ * @param desc   Descriptor blob
+ * @param len    Upper bound of the blob length in bytes
+ * @param limits Hardware limits
+ * @param plan   Output
+ * @return 0 on success, -1 if the endpoints cannot fit (plan is left untouched)
+ */
+int dwc2_fifo_plan(const uint8_t *desc, uint32_t len, const dwc2_fifo_plan_limits_t *limits, struct dwc2_fifo_plan *plan);
+
+/**
+ * @brief Print the FIFO layout in RAM order with word offsets
+ */
+void dwc2_fifo_plan_dump(const struct dwc2_fifo_plan *plan, FILE *stream);
+
+/**
+ * @brief Host mode FIFO partition, all sizes in 32-bit words
+ */
+struct dwc2_host_fifo_plan {
+    uint16_t rx_words;      /*!< Shared RX FIFO, data of all IN channels */
+    uint16_t nptx_words;    /*!< Non-periodic TX FIFO, control and bulk OUT */
+    uint16_t ptx_words;     /*!< Periodic TX FIFO, interrupt and isochronous OUT */
+};
+
+/**
+ * @brief One endpoint of an attached device, as seen by the host planner
+ */
+typedef struct {
+    uint8_t addr;           /*!< bEndpointAddress */
+    uint8_t type;           /*!< bmAttributes transfer type, 0..3 */
+    uint16_t mps;           /*!< wMaxPacketSize, including the additional transaction bits */
+} dwc2_fifo_plan_ep_t;
+
+/**
+ * @brief Compute a host mode FIFO partition for the endpoints in use on the bus
+ *
+ * Control endpoint 0 is always accounted for with a 64 byte packet. Each FIFO
+ * first gets one of the largest packets it has to carry. Then, in this order
+ * and while space allows, the RX FIFO is raised to two packets if a bulk or
+ * isochronous IN endpoint is present (MSC, network, UVC), the non-periodic TX
+ * FIFO if a bulk OUT endpoint is present and the periodic TX FIFO if an
+ * isochronous OUT endpoint is present. The remainder goes to the RX FIFO, or to
+ * the non-periodic TX FIFO when the device only streams out.
+ *
+ * Pure function: does not touch hardware and has no side effects.
+ *
+ * @param eps         Endpoints of the bound interfaces of every attached device
+ * @param ep_num      Number of entries in @p eps
+ * @param total_words FIFO RAM available in words
+ * @param plan        Output
+ * @return 0 on success, -1 if the endpoints cannot fit (plan is left untouched)
+ */
+int dwc2_host_fifo_plan(const dwc2_fifo_plan_ep_t *eps, uint32_t ep_num, uint16_t total_words, struct dwc2_host_fifo_plan *plan);
+
+/**
+ * @brief Print a host mode FIFO layout in RAM order with word offsets
+ */
+void dwc2_host_fifo_plan_dump(const struct dwc2_host_fifo_plan *plan, FILE *stream);
+
+/**
+ * @brief Get the host mode FIFO split currently programmed
+ *
+ * Available with CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO. The split is planned from the
+ * endpoints of a device when it is configured while no other device is attached,
+ * before its class drivers start; it is kept while further devices come and go.
+ */
+void usbh_dwc2_get_fifo_plan(struct dwc2_host_fifo_plan *plan);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,12 +6,64 @@
 #include "sdkconfig.h"
 #include "esp_idf_version.h"
 #include "esp_intr_alloc.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#if defined(CONFIG_CHERRYUSB_INTR_CORE_ID) && CONFIG_CHERRYUSB_INTR_CORE_ID >= 0
+#define USB_INTR_PIN_CORE                   1
+#include "esp_ipc.h"
+#endif
 #include "esp_private/usb_phy.h"
+#include "esp_private/esp_clk.h"
+#ifdef CONFIG_CHERRYUSB_PM
+#include "esp_pm.h"
+#include "esp_timer.h"
+#endif
 #include "soc/periph_defs.h"
 #include "usb_config.h"
 #include "usb_log.h"
 #ifdef CONFIG_CHERRYUSBH_ENABLED
 #include "usbh_core.h"
+#include "usb_osal_ext.h"
+#endif
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+#include <string.h>
+#include "esp_timer.h"
+#include "dwc2_fifo_plan.h"
+#endif
+#ifdef CONFIG_CHERRYUSBH_VPIPE
+#include <string.h>
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "usbh_vpipe.h"
+#endif
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+#include <string.h>
+#include "esp_timer.h"
+#include "freertos/task.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_cpu.h"
+#define usb_cycle_count()                   esp_cpu_get_cycle_count()
+#else
+#include "hal/cpu_hal.h"
+#define usb_cycle_count()                   cpu_hal_get_cycle_count()
+#endif
+#include "usb_errno.h"
+#include "usbh_dispatch.h"
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+#include "usbh_urb_queue.h"
+#endif
+#endif
+#ifdef CONFIG_CHERRYUSBH_ENUM_STATS
+#include "usbh_enum.h"
+#endif
+#ifdef CONFIG_CHERRYUSBH_DMA_BOUNCE
+#include <string.h>
+#include "esp_heap_caps.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_memory_utils.h"
+#else
+#include "soc/soc_memory_layout.h"
+#endif
 #endif
 
 #ifdef CONFIG_IDF_TARGET_ESP32S2
@@ -22,16 +74,264 @@
 #define DEFAULT_CPU_FREQ_MHZ                160
 #endif
 
+#if CONFIG_CHERRYUSB_INTR_LEVEL_1
+#define USB_INTR_FLAG_LEVEL                 ESP_INTR_FLAG_LEVEL1
+#elif CONFIG_CHERRYUSB_INTR_LEVEL_2
+#define USB_INTR_FLAG_LEVEL                 ESP_INTR_FLAG_LEVEL2
+#elif CONFIG_CHERRYUSB_INTR_LEVEL_3
+#define USB_INTR_FLAG_LEVEL                 ESP_INTR_FLAG_LEVEL3
+#else
+#define USB_INTR_FLAG_LEVEL                 ESP_INTR_FLAG_LOWMED
+#endif
+
+#ifdef CONFIG_CHERRYUSB_ISR_IRAM
+#define USB_INTR_FLAGS                      (USB_INTR_FLAG_LEVEL | ESP_INTR_FLAG_IRAM)
+#else
+#define USB_INTR_FLAGS                      USB_INTR_FLAG_LEVEL
+#endif
+
 uint32_t SystemCoreClock = (DEFAULT_CPU_FREQ_MHZ*1000*1000);
 static usb_phy_handle_t s_phy_handle = NULL;
 static intr_handle_t s_interrupt_handle = NULL;
 
-static void usb_interrupt_cb(void *arg_pv)
+typedef struct {
+    intr_handler_t handler;
+    esp_err_t ret;
+} usb_intr_alloc_arg_t;
+
+static void usb_intr_alloc_on_core(void *arg)
+{
+    usb_intr_alloc_arg_t *alloc_arg = (usb_intr_alloc_arg_t *)arg;
+    alloc_arg->ret = esp_intr_alloc(ETS_USB_INTR_SOURCE, USB_INTR_FLAGS, alloc_arg->handler, NULL, &s_interrupt_handle);
+}
+
+// The interrupt is bound to the core that allocates it
+static esp_err_t usb_intr_alloc(intr_handler_t handler)
+{
+    usb_intr_alloc_arg_t arg = {
+        .handler = handler,
+        .ret = ESP_FAIL,
+    };
+#if USB_INTR_PIN_CORE
+    if (xPortGetCoreID() != CONFIG_CHERRYUSB_INTR_CORE_ID) {
+        esp_err_t ret = esp_ipc_call_blocking(CONFIG_CHERRYUSB_INTR_CORE_ID, usb_intr_alloc_on_core, &arg);
+        return ret == ESP_OK ? arg.ret : ret;
+    }
+#endif
+    usb_intr_alloc_on_core(&arg);
+    return arg.ret;
+}
+
+#ifdef CONFIG_CHERRYUSB_PM
+/*
+ * While attached (initialized host port, or device from the first bus reset until disconnect)
+ * light sleep is blocked: the OTG controller is not a wake-up source, so a gated controller
+ * would miss the resume or reset that ends a suspend. While the bus is active (attached and
+ * not suspended) the CPU is held at maximum frequency as long as transfers keep completing.
+ * The frequency lock is dropped after CONFIG_CHERRYUSB_PM_IDLE_TIMEOUT_MS without transfers
+ * and re-taken by the next one.
+ */
+static esp_pm_lock_handle_t s_pm_cpu_lock = NULL;
+static esp_pm_lock_handle_t s_pm_sleep_lock = NULL;
+static esp_timer_handle_t s_pm_idle_timer = NULL;
+static portMUX_TYPE s_pm_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_pm_attached;
+static bool s_pm_bus_active;
+static bool s_pm_cpu_held;
+static bool s_pm_activity;
+
+static void usb_pm_idle_check(void *arg)
+{
+    bool release = false;
+
+    portENTER_CRITICAL(&s_pm_spinlock);
+    if (s_pm_cpu_held && !s_pm_activity) {
+        s_pm_cpu_held = false;
+        release = true;
+    }
+    s_pm_activity = false;
+    portEXIT_CRITICAL(&s_pm_spinlock);
+    if (release) {
+        esp_pm_lock_release(s_pm_cpu_lock);
+    }
+}
+
+static void USB_ISR_ATTR usb_pm_activity(void)
+{
+    bool acquire = false;
+
+    if (s_pm_cpu_lock == NULL) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&s_pm_spinlock);
+    s_pm_activity = true;
+    if (s_pm_bus_active && !s_pm_cpu_held) {
+        s_pm_cpu_held = true;
+        acquire = true;
+    }
+    portEXIT_CRITICAL_SAFE(&s_pm_spinlock);
+    if (acquire) {
+        esp_pm_lock_acquire(s_pm_cpu_lock);
+    }
+}
+
+// Called from the USB interrupt on reset/disconnect, and from init/deinit
+static void USB_ISR_ATTR usb_pm_set_attached(bool attached)
+{
+    bool changed = false;
+
+    if (s_pm_sleep_lock == NULL) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&s_pm_spinlock);
+    if (s_pm_attached != attached) {
+        s_pm_attached = attached;
+        changed = true;
+    }
+    portEXIT_CRITICAL_SAFE(&s_pm_spinlock);
+    if (!changed) {
+        return;
+    }
+    if (attached) {
+        esp_pm_lock_acquire(s_pm_sleep_lock);
+    } else {
+        esp_pm_lock_release(s_pm_sleep_lock);
+    }
+}
+
+// Called from the USB interrupt on reset/resume/suspend/disconnect, and from init/deinit
+static void USB_ISR_ATTR usb_pm_set_bus_active(bool active)
+{
+    bool changed = false;
+    bool release_cpu = false;
+
+    if (s_pm_cpu_lock == NULL) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&s_pm_spinlock);
+    if (s_pm_bus_active != active) {
+        s_pm_bus_active = active;
+        changed = true;
+        if (!active && s_pm_cpu_held) {
+            s_pm_cpu_held = false;
+            release_cpu = true;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&s_pm_spinlock);
+    if (!changed) {
+        return;
+    }
+    if (active) {
+        usb_pm_activity();
+        esp_timer_start_periodic(s_pm_idle_timer, CONFIG_CHERRYUSB_PM_IDLE_TIMEOUT_MS * 1000);
+    } else {
+        esp_timer_stop(s_pm_idle_timer);
+        if (release_cpu) {
+            esp_pm_lock_release(s_pm_cpu_lock);
+        }
+    }
+}
+
+static void usb_pm_init(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = usb_pm_idle_check,
+        .name = "usb_pm_idle",
+    };
+
+    if (s_pm_cpu_lock) {
+        return;
+    }
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "usb_cpu", &s_pm_cpu_lock) != ESP_OK ||
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "usb_sleep", &s_pm_sleep_lock) != ESP_OK ||
+        esp_timer_create(&timer_args, &s_pm_idle_timer) != ESP_OK) {
+        USB_LOG_ERR("USB PM Init Failed!\r\n");
+        if (s_pm_cpu_lock) {
+            esp_pm_lock_delete(s_pm_cpu_lock);
+            s_pm_cpu_lock = NULL;
+        }
+        if (s_pm_sleep_lock) {
+            esp_pm_lock_delete(s_pm_sleep_lock);
+            s_pm_sleep_lock = NULL;
+        }
+    }
+}
+
+static void usb_pm_deinit(void)
+{
+    if (s_pm_cpu_lock == NULL) {
+        return;
+    }
+    usb_pm_set_bus_active(false);
+    usb_pm_set_attached(false);
+    esp_timer_delete(s_pm_idle_timer);
+    esp_pm_lock_delete(s_pm_cpu_lock);
+    esp_pm_lock_delete(s_pm_sleep_lock);
+    s_pm_idle_timer = NULL;
+    s_pm_cpu_lock = NULL;
+    s_pm_sleep_lock = NULL;
+}
+#endif
+
+// The DWC2 port derives timing (e.g. turnaround time) from SystemCoreClock, so take the actual
+// frequency, which with power management is the maximum one while USB holds its lock
+static void usb_update_core_clock(void)
+{
+#ifdef CONFIG_CHERRYUSB_PM
+    if (s_pm_cpu_lock) {
+        esp_pm_lock_acquire(s_pm_cpu_lock);
+        SystemCoreClock = esp_clk_cpu_freq();
+        esp_pm_lock_release(s_pm_cpu_lock);
+        return;
+    }
+#endif
+    SystemCoreClock = esp_clk_cpu_freq();
+}
+
+static void USB_ISR_ATTR usb_interrupt_cb(void *arg_pv)
 {
     extern void USBD_IRQHandler(uint8_t busid);
     USBD_IRQHandler(0);
 }
 
+#ifdef CONFIG_CHERRYUSB_DWC2_FIFO_AUTO
+// Same layout as the static configuration, used until a plan succeeds
+struct dwc2_fifo_plan g_dwc2_fifo_plan = {
+    .rx_words = 208 / 4,
+    .tx_words = { 64 / 4, 136 / 4, 136 / 4, 128 / 4, 128 / 4 },
+};
+
+static const uint8_t *s_registered_desc = NULL;
+
+extern void __real_usbd_desc_register(uint8_t busid, const uint8_t *desc);
+
+// Remember the descriptors so the FIFOs can be planned when the controller is initialized (-Wl,--wrap)
+void __wrap_usbd_desc_register(uint8_t busid, const uint8_t *desc)
+{
+    s_registered_desc = desc;
+    __real_usbd_desc_register(busid, desc);
+}
+
+static void usb_dc_plan_fifo(void)
+{
+    const dwc2_fifo_plan_limits_t limits = {
+        .total_words = ESP_USBD_DWC2_FIFO_TOTAL_SIZE,
+        .tx_fifo_num = ESP_USBD_DWC2_TX_FIFO_NUM,
+        .ep0_mps = 64,
+    };
+
+    if (s_registered_desc == NULL) {
+        return;
+    }
+    // Descriptor blobs end with a zero-length entry, the length is only a safety bound
+    if (dwc2_fifo_plan(s_registered_desc, 4096, &limits, &g_dwc2_fifo_plan) != 0) {
+        USB_LOG_WRN("USB FIFO plan failed, using default layout\r\n");
+        return;
+    }
+    dwc2_fifo_plan_dump(&g_dwc2_fifo_plan, stdout);
+}
+#endif
+
 void usb_dc_low_level_init(void)
 {
     usb_phy_config_t phy_config = {
@@ -40,6 +340,14 @@ void usb_dc_low_level_init(void)
         .target = USB_PHY_TARGET_INT,
     };
 
+#ifdef CONFIG_CHERRYUSB_PM
+    usb_pm_init();
+#endif
+    usb_update_core_clock();
+#ifdef CONFIG_CHERRYUSB_DWC2_FIFO_AUTO
+    usb_dc_plan_fifo();
+#endif
+
     esp_err_t ret = usb_new_phy(&phy_config, &s_phy_handle);
     if (ret != ESP_OK) {
         USB_LOG_ERR("USB Phy Init Failed!\r\n");
@@ -47,7 +355,7 @@ void usb_dc_low_level_init(void)
     }
 
     // TODO: Check when to enable interrupt
-    ret = esp_intr_alloc(ETS_USB_INTR_SOURCE, ESP_INTR_FLAG_LOWMED, usb_interrupt_cb, 0, &s_interrupt_handle);
+    ret = usb_intr_alloc(usb_interrupt_cb);
     if (ret != ESP_OK) {
         USB_LOG_ERR("USB Interrupt Init Failed!\r\n");
         return;
@@ -66,6 +374,9 @@ void usb_dc_low_level_deinit(void)
         usb_del_phy(s_phy_handle);
         s_phy_handle = NULL;
     }
+#ifdef CONFIG_CHERRYUSB_PM
+    usb_pm_deinit();
+#endif
 }
 
 uint32_t usbd_get_dwc2_gccfg_conf(uint32_t reg_base)
@@ -73,14 +384,483 @@ uint32_t usbd_get_dwc2_gccfg_conf(uint32_t reg_base)
     return 0;
 }
 
+#if defined(CONFIG_CHERRYUSB_PM) && defined(CONFIG_CHERRYUSBD_ENABLED)
+/* Bus state and transfer activity, taken from the DWC2 port's calls into the device core (-Wl,--wrap) */
+extern void __real_usbd_event_reset_handler(uint8_t busid);
+extern void __real_usbd_event_resume_handler(uint8_t busid);
+extern void __real_usbd_event_suspend_handler(uint8_t busid);
+extern void __real_usbd_event_disconnect_handler(uint8_t busid);
+extern void __real_usbd_event_ep_in_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbytes);
+extern void __real_usbd_event_ep_out_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbytes);
+
+void USB_ISR_ATTR __wrap_usbd_event_reset_handler(uint8_t busid)
+{
+    usb_pm_set_attached(true);
+    usb_pm_set_bus_active(true);
+    __real_usbd_event_reset_handler(busid);
+}
+
+void USB_ISR_ATTR __wrap_usbd_event_resume_handler(uint8_t busid)
+{
+    usb_pm_set_bus_active(true);
+    __real_usbd_event_resume_handler(busid);
+}
+
+// Only the frequency lock follows suspend, light sleep stays blocked so the resume is seen
+void USB_ISR_ATTR __wrap_usbd_event_suspend_handler(uint8_t busid)
+{
+    __real_usbd_event_suspend_handler(busid);
+    usb_pm_set_bus_active(false);
+}
+
+void USB_ISR_ATTR __wrap_usbd_event_disconnect_handler(uint8_t busid)
+{
+    __real_usbd_event_disconnect_handler(busid);
+    usb_pm_set_bus_active(false);
+    usb_pm_set_attached(false);
+}
+
+void USB_ISR_ATTR __wrap_usbd_event_ep_in_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbytes)
+{
+    usb_pm_activity();
+    __real_usbd_event_ep_in_complete_handler(busid, ep, nbytes);
+}
+
+void USB_ISR_ATTR __wrap_usbd_event_ep_out_complete_handler(uint8_t busid, uint8_t ep, uint32_t nbytes)
+{
+    usb_pm_activity();
+    __real_usbd_event_ep_out_complete_handler(busid, ep, nbytes);
+}
+#endif
+
 #ifdef CONFIG_CHERRYUSBH_ENABLED
 
-static void usb_hc_interrupt_cb(void *arg_pv)
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+/*
+ * Deferred completion, see usbh_dispatch.h. A slot carries an asynchronous URB's own callback
+ * from submit to completion; the interrupt queues the completed slot and wakes the dispatcher
+ * task, which takes a batch of them and runs the callbacks. A slot stays allocated until its
+ * callback has run, so usbh_kill_urb() can find a completion that is still pending.
+ */
+typedef enum {
+    USBH_DISPATCH_FREE,
+    USBH_DISPATCH_ATTACHED,     // URB submitted, completion not yet seen
+    USBH_DISPATCH_DONE,         // Completed, in s_dispatch_ring
+    USBH_DISPATCH_TAKEN,        // In the dispatcher's current batch
+    USBH_DISPATCH_HELD,         // Taken while its key was being killed, left to usbh_dispatch_kill_end()
+} usbh_dispatch_state_t;
+
+typedef struct {
+    usbh_dispatch_state_t state;
+    bool cancelled;             // Taken, but the callback already ran in usbh_dispatch_kill_end()
+    struct usbh_urb *urb;
+    const void *key;            // The URB, or the owner passed to usbh_dispatch_defer()
+    usbh_complete_callback_t user_complete;
+    void *user_arg;
+    int nbytes;
+    int64_t done_us;
+} usbh_dispatch_slot_t;
+
+// Kills in progress at once, usually one from the hub thread
+#define USBH_DISPATCH_KILL_MAX              4
+
+static usbh_dispatch_slot_t s_dispatch_slots[CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN];
+// Completed slots, in completion order
+static uint8_t s_dispatch_ring[CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN];
+static uint8_t s_dispatch_head;
+static uint8_t s_dispatch_count;
+// Key whose callback the dispatcher task is running
+static const void *s_dispatch_running;
+// Keys between usbh_dispatch_kill_begin() and usbh_dispatch_kill_end(), the dispatcher holds their callbacks back
+static const void *s_dispatch_killing[USBH_DISPATCH_KILL_MAX];
+static TaskHandle_t s_dispatch_task = NULL;
+static usbh_dispatch_stats_t s_dispatch_stats;
+// One lock for the slots and the ring, one for the counters, so the interrupt statistics never wait for the ring
+static usb_osal_lock_t s_dispatch_lock;
+static usb_osal_lock_t s_dispatch_stats_lock;
+
+// s_dispatch_lock held
+static inline bool USB_ISR_ATTR usbh_dispatch_is_killing(const void *key)
+{
+    for (int i = 0; i < USBH_DISPATCH_KILL_MAX; i++) {
+        if (s_dispatch_killing[i] == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static usbh_dispatch_slot_t *USB_ISR_ATTR usbh_dispatch_alloc(void)
+{
+    usbh_dispatch_slot_t *slot = NULL;
+    size_t flags;
+
+    if (s_dispatch_task == NULL) {
+        return NULL;
+    }
+    flags = usb_osal_lock_enter(s_dispatch_lock);
+    for (int i = 0; i < CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN; i++) {
+        if (s_dispatch_slots[i].state == USBH_DISPATCH_FREE) {
+            slot = &s_dispatch_slots[i];
+            slot->state = USBH_DISPATCH_ATTACHED;
+            slot->cancelled = false;
+            break;
+        }
+    }
+    usb_osal_lock_leave(s_dispatch_lock, flags);
+
+    if (slot == NULL) {
+        flags = usb_osal_lock_enter(s_dispatch_stats_lock);
+        s_dispatch_stats.inline_complete++;
+        usb_osal_lock_leave(s_dispatch_stats_lock, flags);
+    }
+    return slot;
+}
+
+static void USB_ISR_ATTR usbh_dispatch_queue(usbh_dispatch_slot_t *slot, int nbytes)
+{
+    size_t flags;
+
+    slot->nbytes = nbytes;
+    slot->done_us = esp_timer_get_time();
+    flags = usb_osal_lock_enter(s_dispatch_lock);
+    slot->state = USBH_DISPATCH_DONE;
+    s_dispatch_ring[(s_dispatch_head + s_dispatch_count) % CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN] = slot - s_dispatch_slots;
+    s_dispatch_count++;
+    usb_osal_lock_leave(s_dispatch_lock, flags);
+
+    if (xPortInIsrContext()) {
+        BaseType_t yield = pdFALSE;
+        vTaskNotifyGiveFromISR(s_dispatch_task, &yield);
+        if (yield) {
+            portYIELD_FROM_ISR();
+        }
+    } else {
+        xTaskNotifyGive(s_dispatch_task);
+    }
+}
+
+static void USB_ISR_ATTR usbh_dispatch_complete(void *arg, int nbytes)
+{
+    usbh_dispatch_slot_t *slot = arg;
+
+    // The URB is the owner's again, the callback may resubmit it
+    slot->urb->complete = slot->user_complete;
+    slot->urb->arg = slot->user_arg;
+    usbh_dispatch_queue(slot, nbytes);
+}
+
+// Route the URB's completion through the dispatcher task, NULL if it completes as before
+static usbh_dispatch_slot_t *USB_ISR_ATTR usbh_dispatch_attach(struct usbh_urb *urb)
+{
+    usbh_dispatch_slot_t *slot;
+
+    if (urb->timeout || urb->complete == NULL) {
+        return NULL;
+    }
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+    // A queue chains its next URB from the completion, so that stays in the interrupt
+    if (usbh_urb_queue_owns(urb)) {
+        return NULL;
+    }
+#endif
+    slot = usbh_dispatch_alloc();
+    if (slot == NULL) {
+        return NULL;
+    }
+    slot->urb = urb;
+    slot->key = urb;
+    slot->user_complete = urb->complete;
+    slot->user_arg = urb->arg;
+    urb->complete = usbh_dispatch_complete;
+    urb->arg = slot;
+    return slot;
+}
+
+// The submit failed, so the completion will never come
+static void USB_ISR_ATTR usbh_dispatch_detach(usbh_dispatch_slot_t *slot)
+{
+    size_t flags;
+
+    slot->urb->complete = slot->user_complete;
+    slot->urb->arg = slot->user_arg;
+    flags = usb_osal_lock_enter(s_dispatch_lock);
+    slot->state = USBH_DISPATCH_FREE;
+    usb_osal_lock_leave(s_dispatch_lock, flags);
+}
+
+bool USB_ISR_ATTR usbh_dispatch_defer(const void *key, struct usbh_urb *urb, usbh_complete_callback_t complete, void *arg, int nbytes)
+{
+    usbh_dispatch_slot_t *slot = usbh_dispatch_alloc();
+
+    if (slot == NULL) {
+        return false;
+    }
+    slot->urb = urb;
+    slot->key = key;
+    slot->user_complete = complete;
+    slot->user_arg = arg;
+    usbh_dispatch_queue(slot, nbytes);
+    return true;
+}
+
+/*
+ * Without the dispatcher a URB's callback runs inside usbh_kill_urb() or before it, never
+ * after, and class drivers free the callback argument right after killing on disconnect.
+ * So the key is marked first: the dispatcher no longer starts its callbacks, and one it has
+ * started is waited for. Only then is the URB killed; a callback that ran after the kill
+ * could otherwise resubmit it.
+ */
+void usbh_dispatch_kill_begin(const void *key)
+{
+    bool wait = !xPortInIsrContext() && xTaskGetCurrentTaskHandle() != s_dispatch_task;
+    bool marked = false;
+    bool running;
+    size_t flags;
+
+    if (s_dispatch_lock == NULL) {
+        return;
+    }
+    for (;;) {
+        flags = usb_osal_lock_enter(s_dispatch_lock);
+        for (int i = 0; i < USBH_DISPATCH_KILL_MAX && !marked; i++) {
+            if (s_dispatch_killing[i] == NULL) {
+                s_dispatch_killing[i] = key;
+                marked = true;
+            }
+        }
+        usb_osal_lock_leave(s_dispatch_lock, flags);
+        // Killing from the interrupt or from a callback cannot wait, not even for a free entry
+        if (marked || !wait) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    if (!wait) {
+        return;
+    }
+    for (;;) {
+        flags = usb_osal_lock_enter(s_dispatch_lock);
+        running = (s_dispatch_running == key);
+        usb_osal_lock_leave(s_dispatch_lock, flags);
+        if (!running) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+}
+
+/*
+ * Completions of the key that are still pending, including the one of the kill itself, run
+ * now in the caller's context. The transfer is being torn down, so one that succeeded is
+ * reported as -USB_ERR_SHUTDOWN and its callback does not resubmit.
+ */
+void usbh_dispatch_kill_end(const void *key)
+{
+    usbh_dispatch_slot_t run;
+    size_t flags;
+    bool found;
+
+    if (s_dispatch_lock == NULL) {
+        return;
+    }
+    do {
+        found = false;
+        flags = usb_osal_lock_enter(s_dispatch_lock);
+        for (int i = 0; i < CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN && !found; i++) {
+            usbh_dispatch_slot_t *slot = &s_dispatch_slots[i];
+            if (slot->key != key) {
+                continue;
+            }
+            if (slot->state == USBH_DISPATCH_HELD) {
+                run = *slot;
+                slot->state = USBH_DISPATCH_FREE;
+                found = true;
+            } else if (slot->state == USBH_DISPATCH_TAKEN && !slot->cancelled) {
+                // Taken by the dispatcher but not started: it skips the slot and frees it
+                slot->cancelled = true;
+                run = *slot;
+                found = true;
+            }
+        }
+        // Still queued: take it out of the ring, keeping the order of the others
+        for (uint8_t i = 0; i < s_dispatch_count && !found; i++) {
+            uint8_t pos = (s_dispatch_head + i) % CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN;
+            usbh_dispatch_slot_t *slot = &s_dispatch_slots[s_dispatch_ring[pos]];
+            if (slot->key == key) {
+                run = *slot;
+                slot->state = USBH_DISPATCH_FREE;
+                for (uint8_t j = i + 1; j < s_dispatch_count; j++) {
+                    uint8_t next = (s_dispatch_head + j) % CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN;
+                    s_dispatch_ring[pos] = s_dispatch_ring[next];
+                    pos = next;
+                }
+                s_dispatch_count--;
+                found = true;
+            }
+        }
+        // Unmarked under the same lock, so nothing the dispatcher held back is left behind
+        for (int i = 0; i < USBH_DISPATCH_KILL_MAX && !found; i++) {
+            if (s_dispatch_killing[i] == key) {
+                s_dispatch_killing[i] = NULL;
+                break;
+            }
+        }
+        usb_osal_lock_leave(s_dispatch_lock, flags);
+
+        if (found) {
+            if (run.nbytes >= 0) {
+                run.nbytes = -USB_ERR_SHUTDOWN;
+                if (run.urb) {
+                    run.urb->errorcode = -USB_ERR_SHUTDOWN;
+                }
+            }
+            if (run.user_complete) {
+                run.user_complete(run.user_arg, run.nbytes);
+            }
+        }
+    } while (found);
+}
+
+static void usbh_dispatch_thread(void *arg)
+{
+    uint8_t batch[CONFIG_CHERRYUSBH_COMPLETION_BATCH];
+    size_t flags;
+
+    for (;;) {
+        uint32_t total = 0;
+        uint32_t num;
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        do {
+            num = 0;
+            flags = usb_osal_lock_enter(s_dispatch_lock);
+            while (num < CONFIG_CHERRYUSBH_COMPLETION_BATCH && s_dispatch_count) {
+                uint8_t idx = s_dispatch_ring[s_dispatch_head];
+                s_dispatch_head = (s_dispatch_head + 1) % CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN;
+                s_dispatch_count--;
+                s_dispatch_slots[idx].state = USBH_DISPATCH_TAKEN;
+                batch[num++] = idx;
+            }
+            usb_osal_lock_leave(s_dispatch_lock, flags);
+
+            for (uint32_t i = 0; i < num; i++) {
+                usbh_dispatch_slot_t *slot = &s_dispatch_slots[batch[i]];
+                usbh_dispatch_slot_t done;
+                uint32_t latency_us;
+                bool cancelled;
+                bool held;
+
+                flags = usb_osal_lock_enter(s_dispatch_lock);
+                cancelled = slot->cancelled;
+                held = !cancelled && usbh_dispatch_is_killing(slot->key);
+                done = *slot;
+                if (held) {
+                    slot->state = USBH_DISPATCH_HELD;
+                } else {
+                    if (!cancelled) {
+                        s_dispatch_running = done.key;
+                    }
+                    // Free before the callback, which may resubmit the URB and needs a slot again
+                    slot->state = USBH_DISPATCH_FREE;
+                }
+                usb_osal_lock_leave(s_dispatch_lock, flags);
+
+                if (cancelled || held) {
+                    continue;
+                }
+                latency_us = (uint32_t)(esp_timer_get_time() - done.done_us);
+                flags = usb_osal_lock_enter(s_dispatch_stats_lock);
+                s_dispatch_stats.latency_total_us += latency_us;
+                if (latency_us > s_dispatch_stats.latency_max_us) {
+                    s_dispatch_stats.latency_max_us = latency_us;
+                }
+                usb_osal_lock_leave(s_dispatch_stats_lock, flags);
+                if (done.user_complete) {
+                    done.user_complete(done.user_arg, done.nbytes);
+                }
+                flags = usb_osal_lock_enter(s_dispatch_lock);
+                s_dispatch_running = NULL;
+                usb_osal_lock_leave(s_dispatch_lock, flags);
+                total++;
+            }
+        } while (num == CONFIG_CHERRYUSBH_COMPLETION_BATCH);
+
+        flags = usb_osal_lock_enter(s_dispatch_stats_lock);
+        s_dispatch_stats.wakeups++;
+        s_dispatch_stats.deferred += total;
+        if (total > s_dispatch_stats.max_batch) {
+            s_dispatch_stats.max_batch = total;
+        }
+        usb_osal_lock_leave(s_dispatch_stats_lock, flags);
+    }
+}
+
+void usbh_dispatch_get_stats(usbh_dispatch_stats_t *stats)
+{
+    size_t flags;
+
+    memset(stats, 0, sizeof(usbh_dispatch_stats_t));
+    if (s_dispatch_stats_lock == NULL) {
+        return;
+    }
+    flags = usb_osal_lock_enter(s_dispatch_stats_lock);
+    *stats = s_dispatch_stats;
+    usb_osal_lock_leave(s_dispatch_stats_lock, flags);
+    usb_osal_lock_get_stats(s_dispatch_lock, &stats->lock);
+}
+
+void usbh_dispatch_reset_stats(void)
+{
+    size_t flags;
+
+    if (s_dispatch_stats_lock == NULL) {
+        return;
+    }
+    flags = usb_osal_lock_enter(s_dispatch_stats_lock);
+    memset(&s_dispatch_stats, 0, sizeof(s_dispatch_stats));
+    usb_osal_lock_leave(s_dispatch_stats_lock, flags);
+    usb_osal_lock_reset_stats(s_dispatch_lock);
+}
+#endif
+
+#ifdef CONFIG_CHERRYUSBH_VPIPE
+static void usbh_vpipe_init(void);
+#endif
+#if defined(CONFIG_CHERRYUSBH_DMA_BOUNCE) || defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK)
+static bool usbh_locks_init(void);
+#endif
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+static void usbh_fifo_plan_reset(void);
+#endif
+
+static void USB_ISR_ATTR usb_hc_irq_handler(void)
 {
     extern void USBH_IRQHandler(uint8_t busid);
     USBH_IRQHandler(0);
 }
 
+static void USB_ISR_ATTR usb_hc_interrupt_cb(void *arg_pv)
+{
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    uint32_t start = usb_cycle_count();
+    uint32_t cycles;
+    size_t flags;
+
+    usb_hc_irq_handler();
+    cycles = usb_cycle_count() - start;
+    flags = usb_osal_lock_enter(s_dispatch_stats_lock);
+    s_dispatch_stats.isr_count++;
+    s_dispatch_stats.isr_total_cycles += cycles;
+    if (cycles > s_dispatch_stats.isr_max_cycles) {
+        s_dispatch_stats.isr_max_cycles = cycles;
+    }
+    usb_osal_lock_leave(s_dispatch_stats_lock, flags);
+#else
+    usb_hc_irq_handler();
+#endif
+}
+
 void usb_hc_low_level_init(struct usbh_bus *bus)
 {
     // Host Library defaults to internal PHY
@@ -93,18 +873,50 @@ void usb_hc_low_level_init(struct usbh_bus *bus)
         .otg_io_conf = NULL,
     };
 
+#ifdef CONFIG_CHERRYUSB_PM
+    usb_pm_init();
+#endif
+    usb_update_core_clock();
+
     esp_err_t ret = usb_new_phy(&phy_config, &s_phy_handle);
     if (ret != ESP_OK) {
         USB_LOG_ERR("USB Phy Init Failed!\r\n");
         return;
     }
 
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+    // usb_hc_init() programs the default split again
+    usbh_fifo_plan_reset();
+#endif
+#if defined(CONFIG_CHERRYUSBH_DMA_BOUNCE) || defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK)
+    if (!usbh_locks_init()) {
+        USB_LOG_ERR("USB host lock create failed\r\n");
+        return;
+    }
+#endif
+#ifdef CONFIG_CHERRYUSBH_VPIPE
+    usbh_vpipe_init();
+#endif
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    // Kept across deinit, a callback may still be running
+    if (s_dispatch_task == NULL &&
+        xTaskCreate(usbh_dispatch_thread, "usbh_complete", CONFIG_CHERRYUSBH_COMPLETION_TASK_STACKSIZE, NULL,
+                    CONFIG_CHERRYUSBH_COMPLETION_TASK_PRIO, &s_dispatch_task) != pdPASS) {
+        USB_LOG_ERR("USB completion task create failed, completing in the interrupt\r\n");
+    }
+#endif
+
     // TODO: Check when to enable interrupt
-    ret = esp_intr_alloc(ETS_USB_INTR_SOURCE, ESP_INTR_FLAG_LOWMED, usb_hc_interrupt_cb, 0, &s_interrupt_handle);
+    ret = usb_intr_alloc(usb_hc_interrupt_cb);
     if (ret != ESP_OK) {
         USB_LOG_ERR("USB Interrupt Init Failed!\r\n");
         return;
     }
+#ifdef CONFIG_CHERRYUSB_PM
+    // Connect detection needs the USB clocks, so the host port blocks light sleep while initialized
+    usb_pm_set_attached(true);
+    usb_pm_set_bus_active(true);
+#endif
     USB_LOG_INFO("cherryusb, version: 0x%06x\r\n", CHERRYUSB_VERSION);
 }
 
@@ -118,7 +930,917 @@ void usb_hc_low_level_deinit(struct usbh_bus *bus)
         usb_del_phy(s_phy_handle);
         s_phy_handle = NULL;
     }
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+    usbh_fifo_plan_reset();
+#endif
+#ifdef CONFIG_CHERRYUSB_PM
+    usb_pm_deinit();
+#endif
+}
+
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+#define USBH_DWC2_REG(offset)               (*(volatile uint32_t *)(ESP_USBH_BASE + (offset)))
+#define USBH_DWC2_GRSTCTL                   0x010
+#define USBH_DWC2_GRXFSIZ                   0x024
+#define USBH_DWC2_GNPTXFSIZ                 0x028
+#define USBH_DWC2_HPTXFSIZ                  0x100
+#define USBH_DWC2_HCCHAR(ch)                (0x500 + (ch) * 0x20)
+#define USBH_DWC2_GRSTCTL_AHBIDL            (1UL << 31)
+#define USBH_DWC2_GRSTCTL_TXFNUM_ALL        (0x10UL << 6)
+#define USBH_DWC2_GRSTCTL_TXFFLSH           (1UL << 5)
+#define USBH_DWC2_GRSTCTL_RXFFLSH           (1UL << 4)
+#define USBH_DWC2_HCCHAR_CHENA              (1UL << 31)
+#define USBH_DWC2_FIFO_TOTAL_SIZE           (800 / 4)
+#define USBH_DWC2_RESET_TIMEOUT_US          1000
+
+// Every endpoint address at most once (15 IN + 15 OUT), so a device never overflows its slot
+#define USBH_FIFO_PLAN_EP_MAX               30
+#define USBH_FIFO_PLAN_DEV_MAX              (CONFIG_USBHOST_MAX_RHPORTS + CONFIG_USBHOST_MAX_EXTHUBS * CONFIG_USBHOST_MAX_EHPORTS)
+
+typedef struct {
+    struct usbh_hubport *hport;
+    uint8_t ep_num;
+    dwc2_fifo_plan_ep_t eps[USBH_FIFO_PLAN_EP_MAX];
+} usbh_fifo_plan_dev_t;
+
+// Split programmed by usb_hc_init() from usb_config.h, until the first device is configured
+#define USBH_FIFO_PLAN_DEFAULT                          \
+    {                                                   \
+        .rx_words = CONFIG_USB_DWC2_RX_FIFO_SIZE,       \
+        .nptx_words = CONFIG_USB_DWC2_NPTX_FIFO_SIZE,   \
+        .ptx_words = CONFIG_USB_DWC2_PTX_FIFO_SIZE,     \
+    }
+static struct dwc2_host_fifo_plan s_host_fifo_plan = USBH_FIFO_PLAN_DEFAULT;
+// Only touched from the hub thread, which enumerates and releases devices one at a time
+static usbh_fifo_plan_dev_t s_host_fifo_devs[USBH_FIFO_PLAN_DEV_MAX];
+static struct usbh_hubport *s_host_fifo_enum_hport;
+static dwc2_fifo_plan_ep_t s_host_fifo_eps[USBH_FIFO_PLAN_DEV_MAX * USBH_FIFO_PLAN_EP_MAX];
+
+static void usbh_fifo_plan_add_ep(usbh_fifo_plan_dev_t *dev, const struct usb_endpoint_descriptor *ep_desc)
+{
+    for (int i = 0; i < dev->ep_num; i++) {
+        if (dev->eps[i].addr == ep_desc->bEndpointAddress) {
+            if (ep_desc->wMaxPacketSize > dev->eps[i].mps) {
+                dev->eps[i].mps = ep_desc->wMaxPacketSize;
+            }
+            return;
+        }
+    }
+    if (dev->ep_num < USBH_FIFO_PLAN_EP_MAX) {
+        dev->eps[dev->ep_num].addr = ep_desc->bEndpointAddress;
+        dev->eps[dev->ep_num].type = ep_desc->bmAttributes & 0x03;
+        dev->eps[dev->ep_num].mps = ep_desc->wMaxPacketSize;
+        dev->ep_num++;
+    }
+}
+
+// Record the endpoints of every interface of the parsed configuration, in all alternate settings
+static void usbh_fifo_plan_record(struct usbh_hubport *hport)
+{
+    usbh_fifo_plan_dev_t *dev = NULL;
+    uint8_t intf_num = hport->config.config_desc.bNumInterfaces;
+
+    for (int i = 0; i < USBH_FIFO_PLAN_DEV_MAX; i++) {
+        if (s_host_fifo_devs[i].hport == hport || (dev == NULL && s_host_fifo_devs[i].hport == NULL)) {
+            dev = &s_host_fifo_devs[i];
+        }
+    }
+    if (dev == NULL) {
+        return;
+    }
+    dev->hport = hport;
+    dev->ep_num = 0;
+    if (intf_num > CONFIG_USBHOST_MAX_INTERFACES) {
+        intf_num = CONFIG_USBHOST_MAX_INTERFACES;
+    }
+    for (int i = 0; i < intf_num; i++) {
+        struct usbh_interface *intf = &hport->config.intf[i];
+        uint8_t alt_num = intf->altsetting_num;
+        if (alt_num > CONFIG_USBHOST_MAX_INTF_ALTSETTINGS) {
+            alt_num = CONFIG_USBHOST_MAX_INTF_ALTSETTINGS;
+        }
+        for (int a = 0; a < alt_num; a++) {
+            struct usbh_interface_altsetting *alt = &intf->altsetting[a];
+            uint8_t ep_num = alt->intf_desc.bNumEndpoints;
+            if (ep_num > CONFIG_USBHOST_MAX_ENDPOINTS) {
+                ep_num = CONFIG_USBHOST_MAX_ENDPOINTS;
+            }
+            for (int e = 0; e < ep_num; e++) {
+                usbh_fifo_plan_add_ep(dev, &alt->ep[e].ep_desc);
+            }
+        }
+    }
+}
+
+static bool usbh_dwc2_wait_reset_bit(uint32_t mask, bool set)
+{
+    int64_t start = esp_timer_get_time();
+
+    do {
+        if (((USBH_DWC2_REG(USBH_DWC2_GRSTCTL) & mask) != 0) == set) {
+            return true;
+        }
+    } while (esp_timer_get_time() - start < USBH_DWC2_RESET_TIMEOUT_US);
+    return false;
+}
+
+// The controller is reset on every init, and the devices recorded before are gone with it
+static void usbh_fifo_plan_reset(void)
+{
+    s_host_fifo_plan = (struct dwc2_host_fifo_plan)USBH_FIFO_PLAN_DEFAULT;
+    memset(s_host_fifo_devs, 0, sizeof(s_host_fifo_devs));
+}
+
+/*
+ * The FIFOs can only be moved while no channel uses them. The caller makes sure
+ * no class driver runs, so no channel is allocated. Only the USB interrupt is
+ * masked meanwhile, not the CPU's: each wait is bounded by USBH_DWC2_RESET_TIMEOUT_US,
+ * and other interrupts and tasks keep running.
+ */
+static int usbh_dwc2_apply_fifo_plan(const struct dwc2_host_fifo_plan *plan)
+{
+    int ret = 0;
+
+    esp_intr_disable(s_interrupt_handle);
+    for (int ch = 0; ch < CONFIG_USBHOST_PIPE_NUM; ch++) {
+        if (USBH_DWC2_REG(USBH_DWC2_HCCHAR(ch)) & USBH_DWC2_HCCHAR_CHENA) {
+            ret = -1;
+            goto out;
+        }
+    }
+    if (!usbh_dwc2_wait_reset_bit(USBH_DWC2_GRSTCTL_AHBIDL, true)) {
+        ret = -1;
+        goto out;
+    }
+    USBH_DWC2_REG(USBH_DWC2_GRXFSIZ) = plan->rx_words;
+    USBH_DWC2_REG(USBH_DWC2_GNPTXFSIZ) = ((uint32_t)plan->nptx_words << 16) | plan->rx_words;
+    USBH_DWC2_REG(USBH_DWC2_HPTXFSIZ) = ((uint32_t)plan->ptx_words << 16) | (plan->rx_words + plan->nptx_words);
+    USBH_DWC2_REG(USBH_DWC2_GRSTCTL) = USBH_DWC2_GRSTCTL_TXFNUM_ALL | USBH_DWC2_GRSTCTL_TXFFLSH;
+    if (!usbh_dwc2_wait_reset_bit(USBH_DWC2_GRSTCTL_TXFFLSH, false)) {
+        ret = -1;
+        goto out;
+    }
+    USBH_DWC2_REG(USBH_DWC2_GRSTCTL) = USBH_DWC2_GRSTCTL_RXFFLSH;
+    if (!usbh_dwc2_wait_reset_bit(USBH_DWC2_GRSTCTL_RXFFLSH, false)) {
+        ret = -1;
+    }
+out:
+    esp_intr_enable(s_interrupt_handle);
+    return ret;
+}
+
+static void usbh_fifo_plan_update(void)
+{
+    struct dwc2_host_fifo_plan plan;
+    uint32_t ep_num = 0;
+
+    for (int i = 0; i < USBH_FIFO_PLAN_DEV_MAX; i++) {
+        usbh_fifo_plan_dev_t *dev = &s_host_fifo_devs[i];
+        if (dev->hport == NULL) {
+            continue;
+        }
+        memcpy(&s_host_fifo_eps[ep_num], dev->eps, dev->ep_num * sizeof(dwc2_fifo_plan_ep_t));
+        ep_num += dev->ep_num;
+    }
+    if (dwc2_host_fifo_plan(s_host_fifo_eps, ep_num, USBH_DWC2_FIFO_TOTAL_SIZE, &plan) != 0) {
+        USB_LOG_WRN("USB host FIFO plan failed, keeping current layout\r\n");
+        return;
+    }
+    if (memcmp(&plan, &s_host_fifo_plan, sizeof(plan)) == 0) {
+        return;
+    }
+    if (usbh_dwc2_apply_fifo_plan(&plan) != 0) {
+        USB_LOG_WRN("USB host FIFO busy, keeping current layout\r\n");
+        return;
+    }
+    s_host_fifo_plan = plan;
+    USB_LOG_INFO("USB host FIFO rx %u nptx %u ptx %u words\r\n", plan.rx_words, plan.nptx_words, plan.ptx_words);
+}
+
+/*
+ * Called from the submit wrapper for the SET_CONFIGURATION request of the device
+ * being enumerated: the configuration is parsed, but none of its class drivers
+ * has been bound yet. The FIFOs are only moved if no other device is attached,
+ * i.e. no class driver runs anywhere and the port holds no channel; otherwise
+ * the device is recorded and the split kept until the bus is empty again.
+ */
+static void usbh_fifo_plan_configure(struct usbh_hubport *hport)
+{
+    bool idle = true;
+
+    usbh_fifo_plan_record(hport);
+    for (int i = 0; i < USBH_FIFO_PLAN_DEV_MAX; i++) {
+        if (s_host_fifo_devs[i].hport != NULL && s_host_fifo_devs[i].hport != hport) {
+            idle = false;
+        }
+    }
+    if (idle) {
+        usbh_fifo_plan_update();
+    }
+}
+
+static inline bool usbh_fifo_plan_is_set_config(const struct usbh_urb *urb)
+{
+    return urb->hport == s_host_fifo_enum_hport && urb->setup != NULL &&
+           urb->setup->bmRequestType == (USB_REQUEST_DIR_OUT | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE) &&
+           urb->setup->bRequest == USB_REQUEST_SET_CONFIGURATION;
+}
+
+void usbh_dwc2_get_fifo_plan(struct dwc2_host_fifo_plan *plan)
+{
+    *plan = s_host_fifo_plan;
+}
+
+extern void __real_usbh_hubport_release(struct usbh_hubport *hport);
+
+// Forget a detached device; the FIFOs are re-planned when the next device is the only one
+void __wrap_usbh_hubport_release(struct usbh_hubport *hport)
+{
+    for (int i = 0; i < USBH_FIFO_PLAN_DEV_MAX; i++) {
+        if (s_host_fifo_devs[i].hport == hport) {
+            s_host_fifo_devs[i].hport = NULL;
+            s_host_fifo_devs[i].ep_num = 0;
+        }
+    }
+    __real_usbh_hubport_release(hport);
+}
+#endif
+
+#if defined(CONFIG_CHERRYUSB_PM) || defined(CONFIG_CHERRYUSBH_DMA_BOUNCE) || defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK) || defined(CONFIG_CHERRYUSBH_ENUM_STATS) || defined(CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO)
+extern int __real_usbh_submit_urb(struct usbh_urb *urb);
+#endif
+#if defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK)
+extern int __real_usbh_kill_urb(struct usbh_urb *urb);
+#endif
+
+#ifdef CONFIG_CHERRYUSBH_DMA_BOUNCE
+/*
+ * Host channels move data by buffer DMA (HCDMA), which only reaches word-aligned internal RAM.
+ * URBs whose buffer is unaligned or elsewhere (PSRAM, flash) are run through a bounce buffer
+ * instead. Each channel carries one URB at a time, so one slot per channel is enough. Slot
+ * buffers are allocated, and grown, from task context only and kept for reuse, so URBs
+ * resubmitted from a completion callback find a buffer without touching the heap.
+ */
+typedef struct {
+    bool busy;
+    bool in;
+    uint8_t *buf;
+    uint32_t size;
+    uint8_t *user_buf;
+    usbh_complete_callback_t user_complete;
+    void *user_arg;
+    struct usbh_urb *urb;
+} usbh_bounce_slot_t;
+
+static usbh_bounce_slot_t s_bounce_slots[CONFIG_USBHOST_PIPE_NUM];
+static usb_osal_lock_t s_bounce_lock;
+
+static inline bool USB_ISR_ATTR usbh_bounce_needed(const struct usbh_urb *urb)
+{
+    if (urb->transfer_buffer == NULL || urb->transfer_buffer_length == 0 || urb->num_of_iso_packets) {
+        return false;
+    }
+    return ((uintptr_t)urb->transfer_buffer % CONFIG_USB_ALIGN_SIZE) != 0 ||
+           !esp_ptr_dma_capable(urb->transfer_buffer);
+}
+
+static usbh_bounce_slot_t *USB_ISR_ATTR usbh_bounce_get(uint32_t size)
+{
+    usbh_bounce_slot_t *slot = NULL;
+    bool in_isr = xPortInIsrContext();
+    size_t flags;
+
+    flags = usb_osal_lock_enter(s_bounce_lock);
+    for (int i = 0; i < CONFIG_USBHOST_PIPE_NUM; i++) {
+        usbh_bounce_slot_t *s = &s_bounce_slots[i];
+        if (s->busy || (in_isr && s->size < size)) {
+            continue;
+        }
+        // Prefer a slot whose buffer is already large enough
+        if (slot == NULL || (slot->size < size && s->size >= size)) {
+            slot = s;
+        }
+    }
+    if (slot) {
+        slot->busy = true;
+    }
+    usb_osal_lock_leave(s_bounce_lock, flags);
+
+    if (slot && slot->size < size) {
+        // DMA writes whole words, keep the tail of an odd-sized IN transfer inside the buffer
+        uint32_t alloc_size = (size + CONFIG_USB_ALIGN_SIZE - 1) & ~(CONFIG_USB_ALIGN_SIZE - 1);
+        uint8_t *buf = heap_caps_aligned_alloc(CONFIG_USB_ALIGN_SIZE, alloc_size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (buf == NULL) {
+            slot->busy = false;
+            return NULL;
+        }
+        heap_caps_free(slot->buf);
+        slot->buf = buf;
+        slot->size = alloc_size;
+    }
+    return slot;
+}
+
+// Copy IN data back and give the caller its own buffer and callback again
+static void USB_ISR_ATTR usbh_bounce_finish(usbh_bounce_slot_t *slot)
+{
+    struct usbh_urb *urb = slot->urb;
+    size_t flags;
+
+    if (slot->in && urb->actual_length) {
+        memcpy(slot->user_buf, slot->buf, urb->actual_length);
+    }
+    urb->transfer_buffer = slot->user_buf;
+    urb->complete = slot->user_complete;
+    urb->arg = slot->user_arg;
+    flags = usb_osal_lock_enter(s_bounce_lock);
+    slot->busy = false;
+    usb_osal_lock_leave(s_bounce_lock, flags);
+}
+
+static void USB_ISR_ATTR usbh_bounce_complete(void *arg, int nbytes)
+{
+    usbh_bounce_slot_t *slot = arg;
+    usbh_complete_callback_t complete = slot->user_complete;
+    void *user_arg = slot->user_arg;
+
+    usbh_bounce_finish(slot);
+    if (complete) {
+        complete(user_arg, nbytes);
+    }
+}
+
+static int USB_ISR_ATTR usbh_bounce_submit(struct usbh_urb *urb)
+{
+    usbh_bounce_slot_t *slot;
+    int ret;
+
+    if (!usbh_bounce_needed(urb)) {
+        return __real_usbh_submit_urb(urb);
+    }
+    slot = usbh_bounce_get(urb->transfer_buffer_length);
+    if (slot == NULL) {
+        USB_LOG_ERR("No DMA bounce buffer for %u bytes\r\n", (unsigned int)urb->transfer_buffer_length);
+        return -USB_ERR_NOMEM;
+    }
+    slot->urb = urb;
+    slot->in = urb->setup ? (urb->setup->bmRequestType & 0x80) : (urb->ep->bEndpointAddress & 0x80);
+    slot->user_buf = urb->transfer_buffer;
+    slot->user_complete = urb->complete;
+    slot->user_arg = urb->arg;
+    if (!slot->in) {
+        memcpy(slot->buf, urb->transfer_buffer, urb->transfer_buffer_length);
+    }
+    urb->transfer_buffer = slot->buf;
+    if (urb->timeout == 0) {
+        // Asynchronous, restored from the completion (also called when the URB is killed)
+        urb->complete = usbh_bounce_complete;
+        urb->arg = slot;
+        ret = __real_usbh_submit_urb(urb);
+        if (ret < 0) {
+            usbh_bounce_finish(slot);
+        }
+        return ret;
+    }
+    // Synchronous, finished or killed on timeout by the time the port returns
+    ret = __real_usbh_submit_urb(urb);
+    usbh_bounce_finish(slot);
+    return ret;
 }
+#endif
+
+#if defined(CONFIG_CHERRYUSBH_DMA_BOUNCE) || defined(CONFIG_CHERRYUSBH_VPIPE)
+// Hand a URB that holds a channel to the port
+static inline int USB_ISR_ATTR usbh_urb_run(struct usbh_urb *urb)
+{
+#ifdef CONFIG_CHERRYUSBH_DMA_BOUNCE
+    return usbh_bounce_submit(urb);
+#else
+    return __real_usbh_submit_urb(urb);
+#endif
+}
+#endif
+
+#ifdef CONFIG_CHERRYUSBH_VPIPE
+/*
+ * Channel admission, see usbh_vpipe.h. The port frees a URB's channel before calling its
+ * completion (asynchronous) or before returning (synchronous), so channels are counted here
+ * by interposing on both. A URB that finds every channel held is parked in a virtual pipe;
+ * each release hands the channel straight to the parked URB that is due first.
+ */
+#define USBH_VPIPE_PRIO_CONTROL             0
+#define USBH_VPIPE_PRIO_PERIODIC            1
+#define USBH_VPIPE_PRIO_BULK                2
+
+typedef struct {
+    struct usbh_urb *urb;
+    usbh_complete_callback_t user_complete;
+    void *user_arg;
+    uint32_t start_ms;
+} usbh_vpipe_chan_t;
+
+typedef struct {
+    struct usbh_urb *urb;
+    uint8_t prio;
+    uint32_t deadline_ms;
+    uint32_t seq;
+    bool sync;                          // A task waits on wake, otherwise the URB is run on grant
+    SemaphoreHandle_t wake;
+    StaticSemaphore_t wake_buf;
+    volatile int result;                // 1 while waiting, 0 granted, <0 killed
+} usbh_vpipe_wait_t;
+
+static usbh_vpipe_chan_t s_vpipe_chans[CONFIG_USBHOST_PIPE_NUM];
+static usbh_vpipe_wait_t s_vpipe_waits[CONFIG_CHERRYUSBH_VPIPE_NUM];
+static uint8_t s_vpipe_busy;
+static uint8_t s_vpipe_waiting;
+static uint32_t s_vpipe_seq;
+// Interrupt IN URB being taken off its channel for a control transfer, one at a time
+static struct usbh_urb *s_vpipe_preempt_urb;
+static usbh_vpipe_stats_t s_vpipe_stats;
+static usb_osal_lock_t s_vpipe_lock;
+
+static void usbh_vpipe_release(void);
+
+static inline uint32_t USB_ISR_ATTR usbh_vpipe_now_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static inline uint8_t USB_ISR_ATTR usbh_vpipe_ep_type(const struct usbh_urb *urb)
+{
+    return urb->ep->bmAttributes & USB_ENDPOINT_TYPE_MASK;
+}
+
+// Full-speed bInterval is in frames, i.e. milliseconds
+static inline uint32_t USB_ISR_ATTR usbh_vpipe_interval_ms(const struct usbh_urb *urb)
+{
+    return urb->ep->bInterval ? urb->ep->bInterval : 1;
+}
+
+static uint8_t USB_ISR_ATTR usbh_vpipe_prio(const struct usbh_urb *urb)
+{
+    switch (usbh_vpipe_ep_type(urb)) {
+        case USB_ENDPOINT_TYPE_CONTROL:
+            return USBH_VPIPE_PRIO_CONTROL;
+        case USB_ENDPOINT_TYPE_INTERRUPT:
+        case USB_ENDPOINT_TYPE_ISOCHRONOUS:
+            return USBH_VPIPE_PRIO_PERIODIC;
+        default:
+            return USBH_VPIPE_PRIO_BULK;
+    }
+}
+
+// Called with the lock held, false if every virtual pipe is in use
+static bool USB_ISR_ATTR usbh_vpipe_park(usbh_vpipe_wait_t **out, struct usbh_urb *urb)
+{
+    for (int i = 0; i < CONFIG_CHERRYUSBH_VPIPE_NUM; i++) {
+        usbh_vpipe_wait_t *w = &s_vpipe_waits[i];
+        if (w->urb) {
+            continue;
+        }
+        w->urb = urb;
+        w->prio = usbh_vpipe_prio(urb);
+        w->deadline_ms = usbh_vpipe_now_ms() + (w->prio == USBH_VPIPE_PRIO_PERIODIC ? usbh_vpipe_interval_ms(urb) : 0);
+        w->seq = s_vpipe_seq++;
+        w->sync = false;
+        w->result = 1;
+        if (++s_vpipe_waiting > s_vpipe_stats.max_waiting) {
+            s_vpipe_stats.max_waiting = s_vpipe_waiting;
+        }
+        *out = w;
+        return true;
+    }
+    return false;
+}
+
+// Called with the lock held: the parked URB that is due first
+static usbh_vpipe_wait_t *USB_ISR_ATTR usbh_vpipe_pick(void)
+{
+    usbh_vpipe_wait_t *best = NULL;
+
+    for (int i = 0; i < CONFIG_CHERRYUSBH_VPIPE_NUM; i++) {
+        usbh_vpipe_wait_t *w = &s_vpipe_waits[i];
+        if (w->urb == NULL || w->result != 1) {
+            continue;
+        }
+        if (best == NULL || w->prio < best->prio ||
+            (w->prio == best->prio && w->prio == USBH_VPIPE_PRIO_PERIODIC && (int32_t)(w->deadline_ms - best->deadline_ms) < 0) ||
+            (w->prio == best->prio && w->prio != USBH_VPIPE_PRIO_PERIODIC && (int32_t)(w->seq - best->seq) < 0)) {
+            best = w;
+        }
+    }
+    return best;
+}
+
+static void USB_ISR_ATTR usbh_vpipe_complete(void *arg, int nbytes)
+{
+    usbh_vpipe_chan_t *chan = arg;
+    struct usbh_urb *urb = chan->urb;
+    usbh_complete_callback_t complete = chan->user_complete;
+    void *user_arg = chan->user_arg;
+    bool requeue = false;
+    usbh_vpipe_wait_t *w;
+    size_t flags;
+
+    urb->complete = complete;
+    urb->arg = user_arg;
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    // Only the kill made by usbh_vpipe_preempt() for this very URB requeues it
+    if (s_vpipe_preempt_urb == urb && nbytes == -USB_ERR_SHUTDOWN) {
+        s_vpipe_preempt_urb = NULL;
+        if (usbh_vpipe_park(&w, urb)) {
+            // Poll it again as soon as a channel is free, ahead of the URBs that were waiting
+            w->deadline_ms = usbh_vpipe_now_ms();
+            requeue = true;
+        }
+    }
+    chan->urb = NULL;
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+
+    if (!requeue && complete) {
+        complete(user_arg, nbytes);
+    }
+    usbh_vpipe_release();
+}
+
+// Asynchronous URB that was granted a channel
+static int USB_ISR_ATTR usbh_vpipe_run_async(struct usbh_urb *urb)
+{
+    usbh_vpipe_chan_t *chan = NULL;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    for (int i = 0; i < CONFIG_USBHOST_PIPE_NUM; i++) {
+        if (s_vpipe_chans[i].urb == NULL) {
+            chan = &s_vpipe_chans[i];
+            chan->urb = urb;
+            break;
+        }
+    }
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+
+    chan->user_complete = urb->complete;
+    chan->user_arg = urb->arg;
+    chan->start_ms = usbh_vpipe_now_ms();
+    urb->complete = usbh_vpipe_complete;
+    urb->arg = chan;
+    ret = usbh_urb_run(urb);
+    if (ret < 0) {
+        urb->complete = chan->user_complete;
+        urb->arg = chan->user_arg;
+        flags = usb_osal_lock_enter(s_vpipe_lock);
+        chan->urb = NULL;
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        usbh_vpipe_release();
+    }
+    return ret;
+}
+
+// A channel came free: give it to the parked URB that is due first
+static void USB_ISR_ATTR usbh_vpipe_release(void)
+{
+    usbh_vpipe_wait_t *w;
+    struct usbh_urb *urb;
+    SemaphoreHandle_t wake = NULL;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    w = usbh_vpipe_pick();
+    if (w == NULL) {
+        s_vpipe_busy--;
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        return;
+    }
+    // The channel passes on without being counted free
+    urb = w->urb;
+    s_vpipe_waiting--;
+    if (w->sync) {
+        wake = w->wake;
+        w->result = 0;
+    } else {
+        w->urb = NULL;
+    }
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+
+    if (wake) {
+        // The waiter frees its entry once it has seen the result
+        if (xPortInIsrContext()) {
+            BaseType_t yield = pdFALSE;
+            xSemaphoreGiveFromISR(wake, &yield);
+            if (yield) {
+                portYIELD_FROM_ISR();
+            }
+        } else {
+            xSemaphoreGive(wake);
+        }
+        return;
+    }
+    ret = usbh_vpipe_run_async(urb);
+    if (ret < 0 && urb->complete) {
+        urb->complete(urb->arg, ret);
+    }
+}
+
+/*
+ * Called from task context by a control transfer that found no channel: take one interrupt IN
+ * URB that has been NAKed for at least a whole bInterval off its channel. Its completion parks
+ * it again instead of reporting it (usbh_vpipe_complete). A report the device sends in the same
+ * transaction as the kill is lost, which is the price of not failing the control transfer.
+ */
+static void usbh_vpipe_preempt(void)
+{
+    uint32_t now = usbh_vpipe_now_ms();
+    usbh_vpipe_chan_t *victim = NULL;
+    struct usbh_urb *urb = NULL;
+    size_t flags;
+
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    if (s_vpipe_preempt_urb) {
+        // One at a time, a channel is already on its way
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        return;
+    }
+    for (int i = 0; i < CONFIG_USBHOST_PIPE_NUM; i++) {
+        usbh_vpipe_chan_t *chan = &s_vpipe_chans[i];
+        if (chan->urb && usbh_vpipe_ep_type(chan->urb) == USB_ENDPOINT_TYPE_INTERRUPT &&
+            (chan->urb->ep->bEndpointAddress & 0x80) &&
+            now - chan->start_ms >= usbh_vpipe_interval_ms(chan->urb) &&
+            (victim == NULL || (int32_t)(chan->start_ms - victim->start_ms) < 0)) {
+            victim = chan;
+        }
+    }
+    if (victim) {
+        // The channel may be reused once the lock is dropped, the URB is what gets killed
+        urb = victim->urb;
+        s_vpipe_preempt_urb = urb;
+        s_vpipe_stats.preempted++;
+    }
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+
+    if (urb == NULL) {
+        return;
+    }
+    // The completion runs inside the kill; a URB that had already completed is left alone by the port
+    __real_usbh_kill_urb(urb);
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    if (s_vpipe_preempt_urb == urb) {
+        s_vpipe_preempt_urb = NULL;
+    }
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+}
+
+static int USB_ISR_ATTR usbh_vpipe_submit(struct usbh_urb *urb)
+{
+    usbh_vpipe_wait_t *w;
+    TickType_t start;
+    TickType_t wait;
+    size_t flags;
+    int ret;
+
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    if (s_vpipe_busy < CONFIG_USBHOST_PIPE_NUM) {
+        s_vpipe_busy++;
+        s_vpipe_stats.admitted++;
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        if (urb->timeout == 0) {
+            return usbh_vpipe_run_async(urb);
+        }
+        ret = usbh_urb_run(urb);
+        usbh_vpipe_release();
+        return ret;
+    }
+    if (urb->timeout && xPortInIsrContext()) {
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        return -USB_ERR_BUSY;
+    }
+    if (!usbh_vpipe_park(&w, urb)) {
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        USB_LOG_ERR("No free virtual pipe\r\n");
+        return -USB_ERR_NOMEM;
+    }
+    s_vpipe_stats.deferred++;
+    if (urb->timeout == 0) {
+        usb_osal_lock_leave(s_vpipe_lock, flags);
+        return 0;
+    }
+    w->sync = true;
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+
+    // Synchronous, task context: wait within the URB's own timeout
+    if (w->prio == USBH_VPIPE_PRIO_CONTROL) {
+        usbh_vpipe_preempt();
+    }
+    start = xTaskGetTickCount();
+    wait = pdMS_TO_TICKS(urb->timeout);
+    // A give left over from an earlier waiter on this entry only causes another round
+    while (w->result == 1 && xTaskGetTickCount() - start < wait) {
+        xSemaphoreTake(w->wake, wait - (xTaskGetTickCount() - start));
+    }
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    ret = w->result;
+    if (ret == 1) {
+        s_vpipe_waiting--;
+        s_vpipe_stats.timeouts++;
+        ret = -USB_ERR_TIMEOUT;
+    }
+    w->urb = NULL;
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = usbh_urb_run(urb);
+    usbh_vpipe_release();
+    return ret;
+}
+
+// A URB still parked is completed here, the port has never seen it; otherwise it is killed on its channel
+static int usbh_vpipe_kill(struct usbh_urb *urb)
+{
+    usbh_vpipe_wait_t *parked = NULL;
+    SemaphoreHandle_t wake = NULL;
+    size_t flags;
+
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    for (int i = 0; i < CONFIG_CHERRYUSBH_VPIPE_NUM; i++) {
+        usbh_vpipe_wait_t *w = &s_vpipe_waits[i];
+        if (w->urb == urb && w->result == 1) {
+            parked = w;
+            s_vpipe_waiting--;
+            if (w->sync) {
+                wake = w->wake;
+                w->result = -USB_ERR_SHUTDOWN;
+            } else {
+                w->urb = NULL;
+            }
+            break;
+        }
+    }
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+
+    if (parked == NULL) {
+        return __real_usbh_kill_urb(urb);
+    }
+    urb->errorcode = -USB_ERR_SHUTDOWN;
+    if (wake) {
+        xSemaphoreGive(wake);
+    } else if (urb->complete) {
+        urb->complete(urb->arg, -USB_ERR_SHUTDOWN);
+    }
+    return 0;
+}
+
+// Wake semaphores are static and created once, before any URB can wait
+static void usbh_vpipe_init(void)
+{
+    for (int i = 0; i < CONFIG_CHERRYUSBH_VPIPE_NUM; i++) {
+        if (s_vpipe_waits[i].wake == NULL) {
+            s_vpipe_waits[i].wake = xSemaphoreCreateBinaryStatic(&s_vpipe_waits[i].wake_buf);
+        }
+    }
+}
+
+void usbh_vpipe_get_stats(usbh_vpipe_stats_t *stats)
+{
+    size_t flags;
+
+    memset(stats, 0, sizeof(usbh_vpipe_stats_t));
+    if (s_vpipe_lock == NULL) {
+        return;
+    }
+    flags = usb_osal_lock_enter(s_vpipe_lock);
+    *stats = s_vpipe_stats;
+    usb_osal_lock_leave(s_vpipe_lock, flags);
+    usb_osal_lock_get_stats(s_vpipe_lock, &stats->lock);
+}
+#endif
+
+#if defined(CONFIG_CHERRYUSBH_DMA_BOUNCE) || defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK)
+static bool usbh_lock_create(usb_osal_lock_t *lock)
+{
+    if (*lock == NULL) {
+        *lock = usb_osal_lock_create();
+    }
+    return *lock != NULL;
+}
+
+/*
+ * Each structure on the transfer path has its own lock instead of sharing the global OSAL
+ * critical section, which the port takes around every channel operation. Created on the
+ * first init and kept across deinit, like the dispatcher task.
+ */
+static bool usbh_locks_init(void)
+{
+    bool ok = true;
+
+#ifdef CONFIG_CHERRYUSBH_DMA_BOUNCE
+    ok = ok && usbh_lock_create(&s_bounce_lock);
+#endif
+#ifdef CONFIG_CHERRYUSBH_VPIPE
+    ok = ok && usbh_lock_create(&s_vpipe_lock);
+#endif
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    ok = ok && usbh_lock_create(&s_dispatch_lock) && usbh_lock_create(&s_dispatch_stats_lock);
+#endif
+    return ok;
+}
+#endif
+
+#if defined(CONFIG_CHERRYUSB_PM) || defined(CONFIG_CHERRYUSBH_DMA_BOUNCE) || defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK) || defined(CONFIG_CHERRYUSBH_ENUM_STATS) || defined(CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO)
+static inline int USB_ISR_ATTR usbh_urb_admit(struct usbh_urb *urb)
+{
+#if defined(CONFIG_CHERRYUSBH_VPIPE)
+    return usbh_vpipe_submit(urb);
+#elif defined(CONFIG_CHERRYUSBH_DMA_BOUNCE)
+    return usbh_urb_run(urb);
+#else
+    return __real_usbh_submit_urb(urb);
+#endif
+}
+
+static int USB_ISR_ATTR usbh_urb_submit(struct usbh_urb *urb)
+{
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    // Outermost, so only the owner's callback is deferred and channel handover stays in the interrupt
+    usbh_dispatch_slot_t *slot = usbh_dispatch_attach(urb);
+    int ret = usbh_urb_admit(urb);
+    if (ret < 0 && slot) {
+        usbh_dispatch_detach(slot);
+    }
+    return ret;
+#else
+    return usbh_urb_admit(urb);
+#endif
+}
+
+// Every host transfer, including enumeration, goes through usbh_submit_urb() (-Wl,--wrap)
+int USB_ISR_ATTR __wrap_usbh_submit_urb(struct usbh_urb *urb)
+{
+#ifdef CONFIG_CHERRYUSB_PM
+    usb_pm_activity();
+#endif
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+    // Last chance to move the FIFOs before the class drivers of a new device start
+    if (usbh_fifo_plan_is_set_config(urb)) {
+        usbh_fifo_plan_configure(urb->hport);
+    }
+#endif
+#ifdef CONFIG_CHERRYUSBH_ENUM_STATS
+    // Control transfers of usbh_enumerate(), task context: timed and maybe answered from the cache
+    if (usbh_enum_owns(urb)) {
+        return usbh_enum_submit(urb, usbh_urb_submit);
+    }
+#endif
+    return usbh_urb_submit(urb);
+}
+#endif
+
+#if defined(CONFIG_CHERRYUSBH_VPIPE) || defined(CONFIG_CHERRYUSBH_COMPLETION_TASK)
+// Class drivers kill their URBs on disconnect and then free them (-Wl,--wrap)
+int __wrap_usbh_kill_urb(struct usbh_urb *urb)
+{
+    int ret;
+
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    // No deferred callback of the URB may run from here on, or it could resubmit it behind the kill
+    usbh_dispatch_kill_begin(urb);
+#endif
+#ifdef CONFIG_CHERRYUSBH_VPIPE
+    ret = usbh_vpipe_kill(urb);
+#else
+    ret = __real_usbh_kill_urb(urb);
+#endif
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    usbh_dispatch_kill_end(urb);
+#endif
+    return ret;
+}
+#endif
+
+#if defined(CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO) || defined(CONFIG_CHERRYUSBH_ENUM_STATS)
+extern int __real_usbh_enumerate(struct usbh_hubport *hport);
+
+// The hub thread calls this for every new device (-Wl,--wrap)
+int __wrap_usbh_enumerate(struct usbh_hubport *hport)
+{
+#ifdef CONFIG_CHERRYUSBH_ENUM_STATS
+    usbh_enum_begin(hport);
+#endif
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+    s_host_fifo_enum_hport = hport;
+#endif
+    int ret = __real_usbh_enumerate(hport);
+#ifdef CONFIG_CHERRYUSBH_DWC2_FIFO_AUTO
+    s_host_fifo_enum_hport = NULL;
+#endif
+#ifdef CONFIG_CHERRYUSBH_ENUM_STATS
+    usbh_enum_end(hport, ret);
+#endif
+    return ret;
+}
+#endif
 
 uint32_t usbh_get_dwc2_gccfg_conf(uint32_t reg_base) __attribute__((alias("usbd_get_dwc2_gccfg_conf")));
 #endif
\ No newline at end of file
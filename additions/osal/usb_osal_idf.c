@@ -4,13 +4,46 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 #include "usb_osal.h"
+#include "usb_osal_ext.h"
 #include "usb_errno.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/timers.h"
 #include "freertos/event_groups.h"
-
-static portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+#ifdef CONFIG_CHERRYUSB_OSAL_TIMER_ESP_TIMER
+#include "esp_timer.h"
+#endif
+#ifdef CONFIG_CHERRYUSB_MEMPOOL_USB_MALLOC
+#include "usb_mempool.h"
+#endif
+#ifdef CONFIG_CHERRYUSB_OSAL_LOCK_STATS
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#endif
+
+struct usb_osal_lock {
+    portMUX_TYPE mux;
+#ifdef CONFIG_CHERRYUSB_OSAL_LOCK_STATS
+    uint32_t depth;
+    uint32_t enter_cycles;
+    usb_osal_lock_stats_t stats;
+#endif
+};
+
+#define USB_OSAL_LOCK_INITIALIZER { .mux = portMUX_INITIALIZER_UNLOCKED }
+
+static struct usb_osal_lock s_global_lock = USB_OSAL_LOCK_INITIALIZER;
+static struct usb_osal_lock s_bus_locks[USB_OSAL_BUS_LOCK_NUM] = {
+    [0 ... USB_OSAL_BUS_LOCK_NUM - 1] = USB_OSAL_LOCK_INITIALIZER
+};
+
+/* Keep OSAL wakeups off notification index 0 when the application may use it */
+#if configTASK_NOTIFICATION_ARRAY_ENTRIES > 1
+#define USB_OSAL_NOTIFY_INDEX 1
+#else
+#define USB_OSAL_NOTIFY_INDEX 0
+#endif
 
 usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args)
 {
@@ -25,6 +58,95 @@ void usb_osal_thread_delete(usb_osal_thread_t thread)
     vTaskDelete(thread);
 }
 
+#ifdef CONFIG_CHERRYUSB_OSAL_SEM_NOTIFY
+struct usb_osal_sem {
+    portMUX_TYPE lock;
+    uint8_t count;
+    TaskHandle_t waiter;
+};
+
+usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count)
+{
+    struct usb_osal_sem *sem = pvPortMalloc(sizeof(struct usb_osal_sem));
+
+    if (sem == NULL) {
+        return NULL;
+    }
+    portMUX_INITIALIZE(&sem->lock);
+    sem->count = initial_count ? 1 : 0;
+    sem->waiter = NULL;
+    return (usb_osal_sem_t)sem;
+}
+
+void usb_osal_sem_delete(usb_osal_sem_t sem)
+{
+    vPortFree(sem);
+}
+
+int usb_osal_sem_take(usb_osal_sem_t sem, uint32_t timeout)
+{
+    struct usb_osal_sem *s = (struct usb_osal_sem *)sem;
+    TickType_t ticks = (timeout == USB_OSAL_WAITING_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+    TimeOut_t time_out;
+
+    vTaskSetTimeOutState(&time_out);
+    while (1) {
+        portENTER_CRITICAL(&s->lock);
+        if (s->count) {
+            s->count = 0;
+            s->waiter = NULL;
+            portEXIT_CRITICAL(&s->lock);
+            return 0;
+        }
+        s->waiter = xTaskGetCurrentTaskHandle();
+        portEXIT_CRITICAL(&s->lock);
+
+        if (ticks != portMAX_DELAY && xTaskCheckForTimeOut(&time_out, &ticks) == pdTRUE) {
+            portENTER_CRITICAL(&s->lock);
+            s->waiter = NULL;
+            portEXIT_CRITICAL(&s->lock);
+            return -USB_ERR_TIMEOUT;
+        }
+        /* The notification is only a doorbell, the count is always re-checked after waking */
+        ulTaskNotifyTakeIndexed(USB_OSAL_NOTIFY_INDEX, pdTRUE, ticks);
+    }
+}
+
+int usb_osal_sem_give(usb_osal_sem_t sem)
+{
+    struct usb_osal_sem *s = (struct usb_osal_sem *)sem;
+    TaskHandle_t waiter;
+
+    portENTER_CRITICAL_SAFE(&s->lock);
+    if (s->count) {
+        portEXIT_CRITICAL_SAFE(&s->lock);
+        return -USB_ERR_TIMEOUT;
+    }
+    s->count = 1;
+    waiter = s->waiter;
+    portEXIT_CRITICAL_SAFE(&s->lock);
+
+    if (waiter) {
+        if (xPortInIsrContext()) {
+            BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+            vTaskNotifyGiveIndexedFromISR(waiter, USB_OSAL_NOTIFY_INDEX, &xHigherPriorityTaskWoken);
+            portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+        } else {
+            xTaskNotifyGiveIndexed(waiter, USB_OSAL_NOTIFY_INDEX);
+        }
+    }
+    return 0;
+}
+
+void usb_osal_sem_reset(usb_osal_sem_t sem)
+{
+    struct usb_osal_sem *s = (struct usb_osal_sem *)sem;
+
+    portENTER_CRITICAL_SAFE(&s->lock);
+    s->count = 0;
+    portEXIT_CRITICAL_SAFE(&s->lock);
+}
+#else
 usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count)
 {
     return (usb_osal_sem_t)xSemaphoreCreateCounting(1, initial_count);
@@ -66,6 +188,8 @@ void usb_osal_sem_reset(usb_osal_sem_t sem)
     xQueueReset((QueueHandle_t)sem);
 }
 
+#endif
+
 usb_osal_mutex_t usb_osal_mutex_create(void)
 {
     return (usb_osal_mutex_t)xSemaphoreCreateMutex();
@@ -86,11 +210,184 @@ int usb_osal_mutex_give(usb_osal_mutex_t mutex)
     return (xSemaphoreGive((SemaphoreHandle_t)mutex) == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
 }
 
+static int usb_osal_queue_send(QueueHandle_t queue, uintptr_t addr)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    int ret;
+
+    if (xPortInIsrContext()) {
+        ret = xQueueSendFromISR(queue, &addr, &xHigherPriorityTaskWoken);
+        if (ret == pdPASS) {
+            portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+        }
+    } else {
+        ret = xQueueSend(queue, &addr, 0);
+    }
+
+    return (ret == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+static int usb_osal_queue_recv(QueueHandle_t queue, uintptr_t *addr, uint32_t timeout)
+{
+    if (timeout == USB_OSAL_WAITING_FOREVER) {
+        return (xQueueReceive(queue, addr, portMAX_DELAY) == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
+    } else {
+        return (xQueueReceive(queue, addr, pdMS_TO_TICKS(timeout)) == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
+    }
+}
+
+#ifdef CONFIG_CHERRYUSB_OSAL_MQ_SPSC
+enum {
+    USB_OSAL_MQ_QUEUE,
+    USB_OSAL_MQ_SPSC,
+};
+
+struct usb_osal_mq {
+    uint8_t kind;
+    QueueHandle_t queue;
+    /* SPSC ring, one slot is kept empty to tell full from empty */
+    uint32_t size;
+    uint32_t head; /* written by the receiver only */
+    uint32_t tail; /* written by the sender only */
+    TaskHandle_t waiter;
+    uintptr_t msgs[];
+};
+
+static struct usb_osal_mq *usb_osal_mq_alloc(uint8_t kind, uint32_t max_msgs)
+{
+    struct usb_osal_mq *mq;
+    size_t size = sizeof(struct usb_osal_mq);
+
+    if (kind == USB_OSAL_MQ_SPSC) {
+        size += (max_msgs + 1) * sizeof(uintptr_t);
+    }
+    mq = pvPortMalloc(size);
+    if (mq == NULL) {
+        return NULL;
+    }
+    memset(mq, 0, size);
+    mq->kind = kind;
+    if (kind == USB_OSAL_MQ_SPSC) {
+        mq->size = max_msgs + 1;
+    } else {
+        mq->queue = xQueueCreate(max_msgs, sizeof(uintptr_t));
+        if (mq->queue == NULL) {
+            vPortFree(mq);
+            return NULL;
+        }
+    }
+    return mq;
+}
+
+static int usb_osal_spsc_send(struct usb_osal_mq *mq, uintptr_t addr)
+{
+    uint32_t tail = mq->tail;
+    uint32_t next = (tail + 1 == mq->size) ? 0 : tail + 1;
+    TaskHandle_t waiter;
+
+    if (next == __atomic_load_n(&mq->head, __ATOMIC_ACQUIRE)) {
+        return -USB_ERR_TIMEOUT;
+    }
+    mq->msgs[tail] = addr;
+    __atomic_store_n(&mq->tail, next, __ATOMIC_SEQ_CST);
+
+    /* Pairs with the waiter store in usb_osal_spsc_recv(): either the receiver sees the new tail, or we see the waiter */
+    waiter = __atomic_load_n(&mq->waiter, __ATOMIC_SEQ_CST);
+    if (waiter) {
+        if (xPortInIsrContext()) {
+            BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+            vTaskNotifyGiveIndexedFromISR(waiter, USB_OSAL_NOTIFY_INDEX, &xHigherPriorityTaskWoken);
+            portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+        } else {
+            xTaskNotifyGiveIndexed(waiter, USB_OSAL_NOTIFY_INDEX);
+        }
+    }
+    return 0;
+}
+
+static int usb_osal_spsc_recv(struct usb_osal_mq *mq, uintptr_t *addr, uint32_t timeout)
+{
+    TickType_t ticks = (timeout == USB_OSAL_WAITING_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+    TimeOut_t time_out;
+    int ret = -USB_ERR_TIMEOUT;
+
+    vTaskSetTimeOutState(&time_out);
+    while (1) {
+        uint32_t head = mq->head;
+        if (head != __atomic_load_n(&mq->tail, __ATOMIC_ACQUIRE)) {
+            *addr = mq->msgs[head];
+            __atomic_store_n(&mq->head, (head + 1 == mq->size) ? 0 : head + 1, __ATOMIC_RELEASE);
+            ret = 0;
+            break;
+        }
+        __atomic_store_n(&mq->waiter, xTaskGetCurrentTaskHandle(), __ATOMIC_SEQ_CST);
+        if (head != __atomic_load_n(&mq->tail, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        if (ticks != portMAX_DELAY && xTaskCheckForTimeOut(&time_out, &ticks) == pdTRUE) {
+            break;
+        }
+        /* The notification is only a doorbell, the ring is always re-checked after waking */
+        ulTaskNotifyTakeIndexed(USB_OSAL_NOTIFY_INDEX, pdTRUE, ticks);
+    }
+    __atomic_store_n(&mq->waiter, NULL, __ATOMIC_RELAXED);
+    return ret;
+}
+
+usb_osal_mq_t usb_osal_mq_create(uint32_t max_msgs)
+{
+#ifdef CONFIG_CHERRYUSB_OSAL_MQ_SPSC_DEFAULT
+    return (usb_osal_mq_t)usb_osal_mq_alloc(USB_OSAL_MQ_SPSC, max_msgs);
+#else
+    return (usb_osal_mq_t)usb_osal_mq_alloc(USB_OSAL_MQ_QUEUE, max_msgs);
+#endif
+}
+
+usb_osal_mq_t usb_osal_mq_create_spsc(uint32_t max_msgs)
+{
+    return (usb_osal_mq_t)usb_osal_mq_alloc(USB_OSAL_MQ_SPSC, max_msgs);
+}
+
+void usb_osal_mq_delete(usb_osal_mq_t mq)
+{
+    struct usb_osal_mq *q = (struct usb_osal_mq *)mq;
+
+    if (q->kind == USB_OSAL_MQ_QUEUE) {
+        vQueueDelete(q->queue);
+    }
+    vPortFree(q);
+}
+
+int usb_osal_mq_send(usb_osal_mq_t mq, uintptr_t addr)
+{
+    struct usb_osal_mq *q = (struct usb_osal_mq *)mq;
+
+    if (q->kind == USB_OSAL_MQ_SPSC) {
+        return usb_osal_spsc_send(q, addr);
+    }
+    return usb_osal_queue_send(q->queue, addr);
+}
+
+int usb_osal_mq_recv(usb_osal_mq_t mq, uintptr_t *addr, uint32_t timeout)
+{
+    struct usb_osal_mq *q = (struct usb_osal_mq *)mq;
+
+    if (q->kind == USB_OSAL_MQ_SPSC) {
+        return usb_osal_spsc_recv(q, addr, timeout);
+    }
+    return usb_osal_queue_recv(q->queue, addr, timeout);
+}
+#else
 usb_osal_mq_t usb_osal_mq_create(uint32_t max_msgs)
 {
     return (usb_osal_mq_t)xQueueCreate(max_msgs, sizeof(uintptr_t));
 }
 
+usb_osal_mq_t usb_osal_mq_create_spsc(uint32_t max_msgs)
+{
+    return usb_osal_mq_create(max_msgs);
+}
+
 void usb_osal_mq_delete(usb_osal_mq_t mq)
 {
     vQueueDelete((QueueHandle_t)mq);
@@ -98,26 +395,82 @@ void usb_osal_mq_delete(usb_osal_mq_t mq)
 
 int usb_osal_mq_send(usb_osal_mq_t mq, uintptr_t addr)
 {
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    int ret;
+    return usb_osal_queue_send((QueueHandle_t)mq, addr);
+}
+
+int usb_osal_mq_recv(usb_osal_mq_t mq, uintptr_t *addr, uint32_t timeout)
+{
+    return usb_osal_queue_recv((QueueHandle_t)mq, addr, timeout);
+}
+#endif
+
+#ifdef CONFIG_CHERRYUSB_OSAL_TIMER_ESP_TIMER
+static void __usb_timeout(void *arg)
+{
+    struct usb_osal_timer *timer = (struct usb_osal_timer *)arg;
+
+    timer->handler(timer->argument);
+}
+
+struct usb_osal_timer *usb_osal_timer_create(const char *name, uint32_t timeout_ms, usb_timer_handler_t handler, void *argument, bool is_period)
+{
+    struct usb_osal_timer *timer;
+
+    timer = pvPortMalloc(sizeof(struct usb_osal_timer));
 
-    ret = xQueueSendFromISR((usb_osal_mq_t)mq, &addr, &xHigherPriorityTaskWoken);
-    if (ret == pdPASS) {
-        portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+    if (timer == NULL) {
+        return NULL;
     }
+    memset(timer, 0, sizeof(struct usb_osal_timer));
 
-    return (ret == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
+    timer->handler = handler;
+    timer->argument = argument;
+    timer->is_period = is_period;
+    timer->timeout_ms = timeout_ms;
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = __usb_timeout,
+        .arg = timer,
+#ifdef CONFIG_CHERRYUSB_OSAL_TIMER_ISR_DISPATCH
+        .dispatch_method = ESP_TIMER_ISR,
+#else
+        .dispatch_method = ESP_TIMER_TASK,
+#endif
+        .name = name,
+        .skip_unhandled_events = true,
+    };
+    if (esp_timer_create(&timer_args, (esp_timer_handle_t *)&timer->timer) != ESP_OK) {
+        vPortFree(timer);
+        return NULL;
+    }
+    return timer;
 }
 
-int usb_osal_mq_recv(usb_osal_mq_t mq, uintptr_t *addr, uint32_t timeout)
+void usb_osal_timer_delete(struct usb_osal_timer *timer)
 {
-    if (timeout == USB_OSAL_WAITING_FOREVER) {
-        return (xQueueReceive((usb_osal_mq_t)mq, addr, portMAX_DELAY) == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
+    esp_timer_stop((esp_timer_handle_t)timer->timer);
+    esp_timer_delete((esp_timer_handle_t)timer->timer);
+    vPortFree(timer);
+}
+
+void usb_osal_timer_start(struct usb_osal_timer *timer)
+{
+    esp_timer_handle_t handle = (esp_timer_handle_t)timer->timer;
+
+    /* Same as xTimerStart(): starting an active timer restarts it */
+    esp_timer_stop(handle);
+    if (timer->is_period) {
+        esp_timer_start_periodic(handle, (uint64_t)timer->timeout_ms * 1000);
     } else {
-        return (xQueueReceive((usb_osal_mq_t)mq, addr, pdMS_TO_TICKS(timeout)) == pdPASS) ? 0 : -USB_ERR_TIMEOUT;
+        esp_timer_start_once(handle, (uint64_t)timer->timeout_ms * 1000);
     }
 }
 
+void usb_osal_timer_stop(struct usb_osal_timer *timer)
+{
+    esp_timer_stop((esp_timer_handle_t)timer->timer);
+}
+#else
 static void __usb_timeout(TimerHandle_t *handle)
 {
     struct usb_osal_timer *timer = (struct usb_osal_timer *)pvTimerGetTimerID((TimerHandle_t)handle);
@@ -141,6 +494,7 @@ struct usb_osal_timer *usb_osal_timer_create(const char *name, uint32_t timeout_
 
     timer->timer = (void *)xTimerCreate("usb_tim", pdMS_TO_TICKS(timeout_ms), is_period, timer, (TimerCallbackFunction_t)__usb_timeout);
     if (timer->timer == NULL) {
+        vPortFree(timer);
         return NULL;
     }
     return timer;
@@ -173,15 +527,120 @@ void usb_osal_timer_stop(struct usb_osal_timer *timer)
     xTimerStop(timer->timer, 0);
 }
 
-size_t usb_osal_enter_critical_section(void)
+#endif
+
+usb_osal_lock_t usb_osal_lock_create(void)
+{
+    struct usb_osal_lock *lock = pvPortMalloc(sizeof(struct usb_osal_lock));
+
+    if (lock == NULL) {
+        return NULL;
+    }
+    memset(lock, 0, sizeof(struct usb_osal_lock));
+    portMUX_INITIALIZE(&lock->mux);
+    return lock;
+}
+
+void usb_osal_lock_delete(usb_osal_lock_t lock)
+{
+    vPortFree(lock);
+}
+
+usb_osal_lock_t usb_osal_bus_lock(uint8_t busid)
+{
+    if (busid >= USB_OSAL_BUS_LOCK_NUM) {
+        return &s_global_lock;
+    }
+    return &s_bus_locks[busid];
+}
+
+usb_osal_lock_t usb_osal_global_lock(void)
+{
+    return &s_global_lock;
+}
+
+#ifdef CONFIG_CHERRYUSB_OSAL_LOCK_STATS
+size_t usb_osal_lock_enter(usb_osal_lock_t lock)
+{
+    BaseType_t acquired;
+
+    /* Try once first so that spinning on a lock held by the other core is counted */
+    if (xPortInIsrContext()) {
+        acquired = portTRY_ENTER_CRITICAL_ISR(&lock->mux, portMUX_TRY_LOCK);
+    } else {
+        acquired = portTRY_ENTER_CRITICAL(&lock->mux, portMUX_TRY_LOCK);
+    }
+    if (acquired != pdPASS) {
+        portENTER_CRITICAL_SAFE(&lock->mux);
+    }
+    if (lock->depth++ == 0) {
+        lock->stats.acquisitions++;
+        if (acquired != pdPASS) {
+            lock->stats.contended++;
+        }
+        lock->enter_cycles = esp_cpu_get_cycle_count();
+    }
+    return 0;
+}
+
+void usb_osal_lock_leave(usb_osal_lock_t lock, size_t flag)
 {
-    portENTER_CRITICAL_SAFE(&spinlock);
+    if (--lock->depth == 0) {
+        uint32_t cycles = esp_cpu_get_cycle_count() - lock->enter_cycles;
+        uint32_t ns = (uint64_t)cycles * 1000 / esp_rom_get_cpu_ticks_per_us();
+
+        lock->stats.total_hold_ns += ns;
+        if (ns > lock->stats.max_hold_ns) {
+            lock->stats.max_hold_ns = ns;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&lock->mux);
+}
+
+int usb_osal_lock_get_stats(usb_osal_lock_t lock, usb_osal_lock_stats_t *stats)
+{
+    portENTER_CRITICAL_SAFE(&lock->mux);
+    *stats = lock->stats;
+    portEXIT_CRITICAL_SAFE(&lock->mux);
     return 0;
 }
 
+void usb_osal_lock_reset_stats(usb_osal_lock_t lock)
+{
+    portENTER_CRITICAL_SAFE(&lock->mux);
+    memset(&lock->stats, 0, sizeof(lock->stats));
+    portEXIT_CRITICAL_SAFE(&lock->mux);
+}
+#else
+size_t usb_osal_lock_enter(usb_osal_lock_t lock)
+{
+    portENTER_CRITICAL_SAFE(&lock->mux);
+    return 0;
+}
+
+void usb_osal_lock_leave(usb_osal_lock_t lock, size_t flag)
+{
+    portEXIT_CRITICAL_SAFE(&lock->mux);
+}
+
+int usb_osal_lock_get_stats(usb_osal_lock_t lock, usb_osal_lock_stats_t *stats)
+{
+    return -1;
+}
+
+void usb_osal_lock_reset_stats(usb_osal_lock_t lock)
+{
+}
+#endif
+
+size_t usb_osal_enter_critical_section(void)
+{
+    return usb_osal_lock_enter(&s_global_lock);
+}
+
 void usb_osal_leave_critical_section(size_t flag)
 {
-    portEXIT_CRITICAL_SAFE(&spinlock);
+    usb_osal_lock_leave(&s_global_lock, flag);
 }
 
 void usb_osal_msleep(uint32_t delay)
@@ -191,10 +650,18 @@ void usb_osal_msleep(uint32_t delay)
 
 void *usb_osal_malloc(size_t size)
 {
+#ifdef CONFIG_CHERRYUSB_MEMPOOL_USB_MALLOC
+    return usb_mempool_alloc(size);
+#else
     return malloc(size);
+#endif
 }
 
 void usb_osal_free(void *ptr)
 {
+#ifdef CONFIG_CHERRYUSB_MEMPOOL_USB_MALLOC
+    usb_mempool_free(ptr);
+#else
     free(ptr);
+#endif
 }
\ No newline at end of file
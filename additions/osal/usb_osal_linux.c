@@ -0,0 +1,551 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usb_osal.h"
+#include "usb_osal_ext.h"
+#include "usb_errno.h"
+#include "usb_osal_linux.h"
+
+/* 与 FreeRTOS 移植一致：信号量为最大计数 1 的计数信号量，临界区可嵌套 */
+
+struct usb_osal_lock {
+    pthread_mutex_t mutex;
+    uint32_t depth;
+    uint64_t enter_ns;
+    usb_osal_lock_stats_t stats;
+};
+
+static struct usb_osal_lock critical_lock;
+static struct usb_osal_lock bus_locks[USB_OSAL_BUS_LOCK_NUM];
+static pthread_once_t critical_once = PTHREAD_ONCE_INIT;
+static __thread int isr_nesting;
+
+void usb_osal_linux_isr_enter(void)
+{
+    isr_nesting++;
+}
+
+void usb_osal_linux_isr_exit(void)
+{
+    assert(isr_nesting > 0);
+    isr_nesting--;
+}
+
+bool usb_osal_linux_in_isr(void)
+{
+    return isr_nesting > 0;
+}
+
+static void abs_timeout(struct timespec *ts, uint32_t timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void cond_init_monotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+struct linux_thread {
+    usb_thread_entry_t entry;
+    void *args;
+};
+
+static void *thread_trampoline(void *arg)
+{
+    struct linux_thread thread = *(struct linux_thread *)arg;
+    free(arg);
+    thread.entry(thread.args);
+    return NULL;
+}
+
+usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    struct linux_thread *thread;
+
+    (void)name;
+    (void)prio; // 普通用户无法设置实时优先级，忽略
+    thread = malloc(sizeof(struct linux_thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->entry = entry;
+    thread->args = args;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (stack_size < PTHREAD_STACK_MIN) {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+    pthread_attr_setstacksize(&attr, stack_size);
+    if (pthread_create(&tid, &attr, thread_trampoline, thread) != 0) {
+        pthread_attr_destroy(&attr);
+        free(thread);
+        return NULL;
+    }
+    pthread_attr_destroy(&attr);
+    return (usb_osal_thread_t)tid;
+}
+
+void usb_osal_thread_delete(usb_osal_thread_t thread)
+{
+    if (thread == NULL || pthread_equal((pthread_t)thread, pthread_self())) {
+        pthread_exit(NULL);
+    }
+    pthread_cancel((pthread_t)thread);
+}
+
+struct linux_sem {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t count;
+};
+
+usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count)
+{
+    struct linux_sem *sem = malloc(sizeof(struct linux_sem));
+    if (sem == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&sem->lock, NULL);
+    cond_init_monotonic(&sem->cond);
+    sem->count = initial_count ? 1 : 0;
+    return (usb_osal_sem_t)sem;
+}
+
+void usb_osal_sem_delete(usb_osal_sem_t sem)
+{
+    struct linux_sem *s = (struct linux_sem *)sem;
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+int usb_osal_sem_take(usb_osal_sem_t sem, uint32_t timeout)
+{
+    struct linux_sem *s = (struct linux_sem *)sem;
+    struct timespec ts;
+    int ret = 0;
+
+    assert(!usb_osal_linux_in_isr());
+    if (timeout != USB_OSAL_WAITING_FOREVER) {
+        abs_timeout(&ts, timeout);
+    }
+    pthread_mutex_lock(&s->lock);
+    while (s->count == 0 && ret == 0) {
+        if (timeout == USB_OSAL_WAITING_FOREVER) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        } else {
+            ret = pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+        }
+    }
+    if (s->count) {
+        s->count--;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return (ret == 0) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+int usb_osal_sem_give(usb_osal_sem_t sem)
+{
+    struct linux_sem *s = (struct linux_sem *)sem;
+    int ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->count) {
+        ret = -USB_ERR_TIMEOUT; // 与 FreeRTOS 一致，已满时 give 失败
+    } else {
+        s->count = 1;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+void usb_osal_sem_reset(usb_osal_sem_t sem)
+{
+    struct linux_sem *s = (struct linux_sem *)sem;
+    pthread_mutex_lock(&s->lock);
+    s->count = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+usb_osal_mutex_t usb_osal_mutex_create(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    if (mutex == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(mutex, NULL);
+    return (usb_osal_mutex_t)mutex;
+}
+
+void usb_osal_mutex_delete(usb_osal_mutex_t mutex)
+{
+    pthread_mutex_destroy((pthread_mutex_t *)mutex);
+    free(mutex);
+}
+
+int usb_osal_mutex_take(usb_osal_mutex_t mutex)
+{
+    assert(!usb_osal_linux_in_isr());
+    return (pthread_mutex_lock((pthread_mutex_t *)mutex) == 0) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+int usb_osal_mutex_give(usb_osal_mutex_t mutex)
+{
+    return (pthread_mutex_unlock((pthread_mutex_t *)mutex) == 0) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+struct linux_mq {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t max_msgs;
+    uint32_t head;
+    uint32_t count;
+    uintptr_t msgs[];
+};
+
+usb_osal_mq_t usb_osal_mq_create(uint32_t max_msgs)
+{
+    struct linux_mq *mq = malloc(sizeof(struct linux_mq) + max_msgs * sizeof(uintptr_t));
+    if (mq == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&mq->lock, NULL);
+    cond_init_monotonic(&mq->cond);
+    mq->max_msgs = max_msgs;
+    mq->head = 0;
+    mq->count = 0;
+    return (usb_osal_mq_t)mq;
+}
+
+usb_osal_mq_t usb_osal_mq_create_spsc(uint32_t max_msgs)
+{
+    /* Linux 下互斥锁开销很小，直接复用普通队列 */
+    return usb_osal_mq_create(max_msgs);
+}
+
+void usb_osal_mq_delete(usb_osal_mq_t mq)
+{
+    struct linux_mq *q = (struct linux_mq *)mq;
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+int usb_osal_mq_send(usb_osal_mq_t mq, uintptr_t addr)
+{
+    struct linux_mq *q = (struct linux_mq *)mq;
+    int ret = 0;
+
+    /* 与 FreeRTOS 移植一致，发送不阻塞，队列满时直接失败 */
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->max_msgs) {
+        ret = -USB_ERR_TIMEOUT;
+    } else {
+        q->msgs[(q->head + q->count) % q->max_msgs] = addr;
+        q->count++;
+        pthread_cond_signal(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+int usb_osal_mq_recv(usb_osal_mq_t mq, uintptr_t *addr, uint32_t timeout)
+{
+    struct linux_mq *q = (struct linux_mq *)mq;
+    struct timespec ts;
+    int ret = 0;
+
+    assert(!usb_osal_linux_in_isr());
+    if (timeout != USB_OSAL_WAITING_FOREVER) {
+        abs_timeout(&ts, timeout);
+    }
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && ret == 0) {
+        if (timeout == USB_OSAL_WAITING_FOREVER) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        } else {
+            ret = pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+        }
+    }
+    if (q->count) {
+        *addr = q->msgs[q->head];
+        q->head = (q->head + 1) % q->max_msgs;
+        q->count--;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return (ret == 0) ? 0 : -USB_ERR_TIMEOUT;
+}
+
+/* 每个定时器一个线程，相当于 FreeRTOS 的定时器服务任务 */
+struct linux_timer {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct timespec deadline;
+    bool armed;
+    bool exit;
+};
+
+static void *timer_thread(void *arg)
+{
+    struct usb_osal_timer *timer = (struct usb_osal_timer *)arg;
+    struct linux_timer *t = (struct linux_timer *)timer->timer;
+
+    pthread_mutex_lock(&t->lock);
+    while (!t->exit) {
+        if (!t->armed) {
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+        if (pthread_cond_timedwait(&t->cond, &t->lock, &t->deadline) != ETIMEDOUT || !t->armed) {
+            continue;
+        }
+        if (timer->is_period) {
+            t->deadline.tv_sec += timer->timeout_ms / 1000;
+            t->deadline.tv_nsec += (long)(timer->timeout_ms % 1000) * 1000000;
+            if (t->deadline.tv_nsec >= 1000000000) {
+                t->deadline.tv_sec++;
+                t->deadline.tv_nsec -= 1000000000;
+            }
+        } else {
+            t->armed = false;
+        }
+        pthread_mutex_unlock(&t->lock);
+        timer->handler(timer->argument);
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+struct usb_osal_timer *usb_osal_timer_create(const char *name, uint32_t timeout_ms, usb_timer_handler_t handler, void *argument, bool is_period)
+{
+    struct usb_osal_timer *timer;
+    struct linux_timer *t;
+
+    (void)name;
+    timer = malloc(sizeof(struct usb_osal_timer) + sizeof(struct linux_timer));
+    if (timer == NULL) {
+        return NULL;
+    }
+    memset(timer, 0, sizeof(struct usb_osal_timer) + sizeof(struct linux_timer));
+    t = (struct linux_timer *)(timer + 1);
+
+    timer->handler = handler;
+    timer->argument = argument;
+    timer->is_period = is_period;
+    timer->timeout_ms = timeout_ms;
+    timer->timer = t;
+
+    pthread_mutex_init(&t->lock, NULL);
+    cond_init_monotonic(&t->cond);
+    if (pthread_create(&t->tid, NULL, timer_thread, timer) != 0) {
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        free(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+void usb_osal_timer_delete(struct usb_osal_timer *timer)
+{
+    struct linux_timer *t = (struct linux_timer *)timer->timer;
+
+    pthread_mutex_lock(&t->lock);
+    t->exit = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    if (!pthread_equal(t->tid, pthread_self())) {
+        pthread_join(t->tid, NULL);
+    } else {
+        pthread_detach(t->tid);
+    }
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(timer);
+}
+
+void usb_osal_timer_start(struct usb_osal_timer *timer)
+{
+    struct linux_timer *t = (struct linux_timer *)timer->timer;
+
+    pthread_mutex_lock(&t->lock);
+    abs_timeout(&t->deadline, timer->timeout_ms);
+    t->armed = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void usb_osal_timer_stop(struct usb_osal_timer *timer)
+{
+    struct linux_timer *t = (struct linux_timer *)timer->timer;
+
+    pthread_mutex_lock(&t->lock);
+    t->armed = false;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void lock_init(struct usb_osal_lock *lock)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void critical_lock_init(void)
+{
+    lock_init(&critical_lock);
+    for (int i = 0; i < USB_OSAL_BUS_LOCK_NUM; i++) {
+        lock_init(&bus_locks[i]);
+    }
+}
+
+static uint64_t lock_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+usb_osal_lock_t usb_osal_lock_create(void)
+{
+    struct usb_osal_lock *lock = calloc(1, sizeof(struct usb_osal_lock));
+
+    if (lock == NULL) {
+        return NULL;
+    }
+    lock_init(lock);
+    return lock;
+}
+
+void usb_osal_lock_delete(usb_osal_lock_t lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    free(lock);
+}
+
+usb_osal_lock_t usb_osal_bus_lock(uint8_t busid)
+{
+    pthread_once(&critical_once, critical_lock_init);
+    if (busid >= USB_OSAL_BUS_LOCK_NUM) {
+        return &critical_lock;
+    }
+    return &bus_locks[busid];
+}
+
+usb_osal_lock_t usb_osal_global_lock(void)
+{
+    pthread_once(&critical_once, critical_lock_init);
+    return &critical_lock;
+}
+
+/* 主机上统计开销可以忽略，因此始终记录 */
+size_t usb_osal_lock_enter(usb_osal_lock_t lock)
+{
+    bool contended = false;
+
+    if (pthread_mutex_trylock(&lock->mutex) != 0) {
+        contended = true;
+        pthread_mutex_lock(&lock->mutex);
+    }
+    if (lock->depth++ == 0) {
+        lock->stats.acquisitions++;
+        if (contended) {
+            lock->stats.contended++;
+        }
+        lock->enter_ns = lock_now_ns();
+    }
+    return 0;
+}
+
+void usb_osal_lock_leave(usb_osal_lock_t lock, size_t flag)
+{
+    (void)flag;
+    if (--lock->depth == 0) {
+        uint64_t ns = lock_now_ns() - lock->enter_ns;
+
+        lock->stats.total_hold_ns += ns;
+        if (ns > lock->stats.max_hold_ns) {
+            lock->stats.max_hold_ns = ns;
+        }
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+int usb_osal_lock_get_stats(usb_osal_lock_t lock, usb_osal_lock_stats_t *stats)
+{
+    pthread_mutex_lock(&lock->mutex);
+    *stats = lock->stats;
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+void usb_osal_lock_reset_stats(usb_osal_lock_t lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+    memset(&lock->stats, 0, sizeof(lock->stats));
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+size_t usb_osal_enter_critical_section(void)
+{
+    pthread_once(&critical_once, critical_lock_init);
+    return usb_osal_lock_enter(&critical_lock);
+}
+
+void usb_osal_leave_critical_section(size_t flag)
+{
+    usb_osal_lock_leave(&critical_lock, flag);
+}
+
+void usb_osal_msleep(uint32_t delay)
+{
+    struct timespec ts;
+
+    assert(!usb_osal_linux_in_isr());
+    ts.tv_sec = delay / 1000;
+    ts.tv_nsec = (long)(delay % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+void *usb_osal_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void usb_osal_free(void *ptr)
+{
+    free(ptr);
+}
@@ -0,0 +1,23 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Linux 下没有真实中断，测试代码用以下接口标记当前线程处于模拟的中断上下文 */
+void usb_osal_linux_isr_enter(void);
+
+void usb_osal_linux_isr_exit(void);
+
+bool usb_osal_linux_in_isr(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -16,8 +16,14 @@
 
 #define CONFIG_USB_PRINTF(...) esp_rom_printf(__VA_ARGS__)
 
+#ifdef CONFIG_CHERRYUSB_MEMPOOL_USB_MALLOC
+#include "usb_mempool.h"
+#define usb_malloc(size) usb_mempool_alloc(size)
+#define usb_free(ptr)    usb_mempool_free(ptr)
+#else
 #define usb_malloc(size) malloc(size)
 #define usb_free(ptr)    free(ptr)
+#endif
 
 #ifndef CONFIG_USB_DBG_LEVEL
 #define CONFIG_USB_DBG_LEVEL USB_DBG_INFO
@@ -34,6 +40,14 @@
 /* attribute data into no cache ram */
 #define USB_NOCACHE_RAM_SECTION
 
+/* attribute for code called from the USB interrupt, e.g. endpoint and notify callbacks */
+#ifdef CONFIG_CHERRYUSB_ISR_IRAM
+#include "esp_attr.h"
+#define USB_ISR_ATTR IRAM_ATTR
+#else
+#define USB_ISR_ATTR
+#endif
+
 /* ================= USB Device Stack Configuration ================ */
 // NOTE: Below configurations are removed to Kconfig, `idf.py menuconfig` to config them
 
@@ -220,6 +234,23 @@
 
 /* ---------------- DWC2 Configuration ---------------- */
 //esp32s2/s3 can support up to 5 IN endpoints(include ep0) at the same time
+#define ESP_USBD_DWC2_TX_FIFO_NUM 5
+#define ESP_USBD_DWC2_FIFO_TOTAL_SIZE (800 / 4)
+#ifdef CONFIG_CHERRYUSB_DWC2_FIFO_AUTO
+/* planned from the registered descriptors in usb_dc_low_level_init(), see dwc2_fifo_plan.h */
+#include "dwc2_fifo_plan.h"
+extern struct dwc2_fifo_plan g_dwc2_fifo_plan;
+#define CONFIG_USB_DWC2_RXALL_FIFO_SIZE (g_dwc2_fifo_plan.rx_words)
+#define CONFIG_USB_DWC2_TX0_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[0])
+#define CONFIG_USB_DWC2_TX1_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[1])
+#define CONFIG_USB_DWC2_TX2_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[2])
+#define CONFIG_USB_DWC2_TX3_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[3])
+#define CONFIG_USB_DWC2_TX4_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[4])
+#define CONFIG_USB_DWC2_TX5_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[5])
+#define CONFIG_USB_DWC2_TX6_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[6])
+#define CONFIG_USB_DWC2_TX7_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[7])
+#define CONFIG_USB_DWC2_TX8_FIFO_SIZE (g_dwc2_fifo_plan.tx_words[8])
+#else
 #define CONFIG_USB_DWC2_RXALL_FIFO_SIZE (208 / 4)
 #define CONFIG_USB_DWC2_TX0_FIFO_SIZE (64 / 4)
 #define CONFIG_USB_DWC2_TX1_FIFO_SIZE (136 / 4)
@@ -230,6 +261,7 @@
 #define CONFIG_USB_DWC2_TX6_FIFO_SIZE (0 / 4)
 #define CONFIG_USB_DWC2_TX7_FIFO_SIZE (0 / 4)
 #define CONFIG_USB_DWC2_TX8_FIFO_SIZE (0 / 4)
+#endif
 
 #define CONFIG_USB_DWC2_DMA_ENABLE
 
@@ -252,6 +284,11 @@
 #define CONFIG_USBHOST_PIPE_NUM 8
 
 /* ---------------- DWC2 Configuration ---------------- */
+/*
+ * Host channels always run in buffer DMA (CONFIG_USB_DWC2_DMA_ENABLE above is per SoC, not per
+ * role). Transfer buffers must be word-aligned internal RAM unless CONFIG_CHERRYUSBH_DMA_BOUNCE
+ * is enabled.
+ */
 /* largest non-periodic USB packet used / 4 */
 #define CONFIG_USB_DWC2_NPTX_FIFO_SIZE (240 / 4)
 /* largest periodic USB packet used / 4 */
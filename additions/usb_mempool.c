@@ -0,0 +1,201 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "usb_config.h"
+#include "usb_mempool.h"
+
+#define USB_MEMPOOL_HEAP_CAPS (MALLOC_CAP_DMA | MALLOC_CAP_8BIT)
+
+#ifdef CONFIG_CHERRYUSB_MEMPOOL
+
+_Static_assert(64 % CONFIG_USB_ALIGN_SIZE == 0, "CONFIG_USB_ALIGN_SIZE must divide the smallest block size");
+
+struct usb_mempool_block {
+    struct usb_mempool_block *next;
+};
+
+typedef struct {
+    uint8_t *start;
+    uint8_t *end;
+    struct usb_mempool_block *free_list;
+    usb_mempool_stats_t stats;
+} usb_mempool_class_t;
+
+/*
+ * Plain .bss lives in internal DRAM on ESP32-S2/S3 (only EXT_RAM_BSS_ATTR variables may
+ * go to PSRAM), so these blocks are always reachable by the USB DMA.
+ */
+#define USB_MEMPOOL_STORAGE(name, size, count) \
+    static uint8_t name[(size) * (count)] __attribute__((aligned(CONFIG_USB_ALIGN_SIZE)))
+
+USB_MEMPOOL_STORAGE(s_pool_64, 64, CONFIG_CHERRYUSB_MEMPOOL_64_COUNT);
+USB_MEMPOOL_STORAGE(s_pool_512, 512, CONFIG_CHERRYUSB_MEMPOOL_512_COUNT);
+USB_MEMPOOL_STORAGE(s_pool_2k, 2048, CONFIG_CHERRYUSB_MEMPOOL_2K_COUNT);
+USB_MEMPOOL_STORAGE(s_pool_4k, 4096, CONFIG_CHERRYUSB_MEMPOOL_4K_COUNT);
+USB_MEMPOOL_STORAGE(s_pool_16k, 16384, CONFIG_CHERRYUSB_MEMPOOL_16K_COUNT);
+
+#define USB_MEMPOOL_CLASS_INIT(pool, size, count)                          \
+    {                                                                      \
+        .start = pool,                                                     \
+        .end = pool + sizeof(pool),                                        \
+        .stats = { .block_size = (size), .block_count = (count) },         \
+    }
+
+static usb_mempool_class_t s_classes[USB_MEMPOOL_CLASS_NUM] = {
+    USB_MEMPOOL_CLASS_INIT(s_pool_64, 64, CONFIG_CHERRYUSB_MEMPOOL_64_COUNT),
+    USB_MEMPOOL_CLASS_INIT(s_pool_512, 512, CONFIG_CHERRYUSB_MEMPOOL_512_COUNT),
+    USB_MEMPOOL_CLASS_INIT(s_pool_2k, 2048, CONFIG_CHERRYUSB_MEMPOOL_2K_COUNT),
+    USB_MEMPOOL_CLASS_INIT(s_pool_4k, 4096, CONFIG_CHERRYUSB_MEMPOOL_4K_COUNT),
+    USB_MEMPOOL_CLASS_INIT(s_pool_16k, 16384, CONFIG_CHERRYUSB_MEMPOOL_16K_COUNT),
+};
+
+static portMUX_TYPE s_mempool_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_mempool_ready;
+
+/* Called with the lock held; the free lists are threaded through the blocks themselves */
+static void USB_ISR_ATTR usb_mempool_build(void)
+{
+    for (int i = 0; i < USB_MEMPOOL_CLASS_NUM; i++) {
+        usb_mempool_class_t *pool = &s_classes[i];
+        pool->free_list = NULL;
+        for (uint8_t *p = pool->end; p > pool->start;) {
+            struct usb_mempool_block *block;
+            p -= pool->stats.block_size;
+            block = (struct usb_mempool_block *)p;
+            block->next = pool->free_list;
+            pool->free_list = block;
+        }
+    }
+    s_mempool_ready = true;
+}
+
+USB_ISR_ATTR void *usb_mempool_alloc(size_t size)
+{
+    struct usb_mempool_block *block = NULL;
+    usb_mempool_class_t *first = NULL;
+
+    portENTER_CRITICAL_SAFE(&s_mempool_lock);
+    if (!s_mempool_ready) {
+        usb_mempool_build();
+    }
+    for (int i = 0; i < USB_MEMPOOL_CLASS_NUM; i++) {
+        usb_mempool_class_t *pool = &s_classes[i];
+        if (size > pool->stats.block_size) {
+            continue;
+        }
+        if (first == NULL) {
+            first = pool;
+        }
+        if (pool->free_list) {
+            block = pool->free_list;
+            pool->free_list = block->next;
+            pool->stats.alloc_count++;
+            if (++pool->stats.in_use > pool->stats.high_water) {
+                pool->stats.high_water = pool->stats.in_use;
+            }
+            break;
+        }
+    }
+    if (block == NULL && first) {
+        first->stats.overflow++;
+    }
+    portEXIT_CRITICAL_SAFE(&s_mempool_lock);
+
+    if (block || xPortInIsrContext()) {
+        return block;
+    }
+    return heap_caps_aligned_alloc(CONFIG_USB_ALIGN_SIZE, size, USB_MEMPOOL_HEAP_CAPS);
+}
+
+void USB_ISR_ATTR usb_mempool_free(void *ptr)
+{
+    uint8_t *p = ptr;
+
+    if (ptr == NULL) {
+        return;
+    }
+    for (int i = 0; i < USB_MEMPOOL_CLASS_NUM; i++) {
+        usb_mempool_class_t *pool = &s_classes[i];
+        if (p >= pool->start && p < pool->end) {
+            struct usb_mempool_block *block = ptr;
+            portENTER_CRITICAL_SAFE(&s_mempool_lock);
+            block->next = pool->free_list;
+            pool->free_list = block;
+            pool->stats.in_use--;
+            portEXIT_CRITICAL_SAFE(&s_mempool_lock);
+            return;
+        }
+    }
+    heap_caps_free(ptr);
+}
+
+int usb_mempool_get_stats(uint32_t index, usb_mempool_stats_t *stats)
+{
+    if (index >= USB_MEMPOOL_CLASS_NUM || stats == NULL) {
+        return -1;
+    }
+    portENTER_CRITICAL_SAFE(&s_mempool_lock);
+    *stats = s_classes[index].stats;
+    portEXIT_CRITICAL_SAFE(&s_mempool_lock);
+    return 0;
+}
+
+void usb_mempool_reset_stats(void)
+{
+    portENTER_CRITICAL_SAFE(&s_mempool_lock);
+    for (int i = 0; i < USB_MEMPOOL_CLASS_NUM; i++) {
+        usb_mempool_stats_t *stats = &s_classes[i].stats;
+        stats->high_water = stats->in_use;
+        stats->alloc_count = 0;
+        stats->overflow = 0;
+    }
+    portEXIT_CRITICAL_SAFE(&s_mempool_lock);
+}
+
+void usb_mempool_dump(FILE *stream)
+{
+    usb_mempool_stats_t stats;
+
+    fprintf(stream, "%8s %6s %6s %6s %10s %8s\n", "block", "count", "used", "peak", "allocs", "overflow");
+    for (uint32_t i = 0; i < USB_MEMPOOL_CLASS_NUM; i++) {
+        usb_mempool_get_stats(i, &stats);
+        fprintf(stream, "%8" PRIu32 " %6" PRIu32 " %6" PRIu32 " %6" PRIu32 " %10" PRIu32 " %8" PRIu32 "\n",
+                stats.block_size, stats.block_count, stats.in_use, stats.high_water, stats.alloc_count, stats.overflow);
+    }
+}
+
+#else /* CONFIG_CHERRYUSB_MEMPOOL */
+
+void *usb_mempool_alloc(size_t size)
+{
+    return heap_caps_aligned_alloc(CONFIG_USB_ALIGN_SIZE, size, USB_MEMPOOL_HEAP_CAPS);
+}
+
+void usb_mempool_free(void *ptr)
+{
+    heap_caps_free(ptr);
+}
+
+int usb_mempool_get_stats(uint32_t index, usb_mempool_stats_t *stats)
+{
+    return -1;
+}
+
+void usb_mempool_reset_stats(void)
+{
+}
+
+void usb_mempool_dump(FILE *stream)
+{
+    fprintf(stream, "usb mempool disabled\n");
+}
+
+#endif /* CONFIG_CHERRYUSB_MEMPOOL */
@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size classes, smallest first */
+#define USB_MEMPOOL_CLASS_NUM 5
+
+typedef struct {
+    uint32_t block_size;   /*!< Size of each block in bytes */
+    uint32_t block_count;  /*!< Number of blocks reserved for this class */
+    uint32_t in_use;       /*!< Blocks currently allocated */
+    uint32_t high_water;   /*!< Largest in_use seen since boot or the last reset */
+    uint32_t alloc_count;  /*!< Successful allocations from this class */
+    uint32_t overflow;     /*!< Requests that fitted this class but found it (and larger classes) empty */
+} usb_mempool_stats_t;
+
+/**
+ * @brief Allocate a DMA-capable buffer aligned to CONFIG_USB_ALIGN_SIZE
+ *
+ * The request is served from the smallest size class that fits and has a free
+ * block, in O(1) and from task or ISR context. With CONFIG_CHERRYUSB_ISR_IRAM
+ * the pool functions are placed in IRAM, so they also work while the flash
+ * cache is disabled. When every suitable class is exhausted, or the request is
+ * larger than the biggest class, the buffer is taken from DMA-capable heap
+ * instead; that fallback is not available from ISR, where NULL is returned.
+ *
+ * When CONFIG_CHERRYUSB_MEMPOOL is disabled this is a plain DMA-capable aligned
+ * heap allocation.
+ *
+ * @param size Requested size in bytes
+ * @return Buffer, or NULL if out of memory
+ */
+void *usb_mempool_alloc(size_t size);
+
+/**
+ * @brief Free a buffer returned by usb_mempool_alloc()
+ *
+ * Pool blocks are returned to their class in O(1) and may be freed from ISR.
+ * Heap fallback buffers must be freed from task context. NULL is ignored.
+ */
+void usb_mempool_free(void *ptr);
+
+/**
+ * @brief Get the statistics of one size class
+ *
+ * @param index Size class, 0 .. USB_MEMPOOL_CLASS_NUM - 1
+ * @param stats Output
+ * @return 0 on success, -1 if the index is invalid or the pool is disabled
+ */
+int usb_mempool_get_stats(uint32_t index, usb_mempool_stats_t *stats);
+
+/**
+ * @brief Reset high-water marks and counters to the current usage
+ */
+void usb_mempool_reset_stats(void);
+
+/**
+ * @brief Print the statistics of all size classes
+ *
+ * @param stream Output stream, e.g. stdout
+ */
+void usb_mempool_dump(FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
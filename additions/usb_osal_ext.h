@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "usb_osal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Create a single-producer single-consumer message queue
+ *
+ * Messages are passed through a lock-free ring and the receiver is woken with a
+ * direct task notification. Only one task may receive from the queue, and sends
+ * must not run concurrently with each other (one ISR, or one task).
+ * The queue is used with the normal usb_osal_mq_* functions.
+ *
+ * Falls back to usb_osal_mq_create() when CONFIG_CHERRYUSB_OSAL_MQ_SPSC is disabled.
+ */
+usb_osal_mq_t usb_osal_mq_create_spsc(uint32_t max_msgs);
+
+/* Number of per-bus locks returned by usb_osal_bus_lock() */
+#ifndef USB_OSAL_BUS_LOCK_NUM
+#define USB_OSAL_BUS_LOCK_NUM 2
+#endif
+
+typedef struct usb_osal_lock *usb_osal_lock_t;
+
+typedef struct {
+    uint32_t acquisitions;   /*!< Outermost lock entries */
+    uint32_t contended;      /*!< Entries that found the lock held by someone else */
+    uint32_t max_hold_ns;    /*!< Longest time the lock was held */
+    uint64_t total_hold_ns;  /*!< Sum of all hold times */
+} usb_osal_lock_stats_t;
+
+/**
+ * @brief Create a lock that protects one object, e.g. a pipe or endpoint
+ *
+ * Has the same semantics as usb_osal_enter_critical_section(): may be entered
+ * from task and ISR context and nested on the same core, but only serializes
+ * against other users of the same lock instead of the whole stack.
+ */
+usb_osal_lock_t usb_osal_lock_create(void);
+void usb_osal_lock_delete(usb_osal_lock_t lock);
+
+/**
+ * @brief Get the lock of a USB bus
+ *
+ * Statically allocated, always valid. Bus ids beyond USB_OSAL_BUS_LOCK_NUM share
+ * the global lock.
+ */
+usb_osal_lock_t usb_osal_bus_lock(uint8_t busid);
+
+/**
+ * @brief Get the lock behind usb_osal_enter_critical_section(), e.g. to read its statistics
+ */
+usb_osal_lock_t usb_osal_global_lock(void);
+
+size_t usb_osal_lock_enter(usb_osal_lock_t lock);
+void usb_osal_lock_leave(usb_osal_lock_t lock, size_t flag);
+
+/**
+ * @brief Read contention and hold time statistics of a lock
+ *
+ * @return 0 on success, -1 if statistics are not compiled in (CONFIG_CHERRYUSB_OSAL_LOCK_STATS)
+ */
+int usb_osal_lock_get_stats(usb_osal_lock_t lock, usb_osal_lock_stats_t *stats);
+void usb_osal_lock_reset_stats(usb_osal_lock_t lock);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,238 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "usbd_core.h"
+#include "usb_errno.h"
+#include "usbd_ep_queue.h"
+
+/* DIEPTSIZ/DOEPTSIZ on the ESP32-S2/S3 OTG core: 7-bit packet count, 16-bit transfer size */
+#define USBD_EP_QUEUE_PKTCNT_MAX    127
+#define USBD_EP_QUEUE_XFRSIZ_MAX    0xffff
+
+static inline USB_ISR_ATTR const usbd_ep_seg_t *xfer_seg(const usbd_ep_xfer_t *xfer)
+{
+    return xfer->segs ? &xfer->segs[xfer->seg_idx] : &xfer->seg;
+}
+
+static inline uint8_t USB_ISR_ATTR xfer_seg_num(const usbd_ep_xfer_t *xfer)
+{
+    return xfer->segs ? xfer->seg_num : 1;
+}
+
+/* Size the next hardware transfer of @p xfer, called with the queue locked */
+static inline void USB_ISR_ATTR xfer_next_chunk(usbd_ep_queue_t *q, usbd_ep_xfer_t *xfer)
+{
+    uint32_t left = xfer_seg(xfer)->len - xfer->seg_off;
+
+    xfer->chunk = left > q->chunk_max ? q->chunk_max : left;
+    q->stats.chunks++;
+}
+
+static int USB_ISR_ATTR xfer_start(usbd_ep_queue_t *q, usbd_ep_xfer_t *xfer)
+{
+    uint8_t *buf = xfer_seg(xfer)->buf + xfer->seg_off;
+
+    if (q->ep & 0x80) {
+        return usbd_ep_start_write(q->busid, q->ep, buf, xfer->chunk);
+    }
+    return usbd_ep_start_read(q->busid, q->ep, buf, xfer->chunk);
+}
+
+/* Close the start window opened by setting q->starting, true if a flush took the transfer meanwhile */
+static bool USB_ISR_ATTR xfer_start_end(usbd_ep_queue_t *q)
+{
+    bool flushed;
+
+    portENTER_CRITICAL_SAFE(&q->lock);
+    flushed = q->flushed;
+    q->starting = NULL;
+    q->flushed = false;
+    portEXIT_CRITICAL_SAFE(&q->lock);
+    return flushed;
+}
+
+static void USB_ISR_ATTR xfer_complete(usbd_ep_queue_t *q, usbd_ep_xfer_t *xfer, int status)
+{
+    xfer->status = status;
+    if (xfer->complete) {
+        xfer->complete(q->busid, xfer);
+    }
+}
+
+void usbd_ep_queue_init(usbd_ep_queue_t *q, uint8_t busid, uint8_t ep, uint16_t mps)
+{
+    uint32_t chunk_max = (uint32_t)USBD_EP_QUEUE_PKTCNT_MAX * mps;
+
+    if (chunk_max > USBD_EP_QUEUE_XFRSIZ_MAX) {
+        chunk_max = USBD_EP_QUEUE_XFRSIZ_MAX;
+    }
+    memset(q, 0, sizeof(usbd_ep_queue_t));
+    portMUX_INITIALIZE(&q->lock);
+    q->busid = busid;
+    q->ep = ep;
+    q->mps = mps;
+    // Keep every chunk but the last one a whole number of packets
+    q->chunk_max = chunk_max - chunk_max % mps;
+}
+
+void usbd_ep_xfer_init(usbd_ep_xfer_t *xfer, uint8_t *buf, uint32_t len, usbd_ep_xfer_cb_t complete, void *arg)
+{
+    memset(xfer, 0, sizeof(usbd_ep_xfer_t));
+    xfer->seg.buf = buf;
+    xfer->seg.len = len;
+    xfer->complete = complete;
+    xfer->arg = arg;
+}
+
+int USB_ISR_ATTR usbd_ep_queue_submit(usbd_ep_queue_t *q, usbd_ep_xfer_t *xfer)
+{
+    bool start = false;
+    int ret;
+
+    if (xfer->segs && xfer->seg_num == 0) {
+        return -USB_ERR_INVAL;
+    }
+    xfer->next = NULL;
+    xfer->seg_idx = 0;
+    xfer->seg_off = 0;
+    xfer->actual = 0;
+    xfer->status = 0;
+
+    portENTER_CRITICAL_SAFE(&q->lock);
+    if (q->tail) {
+        q->tail->next = xfer;
+    } else {
+        q->head = xfer;
+        q->starting = xfer;
+        xfer_next_chunk(q, xfer);
+        start = true;
+    }
+    q->tail = xfer;
+    q->depth++;
+    q->stats.submitted++;
+    if (q->depth > q->stats.max_depth) {
+        q->stats.max_depth = q->depth;
+    }
+    portEXIT_CRITICAL_SAFE(&q->lock);
+
+    if (!start) {
+        return 0;
+    }
+    // The endpoint was idle, nothing else can start it until this chunk calls back
+    ret = xfer_start(q, xfer);
+    if (xfer_start_end(q)) {
+        // A bus reset flushed the queue while the chunk was handed over
+        if (ret < 0) {
+            return ret;
+        }
+        xfer_complete(q, xfer, -USB_ERR_SHUTDOWN);
+        return 0;
+    }
+    if (ret < 0) {
+        portENTER_CRITICAL_SAFE(&q->lock);
+        q->head = xfer->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        q->depth--;
+        q->stats.submitted--;
+        portEXIT_CRITICAL_SAFE(&q->lock);
+        // Transfers queued behind in the meantime have nobody left to start them
+        usbd_ep_queue_flush(q);
+    }
+    return ret;
+}
+
+void USB_ISR_ATTR usbd_ep_queue_handle_cb(usbd_ep_queue_t *q, uint32_t nbytes)
+{
+    usbd_ep_xfer_t *done = NULL;
+    usbd_ep_xfer_t *start;
+
+    portENTER_CRITICAL_SAFE(&q->lock);
+    start = q->head;
+    if (start == NULL) {
+        portEXIT_CRITICAL_SAFE(&q->lock);
+        return;
+    }
+    start->actual += nbytes;
+    start->seg_off += nbytes;
+    if (!(q->ep & 0x80) && nbytes < start->chunk) {
+        // Short packet ends an OUT transfer, whatever is left of the chain
+        done = start;
+    } else if (start->seg_off < xfer_seg(start)->len) {
+        xfer_next_chunk(q, start);
+    } else if (start->seg_idx + 1 < xfer_seg_num(start)) {
+        start->seg_idx++;
+        start->seg_off = 0;
+        xfer_next_chunk(q, start);
+    } else {
+        done = start;
+    }
+    if (done) {
+        q->head = done->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        q->depth--;
+        q->stats.completed++;
+        start = q->head;
+        if (start) {
+            xfer_next_chunk(q, start);
+            q->stats.back_to_back++;
+        }
+    }
+    q->starting = start;
+    portEXIT_CRITICAL_SAFE(&q->lock);
+
+    // Keep the endpoint busy before handing the finished transfer back
+    if (start) {
+        int ret = xfer_start(q, start);
+        if (xfer_start_end(q)) {
+            xfer_complete(q, start, -USB_ERR_SHUTDOWN);
+        } else if (ret < 0) {
+            usbd_ep_queue_flush(q);
+        }
+    }
+    if (done && done->complete) {
+        done->complete(q->busid, done);
+    }
+}
+
+void USB_ISR_ATTR usbd_ep_queue_flush(usbd_ep_queue_t *q)
+{
+    usbd_ep_xfer_t *xfer;
+
+    portENTER_CRITICAL_SAFE(&q->lock);
+    xfer = q->head;
+    if (xfer && xfer == q->starting) {
+        // Left to the caller starting it, which completes it once the start has returned
+        q->flushed = true;
+        xfer = xfer->next;
+    }
+    q->head = NULL;
+    q->tail = NULL;
+    q->depth = 0;
+    portEXIT_CRITICAL_SAFE(&q->lock);
+
+    while (xfer) {
+        usbd_ep_xfer_t *next = xfer->next;
+        xfer_complete(q, xfer, -USB_ERR_SHUTDOWN);
+        xfer = next;
+    }
+}
+
+bool USB_ISR_ATTR usbd_ep_queue_idle(usbd_ep_queue_t *q)
+{
+    return q->head == NULL;
+}
+
+void usbd_ep_queue_get_stats(usbd_ep_queue_t *q, usbd_ep_queue_stats_t *stats)
+{
+    portENTER_CRITICAL_SAFE(&q->lock);
+    *stats = q->stats;
+    portEXIT_CRITICAL_SAFE(&q->lock);
+}
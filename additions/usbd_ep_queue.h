@@ -0,0 +1,142 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-endpoint transfer queue for device bulk/interrupt endpoints.
+ *
+ * usbd_ep_start_write()/usbd_ep_start_read() accept one buffer per endpoint at
+ * a time, so a class that streams data leaves the endpoint idle between the
+ * completion interrupt and the moment its task submits the next buffer. The
+ * queue keeps a list of transfers per endpoint; each transfer is a chain of
+ * segments, and the next segment or transfer is started from the endpoint
+ * callback itself, before the owner is told about the previous one.
+ *
+ * The owner gets one callback per transfer, after the last segment (or after a
+ * short OUT packet), not one per packet or per segment.
+ */
+
+typedef struct {
+    uint8_t *buf;       /*!< DMA-capable buffer, IN buffers are only read */
+    uint32_t len;       /*!< Length, 0 for a zero-length packet (IN only) */
+} usbd_ep_seg_t;
+
+typedef struct usbd_ep_xfer usbd_ep_xfer_t;
+
+/**
+ * @brief Transfer completion, called from the endpoint callback (usually ISR context)
+ *
+ * The transfer belongs to the owner again when this is called, and may be
+ * resubmitted from here.
+ */
+typedef void (*usbd_ep_xfer_cb_t)(uint8_t busid, usbd_ep_xfer_t *xfer);
+
+struct usbd_ep_xfer {
+    const usbd_ep_seg_t *segs;  /*!< Segment chain, NULL to use @c seg alone */
+    uint8_t seg_num;            /*!< Number of entries in @c segs */
+    usbd_ep_seg_t seg;          /*!< Single segment, used when @c segs is NULL */
+    usbd_ep_xfer_cb_t complete; /*!< Called once for the whole chain, may be NULL */
+    void *arg;                  /*!< Owner context */
+    int status;                 /*!< 0, or -USB_ERR_SHUTDOWN if flushed or the endpoint would not start */
+    uint32_t actual;            /*!< Bytes transferred over all segments */
+
+    /* Owned by the queue while the transfer is submitted */
+    usbd_ep_xfer_t *next;
+    uint8_t seg_idx;
+    uint32_t seg_off;
+    uint32_t chunk;
+};
+
+typedef struct {
+    uint32_t submitted;     /*!< Transfers submitted */
+    uint32_t completed;     /*!< Transfers completed, flushed ones excluded */
+    uint32_t chunks;        /*!< Hardware transfers started */
+    uint32_t back_to_back;  /*!< Transfers started from the callback of the previous one */
+    uint32_t max_depth;     /*!< Most transfers queued at once */
+} usbd_ep_queue_stats_t;
+
+typedef struct {
+    uint8_t busid;
+    uint8_t ep;
+    uint16_t mps;
+    uint32_t chunk_max;
+    portMUX_TYPE lock;
+    usbd_ep_xfer_t *head;
+    usbd_ep_xfer_t *tail;
+    usbd_ep_xfer_t *starting;   /*!< Head whose chunk is being handed to the controller, outside the lock */
+    bool flushed;               /*!< A flush took @c starting off the queue meanwhile */
+    uint32_t depth;
+    usbd_ep_queue_stats_t stats;
+} usbd_ep_queue_t;
+
+/**
+ * @brief Set up an empty queue for one endpoint
+ *
+ * @param q     Queue
+ * @param busid Bus the endpoint belongs to
+ * @param ep    Endpoint address, bit 7 set for IN
+ * @param mps   Max packet size of the endpoint
+ */
+void usbd_ep_queue_init(usbd_ep_queue_t *q, uint8_t busid, uint8_t ep, uint16_t mps);
+
+/**
+ * @brief Fill a transfer with a single segment
+ */
+void usbd_ep_xfer_init(usbd_ep_xfer_t *xfer, uint8_t *buf, uint32_t len, usbd_ep_xfer_cb_t complete, void *arg);
+
+/**
+ * @brief Append a transfer to the queue, starting it if the endpoint is idle
+ *
+ * May be called from task or ISR context, including from a completion
+ * callback. OUT segments except the last must be a multiple of the max packet
+ * size; a short packet ends the transfer.
+ *
+ * @return 0, -USB_ERR_INVAL for an empty chain, or the error of
+ *         usbd_ep_start_write()/usbd_ep_start_read() when the endpoint was idle;
+ *         on error the transfer is not queued and its callback is not called
+ */
+int usbd_ep_queue_submit(usbd_ep_queue_t *q, usbd_ep_xfer_t *xfer);
+
+/**
+ * @brief Account a finished hardware transfer, to be called from the endpoint callback
+ *
+ * Starts the next chunk, segment or transfer before completing the current
+ * transfer to its owner.
+ *
+ * @param q      Queue of the endpoint
+ * @param nbytes Byte count passed to the endpoint callback
+ */
+void usbd_ep_queue_handle_cb(usbd_ep_queue_t *q, uint32_t nbytes);
+
+/**
+ * @brief Drop every queued transfer, completing each with -USB_ERR_SHUTDOWN
+ *
+ * To be called on bus reset or disconnect, when the transfer in progress has
+ * been discarded by the controller and will not call back, or once the endpoint
+ * has been closed with usbd_ep_close() so it no longer touches the buffers. A transfer that is
+ * just being started elsewhere is completed by that caller once the start returns.
+ */
+void usbd_ep_queue_flush(usbd_ep_queue_t *q);
+
+/**
+ * @brief Whether no transfer is queued or in progress
+ */
+bool usbd_ep_queue_idle(usbd_ep_queue_t *q);
+
+void usbd_ep_queue_get_stats(usbd_ep_queue_t *q, usbd_ep_queue_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
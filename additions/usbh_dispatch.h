@@ -0,0 +1,89 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usbh_core.h"
+#include "usb_osal_ext.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Deferred completion of host URBs (CONFIG_CHERRYUSBH_COMPLETION_TASK).
+ *
+ * The port calls a URB's complete callback from USBH_IRQHandler, so a callback
+ * that parses, logs or resubmits extends the interrupt for every other channel.
+ * With this option the interrupt only services the channels and records the
+ * completion; the callbacks run in a dispatcher task at
+ * CONFIG_CHERRYUSBH_COMPLETION_TASK_PRIO, up to CONFIG_CHERRYUSBH_COMPLETION_BATCH
+ * of them per wake-up, in completion order. Callbacks may block briefly, log and
+ * submit URBs; a callback that blocks for long delays the others.
+ *
+ * Channel bookkeeping (DMA bounce buffers, waiting URBs) still happens in the
+ * interrupt, so a freed channel is reused at once. Only asynchronous URBs with a
+ * complete callback are deferred; if more than CONFIG_CHERRYUSBH_COMPLETION_QUEUE_LEN
+ * are outstanding, the extra ones complete in the interrupt as before.
+ *
+ * usbh_kill_urb() first stops the dispatcher from starting the URB's callbacks
+ * and waits for one it is running, then kills the URB. Completions still pending
+ * then run in the caller's context, a successful one with -USB_ERR_SHUTDOWN, so
+ * no callback can resubmit the URB behind the kill and none runs once it has
+ * returned. The wait is skipped when the kill is made from the interrupt or from
+ * a callback in the dispatcher task itself.
+ *
+ * URBs of a usbh_urb_queue_t are not deferred: the queue submits the next URB
+ * from the completion in the interrupt and hands only the owner's callbacks to
+ * the dispatcher task.
+ */
+
+typedef struct {
+    uint32_t isr_count;         /*!< USB interrupts */
+    uint32_t isr_max_cycles;    /*!< Longest interrupt, CPU cycles */
+    uint64_t isr_total_cycles;  /*!< Time in the interrupt, CPU cycles */
+    uint32_t deferred;          /*!< Callbacks run by the dispatcher task */
+    uint32_t inline_complete;   /*!< Callbacks run in the interrupt, no free slot */
+    uint32_t wakeups;           /*!< Dispatcher task wake-ups */
+    uint32_t max_batch;         /*!< Most callbacks run in one wake-up */
+    uint32_t latency_max_us;    /*!< Longest time from completion to callback */
+    uint64_t latency_total_us;  /*!< Sum over all deferred callbacks */
+    usb_osal_lock_stats_t lock; /*!< Completion ring lock, with CONFIG_CHERRYUSB_OSAL_LOCK_STATS */
+} usbh_dispatch_stats_t;
+
+/**
+ * @brief Get the interrupt and completion counters since boot or the last reset
+ */
+void usbh_dispatch_get_stats(usbh_dispatch_stats_t *stats);
+
+void usbh_dispatch_reset_stats(void);
+
+/* Hooks for the usbh_kill_urb() wrapper in esp_cherryusb.c and for usbh_urb_queue.c */
+
+/**
+ * @brief Run a callback in the dispatcher task, in completion order with the others
+ *
+ * @param key What usbh_dispatch_kill_begin() and usbh_dispatch_kill_end() match it by
+ * @return false if the dispatcher task is not running or all slots are in use,
+ *         the caller then runs the callback itself
+ */
+bool usbh_dispatch_defer(const void *key, struct usbh_urb *urb, usbh_complete_callback_t complete, void *arg, int nbytes);
+
+/**
+ * @brief Keep the dispatcher from starting callbacks of @p key and wait for one it is running
+ */
+void usbh_dispatch_kill_begin(const void *key);
+
+/**
+ * @brief Run the callbacks of @p key that are still pending, then let the dispatcher run new ones
+ */
+void usbh_dispatch_kill_end(const void *key);
+
+#ifdef __cplusplus
+}
+#endif
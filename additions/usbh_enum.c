@@ -0,0 +1,537 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "usb_config.h"
+#include "usb_log.h"
+#include "usb_errno.h"
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+#include "nvs.h"
+#include "esp_rom_crc.h"
+#endif
+#include "usbh_enum.h"
+
+#define USBH_DESC_CACHE_NAMESPACE   "cusb_desc"
+#define USBH_DESC_CACHE_MAGIC       0x32445543 /* "CUD2", bump when the record layout changes */
+#define USBH_DESC_STRING_MAX        255
+
+/* Start of an entry, followed by the records */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;       /* CRC32 of the records */
+} usbh_desc_entry_head_t;
+
+/* One descriptor as returned by GET_DESCRIPTOR, langid is 0 except for strings */
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t index;
+    uint16_t langid;
+    uint16_t len;
+} usbh_desc_record_t;
+
+typedef struct {
+    struct usbh_hubport *volatile hport;    /* Device being enumerated, NULL otherwise */
+    int64_t start_us;
+    usbh_enum_timing_t timing;
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    bool looked_up;     /* Device descriptor seen, entry loaded or started */
+    bool hit;           /* Cached entry verified against the device */
+    bool verify_config; /* Hit without a serial number: nothing is served until the configuration matches */
+    bool dirty;         /* Entry built or extended, store it when done */
+    bool overflow;      /* Entry does not fit CONFIG_CHERRYUSBH_DESC_CACHE_SIZE */
+    char key[16];
+    size_t len;
+    size_t stored_len;  /* Length and CRC of the entry found in NVS under key, 0 if none */
+    uint32_t stored_crc;
+    uint8_t entry[CONFIG_CHERRYUSBH_DESC_CACHE_SIZE] __attribute__((aligned(4)));
+#endif
+} usbh_enum_ctx_t;
+
+static usbh_enum_ctx_t s_enum;
+static portMUX_TYPE s_enum_lock = portMUX_INITIALIZER_UNLOCKED;
+static usbh_enum_timing_t s_enum_last;
+
+#ifdef CONFIG_CHERRYUSBH_ENUM_LOG
+static const char *const s_enum_step_name[USBH_ENUM_STEP_MAX] = {
+    "dev", "addr", "config", "string", "set_config", "class"
+};
+#endif
+
+static usbh_enum_step_t usbh_enum_step(const struct usb_setup_packet *setup)
+{
+    if ((setup->bmRequestType & (USB_REQUEST_TYPE_MASK | USB_REQUEST_RECIPIENT_MASK)) != (USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE)) {
+        return USBH_ENUM_STEP_CLASS;
+    }
+    switch (setup->bRequest) {
+        case USB_REQUEST_GET_DESCRIPTOR:
+            switch (setup->wValue >> 8) {
+                case USB_DESCRIPTOR_TYPE_DEVICE:
+                    return USBH_ENUM_STEP_DEVICE_DESC;
+                case USB_DESCRIPTOR_TYPE_CONFIGURATION:
+                    return USBH_ENUM_STEP_CONFIG_DESC;
+                case USB_DESCRIPTOR_TYPE_STRING:
+                    return USBH_ENUM_STEP_STRING_DESC;
+                default:
+                    break;
+            }
+            break;
+        case USB_REQUEST_SET_ADDRESS:
+            return USBH_ENUM_STEP_SET_ADDRESS;
+        case USB_REQUEST_SET_CONFIGURATION:
+            return USBH_ENUM_STEP_SET_CONFIG;
+        default:
+            break;
+    }
+    return USBH_ENUM_STEP_CLASS;
+}
+
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+static nvs_handle_t s_desc_nvs;
+static bool s_desc_nvs_open;
+static usbh_desc_cache_stats_t s_desc_stats;
+
+/* Own transfers to check the serial number, run while nothing else knows the device */
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX struct usb_setup_packet s_desc_setup;
+static USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t s_desc_buf[USBH_DESC_STRING_MAX + 1];
+static struct usbh_urb s_desc_urb;
+
+/* Language IDs and serial number read from the device before the key is known */
+static uint8_t s_desc_langids[USBH_DESC_STRING_MAX];
+static uint8_t s_desc_serial[USBH_DESC_STRING_MAX];
+static uint16_t s_desc_langids_len;
+static uint16_t s_desc_serial_len;
+static uint16_t s_desc_langid;
+
+static bool usbh_desc_nvs_open(void)
+{
+    if (!s_desc_nvs_open) {
+        esp_err_t err = nvs_open(USBH_DESC_CACHE_NAMESPACE, NVS_READWRITE, &s_desc_nvs);
+        if (err != ESP_OK) {
+            USB_LOG_WRN("descriptor cache unavailable, nvs_open: 0x%x\r\n", err);
+            return false;
+        }
+        s_desc_nvs_open = true;
+    }
+    return true;
+}
+
+static const uint8_t *usbh_desc_find(uint8_t type, uint8_t index, uint16_t langid, uint16_t *len)
+{
+    size_t off = sizeof(usbh_desc_entry_head_t);
+
+    while (off + sizeof(usbh_desc_record_t) <= s_enum.len) {
+        const usbh_desc_record_t *rec = (const usbh_desc_record_t *)&s_enum.entry[off];
+        if (off + sizeof(usbh_desc_record_t) + rec->len > s_enum.len) {
+            break;
+        }
+        if (rec->type == type && rec->index == index && rec->langid == langid) {
+            *len = rec->len;
+            return (const uint8_t *)(rec + 1);
+        }
+        off += sizeof(usbh_desc_record_t) + rec->len;
+    }
+    return NULL;
+}
+
+/* Add a descriptor, replacing a shorter read of the same one (e.g. the 9 byte configuration header) */
+static void usbh_desc_add(uint8_t type, uint8_t index, uint16_t langid, const uint8_t *data, uint16_t len)
+{
+    uint16_t old_len;
+    const uint8_t *old = usbh_desc_find(type, index, langid, &old_len);
+
+    if (old) {
+        if (old_len >= len) {
+            return;
+        }
+        uint8_t *rec = (uint8_t *)old - sizeof(usbh_desc_record_t);
+        size_t rec_size = sizeof(usbh_desc_record_t) + old_len;
+        memmove(rec, rec + rec_size, s_enum.len - (size_t)(rec + rec_size - s_enum.entry));
+        s_enum.len -= rec_size;
+    }
+    if (s_enum.len + sizeof(usbh_desc_record_t) + len > sizeof(s_enum.entry)) {
+        s_enum.overflow = true;
+        return;
+    }
+    usbh_desc_record_t rec = { .type = type, .index = index, .langid = langid, .len = len };
+    memcpy(&s_enum.entry[s_enum.len], &rec, sizeof(rec));
+    memcpy(&s_enum.entry[s_enum.len + sizeof(rec)], data, len);
+    s_enum.len += sizeof(rec) + len;
+    s_enum.dirty = true;
+}
+
+static void usbh_desc_reset(void)
+{
+    usbh_desc_entry_head_t head = { .magic = USBH_DESC_CACHE_MAGIC };
+
+    memcpy(s_enum.entry, &head, sizeof(head));
+    s_enum.len = sizeof(head);
+    s_enum.hit = false;
+    s_enum.verify_config = false;
+    s_enum.overflow = false;
+}
+
+static uint32_t usbh_desc_crc(void)
+{
+    return esp_rom_crc32_le(0, &s_enum.entry[sizeof(usbh_desc_entry_head_t)], s_enum.len - sizeof(usbh_desc_entry_head_t));
+}
+
+/* The whole entry has to be intact: known layout, matching CRC and records that end exactly at its end */
+static bool usbh_desc_validate(void)
+{
+    usbh_desc_entry_head_t head;
+    size_t off = sizeof(head);
+
+    if (s_enum.len < sizeof(head)) {
+        return false;
+    }
+    memcpy(&head, s_enum.entry, sizeof(head));
+    if (head.magic != USBH_DESC_CACHE_MAGIC || head.crc != usbh_desc_crc()) {
+        return false;
+    }
+    while (off < s_enum.len) {
+        const usbh_desc_record_t *rec = (const usbh_desc_record_t *)&s_enum.entry[off];
+        if (off + sizeof(usbh_desc_record_t) > s_enum.len || off + sizeof(usbh_desc_record_t) + rec->len > s_enum.len) {
+            return false;
+        }
+        off += sizeof(usbh_desc_record_t) + rec->len;
+    }
+    return true;
+}
+
+static int usbh_desc_read(usbh_enum_submit_t submit, uint8_t type, uint8_t index, uint16_t langid, uint16_t length)
+{
+    int ret;
+
+    s_desc_setup.bmRequestType = USB_REQUEST_DIR_IN | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE;
+    s_desc_setup.bRequest = USB_REQUEST_GET_DESCRIPTOR;
+    s_desc_setup.wValue = (uint16_t)((type << 8) | index);
+    s_desc_setup.wIndex = langid;
+    s_desc_setup.wLength = length;
+    usbh_control_urb_fill(&s_desc_urb, s_enum.hport, &s_desc_setup, s_desc_buf, length,
+                          CONFIG_USBHOST_CONTROL_TRANSFER_TIMEOUT, NULL, NULL);
+    ret = submit(&s_desc_urb);
+    s_enum.timing.transfers++;
+    if (ret < 0) {
+        return ret;
+    }
+    return (int)s_desc_urb.actual_length;
+}
+
+/* Read the language IDs and the serial number string, false if the device has none or they cannot be read */
+static bool usbh_desc_read_serial(usbh_enum_submit_t submit, uint8_t iserial)
+{
+    int ret;
+
+    s_desc_langids_len = 0;
+    s_desc_serial_len = 0;
+    if (iserial == 0) {
+        return false;
+    }
+    ret = usbh_desc_read(submit, USB_DESCRIPTOR_TYPE_STRING, 0, 0, USBH_DESC_STRING_MAX);
+    if (ret < 4) {
+        return false;
+    }
+    memcpy(s_desc_langids, s_desc_buf, ret);
+    s_desc_langids_len = ret;
+    s_desc_langid = (uint16_t)(s_desc_buf[2] | (s_desc_buf[3] << 8));
+
+    ret = usbh_desc_read(submit, USB_DESCRIPTOR_TYPE_STRING, iserial, s_desc_langid, USBH_DESC_STRING_MAX);
+    if (ret < 2) {
+        return false;
+    }
+    memcpy(s_desc_serial, s_desc_buf, ret);
+    s_desc_serial_len = ret;
+    return true;
+}
+
+/*
+ * NVS keys are at most 15 characters: idVendor, idProduct and 28 bits of an FNV-1a hash over
+ * bcdDevice and the serial number string, so that devices of one model get their own entries.
+ */
+static void usbh_desc_make_key(const struct usb_device_descriptor *desc)
+{
+    uint8_t bcd[2] = { desc->bcdDevice & 0xff, desc->bcdDevice >> 8 };
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(bcd); i++) {
+        hash = (hash ^ bcd[i]) * 16777619u;
+    }
+    for (int i = 0; i < s_desc_serial_len; i++) {
+        hash = (hash ^ s_desc_serial[i]) * 16777619u;
+    }
+    snprintf(s_enum.key, sizeof(s_enum.key), "%04x%04x%07lx", desc->idVendor, desc->idProduct, (unsigned long)(hash & 0xfffffff));
+}
+
+/* The full device descriptor has just been read: load the entry and verify it, or start a new one */
+static void usbh_desc_lookup(const struct usb_device_descriptor *desc, usbh_enum_submit_t submit)
+{
+    int64_t start = esp_timer_get_time();
+    const uint8_t *cached;
+    uint16_t cached_len;
+    bool serial;
+    size_t len = sizeof(s_enum.entry);
+
+    s_enum.looked_up = true;
+    serial = usbh_desc_read_serial(submit, desc->iSerialNumber);
+    if (desc->iSerialNumber && !serial) {
+        // Cannot tell this device from others of its model, leave the cache alone
+        s_enum.len = 0;
+        s_enum.timing.cache_us += (uint32_t)(esp_timer_get_time() - start);
+        return;
+    }
+    usbh_desc_make_key(desc);
+    usbh_desc_reset();
+    s_enum.stored_len = 0;
+    if (nvs_get_blob(s_desc_nvs, s_enum.key, s_enum.entry, &len) == ESP_OK) {
+        s_enum.len = len;
+        if (usbh_desc_validate()) {
+            s_enum.stored_len = len;
+            s_enum.stored_crc = usbh_desc_crc();
+            cached = usbh_desc_find(USB_DESCRIPTOR_TYPE_DEVICE, 0, 0, &cached_len);
+            if (cached && cached_len == sizeof(*desc) && memcmp(cached, desc, sizeof(*desc)) == 0) {
+                if (serial) {
+                    cached = usbh_desc_find(USB_DESCRIPTOR_TYPE_STRING, desc->iSerialNumber, s_desc_langid, &cached_len);
+                    s_enum.hit = cached && cached_len == s_desc_serial_len && memcmp(cached, s_desc_serial, cached_len) == 0;
+                } else {
+                    /*
+                     * Nothing tells this device from another configuration under the same
+                     * idVendor/idProduct/bcdDevice (e.g. firmware updated without a new bcdDevice).
+                     * The configuration is read from the bus and compared in full before any
+                     * string is answered from the entry.
+                     */
+                    s_enum.hit = true;
+                    s_enum.verify_config = true;
+                }
+            }
+        }
+        if (!s_enum.hit) {
+            s_desc_stats.mismatches++;
+            usbh_desc_reset();
+        }
+    }
+    if (!s_enum.hit) {
+        s_desc_stats.misses++;
+        usbh_desc_add(USB_DESCRIPTOR_TYPE_DEVICE, 0, 0, (const uint8_t *)desc, sizeof(*desc));
+        if (serial) {
+            usbh_desc_add(USB_DESCRIPTOR_TYPE_STRING, 0, 0, s_desc_langids, s_desc_langids_len);
+            usbh_desc_add(USB_DESCRIPTOR_TYPE_STRING, desc->iSerialNumber, s_desc_langid, s_desc_serial, s_desc_serial_len);
+        }
+    } else if (!s_enum.verify_config) {
+        s_desc_stats.hits++;
+        s_enum.timing.cache_hit = true;
+    }
+    s_enum.timing.cache_us += (uint32_t)(esp_timer_get_time() - start);
+}
+
+/* A configuration read from the bus on a hit without a serial number: confirm the hit, or start a new entry */
+static void usbh_desc_verify_config(uint8_t index, const uint8_t *data, uint16_t len)
+{
+    uint16_t cached_len;
+    const uint8_t *cached = usbh_desc_find(USB_DESCRIPTOR_TYPE_CONFIGURATION, index, 0, &cached_len);
+
+    if (cached && cached_len >= len && memcmp(cached, data, len) == 0) {
+        // The 9 byte header matches so far, the full read decides
+        if (cached_len == len) {
+            s_enum.verify_config = false;
+            s_desc_stats.hits++;
+            s_enum.timing.cache_hit = true;
+        }
+        return;
+    }
+    // The device descriptor matched in the lookup, carry it over to the new entry
+    struct usb_device_descriptor desc;
+    memcpy(&desc, usbh_desc_find(USB_DESCRIPTOR_TYPE_DEVICE, 0, 0, &cached_len), sizeof(desc));
+    s_desc_stats.mismatches++;
+    s_desc_stats.misses++;
+    usbh_desc_reset();
+    usbh_desc_add(USB_DESCRIPTOR_TYPE_DEVICE, 0, 0, (const uint8_t *)&desc, sizeof(desc));
+    usbh_desc_add(USB_DESCRIPTOR_TYPE_CONFIGURATION, index, 0, data, len);
+}
+
+static bool usbh_desc_cacheable(const struct usb_setup_packet *setup)
+{
+    uint8_t type = setup->wValue >> 8;
+
+    return setup->bmRequestType == (USB_REQUEST_DIR_IN | USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_DEVICE) &&
+           setup->bRequest == USB_REQUEST_GET_DESCRIPTOR &&
+           (type == USB_DESCRIPTOR_TYPE_CONFIGURATION || type == USB_DESCRIPTOR_TYPE_STRING);
+}
+
+static bool usbh_desc_serve(struct usbh_urb *urb)
+{
+    const struct usb_setup_packet *setup = urb->setup;
+    const uint8_t *data;
+    uint16_t len;
+
+    if (!s_enum.hit || s_enum.verify_config || !usbh_desc_cacheable(setup)) {
+        return false;
+    }
+    data = usbh_desc_find(setup->wValue >> 8, setup->wValue & 0xff, (setup->wValue >> 8) == USB_DESCRIPTOR_TYPE_STRING ? setup->wIndex : 0, &len);
+    if (!data) {
+        return false;
+    }
+    // What the device would return: never more than asked for
+    len = MIN(len, MIN(setup->wLength, urb->transfer_buffer_length));
+    memcpy(urb->transfer_buffer, data, len);
+    urb->actual_length = len;
+    urb->errorcode = 0;
+    return true;
+}
+
+static void usbh_desc_store(int ret)
+{
+    int64_t start = esp_timer_get_time();
+
+    if (ret < 0) {
+        // The cached descriptors may be what made it fail, read them from the bus next time
+        if (s_enum.hit && !s_enum.verify_config && nvs_erase_key(s_desc_nvs, s_enum.key) == ESP_OK) {
+            nvs_commit(s_desc_nvs);
+            s_desc_stats.dropped++;
+        }
+    } else if (s_enum.dirty && !s_enum.overflow) {
+        usbh_desc_entry_head_t head = { .magic = USBH_DESC_CACHE_MAGIC, .crc = usbh_desc_crc() };
+        memcpy(s_enum.entry, &head, sizeof(head));
+        if (s_enum.len == s_enum.stored_len && head.crc == s_enum.stored_crc) {
+            // Same content as in flash, e.g. a miss that read back what was cached
+        } else if (nvs_set_blob(s_desc_nvs, s_enum.key, s_enum.entry, s_enum.len) == ESP_OK && nvs_commit(s_desc_nvs) == ESP_OK) {
+            s_desc_stats.stored++;
+        } else {
+            USB_LOG_WRN("descriptor cache: cannot store %s\r\n", s_enum.key);
+        }
+    }
+    s_enum.timing.cache_us += (uint32_t)(esp_timer_get_time() - start);
+}
+#endif
+
+void usbh_enum_begin(struct usbh_hubport *hport)
+{
+    memset(&s_enum.timing, 0, sizeof(s_enum.timing));
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    s_enum.looked_up = !usbh_desc_nvs_open();
+    s_enum.hit = false;
+    s_enum.verify_config = false;
+    s_enum.dirty = false;
+#endif
+    s_enum.start_us = esp_timer_get_time();
+    s_enum.hport = hport;
+}
+
+void usbh_enum_end(struct usbh_hubport *hport, int ret)
+{
+    usbh_enum_timing_t *t = &s_enum.timing;
+
+    s_enum.hport = NULL;
+    t->result = ret;
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    if (s_desc_nvs_open && s_enum.len) {
+        usbh_desc_store(ret);
+    }
+    s_enum.len = 0;
+#endif
+    t->total_us = (uint32_t)(esp_timer_get_time() - s_enum.start_us);
+
+#ifdef CONFIG_CHERRYUSBH_ENUM_LOG
+    char steps[96];
+    int off = 0;
+    for (int i = 0; i < USBH_ENUM_STEP_MAX; i++) {
+        off += snprintf(&steps[off], sizeof(steps) - off, " %s %lu", s_enum_step_name[i], (unsigned long)t->step_us[i]);
+    }
+    USB_LOG_INFO("enumerated %04x:%04x in %lu us (%s, %u transfers, %u cached, cache %lu us):%s\r\n",
+                 t->vid, t->pid, (unsigned long)t->total_us, t->cache_hit ? "hit" : "miss",
+                 t->transfers, t->cached, (unsigned long)t->cache_us, steps);
+#endif
+
+    portENTER_CRITICAL(&s_enum_lock);
+    s_enum_last = *t;
+    portEXIT_CRITICAL(&s_enum_lock);
+}
+
+bool USB_ISR_ATTR usbh_enum_owns(const struct usbh_urb *urb)
+{
+    return urb->setup && urb->hport == s_enum.hport;
+}
+
+int usbh_enum_submit(struct usbh_urb *urb, usbh_enum_submit_t submit)
+{
+    const struct usb_setup_packet *setup = urb->setup;
+    usbh_enum_step_t step = usbh_enum_step(setup);
+    int64_t start = esp_timer_get_time();
+    int ret;
+
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    if (usbh_desc_serve(urb)) {
+        s_enum.timing.cached++;
+        s_enum.timing.step_us[step] += (uint32_t)(esp_timer_get_time() - start);
+        return 0;
+    }
+#endif
+    ret = submit(urb);
+    s_enum.timing.transfers++;
+    s_enum.timing.step_us[step] += (uint32_t)(esp_timer_get_time() - start);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (step == USBH_ENUM_STEP_DEVICE_DESC && urb->actual_length >= sizeof(struct usb_device_descriptor)) {
+        const struct usb_device_descriptor *desc = (const struct usb_device_descriptor *)urb->transfer_buffer;
+        s_enum.timing.vid = desc->idVendor;
+        s_enum.timing.pid = desc->idProduct;
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+        if (!s_enum.looked_up) {
+            usbh_desc_lookup(desc, submit);
+        }
+#endif
+    }
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    else if (s_enum.len && usbh_desc_cacheable(setup)) {
+        uint8_t type = setup->wValue >> 8;
+        if (s_enum.verify_config && type == USB_DESCRIPTOR_TYPE_CONFIGURATION) {
+            usbh_desc_verify_config(setup->wValue & 0xff, urb->transfer_buffer, urb->actual_length);
+        } else {
+            usbh_desc_add(type, setup->wValue & 0xff, type == USB_DESCRIPTOR_TYPE_STRING ? setup->wIndex : 0,
+                          urb->transfer_buffer, urb->actual_length);
+        }
+    }
+#endif
+    return ret;
+}
+
+void usbh_enum_get_timing(usbh_enum_timing_t *timing)
+{
+    portENTER_CRITICAL(&s_enum_lock);
+    *timing = s_enum_last;
+    portEXIT_CRITICAL(&s_enum_lock);
+}
+
+void usbh_desc_cache_get_stats(usbh_desc_cache_stats_t *stats)
+{
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    portENTER_CRITICAL(&s_enum_lock);
+    *stats = s_desc_stats;
+    portEXIT_CRITICAL(&s_enum_lock);
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+int usbh_desc_cache_clear(void)
+{
+#ifdef CONFIG_CHERRYUSBH_DESC_CACHE
+    if (!usbh_desc_nvs_open()) {
+        return -USB_ERR_IO;
+    }
+    if (nvs_erase_all(s_desc_nvs) != ESP_OK || nvs_commit(s_desc_nvs) != ESP_OK) {
+        return -USB_ERR_IO;
+    }
+    return 0;
+#else
+    return -USB_ERR_NOTSUPP;
+#endif
+}
@@ -0,0 +1,118 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usbh_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Enumeration timing and descriptor cache (CONFIG_CHERRYUSBH_ENUM_STATS,
+ * CONFIG_CHERRYUSBH_DESC_CACHE).
+ *
+ * Every control transfer made by usbh_enumerate() is timed and counted against
+ * the step it belongs to; the figures of the last enumeration are available from
+ * usbh_enum_get_timing(). The total runs from the first request to the device
+ * to the return of the class driver connect handlers, i.e. until the device is
+ * ready for use. Port reset and debounce happen before and are not included.
+ *
+ * With the descriptor cache, the descriptors read from a device are kept in NVS,
+ * one entry per idVendor/idProduct/bcdDevice and serial number string, so that
+ * devices of one model with different serial numbers have their own entries. A
+ * device with a serial number therefore has its language IDs and serial number
+ * read from the bus before the lookup; if they cannot be read, it is not cached.
+ * A loaded entry is used only if it is intact as a whole (CRC over all records)
+ * and its device descriptor, still read from the bus, matches byte for byte,
+ * as does the serial number. Without a serial number the configuration
+ * descriptor is also read from the bus and must match the cached one in full
+ * before any string is answered from the cache. On a hit the configuration
+ * and string descriptor requests are answered from the cache; the configuration
+ * is still parsed and the class drivers still bound by the stack, and
+ * SET_ADDRESS, SET_CONFIGURATION and every class request still go to the device.
+ * A cached entry is dropped if an enumeration that used it fails, and an entry
+ * is only written when its content differs from what NVS holds.
+ *
+ * The application must have called nvs_flash_init() before the first device is
+ * attached; without NVS the cache is skipped and only the timing is recorded.
+ */
+
+typedef enum {
+    USBH_ENUM_STEP_DEVICE_DESC,     /*!< GET_DESCRIPTOR(DEVICE), both the 8 and the 18 byte read */
+    USBH_ENUM_STEP_SET_ADDRESS,
+    USBH_ENUM_STEP_CONFIG_DESC,     /*!< GET_DESCRIPTOR(CONFIGURATION), header and full */
+    USBH_ENUM_STEP_STRING_DESC,
+    USBH_ENUM_STEP_SET_CONFIG,
+    USBH_ENUM_STEP_CLASS,           /*!< Any other request, mostly from the class driver connect handlers */
+    USBH_ENUM_STEP_MAX,
+} usbh_enum_step_t;
+
+typedef struct {
+    uint16_t vid;                           /*!< idVendor, 0 if the device descriptor could not be read */
+    uint16_t pid;                           /*!< idProduct */
+    int result;                             /*!< Return value of usbh_enumerate() */
+    bool cache_hit;                         /*!< Descriptors were answered from the cache */
+    uint8_t transfers;                      /*!< Control transfers on the bus */
+    uint8_t cached;                         /*!< Requests answered from the cache */
+    uint32_t total_us;                      /*!< usbh_enumerate() from start to ready */
+    uint32_t cache_us;                      /*!< NVS lookup, serial number check and store */
+    uint32_t step_us[USBH_ENUM_STEP_MAX];   /*!< Time spent in the transfers of each step */
+} usbh_enum_timing_t;
+
+typedef struct {
+    uint32_t hits;          /*!< Enumerations that used a cached entry */
+    uint32_t misses;        /*!< Enumerations that read the descriptors from the bus */
+    uint32_t mismatches;    /*!< Cached entries that were damaged or whose device descriptor, serial number or configuration differed */
+    uint32_t stored;        /*!< Entries written to NVS */
+    uint32_t dropped;       /*!< Cached entries erased after a failed enumeration */
+} usbh_desc_cache_stats_t;
+
+/**
+ * @brief Get the step timing of the last completed enumeration
+ */
+void usbh_enum_get_timing(usbh_enum_timing_t *timing);
+
+/**
+ * @brief Get the descriptor cache counters since boot
+ */
+void usbh_desc_cache_get_stats(usbh_desc_cache_stats_t *stats);
+
+/**
+ * @brief Erase every cached descriptor entry from NVS
+ *
+ * Task context, not while a device is being enumerated.
+ *
+ * @return 0, -USB_ERR_NOTSUPP without CONFIG_CHERRYUSBH_DESC_CACHE, or -USB_ERR_IO
+ */
+int usbh_desc_cache_clear(void);
+
+/* Hooks for the usbh_enumerate() and usbh_submit_urb() wrappers in esp_cherryusb.c */
+typedef int (*usbh_enum_submit_t)(struct usbh_urb *urb);
+
+void usbh_enum_begin(struct usbh_hubport *hport);
+
+void usbh_enum_end(struct usbh_hubport *hport, int ret);
+
+/**
+ * @brief Whether a URB is a control transfer of the device being enumerated
+ */
+bool usbh_enum_owns(const struct usbh_urb *urb);
+
+/**
+ * @brief Run a control transfer of the device being enumerated
+ *
+ * Answers it from the cache or passes it to @p submit, which hands the URB to
+ * the port; further transfers needed to check the cache go the same way.
+ */
+int usbh_enum_submit(struct usbh_urb *urb, usbh_enum_submit_t submit);
+
+#ifdef __cplusplus
+}
+#endif
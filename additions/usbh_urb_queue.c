@@ -0,0 +1,227 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "usb_config.h"
+#include "usb_errno.h"
+#include "usbh_urb_queue.h"
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+#include "usbh_dispatch.h"
+#endif
+
+static void usbh_urb_queue_complete(void *arg, int nbytes);
+
+static inline void USB_ISR_ATTR usbh_urb_queue_restore(const usbh_urb_queue_entry_t *entry)
+{
+    entry->urb->complete = entry->complete;
+    entry->urb->arg = entry->arg;
+}
+
+/* The owner's callback; from the interrupt it goes to the dispatcher task like any other */
+static void USB_ISR_ATTR usbh_urb_queue_call(usbh_urb_queue_t *q, const usbh_urb_queue_entry_t *entry, int nbytes)
+{
+    if (entry->complete == NULL) {
+        return;
+    }
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    if (xPortInIsrContext() && usbh_dispatch_defer(q, entry->urb, entry->complete, entry->arg, nbytes)) {
+        return;
+    }
+#endif
+    entry->complete(entry->arg, nbytes);
+}
+
+/* Take every URB still queued and complete it unsent, in order; a head in flight stays for its own completion */
+static void USB_ISR_ATTR usbh_urb_queue_cancel_all(usbh_urb_queue_t *q)
+{
+    usbh_urb_queue_entry_t cancel[USBH_URB_QUEUE_DEPTH];
+    uint8_t first;
+    uint8_t num;
+
+    portENTER_CRITICAL_SAFE(&q->lock);
+    first = (q->count && q->ring[q->head].in_flight) ? 1 : 0;
+    num = q->count - first;
+    for (uint8_t i = 0; i < num; i++) {
+        cancel[i] = q->ring[(q->head + first + i) % USBH_URB_QUEUE_DEPTH];
+    }
+    q->count = first;
+    q->toggle_valid = false;
+    q->stats.cancelled += num;
+    portEXIT_CRITICAL_SAFE(&q->lock);
+
+    for (uint8_t i = 0; i < num; i++) {
+        usbh_urb_queue_restore(&cancel[i]);
+        cancel[i].urb->actual_length = 0;
+        cancel[i].urb->errorcode = -USB_ERR_SHUTDOWN;
+        usbh_urb_queue_call(q, &cancel[i], -USB_ERR_SHUTDOWN);
+    }
+}
+
+static void USB_ISR_ATTR usbh_urb_queue_complete(void *arg, int nbytes)
+{
+    usbh_urb_queue_t *q = arg;
+    usbh_urb_queue_entry_t done;
+    struct usbh_urb *next = NULL;
+    bool cancel = false;
+
+    portENTER_CRITICAL_SAFE(&q->lock);
+    done = q->ring[q->head];
+    q->ring[q->head].in_flight = false;
+    q->head = (q->head + 1) % USBH_URB_QUEUE_DEPTH;
+    q->count--;
+    if (nbytes >= 0) {
+        q->data_toggle = done.urb->data_toggle;
+        q->toggle_valid = true;
+        q->stats.completed++;
+        if (q->count && !q->killing) {
+            next = q->ring[q->head].urb;
+            next->data_toggle = q->data_toggle;
+            q->ring[q->head].in_flight = true;
+            q->stats.chained++;
+        }
+    } else {
+        // The pipe needs recovery by its owner, nothing behind this URB may go out
+        q->toggle_valid = false;
+        cancel = q->count != 0;
+    }
+    portEXIT_CRITICAL_SAFE(&q->lock);
+
+    // Keep the channel busy before handing the finished URB back
+    if (next && usbh_submit_urb(next) < 0) {
+        portENTER_CRITICAL_SAFE(&q->lock);
+        q->ring[q->head].in_flight = false;
+        portEXIT_CRITICAL_SAFE(&q->lock);
+        cancel = true;
+    }
+    usbh_urb_queue_restore(&done);
+    usbh_urb_queue_call(q, &done, nbytes);
+    if (cancel) {
+        usbh_urb_queue_cancel_all(q);
+    }
+}
+
+void usbh_urb_queue_init(usbh_urb_queue_t *q)
+{
+    memset(q, 0, sizeof(usbh_urb_queue_t));
+    portMUX_INITIALIZE(&q->lock);
+}
+
+int USB_ISR_ATTR usbh_urb_queue_submit(usbh_urb_queue_t *q, struct usbh_urb *urb)
+{
+    usbh_urb_queue_entry_t *entry;
+    bool start;
+    int ret;
+
+    if (urb->timeout) {
+        return -USB_ERR_INVAL;
+    }
+    portENTER_CRITICAL_SAFE(&q->lock);
+    if (q->count == USBH_URB_QUEUE_DEPTH) {
+        portEXIT_CRITICAL_SAFE(&q->lock);
+        return -USB_ERR_BUSY;
+    }
+    entry = &q->ring[(q->head + q->count) % USBH_URB_QUEUE_DEPTH];
+    entry->urb = urb;
+    entry->complete = urb->complete;
+    entry->arg = urb->arg;
+    entry->in_flight = false;
+    urb->complete = usbh_urb_queue_complete;
+    urb->arg = q;
+    q->count++;
+    q->stats.submitted++;
+    if (q->count > q->stats.max_depth) {
+        q->stats.max_depth = q->count;
+    }
+    start = (q->count == 1);
+    if (start) {
+        entry->in_flight = true;
+        if (q->toggle_valid) {
+            urb->data_toggle = q->data_toggle;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&q->lock);
+
+    if (!start) {
+        return 0;
+    }
+    // The pipe was idle: nothing else submits until this URB completes
+    ret = usbh_submit_urb(urb);
+    if (ret < 0) {
+        usbh_urb_queue_entry_t self;
+        portENTER_CRITICAL_SAFE(&q->lock);
+        self = q->ring[q->head];
+        q->ring[q->head].in_flight = false;
+        q->head = (q->head + 1) % USBH_URB_QUEUE_DEPTH;
+        q->count--;
+        q->stats.submitted--;
+        portEXIT_CRITICAL_SAFE(&q->lock);
+        usbh_urb_queue_restore(&self);
+        // URBs queued behind in the meantime have nobody left to start them
+        usbh_urb_queue_cancel_all(q);
+    }
+    return ret;
+}
+
+void usbh_urb_queue_kill(usbh_urb_queue_t *q)
+{
+    struct usbh_urb *killed = NULL;
+
+    portENTER_CRITICAL(&q->lock);
+    q->killing = true;
+    portEXIT_CRITICAL(&q->lock);
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    usbh_dispatch_kill_begin(q);
+#endif
+
+    /*
+     * If the head completed just before, its completion has already started the
+     * next URB, which is then the head in flight and is killed in turn. With
+     * killing set no further URB is started, so this ends after one more round.
+     */
+    while (1) {
+        struct usbh_urb *in_flight = NULL;
+
+        portENTER_CRITICAL(&q->lock);
+        if (q->count && q->ring[q->head].in_flight && q->ring[q->head].urb != killed) {
+            in_flight = q->ring[q->head].urb;
+        }
+        portEXIT_CRITICAL(&q->lock);
+        if (in_flight == NULL) {
+            break;
+        }
+        usbh_kill_urb(in_flight);
+        killed = in_flight;
+    }
+    usbh_urb_queue_cancel_all(q);
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    // Owner callbacks the interrupt handed to the dispatcher before the kill
+    usbh_dispatch_kill_end(q);
+#endif
+
+    portENTER_CRITICAL(&q->lock);
+    q->killing = false;
+    portEXIT_CRITICAL(&q->lock);
+}
+
+void usbh_urb_queue_reset_toggle(usbh_urb_queue_t *q)
+{
+    portENTER_CRITICAL(&q->lock);
+    q->data_toggle = 0;
+    q->toggle_valid = true;
+    portEXIT_CRITICAL(&q->lock);
+}
+
+void usbh_urb_queue_get_stats(usbh_urb_queue_t *q, usbh_urb_queue_stats_t *stats)
+{
+    portENTER_CRITICAL(&q->lock);
+    *stats = q->stats;
+    portEXIT_CRITICAL(&q->lock);
+}
+
+bool USB_ISR_ATTR usbh_urb_queue_owns(const struct usbh_urb *urb)
+{
+    return urb->complete == usbh_urb_queue_complete;
+}
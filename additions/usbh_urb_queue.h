@@ -0,0 +1,111 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "usbh_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-pipe URB queue for the host (CONFIG_CHERRYUSBH_URB_QUEUE).
+ *
+ * The DWC2 host port runs one URB per pipe; a class driver that waits for each
+ * completion before resubmitting leaves the channel idle for the wake-up and
+ * resubmit latency of its thread. A queue accepts several asynchronous URBs
+ * for the same endpoint and submits the next one from the completion callback
+ * of the previous, i.e. from the USB interrupt, before the owner's callback
+ * runs. Each URB starts with the data toggle the previous one ended on, so
+ * separate URB structures can be used for one endpoint.
+ *
+ * A URB that fails (STALL, timeout, disconnect) stops the queue: the URBs
+ * behind it complete with -USB_ERR_SHUTDOWN without being sent, and the owner
+ * recovers the pipe (e.g. clears the halt and calls usbh_urb_queue_reset_toggle())
+ * before submitting again.
+ *
+ * With CONFIG_CHERRYUSBH_COMPLETION_TASK the next URB is still submitted from
+ * the interrupt; only the owner's callbacks run in the dispatcher task, and
+ * usbh_urb_queue_kill() runs the ones still pending before it returns.
+ */
+
+#define USBH_URB_QUEUE_DEPTH    8
+
+typedef struct {
+    struct usbh_urb *urb;
+    usbh_complete_callback_t complete;
+    void *arg;
+    bool in_flight;         /*!< Handed to usbh_submit_urb(), only ever the head */
+} usbh_urb_queue_entry_t;
+
+typedef struct {
+    uint32_t submitted;     /*!< URBs accepted */
+    uint32_t completed;     /*!< URBs completed successfully */
+    uint32_t chained;       /*!< URBs submitted from the completion of the previous one */
+    uint32_t cancelled;     /*!< URBs completed with -USB_ERR_SHUTDOWN behind a failed one */
+    uint32_t max_depth;     /*!< Most URBs queued at once */
+} usbh_urb_queue_stats_t;
+
+typedef struct {
+    portMUX_TYPE lock;
+    uint8_t head;
+    uint8_t count;
+    bool toggle_valid;
+    bool killing;           /*!< usbh_urb_queue_kill() running, completions start nothing */
+    uint8_t data_toggle;
+    usbh_urb_queue_entry_t ring[USBH_URB_QUEUE_DEPTH];
+    usbh_urb_queue_stats_t stats;
+} usbh_urb_queue_t;
+
+/**
+ * @brief Set up an empty queue, one per endpoint
+ */
+void usbh_urb_queue_init(usbh_urb_queue_t *q);
+
+/**
+ * @brief Queue an asynchronous URB, submitting it at once if the pipe is idle
+ *
+ * The URB must be filled for asynchronous use (timeout 0) with its own
+ * complete callback, which is called as usual once the URB is done. Task or
+ * ISR context, including from a completion callback.
+ *
+ * @return 0, -USB_ERR_INVAL for a synchronous URB, -USB_ERR_BUSY if the queue
+ *         is full, or the error of usbh_submit_urb() when the pipe was idle
+ */
+int usbh_urb_queue_submit(usbh_urb_queue_t *q, struct usbh_urb *urb);
+
+/**
+ * @brief Kill the URB in flight and complete every queued one with -USB_ERR_SHUTDOWN
+ *
+ * The URB on the channel is killed first, including one the completion of
+ * the previous URB has just started; only the URBs behind it are completed
+ * unsent. Task context, e.g. from the class disconnect handler.
+ */
+void usbh_urb_queue_kill(usbh_urb_queue_t *q);
+
+/**
+ * @brief Restart the toggle sequence at DATA0 after a CLEAR_FEATURE(ENDPOINT_HALT)
+ *
+ * Until the first URB of a queue has completed, and after a failed URB, the
+ * next URB submitted keeps its own data_toggle; after this call it starts at DATA0.
+ */
+void usbh_urb_queue_reset_toggle(usbh_urb_queue_t *q);
+
+void usbh_urb_queue_get_stats(usbh_urb_queue_t *q, usbh_urb_queue_stats_t *stats);
+
+/* Hook for the usbh_submit_urb() wrapper in esp_cherryusb.c */
+
+/**
+ * @brief Whether a URB was submitted through a queue and completes into it
+ */
+bool usbh_urb_queue_owns(const struct usbh_urb *urb);
+
+#ifdef __cplusplus
+}
+#endif
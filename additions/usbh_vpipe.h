@@ -0,0 +1,47 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "usb_osal_ext.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Host channel admission (CONFIG_CHERRYUSBH_VPIPE).
+ *
+ * The DWC2 host port takes a channel for every URB in flight, and an interrupt
+ * IN URB keeps its channel for as long as the device NAKs. Once all channels
+ * are held, usbh_submit_urb() fails and enumeration of the next device with it.
+ * With this option a URB that finds no free channel waits in a virtual pipe
+ * instead, and each channel released goes to the waiting URB that is due first:
+ * control transfers, then interrupt/isochronous URBs by bInterval deadline, then
+ * bulk URBs in submission order. When a control transfer has to wait, an
+ * interrupt IN URB that has already been polled for a whole bInterval without
+ * data is taken off its channel and queued again, so enumeration and class
+ * requests always make progress.
+ */
+
+typedef struct {
+    uint32_t admitted;          /*!< URBs that got a channel at once */
+    uint32_t deferred;          /*!< URBs that waited for a channel */
+    uint32_t preempted;         /*!< Interrupt IN URBs taken off their channel for a control transfer */
+    uint32_t timeouts;          /*!< Synchronous URBs whose timeout expired while waiting */
+    uint32_t max_waiting;       /*!< Most URBs waiting at once */
+    usb_osal_lock_stats_t lock; /*!< Scheduler lock, with CONFIG_CHERRYUSB_OSAL_LOCK_STATS */
+} usbh_vpipe_stats_t;
+
+/**
+ * @brief Get the channel admission counters since boot
+ */
+void usbh_vpipe_get_stats(usbh_vpipe_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
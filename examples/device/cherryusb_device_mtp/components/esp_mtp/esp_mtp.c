@@ -7,6 +7,7 @@
 #include "esp_mtp.h"
 #include "esp_mtp_def.h"
 #include "esp_mtp_helper.h"
+#include "esp_mtp_cq.h"
 
 #include "string.h"
 #include "dirent.h"
@@ -17,28 +18,86 @@
 
 #include "esp_vfs_fat.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #ifdef CONFIG_SPIRAM_BOOT_INIT
 #include "esp_heap_caps.h"
 #endif
+#if CONFIG_CHERRYUSB_MEMPOOL
+#include "usb_mempool.h"
+#endif
 
 static char *TAG = "esp_mtp";
 
 #define ASYNC_READ_NOTIFY_BIT  BIT0
 #define ASYNC_WRITE_NOTIFY_BIT  BIT1
 
+#define MTP_PATH_MAX  256
+
 typedef struct esp_mtp {
     void *pipe_context;
     void (*wait_start)(void *pipe_context);
     int (*read)(void *pipe_context, uint8_t *buffer, int len);
     int (*write)(void *pipe_context, const uint8_t *buffer, int len);
+    void (*closed)(void *pipe_context);
     esp_mtp_flags_t flags;
     TaskHandle_t task_hdl;
-    int async_read_len;
+    esp_mtp_cq_t rx_cq;     //OUT 方向完成队列
+    esp_mtp_cq_t tx_cq;     //IN 方向完成队列
     esp_mtp_file_handle_list_t handle_list;
+    portMUX_TYPE virtual_lock;
+    esp_mtp_virtual_object_t virtual_objects[ESP_MTP_VIRTUAL_OBJECT_MAX];
+    char base_path[ESP_MTP_BASE_PATH_MAX];
+    const char *storage_description;
+    char object_path[MTP_PATH_MAX];  //SendObjectInfo 解析出的完整路径, 接收完成后设置时间戳使用
+    bool is_static;
+#if CONFIG_ESP_MTP_STATS
+    portMUX_TYPE stats_lock;
+    int64_t op_start_us;
+    int64_t op_usb_wait_us;
+    uint64_t op_bytes;
+    esp_mtp_op_stats_t stats[ESP_MTP_STATS_OP_MAX];
+#endif
     uint32_t buffer_size;
-    uint8_t buff[0];
+    uint8_t *buff;
 }esp_mtp_t;
 
+#if CONFIG_ESP_MTP_STATIC_ALLOCATION
+static esp_mtp_t s_static_engines[CONFIG_ESP_MTP_MAX_INSTANCES];
+static bool s_static_engine_used[CONFIG_ESP_MTP_MAX_INSTANCES];
+static portMUX_TYPE s_static_engine_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_mtp_handle_t static_engine_alloc(void)
+{
+    esp_mtp_handle_t handle = NULL;
+    portENTER_CRITICAL(&s_static_engine_lock);
+    for (int i = 0; i < CONFIG_ESP_MTP_MAX_INSTANCES; i++) {
+        if (!s_static_engine_used[i]) {
+            s_static_engine_used[i] = true;
+            handle = &s_static_engines[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_static_engine_lock);
+    return handle;
+}
+#endif
+
+static void engine_free(esp_mtp_handle_t handle)
+{
+#if CONFIG_ESP_MTP_STATIC_ALLOCATION
+    if (handle->is_static) {
+        portENTER_CRITICAL(&s_static_engine_lock);
+        s_static_engine_used[handle - s_static_engines] = false;
+        portEXIT_CRITICAL(&s_static_engine_lock);
+        return;
+    }
+#endif
+#if CONFIG_CHERRYUSB_MEMPOOL
+    usb_mempool_free(handle->buff);
+#endif
+    free(handle);
+}
+
 const mtp_operation_code_t supported_operation_codes[] = {
     MTP_OPERATION_GET_DEVICE_INFO,
     MTP_OPERATION_OPEN_SESSION,
@@ -64,6 +123,124 @@ const mtp_operation_code_t supported_event_codes[] = {
 
 };
 
+#if CONFIG_ESP_MTP_STATS
+#define MTP_STATS_WAIT_BEGIN()          int64_t wait_start_us = esp_timer_get_time()
+#define MTP_STATS_WAIT_END(handle)      (handle)->op_usb_wait_us += esp_timer_get_time() - wait_start_us
+#define MTP_STATS_ADD_BYTES(handle, n)  (handle)->op_bytes += (n)
+#define MTP_STATS_OP_BEGIN(handle)      stats_op_begin(handle)
+#define MTP_STATS_OP_END(handle, opt)   stats_op_end(handle, opt)
+
+static void stats_op_begin(esp_mtp_handle_t handle)
+{
+    handle->op_usb_wait_us = 0;
+    handle->op_bytes = 0;
+    handle->op_start_us = esp_timer_get_time();
+}
+
+//只有标准操作码 0x1000~0x101F 按低位索引，厂商扩展（0x9xxx）等其余操作码计入索引 0
+static inline uint32_t stats_op_index(uint16_t opt)
+{
+    if ((opt & 0xF000) == 0x1000 && (opt & 0xFFF) < ESP_MTP_STATS_OP_MAX) {
+        return opt & 0xFFF;
+    }
+    return 0;
+}
+
+static void stats_op_end(esp_mtp_handle_t handle, uint16_t opt)
+{
+    uint32_t elapsed = esp_timer_get_time() - handle->op_start_us;
+    uint32_t index = stats_op_index(opt);
+    uint32_t bucket = elapsed ? 31 - __builtin_clz(elapsed) : 0;
+    if (bucket >= ESP_MTP_STATS_HIST_BUCKETS) {
+        bucket = ESP_MTP_STATS_HIST_BUCKETS - 1;
+    }
+    esp_mtp_op_stats_t *stats = &handle->stats[index];
+    portENTER_CRITICAL(&handle->stats_lock);
+    stats->count++;
+    stats->total_us += elapsed;
+    stats->usb_wait_us += handle->op_usb_wait_us;
+    stats->bytes += handle->op_bytes;
+    if (elapsed > stats->max_us) {
+        stats->max_us = elapsed;
+    }
+    stats->hist[bucket]++;
+    portEXIT_CRITICAL(&handle->stats_lock);
+}
+#else
+#define MTP_STATS_WAIT_BEGIN()
+#define MTP_STATS_WAIT_END(handle)
+#define MTP_STATS_ADD_BYTES(handle, n)
+#define MTP_STATS_OP_BEGIN(handle)
+#define MTP_STATS_OP_END(handle, opt)
+#endif
+
+static inline int pipe_write(esp_mtp_handle_t handle, const uint8_t *buffer, int len)
+{
+    int ret;
+    ret = esp_mtp_cq_submit(&handle->tx_cq, (uint8_t *)buffer);
+    if (ret < 0) {
+        // 管道已退出，不再发起传输，由等待方收到退出
+        esp_mtp_cq_post(&handle->tx_cq, ret);
+        return ret;
+    }
+    ret = handle->write(handle->pipe_context, buffer, len);
+    if (!(handle->flags & ESP_MTP_FLAG_ASYNC_WRITE)) {
+        // 同步管道直接投递结果，与异步管道走同一回收流程
+        esp_mtp_cq_post(&handle->tx_cq, ret);
+    }
+    return ret;
+}
+
+/** @brief 回收最早一次写的完成
+ *
+ * @return 实际发送长度，或 ESP_MTP_STOP_CMD/ESP_MTP_EXIT_CMD；非空写返回 0 即为 STOP
+ */
+static inline int wait_write_done(esp_mtp_handle_t handle)
+{
+    esp_mtp_completion_t completion;
+    MTP_STATS_WAIT_BEGIN();
+    esp_mtp_cq_reap(&handle->tx_cq, &completion);
+    MTP_STATS_WAIT_END(handle);
+    return completion.len;
+}
+
+/** @brief 回收全部在途写，包括之前未等待的响应包
+ */
+static inline void wait_write_idle(esp_mtp_handle_t handle)
+{
+    while (handle->tx_cq.outstanding) {
+        wait_write_done(handle);
+    }
+}
+
+static inline int pipe_read(esp_mtp_handle_t handle, uint8_t *buffer, int len)
+{
+    int ret;
+    ret = esp_mtp_cq_submit(&handle->rx_cq, buffer);
+    if (ret < 0) {
+        esp_mtp_cq_post(&handle->rx_cq, ret);
+        return ret;
+    }
+    ret = handle->read(handle->pipe_context, buffer, len);
+    if (!(handle->flags & ESP_MTP_FLAG_ASYNC_READ)) {
+        esp_mtp_cq_post(&handle->rx_cq, ret);
+    }
+    return ret;
+}
+
+/** @brief 回收最早一次读的完成
+ *
+ * @return 实际读取长度，或 ESP_MTP_STOP_CMD/ESP_MTP_EXIT_CMD
+ */
+static inline int wait_read_done(esp_mtp_handle_t handle)
+{
+    esp_mtp_completion_t completion;
+    MTP_STATS_WAIT_BEGIN();
+    esp_mtp_cq_reap(&handle->rx_cq, &completion);
+    MTP_STATS_WAIT_END(handle);
+    return completion.len;
+}
+
 static void check_usb_len_mps_and_send_end(esp_mtp_handle_t handle, uint32_t len)
 {
     bool need_send_end = false;
@@ -78,16 +255,38 @@ static void check_usb_len_mps_and_send_end(esp_mtp_handle_t handle, uint32_t len
             }
         }
         if (need_send_end) {
-            handle->write(handle->pipe_context, NULL, 0);
-            if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-                uint32_t notify_value;
-                xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-            }
+            pipe_write(handle, NULL, 0);
+            wait_write_done(handle);
         }
     }
 }
 
 
+static bool get_virtual_object(esp_mtp_handle_t handle, uint32_t object_handle, esp_mtp_virtual_object_t *object)
+{
+    uint32_t index;
+    bool found = false;
+    if (!(object_handle & ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG)) {
+        return false;
+    }
+    index = (object_handle & ~ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG) - 1;
+    if (index >= ESP_MTP_VIRTUAL_OBJECT_MAX) {
+        return false;
+    }
+    portENTER_CRITICAL(&handle->virtual_lock);
+    if (handle->virtual_objects[index].produce) {
+        *object = handle->virtual_objects[index];
+        found = true;
+    }
+    portEXIT_CRITICAL(&handle->virtual_lock);
+    return found;
+}
+
+static uint32_t get_virtual_object_size(const esp_mtp_virtual_object_t *object)
+{
+    return object->get_size ? object->get_size(object->user_ctx) : object->size;
+}
+
 static mtp_response_code_t open_session(esp_mtp_handle_t handle)
 {
     return MTP_RESPONSE_OK;
@@ -161,12 +360,10 @@ static mtp_response_code_t get_device_info(esp_mtp_handle_t handle)
     data = (uint8_t *)esp_mtp_utf8_to_utf16("123456", (char *)data + 1, data);    // Serial Number
 
     container->len = data - handle->buff;
-    handle->write(handle->pipe_context, handle->buff, container->len);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
+    pipe_write(handle, handle->buff, container->len);
+    if (wait_write_done(handle) > 0) {
+        check_usb_len_mps_and_send_end(handle, container->len);
     }
-    check_usb_len_mps_and_send_end(handle, container->len);
 
     return MTP_RESPONSE_OK;
 }
@@ -182,11 +379,8 @@ static mtp_response_code_t get_storage_ids(esp_mtp_handle_t handle)
     *(uint32_t *)data = 0x010001;
     data += 4;
     container->len = data - handle->buff;
-    handle->write(handle->pipe_context, handle->buff, container->len);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-    }
+    pipe_write(handle, handle->buff, container->len);
+    wait_write_done(handle);
     // 长度不会达到 MPS，无需检查
     // check_usb_len_mps_and_send_end(handle, container->len);
 
@@ -212,7 +406,7 @@ static mtp_response_code_t get_storage_info(esp_mtp_handle_t handle)
     data += sizeof(mtp_access_cap_t);
 
     uint64_t total_bytes = 0, out_free_bytes = 0;
-    esp_vfs_fat_info("/sdcard", &total_bytes, &out_free_bytes);
+    esp_vfs_fat_info(handle->base_path, &total_bytes, &out_free_bytes);
     *(uint64_t *)data = total_bytes;                                   // Max Capacity
     data += sizeof(uint64_t);
 
@@ -224,18 +418,16 @@ static mtp_response_code_t get_storage_info(esp_mtp_handle_t handle)
 
 
     *data = handle->buff + handle->buffer_size - data;
-    data = (uint8_t *)esp_mtp_utf8_to_utf16("test", (char *)data + 1, data);    // Storage Description
+    data = (uint8_t *)esp_mtp_utf8_to_utf16(handle->storage_description, (char *)data + 1, data);    // Storage Description
 
     *data = handle->buff + handle->buffer_size - data;
     data = (uint8_t *)esp_mtp_utf8_to_utf16("0", (char *)data + 1, data);    // Volume Identifier
 
     container->len = data - handle->buff;
-    handle->write(handle->pipe_context, handle->buff, container->len);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
+    pipe_write(handle, handle->buff, container->len);
+    if (wait_write_done(handle) > 0) {
+        check_usb_len_mps_and_send_end(handle, container->len);
     }
-    check_usb_len_mps_and_send_end(handle, container->len);
     return MTP_RESPONSE_OK;
 }
 
@@ -259,13 +451,9 @@ static mtp_response_code_t get_object_handles(esp_mtp_handle_t handle)
         parent_handle = 0;
     }
 
-    container->type = MTP_CONTAINER_DATA;
-    *(uint32_t *)container->data = handle->buff + handle->buffer_size - container->data - 4;  // Number of Object Handles
     //todo 暂未支持多个 storage
-    data = esp_mtp_file_list_fill_handle_array(&handle->handle_list, parent_handle, container->data + 4, (uint32_t *)container->data); // Object Handles
-
-    if (*(uint32_t *)container->data == 0) {
-        strcpy((char *)container->data, "/sdcard");
+    if (!esp_mtp_file_list_is_scanned(&handle->handle_list, parent_handle)) {
+        strcpy((char *)container->data, handle->base_path);
         data = container->data + strlen((char *)container->data);
         if (parent_handle != 0) {
             if (esp_mtp_file_list_find(&handle->handle_list, parent_handle, (char *)data, handle->buff + handle->buffer_size - data) == NULL) {
@@ -273,35 +461,56 @@ static mtp_response_code_t get_object_handles(esp_mtp_handle_t handle)
             }
         }
 
-        {
-            DIR *dir;
-            struct dirent *file;
-            dir = opendir((char *)container->data);
-            if (dir == NULL) {
-                ESP_LOGW(TAG, "Failed to open dir for reading:%s", container->data);
-                return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+        DIR *dir;
+        struct dirent *file;
+        bool has_child;
+        dir = opendir((char *)container->data);
+        if (dir == NULL) {
+            ESP_LOGW(TAG, "Failed to open dir for reading:%s", container->data);
+            return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+        }
+        // 遍历前已有子对象（如先 SendObjectInfo 再浏览），需跳过已存在的对象避免重复添加
+        uint32_t temp_len = sizeof(uint32_t);
+        esp_mtp_file_list_fill_handle_array(&handle->handle_list, parent_handle, container->data, &temp_len);
+        has_child = temp_len != 0;
+        while ((file = readdir(dir)) != NULL) {
+            if (has_child && esp_mtp_file_list_find_child(&handle->handle_list, parent_handle, file->d_name) != 0) {
+                continue;
             }
-            data = container->data + sizeof(uint32_t);
-            while ((file = readdir(dir)) != NULL) {
-                *(uint32_t *)data = esp_mtp_file_list_add(&handle->handle_list, 0x00010001, parent_handle, file->d_name);
-                if (*(uint32_t *)data == 0) {
-                    ESP_LOGW(TAG, "add file list fail");
-                    break;
-                }
-                data += sizeof(uint32_t);
+            if (esp_mtp_file_list_add(&handle->handle_list, 0x00010001, parent_handle, file->d_name) == 0) {
+                ESP_LOGW(TAG, "add file list fail");
+                break;
+            }
+        }
+        closedir(dir);
+        esp_mtp_file_list_set_scanned(&handle->handle_list, parent_handle);
+    } else if (parent_handle != 0) {
+        if (esp_mtp_file_list_find(&handle->handle_list, parent_handle, (char *)container->data, handle->buff + handle->buffer_size - container->data) == NULL) {
+            return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+        }
+    }
+
+    container->type = MTP_CONTAINER_DATA;
+    *(uint32_t *)container->data = handle->buff + handle->buffer_size - container->data - 4;  // Number of Object Handles
+    data = esp_mtp_file_list_fill_handle_array(&handle->handle_list, parent_handle, container->data + 4, (uint32_t *)container->data); // Object Handles
+    if (parent_handle == 0) {
+        portENTER_CRITICAL(&handle->virtual_lock);
+        for (uint32_t i = 0; i < ESP_MTP_VIRTUAL_OBJECT_MAX; i++) {
+            if (handle->virtual_objects[i].produce == NULL || handle->buff + handle->buffer_size - data < sizeof(uint32_t)) {
+                continue;
             }
-            closedir(dir);
-            *(uint32_t *)container->data = (data - (container->data + sizeof(uint32_t))) / sizeof(uint32_t);
+            *(uint32_t *)data = ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG | (i + 1);
+            data += sizeof(uint32_t);
+            *(uint32_t *)container->data += 1;
         }
+        portEXIT_CRITICAL(&handle->virtual_lock);
     }
 
     container->len = data - handle->buff;
-    handle->write(handle->pipe_context, handle->buff, container->len);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
+    pipe_write(handle, handle->buff, container->len);
+    if (wait_write_done(handle) > 0) {
+        check_usb_len_mps_and_send_end(handle, container->len);
     }
-    check_usb_len_mps_and_send_end(handle, container->len);
     return MTP_RESPONSE_OK;
 }
 
@@ -313,23 +522,38 @@ static mtp_response_code_t get_object_info(esp_mtp_handle_t handle)
     mtp_container_t *container = (mtp_container_t *)handle->buff;
 
     object_handle = container->operation.get_object_info.object_handle;
-    strcpy((char *)container->data, "/sdcard");
-    data = container->data + strlen((char *)container->data);
-    entry = esp_mtp_file_list_find(&handle->handle_list, object_handle, (char *)data, handle->buff + handle->buffer_size - data);
-    if (entry == NULL) {
-        return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
-    }
-    ESP_LOGD(TAG, "%s %s", __FUNCTION__, (char *)container->data);
+    esp_mtp_virtual_object_t object;
     struct stat st;
-    if (stat((char *)container->data, &st) != 0) {
-        return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+    const char *name;
+    uint32_t parent;
+    bool is_virtual;
+    is_virtual = get_virtual_object(handle, object_handle, &object);
+    if (is_virtual) {
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFREG;
+        st.st_size = get_virtual_object_size(&object);
+        st.st_ctime = st.st_mtime = time(NULL);
+        name = object.name;
+        parent = 0;
+    } else {
+        strcpy((char *)container->data, handle->base_path);
+        data = container->data + strlen((char *)container->data);
+        entry = esp_mtp_file_list_find(&handle->handle_list, object_handle, (char *)data, handle->buff + handle->buffer_size - data);
+        if (entry == NULL) {
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+        }
+        ESP_LOGD(TAG, "%s %s", __FUNCTION__, (char *)container->data);
+        if (stat((char *)container->data, &st) != 0) {
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+        }
+        name = entry->name;
+        parent = entry->parent;
     }
 
     container->type = MTP_CONTAINER_DATA;
     data = container->data;
 
-    *(uint32_t *)data = entry->storage_id;  // StorageID
-    *(uint32_t *)data = 0x010001;
+    *(uint32_t *)data = 0x010001;           // StorageID
     data += sizeof(uint32_t);
 
     if (S_ISDIR(st.st_mode)) {
@@ -339,7 +563,7 @@ static mtp_response_code_t get_object_info(esp_mtp_handle_t handle)
     }
     data += sizeof(uint16_t);
 
-    *(uint16_t *)data = 0x0000;            // Protection Status
+    *(uint16_t *)data = is_virtual ? 0x0001 : 0x0000;            // Protection Status，虚拟对象只读
     data += sizeof(uint16_t);
 
     *(uint32_t *)data = st.st_size;  // Object Compressed Size
@@ -366,7 +590,7 @@ static mtp_response_code_t get_object_info(esp_mtp_handle_t handle)
     *(uint32_t *)data = 0x0000;            // Image Bit Depth(未使用)
     data += sizeof(uint32_t);
 
-    *(uint32_t *)data = entry->parent;            // Parent Object
+    *(uint32_t *)data = parent;            // Parent Object
     data += sizeof(uint32_t);
 
     if (S_ISDIR(st.st_mode)) {
@@ -383,7 +607,7 @@ static mtp_response_code_t get_object_info(esp_mtp_handle_t handle)
     data += sizeof(uint32_t);
 
     *data = handle->buff + handle->buffer_size - data;
-    data = (uint8_t *)esp_mtp_utf8_to_utf16(entry->name, (char *)data + 1, data);    // Filename
+    data = (uint8_t *)esp_mtp_utf8_to_utf16(name, (char *)data + 1, data);    // Filename
 
     // Date Created "YYYYMMDDThhmmss.s"
     *data = handle->buff + handle->buffer_size - data;
@@ -399,12 +623,10 @@ static mtp_response_code_t get_object_info(esp_mtp_handle_t handle)
     data++;
 
     container->len = data - handle->buff;
-    handle->write(handle->pipe_context, handle->buff, container->len);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
+    pipe_write(handle, handle->buff, container->len);
+    if (wait_write_done(handle) > 0) {
+        check_usb_len_mps_and_send_end(handle, container->len);
     }
-    check_usb_len_mps_and_send_end(handle, container->len);
     return MTP_RESPONSE_OK;
 }
 
@@ -413,27 +635,38 @@ static mtp_response_code_t _get_object_common(esp_mtp_handle_t handle, uint32_t
     uint8_t *data;
     mtp_container_t *container = (mtp_container_t *)handle->buff;
 
-    strcpy((char *)container->data, "/sdcard");
-    data = container->data + strlen((char *)container->data);
-    if (esp_mtp_file_list_find(&handle->handle_list, object_handle, (char *)data, handle->buff + handle->buffer_size - data) == NULL) {
-        return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
-    }
-    ESP_LOGD(TAG, "%s %s", __FUNCTION__, (char *)container->data);
-
-    int fd;
+    int fd = -1;
     struct stat st;
-    if (stat((char *)container->data, &st) != 0) {
-        return MTP_RESPONSE_ACCESS_DENIED;
-    }
-    fd = open((char *)container->data, O_RDONLY);
-    if (fd < 0) {
-        return MTP_RESPONSE_ACCESS_DENIED;
-    }
-    if (offset) {
+    esp_mtp_virtual_object_t object;
+    bool is_virtual;
+    is_virtual = get_virtual_object(handle, object_handle, &object);
+    if (is_virtual) {
+        // 虚拟对象大小在传输开始时确定，内容由回调直接填入传输缓冲区
+        st.st_size = get_virtual_object_size(&object);
         if (offset > st.st_size) {
             offset = st.st_size;
         }
-        lseek(fd, offset, SEEK_SET);
+    } else {
+        strcpy((char *)container->data, handle->base_path);
+        data = container->data + strlen((char *)container->data);
+        if (esp_mtp_file_list_find(&handle->handle_list, object_handle, (char *)data, handle->buff + handle->buffer_size - data) == NULL) {
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+        }
+        ESP_LOGD(TAG, "%s %s", __FUNCTION__, (char *)container->data);
+
+        if (stat((char *)container->data, &st) != 0) {
+            return MTP_RESPONSE_ACCESS_DENIED;
+        }
+        fd = open((char *)container->data, O_RDONLY);
+        if (fd < 0) {
+            return MTP_RESPONSE_ACCESS_DENIED;
+        }
+        if (offset) {
+            if (offset > st.st_size) {
+                offset = st.st_size;
+            }
+            lseek(fd, offset, SEEK_SET);
+        }
     }
 
     uint32_t trans_id;
@@ -459,44 +692,73 @@ static mtp_response_code_t _get_object_common(esp_mtp_handle_t handle, uint32_t
     max_len = max_len & (~0x1ff);  //512对齐
     ESP_LOGD(TAG, "max_len:%"PRIu32, max_len);
     mtp_response_code_t res = MTP_RESPONSE_OK;
+    bool aborted = false;
+
+    //管道支持排队时，下一半缓冲区在上一半发送完成前就提交，端点不会空等任务调度
+    bool queued = handle->flags & ESP_MTP_FLAG_QUEUED_WRITE;
+    if (queued) {
+        wait_write_idle(handle);
+        esp_mtp_cq_set_max_outstanding(&handle->tx_cq, 2);
+    }
 
     if (file_size == 0) {
-        handle->write(handle->pipe_context, handle->buff, MTP_CONTAINER_HEAD_LEN);
+        pipe_write(handle, handle->buff, MTP_CONTAINER_HEAD_LEN);
         last_write_len = MTP_CONTAINER_HEAD_LEN;
     }
 
     while (file_size) {
+        int ret;
+        bool first = (file_size == st.st_size);
         read_len = file_size > max_len ? max_len : file_size;
-        if (read(fd, data, read_len) != read_len) {
+        if (is_virtual) {
+            ret = object.produce(object.user_ctx, offset, data, read_len);
+            offset += read_len;
+        } else {
+            ret = read(fd, data, read_len);
+        }
+        if (ret != read_len) {
             ESP_LOGE(TAG, "file read error");
             last_write_len = 0;
             res = MTP_RESPONSE_INCOMPLETE_TRANSFER;
             break;
         }
-        if (file_size != st.st_size) {
-            if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-                uint32_t notify_value;
-                xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-            }
+        //数据包不为空，完成长度为 0 (STOP) 或负数 (EXIT) 表示主机已中止，不再继续读取文件
+        if (!queued && !first && wait_write_done(handle) <= 0) {
+            aborted = true;
+            break;
         }
         file_size -= read_len;
         last_write_len = file_size > 0 ? read_len : MTP_CONTAINER_HEAD_LEN + read_len;
 
+        pipe_write(handle, data == container->data ? handle->buff : handle->buff + max_len, last_write_len);
+        MTP_STATS_ADD_BYTES(handle, read_len);
+        if (queued && !first) {
+            //当前包已排在上一包之后，再回收上一包，之后才能改写它的缓冲区
+            if (wait_write_done(handle) <= 0) {
+                aborted = true;
+                break;
+            }
+        }
         if (data == container->data) {
-            handle->write(handle->pipe_context, handle->buff, last_write_len);
             data = container->data + max_len;
         } else {
-            handle->write(handle->pipe_context, handle->buff + max_len, last_write_len);
             memcpy(handle->buff, data + read_len - MTP_CONTAINER_HEAD_LEN, MTP_CONTAINER_HEAD_LEN);
             data = container->data;
         }
     }
-    close(fd);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (aborted) {
+        //中止时在途的写由管道清空并完成，回收后不再发送结束包
+        wait_write_idle(handle);
+        res = MTP_RESPONSE_INCOMPLETE_TRANSFER;
+    } else if (wait_write_done(handle) > 0) {
+        check_usb_len_mps_and_send_end(handle, last_write_len);
+    }
+    if (queued) {
+        esp_mtp_cq_set_max_outstanding(&handle->tx_cq, 1);
     }
-    check_usb_len_mps_and_send_end(handle, last_write_len);
     if (actual_bytes) {
         *actual_bytes = st.st_size - file_size;
     }
@@ -511,7 +773,7 @@ static mtp_response_code_t get_object(esp_mtp_handle_t handle)
     uint32_t object_handle;
     mtp_container_t *container = (mtp_container_t *)handle->buff;
     object_handle = container->operation.get_object.object_handle;
-    strcpy((char *)container->data, "/sdcard");
+    strcpy((char *)container->data, handle->base_path);
     data = container->data + strlen((char *)container->data);
     if (esp_mtp_file_list_find(&handle->handle_list, object_handle, (char *)data, handle->buff + handle->buffer_size - data) == NULL) {
         return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
@@ -555,28 +817,22 @@ static mtp_response_code_t get_object(esp_mtp_handle_t handle)
             break;
         }
         if (file_size != st.st_size) {
-            if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-                uint32_t notify_value;
-                xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-            }
+            wait_write_done(handle);
         }
         file_size -= read_len;
         last_write_len = file_size > 0 ? read_len : MTP_CONTAINER_HEAD_LEN + read_len;
 
         if (data == container->data) {
-            handle->write(handle->pipe_context, handle->buff, last_write_len);
+            pipe_write(handle, handle->buff, last_write_len);
             data = container->data + max_len;
         } else {
-            handle->write(handle->pipe_context, handle->buff + max_len, last_write_len);
+            pipe_write(handle, handle->buff + max_len, last_write_len);
             memcpy(handle->buff, data + read_len - MTP_CONTAINER_HEAD_LEN, MTP_CONTAINER_HEAD_LEN);
             data = container->data;
         }
     }
     close(fd);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_WRITE) {
-        uint32_t notify_value;
-        xTaskNotifyWait(0x0, ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-    }
+    wait_write_done(handle);
     check_usb_len_mps_and_send_end(handle, last_write_len);
     container->trans_id = trans_id;
     return res;
@@ -603,14 +859,8 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
     }
 
     int len;
-    len = handle->read(handle->pipe_context, handle->buff, handle->buffer_size);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_READ) {
-        uint32_t notify_value;
-        do {
-            xTaskNotifyWait(0x0, ASYNC_READ_NOTIFY_BIT | ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-        } while (!(notify_value & ASYNC_READ_NOTIFY_BIT));
-        len = handle->async_read_len;
-    }
+    pipe_read(handle, handle->buff, handle->buffer_size);
+    len = wait_read_done(handle);
 
     data = container->data;
     //Skip No Use StorageID
@@ -627,6 +877,7 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
     uint32_t file_size;
     file_size = *(uint32_t *)data;   //Object Compressed Size
     data += sizeof(uint32_t);
+    uint32_t object_size = file_size;
 
     //Skip No Use Thumb Format
     data += sizeof(uint16_t);
@@ -696,7 +947,7 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
         }
     }
     //todo
-    strcpy((char *)container->data, "/sdcard");
+    strcpy((char *)container->data, handle->base_path);
     data = container->data + strlen((char *)container->data);
     const esp_mtp_file_entry_t *entry = NULL;
     if (parent_handle != 0) {
@@ -714,6 +965,11 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
     data++;
     strcpy((char *)data, filename);
     ESP_LOGD(TAG, "%s %s", __FUNCTION__, (char *)container->data);
+    //缓存路径, 接收完成后无需再从句柄列表重建一次
+    if (strlcpy(handle->object_path, (char *)container->data, sizeof(handle->object_path)) >= sizeof(handle->object_path)) {
+        return MTP_RESPONSE_ACCESS_DENIED;
+    }
+    int64_t start_time = esp_timer_get_time();
 
     int fd = -1;
     if (object_format != MTP_OBJECT_FORMAT_ASSOCIATION) {
@@ -745,7 +1001,7 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
     container->len = MTP_CONTAINER_HEAD_LEN + 12;
     container->type = MTP_CONTAINER_RESPONSE;
     container->res = MTP_RESPONSE_OK;
-    handle->write(handle->pipe_context, handle->buff, container->len);
+    pipe_write(handle, handle->buff, container->len);
 
     if (fd >= 0) {
 
@@ -758,15 +1014,13 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
             max_len = max_len / 2;
             max_len = max_len & (~0x1ff);  //512对齐
 
-            len = handle->read(handle->pipe_context, handle->buff, max_len);
-            if (handle->flags & ESP_MTP_FLAG_ASYNC_READ) {
-                uint32_t notify_value;
-                do {
-                    xTaskNotifyWait(0x0, ASYNC_READ_NOTIFY_BIT | ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-                } while (!(notify_value & ASYNC_READ_NOTIFY_BIT));
-                len = handle->async_read_len;
-            }
-            ESP_LOGI(TAG, "%d recv %d", __LINE__, len);
+            //能放进整个缓冲区的小文件一次接收完成, 不走双缓冲流程
+            uint32_t single_len = handle->buffer_size & (~0x1ff);
+            bool single_transfer = (MTP_CONTAINER_HEAD_LEN + file_size <= single_len);
+
+            pipe_read(handle, handle->buff, max_len);
+            len = wait_read_done(handle);
+            ESP_LOGD(TAG, "%d recv %d", __LINE__, len);
 
             if (container->type != MTP_CONTAINER_OPERATION || container->opt != MTP_OPERATION_SEND_OBJECT) {
                 req = MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
@@ -775,20 +1029,24 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
 
             //DWC2 read len 为非 MPS 倍数时，如果主机发送大于 read len 的数据会产生错误
             //len = handle->read(handle->pipe_context, handle->buff, MTP_CONTAINER_HEAD_LEN + max_len);
-            len = handle->read(handle->pipe_context, handle->buff, max_len);
-            if (handle->flags & ESP_MTP_FLAG_ASYNC_READ) {
-                uint32_t notify_value;
-                do {
-                    xTaskNotifyWait(0x0, ASYNC_READ_NOTIFY_BIT | ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-                } while (!(notify_value & ASYNC_READ_NOTIFY_BIT));
-                len = handle->async_read_len;
-            }
-            ESP_LOGI(TAG, "%d recv %d", __LINE__, len);
+            pipe_read(handle, handle->buff, single_transfer ? single_len : max_len);
+            len = wait_read_done(handle);
+            ESP_LOGD(TAG, "%d recv %d", __LINE__, len);
 
             if (container->len != MTP_CONTAINER_HEAD_LEN + file_size || container->type != MTP_CONTAINER_DATA || container->opt != MTP_OPERATION_SEND_OBJECT) {
                 req = MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
                 goto exit;
             }
+            if (single_transfer) {
+                //数据已完整在缓冲区中, 直接一次写入
+                if (len != MTP_CONTAINER_HEAD_LEN + file_size || write(fd, container->data, file_size) != file_size) {
+                    req = MTP_RESPONSE_ACCESS_DENIED;
+                    goto exit;
+                }
+                MTP_STATS_ADD_BYTES(handle, file_size);
+                req = MTP_RESPONSE_OK;
+                goto exit;
+            }
             last_write_len = len - MTP_CONTAINER_HEAD_LEN;
             data = container->data;
             while (1) {
@@ -796,25 +1054,20 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
                 if (file_size) {
                     read_len = file_size > max_len ? max_len : file_size;
                     if (data == container->data) {
-                        len = handle->read(handle->pipe_context, container->data + max_len, max_len);
+                        pipe_read(handle, container->data + max_len, max_len);
                     } else {
-                        len = handle->read(handle->pipe_context, container->data, max_len);
+                        pipe_read(handle, container->data, max_len);
                     }
                 }
                 if (write(fd, data, last_write_len) != last_write_len) {
                     req = MTP_RESPONSE_ACCESS_DENIED;
                     goto exit;
                 }
+                MTP_STATS_ADD_BYTES(handle, last_write_len);
                 if (file_size == 0) {
                     break;
                 }
-                if (handle->flags & ESP_MTP_FLAG_ASYNC_READ) {
-                    uint32_t notify_value;
-                    do {
-                        xTaskNotifyWait(0x0, ASYNC_READ_NOTIFY_BIT | ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-                    } while (!(notify_value & ASYNC_READ_NOTIFY_BIT));
-                    len = handle->async_read_len;
-                }
+                len = wait_read_done(handle);
                 if (len != read_len) {
                     req = MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
                     goto exit;
@@ -827,22 +1080,22 @@ static mtp_response_code_t send_object_info(esp_mtp_handle_t handle)
                 }
             }
             req = MTP_RESPONSE_OK;
-            ESP_LOGI(TAG, "recv file ok");
         }
     }
 
 exit:
     if (fd >= 0) {
+        //FATFS 在 close 时会以当前时间覆盖修改时间, 且 VFS 不支持通过 fd 设置时间, 只能在 close 之后 utime
         close(fd);
     }
-    if (object_handle != 0) {
-        //todo
-        strcpy((char *)container->data, "/sdcard");
-        data = container->data + strlen((char *)container->data);
-        if (esp_mtp_file_list_find(&handle->handle_list, object_handle, (char *)data, handle->buff + handle->buffer_size - data) != NULL) {
-            utime((char *)container->data, &times);
+    //主机未提供有效时间时跳过 utime, 省去一次目录项更新
+    if (object_handle != 0 && times.modtime != 0) {
+        if (times.actime == 0) {
+            times.actime = times.modtime;
         }
+        utime(handle->object_path, &times);
     }
+    ESP_LOGD(TAG, "%s %"PRIu32" bytes %"PRId64" us", handle->object_path, object_size, esp_timer_get_time() - start_time);
     return req;
 }
 
@@ -850,14 +1103,8 @@ static mtp_response_code_t send_object(esp_mtp_handle_t handle)
 {
     int len;
     mtp_container_t *container = (mtp_container_t *)handle->buff;
-    len = handle->read(handle->pipe_context, handle->buff, handle->buffer_size);
-    if (handle->flags & ESP_MTP_FLAG_ASYNC_READ) {
-        uint32_t notify_value;
-        do {
-            xTaskNotifyWait(0x0, ASYNC_READ_NOTIFY_BIT | ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-        } while (!(notify_value & ASYNC_READ_NOTIFY_BIT));
-        len = handle->async_read_len;
-    }
+    pipe_read(handle, handle->buff, handle->buffer_size);
+    len = wait_read_done(handle);
     // 有文件内容接收已在 send_object_info 中进行处理，此处仅处理无内容接收的包
     if (len != container->len || container->len != MTP_CONTAINER_HEAD_LEN || container->type != MTP_CONTAINER_DATA || container->opt != MTP_OPERATION_SEND_OBJECT) {
         return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
@@ -913,7 +1160,11 @@ static mtp_response_code_t delete_object(esp_mtp_handle_t handle)
     if (object_handle == 0xFFFFFFFF && container->operation.delete_object.object_format_code != 0x0) {
         return MTP_RESPONSE_SPECIFICATION_BY_FORMAT_UNSUPPORTED;
     }
-    strcpy((char *)container->data, "/sdcard");
+    if (object_handle & ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG && object_handle != 0xFFFFFFFF) {
+        esp_mtp_virtual_object_t object;
+        return get_virtual_object(handle, object_handle, &object) ? MTP_RESPONSE_OBJECT_WRITE_PROTECTED : MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+    }
+    strcpy((char *)container->data, handle->base_path);
     data = container->data + strlen((char *)container->data);
     const esp_mtp_file_entry_t *entry = NULL;
     if (object_handle != 0) {
@@ -930,9 +1181,15 @@ static mtp_response_code_t delete_object(esp_mtp_handle_t handle)
     }
     if (S_ISDIR(st.st_mode)) {
         delete_dir((char *)container->data, data - container->data, handle->buffer_size - MTP_CONTAINER_HEAD_LEN);
-    } else {
-        unlink((char *)container->data);
+        if (stat((char *)container->data, &st) == 0) {
+            // 目录未能完全删除，丢弃子对象句柄，下次浏览时重新遍历剩余内容
+            esp_mtp_file_list_forget_children(&handle->handle_list, object_handle);
+            return MTP_RESPONSE_PARTIAL_DELETION;
+        }
+    } else if (unlink((char *)container->data) != 0) {
+        return MTP_RESPONSE_ACCESS_DENIED;
     }
+    esp_mtp_file_list_remove(&handle->handle_list, object_handle);
 
     return MTP_RESPONSE_OK;
 }
@@ -950,7 +1207,7 @@ static mtp_response_code_t get_partial_object(esp_mtp_handle_t handle)
     container->len = MTP_CONTAINER_HEAD_LEN + 4;
     container->type = MTP_CONTAINER_RESPONSE;
     container->res = MTP_RESPONSE_OK;
-    handle->write(handle->pipe_context, handle->buff, container->len);
+    pipe_write(handle, handle->buff, container->len);
     return MTP_RESPONSE_MAX;
 }
 
@@ -960,20 +1217,20 @@ static void esp_mtp_task(void *args)
     esp_mtp_handle_t handle = (esp_mtp_handle_t)args;
     mtp_container_t *container;
     container = (mtp_container_t *)handle->buff;
+    esp_mtp_cq_bind_task(&handle->rx_cq, xTaskGetCurrentTaskHandle());
+    esp_mtp_cq_bind_task(&handle->tx_cq, xTaskGetCurrentTaskHandle());
 
 wait:
-    esp_mtp_file_list_clean(&handle->handle_list);
+    //保留已分配的句柄块，重连时无需重新申请
+    esp_mtp_file_list_reset(&handle->handle_list);
     handle->wait_start(handle->pipe_context);
+    //上个会话被中止的传输不会再完成，丢弃其在途记录
+    esp_mtp_cq_reset(&handle->rx_cq);
+    esp_mtp_cq_reset(&handle->tx_cq);
     ESP_LOGW(TAG, "MTP task start");
     while (1) {
-        len = handle->read(handle->pipe_context, handle->buff, handle->buffer_size);
-        if (handle->flags & ESP_MTP_FLAG_ASYNC_READ) {
-            uint32_t notify_value;
-            do {
-                xTaskNotifyWait(0x0, ASYNC_READ_NOTIFY_BIT | ASYNC_WRITE_NOTIFY_BIT, &notify_value, portMAX_DELAY);
-            } while (!(notify_value & ASYNC_READ_NOTIFY_BIT));
-            len = handle->async_read_len;
-        }
+        pipe_read(handle, handle->buff, handle->buffer_size);
+        len = wait_read_done(handle);
         if (len < 0) {
             break;
         }
@@ -985,7 +1242,9 @@ wait:
         }
 
         mtp_response_code_t res = MTP_RESPONSE_MAX;
-        switch (container->opt) {
+        uint16_t opt = container->opt;
+        MTP_STATS_OP_BEGIN(handle);
+        switch (opt) {
         case MTP_OPERATION_OPEN_SESSION:
             res = open_session(handle);
             break;
@@ -1031,15 +1290,20 @@ wait:
             container->len = MTP_CONTAINER_HEAD_LEN;
             container->type = MTP_CONTAINER_RESPONSE;
             container->res = res;
-            handle->write(handle->pipe_context, handle->buff, container->len);
+            pipe_write(handle, handle->buff, container->len);
             // 长度不会达到 MPS，无需检查
             // check_usb_len_mps_and_send_end(handle, container->len);
         }
-
+        MTP_STATS_OP_END(handle, opt);
     }
     ESP_LOGW(TAG, "MTP task exit");
+    void (*closed)(void *pipe_context) = handle->closed;
+    void *pipe_context = handle->pipe_context;
     esp_mtp_file_list_clean(&handle->handle_list);
-    free(handle);
+    engine_free(handle);
+    if (closed) {
+        closed(pipe_context);
+    }
     vTaskDelete(NULL);
 }
 
@@ -1049,61 +1313,195 @@ esp_mtp_handle_t esp_mtp_init(const esp_mtp_config_t *config)
     uint32_t buffer_size;
     buffer_size = config->buffer_size;
     if (buffer_size < 1024) {
+        if (config->buffer) {
+            //调用者提供的缓冲区不能被扩大
+            ESP_LOGE(TAG, "static buffer too small");
+            return NULL;
+        }
         buffer_size = 1024;
     }
+    if (config->buffer) {
+#if CONFIG_ESP_MTP_STATIC_ALLOCATION
+        if (config->task_buffer == NULL || config->task_stack == NULL) {
+            ESP_LOGE(TAG, "static task buffer not set");
+            return NULL;
+        }
+        handle = static_engine_alloc();
+        if (handle == NULL) {
+            ESP_LOGE(TAG, "no free static engine");
+            return NULL;
+        }
+        handle->is_static = true;
+        handle->buff = config->buffer;
+#else
+        ESP_LOGE(TAG, "static allocation not enabled");
+        return NULL;
+#endif
+    } else {
+#if CONFIG_CHERRYUSB_MEMPOOL
+        //传输缓冲区取自 USB 缓冲池，保证可 DMA 且对齐
+        //容器头计入 buffer_size，默认 4096 正好占一个 4K 块，否则多出的 12 字节会落入 16K 类
+        handle = malloc(sizeof(esp_mtp_t));
+        if (handle == NULL) {
+            return NULL;
+        }
+        buffer_size -= MTP_CONTAINER_HEAD_LEN;
+        handle->buff = usb_mempool_alloc(MTP_CONTAINER_HEAD_LEN + buffer_size);
+        if (handle->buff == NULL) {
+            free(handle);
+            return NULL;
+        }
+#else
 #ifndef CONFIG_SPIRAM_USE_MALLOC
-    handle = malloc(sizeof(esp_mtp_t) + MTP_CONTAINER_HEAD_LEN + buffer_size);
+        handle = malloc(sizeof(esp_mtp_t) + MTP_CONTAINER_HEAD_LEN + buffer_size);
 #else
-    handle = heap_caps_malloc(sizeof(esp_mtp_t) + MTP_CONTAINER_HEAD_LEN + buffer_size, MALLOC_CAP_DEFAULT | MALLOC_CAP_INTERNAL);
+        handle = heap_caps_malloc(sizeof(esp_mtp_t) + MTP_CONTAINER_HEAD_LEN + buffer_size, MALLOC_CAP_DEFAULT | MALLOC_CAP_INTERNAL);
+#endif
+        if (handle == NULL) {
+            return NULL;
+        }
+        handle->buff = (uint8_t *)(handle + 1);
 #endif
+        handle->is_static = false;
+    }
 
     esp_mtp_file_list_init(&handle->handle_list);
+    portMUX_INITIALIZE(&handle->virtual_lock);
+    //底层端点同一时间只能有一个传输
+    esp_mtp_cq_init(&handle->rx_cq, ASYNC_READ_NOTIFY_BIT, 1);
+    esp_mtp_cq_init(&handle->tx_cq, ASYNC_WRITE_NOTIFY_BIT, 1);
+#if CONFIG_ESP_MTP_STATS
+    portMUX_INITIALIZE(&handle->stats_lock);
+    memset(handle->stats, 0, sizeof(handle->stats));
+#endif
+    memset(handle->virtual_objects, 0, sizeof(handle->virtual_objects));
 
     handle->pipe_context = config->pipe_context;
     handle->wait_start = config->wait_start;
     handle->read = config->read;
     handle->write = config->write;
+    handle->closed = config->closed;
     handle->flags = config->flags;
     handle->buffer_size = MTP_CONTAINER_HEAD_LEN + buffer_size;
+    strlcpy(handle->base_path, config->base_path ? config->base_path : ESP_MTP_DEFAULT_BASE_PATH, sizeof(handle->base_path));
+    handle->storage_description = config->storage_description ? config->storage_description : "test";
+    UBaseType_t task_priority = config->task_priority ? config->task_priority : 5;
+#if CONFIG_ESP_MTP_STATIC_ALLOCATION
+    if (handle->is_static) {
+        handle->task_hdl = xTaskCreateStatic(esp_mtp_task, "esp_mtp_task", config->task_stack_size ? config->task_stack_size : 4096,
+            handle, task_priority, config->task_stack, config->task_buffer);
+        if (handle->task_hdl == NULL) {
+            goto _exit;
+        }
+        return handle;
+    }
+#endif
     if (xTaskCreate(esp_mtp_task, "esp_mtp_task", 4096,
-        handle, 5, &handle->task_hdl) != pdTRUE) {
+        handle, task_priority, &handle->task_hdl) != pdTRUE) {
         goto _exit;
     }
     return handle;
 _exit:
-    free(handle);
+    engine_free(handle);
     return NULL;
 }
 
-void esp_mtp_read_async_cb(esp_mtp_handle_t handle, int len)
+void ESP_MTP_ISR_ATTR esp_mtp_read_async_cb(esp_mtp_handle_t handle, int len)
+{
+    esp_mtp_cq_post(&handle->rx_cq, len);
+}
+
+void ESP_MTP_ISR_ATTR esp_mtp_write_async_cb(esp_mtp_handle_t handle, int len)
+{
+    esp_mtp_cq_post(&handle->tx_cq, len);
+}
+
+TaskHandle_t esp_mtp_get_task_handle(esp_mtp_handle_t handle)
+{
+    return handle->task_hdl;
+}
+
+uint32_t esp_mtp_add_virtual_object(esp_mtp_handle_t handle, const esp_mtp_virtual_object_t *object)
 {
-    handle->async_read_len = len;
-    if (xPortInIsrContext()) {
-        BaseType_t high_task_wakeup;
-        high_task_wakeup = pdFALSE;
-        xTaskNotifyFromISR(handle->task_hdl, ASYNC_READ_NOTIFY_BIT, eSetBits, &high_task_wakeup);
-        if (high_task_wakeup == pdTRUE) {
-            portYIELD_FROM_ISR();
+    uint32_t object_handle = 0;
+    if (handle == NULL || object == NULL || object->name == NULL || object->produce == NULL) {
+        return 0;
+    }
+    portENTER_CRITICAL(&handle->virtual_lock);
+    for (uint32_t i = 0; i < ESP_MTP_VIRTUAL_OBJECT_MAX; i++) {
+        if (handle->virtual_objects[i].produce == NULL) {
+            handle->virtual_objects[i] = *object;
+            object_handle = ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG | (i + 1);
+            break;
         }
-    } else {
-        xTaskNotify(handle->task_hdl, ASYNC_READ_NOTIFY_BIT, eSetBits);
     }
+    portEXIT_CRITICAL(&handle->virtual_lock);
+    return object_handle;
 }
 
-void esp_mtp_write_async_cb(esp_mtp_handle_t handle, int len)
+esp_err_t esp_mtp_remove_virtual_object(esp_mtp_handle_t handle, uint32_t object_handle)
 {
-    if (xPortInIsrContext()) {
-        BaseType_t high_task_wakeup = pdFALSE;
-        xTaskNotifyFromISR(handle->task_hdl, ASYNC_WRITE_NOTIFY_BIT, eSetBits, &high_task_wakeup);
-        if (high_task_wakeup == pdTRUE) {
-            portYIELD_FROM_ISR();
-        }
-    } else {
-        xTaskNotify(handle->task_hdl, ASYNC_WRITE_NOTIFY_BIT, eSetBits);
+    uint32_t index;
+    if (handle == NULL || !(object_handle & ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    index = (object_handle & ~ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG) - 1;
+    if (index >= ESP_MTP_VIRTUAL_OBJECT_MAX) {
+        return ESP_ERR_INVALID_ARG;
     }
+    portENTER_CRITICAL(&handle->virtual_lock);
+    memset(&handle->virtual_objects[index], 0, sizeof(esp_mtp_virtual_object_t));
+    portEXIT_CRITICAL(&handle->virtual_lock);
+    return ESP_OK;
 }
 
-TaskHandle_t esp_mtp_get_task_handle(esp_mtp_handle_t handle)
+esp_err_t esp_mtp_get_op_stats(esp_mtp_handle_t handle, uint16_t opcode, esp_mtp_op_stats_t *stats)
 {
-    return handle->task_hdl;
-}
\ No newline at end of file
+#if CONFIG_ESP_MTP_STATS
+    if (handle == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&handle->stats_lock);
+    *stats = handle->stats[stats_op_index(opcode)];
+    portEXIT_CRITICAL(&handle->stats_lock);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void esp_mtp_reset_stats(esp_mtp_handle_t handle)
+{
+#if CONFIG_ESP_MTP_STATS
+    portENTER_CRITICAL(&handle->stats_lock);
+    memset(handle->stats, 0, sizeof(handle->stats));
+    portEXIT_CRITICAL(&handle->stats_lock);
+#endif
+}
+
+void esp_mtp_dump_stats(esp_mtp_handle_t handle, FILE *stream)
+{
+#if CONFIG_ESP_MTP_STATS
+    esp_mtp_op_stats_t stats;
+    // 每个操作一行：op 次数 总耗时 USB等待 文件系统 最长 字节 MB/s | 非零直方图桶 log2(us):次数
+    fprintf(stream, "op     count   total_ms   usb_ms    fs_ms   max_us      bytes   MB/s | hist\n");
+    for (uint32_t i = 0; i < ESP_MTP_STATS_OP_MAX; i++) {
+        portENTER_CRITICAL(&handle->stats_lock);
+        stats = handle->stats[i];
+        portEXIT_CRITICAL(&handle->stats_lock);
+        if (stats.count == 0) {
+            continue;
+        }
+        fprintf(stream, "0x%04"PRIx32" %6"PRIu32" %10"PRIu64" %8"PRIu64" %8"PRIu64" %8"PRIu32" %10"PRIu64" %6.2f |",
+            i ? 0x1000 + i : 0, stats.count, stats.total_us / 1000, stats.usb_wait_us / 1000,
+            (stats.total_us - stats.usb_wait_us) / 1000, stats.max_us, stats.bytes,
+            stats.total_us ? (double)stats.bytes / stats.total_us : 0.0);
+        for (uint32_t j = 0; j < ESP_MTP_STATS_HIST_BUCKETS; j++) {
+            if (stats.hist[j]) {
+                fprintf(stream, " %"PRIu32":%"PRIu32, j, stats.hist[j]);
+            }
+        }
+        fprintf(stream, "\n");
+    }
+#endif
+}
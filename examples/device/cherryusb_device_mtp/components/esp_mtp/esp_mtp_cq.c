@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2024, udoudou
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include "esp_mtp_cq.h"
+
+void esp_mtp_cq_init(esp_mtp_cq_t *cq, uint32_t notify_bit, uint8_t max_outstanding)
+{
+    memset(cq, 0, sizeof(esp_mtp_cq_t));
+    portMUX_INITIALIZE(&cq->lock);
+    cq->notify_bit = notify_bit;
+    esp_mtp_cq_set_max_outstanding(cq, max_outstanding);
+}
+
+void esp_mtp_cq_set_max_outstanding(esp_mtp_cq_t *cq, uint8_t max_outstanding)
+{
+    if (max_outstanding == 0) {
+        max_outstanding = 1;
+    }
+    if (max_outstanding > ESP_MTP_CQ_DEPTH / 2) {
+        max_outstanding = ESP_MTP_CQ_DEPTH / 2;
+    }
+    cq->max_outstanding = max_outstanding;
+}
+
+void esp_mtp_cq_bind_task(esp_mtp_cq_t *cq, TaskHandle_t task)
+{
+    cq->task = task;
+}
+
+void esp_mtp_cq_reset(esp_mtp_cq_t *cq)
+{
+    portENTER_CRITICAL(&cq->lock);
+    cq->outstanding = 0;
+    cq->submit_head = 0;
+    cq->submit_count = 0;
+    cq->head = 0;
+    cq->count = 0;
+    portEXIT_CRITICAL(&cq->lock);
+}
+
+int esp_mtp_cq_submit(esp_mtp_cq_t *cq, uint8_t *buffer)
+{
+    esp_mtp_completion_t completion;
+    int ret = 0;
+    // 未回收的完成（如不等待的响应包）在这里被消耗，其中的 EXIT 需交还调用者
+    while (cq->outstanding >= cq->max_outstanding) {
+        esp_mtp_cq_reap(cq, &completion);
+        if (completion.len < 0 && ret == 0) {
+            ret = completion.len;
+        }
+    }
+    portENTER_CRITICAL(&cq->lock);
+    cq->submitted[(cq->submit_head + cq->submit_count) % ESP_MTP_CQ_DEPTH] = buffer;
+    cq->submit_count++;
+    cq->outstanding++;
+    portEXIT_CRITICAL(&cq->lock);
+    return ret;
+}
+
+bool ESP_MTP_ISR_ATTR esp_mtp_cq_post(esp_mtp_cq_t *cq, int len)
+{
+    bool in_isr = xPortInIsrContext();
+    bool ret = false;
+    if (in_isr) {
+        portENTER_CRITICAL_ISR(&cq->lock);
+    } else {
+        portENTER_CRITICAL(&cq->lock);
+    }
+    if (cq->count < ESP_MTP_CQ_DEPTH) {
+        esp_mtp_completion_t *completion = &cq->ring[(cq->head + cq->count) % ESP_MTP_CQ_DEPTH];
+        completion->len = len;
+        completion->buffer = NULL;
+        completion->control = (cq->submit_count == 0);
+        // 按提交顺序与在途请求配对，没有在途请求的为控制完成
+        if (cq->submit_count) {
+            completion->buffer = cq->submitted[cq->submit_head];
+            cq->submit_head = (cq->submit_head + 1) % ESP_MTP_CQ_DEPTH;
+            cq->submit_count--;
+        }
+        cq->count++;
+        ret = true;
+    }
+    if (in_isr) {
+        portEXIT_CRITICAL_ISR(&cq->lock);
+    } else {
+        portEXIT_CRITICAL(&cq->lock);
+    }
+    if (cq->task == NULL) {
+        return ret;
+    }
+    if (in_isr) {
+        BaseType_t high_task_wakeup = pdFALSE;
+        xTaskNotifyFromISR(cq->task, cq->notify_bit, eSetBits, &high_task_wakeup);
+        if (high_task_wakeup == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    } else {
+        xTaskNotify(cq->task, cq->notify_bit, eSetBits);
+    }
+    return ret;
+}
+
+void esp_mtp_cq_reap(esp_mtp_cq_t *cq, esp_mtp_completion_t *completion)
+{
+    uint32_t notify_value;
+    while (1) {
+        portENTER_CRITICAL(&cq->lock);
+        if (cq->count) {
+            *completion = cq->ring[cq->head];
+            cq->head = (cq->head + 1) % ESP_MTP_CQ_DEPTH;
+            cq->count--;
+            if (!completion->control && cq->outstanding) {
+                cq->outstanding--;
+            }
+            portEXIT_CRITICAL(&cq->lock);
+            return;
+        }
+        portEXIT_CRITICAL(&cq->lock);
+        // 检查与等待之间投递的完成会保留通知位，等待立即返回
+        xTaskNotifyWait(0x0, cq->notify_bit, &notify_value, portMAX_DELAY);
+    }
+}
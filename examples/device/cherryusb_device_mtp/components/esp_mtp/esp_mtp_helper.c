@@ -124,6 +124,53 @@ time_t esp_mtp_utf16_datatime_to_time(const char *utf16)
     return mktime(&tm_time);
 }
 
+static inline uint32_t file_list_make_handle(uint32_t index, uint8_t generation)
+{
+    return ((uint32_t)(generation & MTP_FILE_HANDLE_GEN_MASK) << MTP_FILE_HANDLE_GEN_SHIFT) | (index + 1);
+}
+
+static esp_mtp_file_list_t *file_list_block(esp_mtp_file_handle_list_t *file_list, uint32_t index)
+{
+    esp_mtp_file_list_t *list;
+    list = &file_list->list;
+    for (uint32_t i = 1; i <= index / MTP_FILE_LIST_SIZE; i++) {
+        list = list->next;
+    }
+    return list;
+}
+
+static esp_mtp_file_entry_t *file_list_slot(esp_mtp_file_handle_list_t *file_list, uint32_t index)
+{
+    return &file_list_block(file_list, index)->entry_list[index % MTP_FILE_LIST_SIZE];
+}
+
+static esp_mtp_file_entry_t *file_list_get(esp_mtp_file_handle_list_t *file_list, uint32_t handle)
+{
+    esp_mtp_file_entry_t *entry;
+    uint32_t index = handle & MTP_FILE_HANDLE_INDEX_MASK;
+
+    if (index == 0 || index > file_list->count || (handle >> MTP_FILE_HANDLE_GEN_SHIFT) > MTP_FILE_HANDLE_GEN_MASK) {
+        return NULL;
+    }
+    entry = file_list_slot(file_list, index - 1);
+    if (entry->name == NULL || entry->generation != (handle >> MTP_FILE_HANDLE_GEN_SHIFT)) {
+        return NULL;
+    }
+    return entry;
+}
+
+// 父对象的子对象链表头，父对象无效时返回 NULL
+static uint32_t *file_list_children(esp_mtp_file_handle_list_t *file_list, uint32_t parent)
+{
+    esp_mtp_file_entry_t *entry;
+
+    if (parent == 0) {
+        return &file_list->root_child;
+    }
+    entry = file_list_get(file_list, parent);
+    return entry ? &entry->child : NULL;
+}
+
 void esp_mtp_file_list_init(esp_mtp_file_handle_list_t *file_list)
 {
     memset(file_list, 0, sizeof(esp_mtp_file_handle_list_t));
@@ -132,55 +179,83 @@ void esp_mtp_file_list_init(esp_mtp_file_handle_list_t *file_list)
 uint32_t esp_mtp_file_list_add(esp_mtp_file_handle_list_t *file_list, uint32_t storage_id, uint32_t parent, const char *name)
 {
     esp_mtp_file_list_t *list;
-    list = &file_list->list;
-    for (uint32_t i = 1; i <= file_list->count / MTP_FILE_LIST_SIZE; i++) {
-        if (list->next == NULL) {
+    esp_mtp_file_entry_t *entry;
+    uint32_t *children;
+    uint32_t index;
+    char *entry_name;
+
+    children = file_list_children(file_list, parent);
+    if (children == NULL) {
+        return 0;
+    }
+
 #if defined CONFIG_SPIRAM_USE_MALLOC || defined CONFIG_SPIRAM_USE_CAPS_ALLOC
-            list->next = (esp_mtp_file_list_t *)heap_caps_calloc(1, sizeof(esp_mtp_file_list_t), MALLOC_CAP_DEFAULT | MALLOC_CAP_SPIRAM);
-#else            
-            list->next = (esp_mtp_file_list_t *)calloc(1, sizeof(esp_mtp_file_list_t));
+    entry_name = (char *)heap_caps_malloc(strlen(name) + 1, MALLOC_CAP_DEFAULT | MALLOC_CAP_SPIRAM);
+#else
+    entry_name = (char *)malloc(strlen(name) + 1);
 #endif
-            if (list->next == NULL) {
-                return 0;
-            }
-        }
-        list = list->next;
+    if (entry_name == NULL) {
+        return 0;
     }
+
+    if (file_list->free_slot) {
+        // 优先复用已删除对象的槽位，代数已在删除时更新
+        index = file_list->free_slot - 1;
+        list = file_list_block(file_list, index);
+        entry = &list->entry_list[index % MTP_FILE_LIST_SIZE];
+        file_list->free_slot = entry->parent;
+    } else {
+        if (file_list->count >= MTP_FILE_HANDLE_INDEX_MASK) {
+            free(entry_name);
+            return 0;
+        }
+        index = file_list->count;
+        list = &file_list->list;
+        for (uint32_t i = 1; i <= index / MTP_FILE_LIST_SIZE; i++) {
+            if (list->next == NULL) {
 #if defined CONFIG_SPIRAM_USE_MALLOC || defined CONFIG_SPIRAM_USE_CAPS_ALLOC
-    list->entry_list[file_list->count % MTP_FILE_LIST_SIZE].name = (char *)heap_caps_malloc(strlen(name) + 1, MALLOC_CAP_DEFAULT | MALLOC_CAP_SPIRAM);
+                list->next = (esp_mtp_file_list_t *)heap_caps_calloc(1, sizeof(esp_mtp_file_list_t), MALLOC_CAP_DEFAULT | MALLOC_CAP_SPIRAM);
 #else
-    list->entry_list[file_list->count % MTP_FILE_LIST_SIZE].name = (char *)malloc(strlen(name) + 1);
+                list->next = (esp_mtp_file_list_t *)calloc(1, sizeof(esp_mtp_file_list_t));
 #endif
-    if (list->entry_list[file_list->count % MTP_FILE_LIST_SIZE].name == NULL) {
-        return 0;
+                if (list->next == NULL) {
+                    free(entry_name);
+                    return 0;
+                }
+                for (uint32_t j = 0; j < MTP_FILE_LIST_SIZE; j++) {
+                    list->next->entry_list[j].generation = file_list->generation;
+                }
+            }
+            list = list->next;
+        }
+        entry = &list->entry_list[index % MTP_FILE_LIST_SIZE];
+        file_list->count++;
     }
-    strcpy(list->entry_list[file_list->count % MTP_FILE_LIST_SIZE].name, name);
-    list->entry_list[file_list->count % MTP_FILE_LIST_SIZE].storage_id = storage_id;
-    list->entry_list[file_list->count % MTP_FILE_LIST_SIZE].parent = parent;
-    file_list->count++;
-    // printf("add hande: %"PRIu32"(%"PRIu32")\n", file_list->count, parent);
-    return file_list->count;
+    strcpy(entry_name, name);
+    entry->name = entry_name;
+    entry->storage_id = storage_id;
+    entry->parent = parent;
+    entry->flags = 0;
+    entry->child = 0;
+    // 插入父对象子链表的表头
+    entry->sibling = *children;
+    *children = index + 1;
+    list->used++;
+    file_list->used++;
+    // printf("add hande: %"PRIu32"(%"PRIu32")\n", index + 1, parent);
+    return file_list_make_handle(index, entry->generation);
 }
 
 const esp_mtp_file_entry_t *esp_mtp_file_list_find(esp_mtp_file_handle_list_t *file_list, uint32_t handle, char *path, uint32_t max_len)
 {
     esp_mtp_file_entry_t *entry;
-    esp_mtp_file_list_t *list;
     uint32_t path_len = 0;
 
-    if (handle > file_list->count) {
+    entry = file_list_get(file_list, handle);
+    if (entry == NULL) {
         return NULL;
     }
-    handle = handle - 1;
-    list = &file_list->list;
-    for (uint32_t i = 1; i <= handle / MTP_FILE_LIST_SIZE; i++) {
-        list = list->next;
-    }
-    entry = &list->entry_list[handle % MTP_FILE_LIST_SIZE];
-    if (entry->name == NULL) {
-        return NULL;
-    }
-    // printf("find: %"PRIu32"(%"PRIu16")\n", handle + 1, entry->parent);
+    // printf("find: %"PRIu32"(%"PRIu32")\n", handle, entry->parent);
     if (entry->parent != 0) {
         if (esp_mtp_file_list_find(file_list, entry->parent, path, max_len) == NULL) {
             return NULL;
@@ -196,6 +271,171 @@ const esp_mtp_file_entry_t *esp_mtp_file_list_find(esp_mtp_file_handle_list_t *f
     return entry;
 }
 
+uint32_t esp_mtp_file_list_find_child(esp_mtp_file_handle_list_t *file_list, uint32_t parent, const char *name)
+{
+    esp_mtp_file_entry_t *entry;
+    uint32_t *children;
+
+    children = file_list_children(file_list, parent);
+    if (children == NULL) {
+        return 0;
+    }
+    for (uint32_t index = *children; index; index = entry->sibling) {
+        entry = file_list_slot(file_list, index - 1);
+        if (strcmp(entry->name, name) == 0) {
+            return file_list_make_handle(index - 1, entry->generation);
+        }
+    }
+    return 0;
+}
+
+static void file_list_release(esp_mtp_file_handle_list_t *file_list, uint32_t handle, esp_mtp_file_entry_t *entry)
+{
+    esp_mtp_file_list_forget_children(file_list, handle);
+    free(entry->name);
+    entry->name = NULL;
+    entry->flags = 0;
+    entry->sibling = 0;
+    // 代数加一，使仍持有旧句柄的主机请求失效
+    entry->generation = (entry->generation + 1) & MTP_FILE_HANDLE_GEN_MASK;
+    entry->parent = file_list->free_slot;
+    file_list->free_slot = (handle & MTP_FILE_HANDLE_INDEX_MASK);
+    file_list_block(file_list, file_list->free_slot - 1)->used--;
+    file_list->used--;
+}
+
+void esp_mtp_file_list_forget_children(esp_mtp_file_handle_list_t *file_list, uint32_t handle)
+{
+    esp_mtp_file_entry_t *entry;
+    uint32_t *children;
+    uint32_t index;
+
+    if (handle == 0) {
+        file_list->root_scanned = false;
+    } else {
+        entry = file_list_get(file_list, handle);
+        if (entry == NULL) {
+            return;
+        }
+        entry->flags &= ~MTP_FILE_FLAG_SCANNED;
+    }
+
+    // 逐个从表头摘下释放，子对象的子对象在 file_list_release 中递归释放
+    children = file_list_children(file_list, handle);
+    while (*children) {
+        index = *children - 1;
+        entry = file_list_slot(file_list, index);
+        *children = entry->sibling;
+        file_list_release(file_list, file_list_make_handle(index, entry->generation), entry);
+    }
+}
+
+void esp_mtp_file_list_remove(esp_mtp_file_handle_list_t *file_list, uint32_t handle)
+{
+    esp_mtp_file_entry_t *entry;
+    uint32_t *link;
+
+    entry = file_list_get(file_list, handle);
+    if (entry == NULL) {
+        return;
+    }
+    link = file_list_children(file_list, entry->parent);
+    while (link && *link) {
+        if (*link == (handle & MTP_FILE_HANDLE_INDEX_MASK)) {
+            *link = entry->sibling;
+            break;
+        }
+        link = &file_list_slot(file_list, *link - 1)->sibling;
+    }
+    file_list_release(file_list, handle, entry);
+    // 尾块全部空闲时整理一次，释放空块，避免长时间会话中句柄表只增不减；中间的空闲槽位留给空闲链表复用
+    if (file_list->count > MTP_FILE_LIST_SIZE && file_list_block(file_list, file_list->count - 1)->used == 0) {
+        esp_mtp_file_list_compact(file_list);
+    }
+}
+
+void esp_mtp_file_list_compact(esp_mtp_file_handle_list_t *file_list)
+{
+    esp_mtp_file_list_t *list;
+    esp_mtp_file_list_t *last = &file_list->list;
+    esp_mtp_file_list_t *next;
+    esp_mtp_file_entry_t *entry;
+    uint32_t last_base = 0;
+    uint32_t base;
+    uint32_t *link;
+
+    // 找到最后一个仍有对象的块，截掉其后的全部槽位
+    base = 0;
+    for (list = &file_list->list; list && base < file_list->count; list = list->next, base += MTP_FILE_LIST_SIZE) {
+        if (list->used) {
+            last = list;
+            last_base = base;
+        }
+    }
+    if (last->used == 0) {
+        file_list->count = 0;
+    } else {
+        if (file_list->count > last_base + MTP_FILE_LIST_SIZE) {
+            file_list->count = last_base + MTP_FILE_LIST_SIZE;
+        }
+        while (last->entry_list[(file_list->count - 1) % MTP_FILE_LIST_SIZE].name == NULL) {
+            file_list->count--;
+        }
+    }
+
+    // 释放尾部的空块，首块内嵌在结构体中不释放
+    next = last->next;
+    last->next = NULL;
+    if (next) {
+        // 释放块中槽位的代数随之丢失，之后新分配的块换用新的代数
+        file_list->generation = (file_list->generation + 1) & MTP_FILE_HANDLE_GEN_MASK;
+    }
+    while (next) {
+        list = next;
+        next = list->next;
+        free(list);
+    }
+
+    // 按序号从低到高重建空闲链表，链表头为最低序号的空闲槽位
+    link = &file_list->free_slot;
+    base = 0;
+    for (list = &file_list->list; base < file_list->count; list = list->next, base += MTP_FILE_LIST_SIZE) {
+        for (uint32_t i = 0; i < MTP_FILE_LIST_SIZE && base + i < file_list->count; i++) {
+            entry = &list->entry_list[i];
+            if (entry->name == NULL) {
+                *link = base + i + 1;
+                link = &entry->parent;
+            }
+        }
+    }
+    *link = 0;
+}
+
+bool esp_mtp_file_list_is_scanned(esp_mtp_file_handle_list_t *file_list, uint32_t parent)
+{
+    esp_mtp_file_entry_t *entry;
+
+    if (parent == 0) {
+        return file_list->root_scanned;
+    }
+    entry = file_list_get(file_list, parent);
+    return entry && (entry->flags & MTP_FILE_FLAG_SCANNED);
+}
+
+void esp_mtp_file_list_set_scanned(esp_mtp_file_handle_list_t *file_list, uint32_t parent)
+{
+    esp_mtp_file_entry_t *entry;
+
+    if (parent == 0) {
+        file_list->root_scanned = true;
+        return;
+    }
+    entry = file_list_get(file_list, parent);
+    if (entry) {
+        entry->flags |= MTP_FILE_FLAG_SCANNED;
+    }
+}
+
 void esp_mtp_file_list_clean(esp_mtp_file_handle_list_t *file_list)
 {
     esp_mtp_file_list_t *list;
@@ -214,34 +454,66 @@ void esp_mtp_file_list_clean(esp_mtp_file_handle_list_t *file_list)
         }
         list = next;
     } while (list != NULL);
-    memset(&file_list->list, 0, sizeof(file_list->list));
+    esp_mtp_file_list_init(file_list);
+}
+
+void esp_mtp_file_list_reset(esp_mtp_file_handle_list_t *file_list)
+{
+    esp_mtp_file_list_t *list;
+
+    list = &file_list->list;
+    do {
+        for (uint32_t i = 0; i < MTP_FILE_LIST_SIZE; i++) {
+            if (list->entry_list[i].name) {
+                free(list->entry_list[i].name);
+                list->entry_list[i].name = NULL;
+            }
+            // 新会话中槽位全部重新分配，代数递增使上个会话的句柄失效
+            list->entry_list[i].generation = (list->entry_list[i].generation + 1) & MTP_FILE_HANDLE_GEN_MASK;
+            list->entry_list[i].flags = 0;
+            list->entry_list[i].child = 0;
+            list->entry_list[i].sibling = 0;
+        }
+        list->used = 0;
+        list = list->next;
+    } while (list != NULL);
     file_list->count = 0;
+    file_list->used = 0;
+    file_list->free_slot = 0;
+    file_list->root_scanned = false;
+    file_list->root_child = 0;
 }
 
 uint8_t *esp_mtp_file_list_fill_handle_array(esp_mtp_file_handle_list_t *file_list, uint32_t parent, uint8_t *out, uint32_t *len)
 {
     uint32_t max_count;
     uint32_t count = 0;
-    esp_mtp_file_list_t *list;
+    uint32_t pos;
+    uint32_t *children;
+    esp_mtp_file_entry_t *entry;
 
-    if (parent < file_list->count) {
-        list = &file_list->list;
-        for (uint32_t i = 1; i <= parent / MTP_FILE_LIST_SIZE; i++) {
-            list = list->next;
-        }
-        max_count = *len / sizeof(uint32_t);
-        for (uint32_t i = parent; i < file_list->count; i++) {
-            if (list->entry_list[i % MTP_FILE_LIST_SIZE].parent == parent) {
-                *(uint32_t *)out = i + 1;
-                out += sizeof(uint32_t);
-                count++;
-                if (count == max_count) {
-                    break;;
-                }
-            }
+    max_count = *len / sizeof(uint32_t);
+    children = file_list_children(file_list, parent);
+    if (children == NULL) {
+        *len = 0;
+        return out;
+    }
+    // 子对象按添加的逆序链接，先计数再从后往前填写，使句柄保持目录遍历的顺序
+    for (uint32_t index = *children; index; index = entry->sibling) {
+        entry = file_list_slot(file_list, index - 1);
+        count++;
+    }
+    pos = count;
+    if (count > max_count) {
+        count = max_count;
+    }
+    for (uint32_t index = *children; index; index = entry->sibling) {
+        entry = file_list_slot(file_list, index - 1);
+        if (--pos < count) {
+            ((uint32_t *)out)[pos] = file_list_make_handle(index - 1, entry->generation);
         }
     }
 
     *len = count;
-    return out;
-}
\ No newline at end of file
+    return out + count * sizeof(uint32_t);
+}
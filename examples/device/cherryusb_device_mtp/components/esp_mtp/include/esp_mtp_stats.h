@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2024, udoudou
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* 直方图第 i 个桶统计耗时在 [2^i, 2^(i+1)) us 内的次数，最后一个桶包含更长的耗时 */
+#define ESP_MTP_STATS_HIST_BUCKETS  20
+/* 标准操作码（0x1001~0x101F）按低 12 位索引，厂商扩展等其余操作码计入索引 0 */
+#define ESP_MTP_STATS_OP_MAX        0x20
+
+/**
+ * @brief 单个 MTP 操作的统计数据
+ *
+ * total_us - usb_wait_us 为文件系统及 CPU 处理耗时，bytes / total_us 即该操作的 MB/s。
+ */
+typedef struct {
+    uint32_t count;         /*!< 执行次数 */
+    uint32_t max_us;        /*!< 单次最长耗时 */
+    uint64_t total_us;      /*!< 总耗时 */
+    uint64_t usb_wait_us;   /*!< 阻塞等待 USB 传输完成的耗时 */
+    uint64_t bytes;         /*!< 对象文件内容的字节数：GetObject/GetPartialObject 发出、SendObjectInfo 写入的部分，不含容器头、数据集、命令及响应 */
+    uint32_t hist[ESP_MTP_STATS_HIST_BUCKETS];  /*!< log2(us) 耗时直方图 */
+} esp_mtp_op_stats_t;
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2024, udoudou
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* 虚拟对象句柄使用 bit31，与文件句柄区分 */
+#define ESP_MTP_VIRTUAL_OBJECT_HANDLE_FLAG  0x80000000
+#define ESP_MTP_VIRTUAL_OBJECT_MAX          8
+
+/**
+ * @brief 虚拟对象，内容由回调生成，无需先写入文件系统
+ *
+ * 对象显示在存储根目录下，只读。name 及 user_ctx 在对象移除前需保持有效。
+ */
+typedef struct {
+    const char *name;       /*!< 对象文件名 */
+    uint32_t size;          /*!< 对象大小，get_size 为 NULL 时使用 */
+    /**
+     * @brief 可选，主机获取对象信息或读取对象时调用，返回当前对象大小
+     *
+     * 主机先由 GetObjectInfo 得到大小再 GetObject，内容会变化的对象应返回快照的大小，
+     * 并由 produce 提供同一快照的内容，否则两次操作的大小不一致。
+     */
+    uint32_t (*get_size)(void *user_ctx);
+    /**
+     * @brief 将对象 offset 处的 len 字节直接填入传输缓冲区
+     *
+     * @return 实际填充的字节数，小于 len 视为读取失败
+     */
+    int (*produce)(void *user_ctx, uint32_t offset, uint8_t *buffer, uint32_t len);
+    void *user_ctx;
+} esp_mtp_virtual_object_t;
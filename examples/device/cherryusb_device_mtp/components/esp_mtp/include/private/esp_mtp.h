@@ -10,6 +10,9 @@
 #include "freertos/task.h"
 
 #include "esp_err.h"
+#include "esp_mtp_virtual_object.h"
+#include "esp_mtp_stats.h"
+#include <stdio.h>
 
 typedef struct esp_mtp *esp_mtp_handle_t;
 
@@ -19,21 +22,36 @@ typedef enum {
     ESP_MTP_FLAG_USB_HS = 1 << 1,
     ESP_MTP_FLAG_ASYNC_READ = 1 << 2,
     ESP_MTP_FLAG_ASYNC_WRITE = 1 << 3,
+    ESP_MTP_FLAG_QUEUED_WRITE = 1 << 4,     //管道可在上一个写完成前接收下一个写，按提交顺序完成
     ESP_MTP_FLAG_MAX = 0xFFFFFFFF,
 } __attribute__((packed)) esp_mtp_flags_t;
 
 #define ESP_MTP_STOP_CMD    0
 #define ESP_MTP_EXIT_CMD    -1
 
+#define ESP_MTP_BASE_PATH_MAX       16      //与 ESP_VFS_PATH_MAX 一致
+#define ESP_MTP_DEFAULT_BASE_PATH   "/sdcard"
+
 typedef struct {
     void *pipe_context;
     void (*wait_start)(void *pipe_context);
     int (*read)(void *pipe_context, uint8_t *buffer, int len);
     int (*write)(void *pipe_context, const uint8_t *buffer, int len);
+    void (*closed)(void *pipe_context);  //引擎任务退出、handle 已释放后调用，此后管道不再被访问，可为 NULL
     esp_mtp_flags_t flags;
-    uint32_t buffer_size;
+    uint32_t buffer_size;               //动态分配且开启 CONFIG_CHERRYUSB_MEMPOOL 时含容器头，即从缓冲池申请的长度
+    const char *base_path;              //存储挂载点, NULL 时使用 ESP_MTP_DEFAULT_BASE_PATH
+    const char *storage_description;    //需在实例生命周期内保持有效, NULL 时使用默认描述
+    UBaseType_t task_priority;          //0 时使用默认优先级 5
+    /* 静态分配（需开启 CONFIG_ESP_MTP_STATIC_ALLOCATION），buffer 非 NULL 时生效 */
+    uint8_t *buffer;                    //长度为 ESP_MTP_STATIC_BUFFER_LEN(buffer_size)，4 字节对齐
+    StaticTask_t *task_buffer;
+    StackType_t *task_stack;
+    uint32_t task_stack_size;           //0 时为 4096
 }esp_mtp_config_t;
 
+#define ESP_MTP_STATIC_BUFFER_LEN(buffer_size)  (12 + (buffer_size))  //MTP 容器头 + 数据
+
 esp_mtp_handle_t esp_mtp_init(const esp_mtp_config_t *config);
 
 void esp_mtp_read_async_cb(esp_mtp_handle_t handle, int len);
@@ -41,3 +59,23 @@ void esp_mtp_read_async_cb(esp_mtp_handle_t handle, int len);
 void esp_mtp_write_async_cb(esp_mtp_handle_t handle, int len);
 
 TaskHandle_t esp_mtp_get_task_handle(esp_mtp_handle_t handle);
+
+/** @brief 注册虚拟对象
+ *
+ * @return 对象句柄，失败返回 0
+ */
+uint32_t esp_mtp_add_virtual_object(esp_mtp_handle_t handle, const esp_mtp_virtual_object_t *object);
+
+esp_err_t esp_mtp_remove_virtual_object(esp_mtp_handle_t handle, uint32_t object_handle);
+
+/** @brief 获取某个操作码的统计数据，需开启 CONFIG_ESP_MTP_STATS
+ *
+ * @return ESP_ERR_NOT_SUPPORTED 统计未开启
+ */
+esp_err_t esp_mtp_get_op_stats(esp_mtp_handle_t handle, uint16_t opcode, esp_mtp_op_stats_t *stats);
+
+void esp_mtp_reset_stats(esp_mtp_handle_t handle);
+
+/** @brief 以每个操作一行的紧凑格式输出统计数据
+ */
+void esp_mtp_dump_stats(esp_mtp_handle_t handle, FILE *stream);
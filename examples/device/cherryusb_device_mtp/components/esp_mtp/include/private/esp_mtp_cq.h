@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024, udoudou
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* 投递可能在 USB 中断中执行，开启 CONFIG_CHERRYUSB_ISR_IRAM 时需放在 IRAM */
+#if CONFIG_CHERRYUSB_ISR_IRAM
+#include "esp_attr.h"
+#define ESP_MTP_ISR_ATTR IRAM_ATTR
+#else
+#define ESP_MTP_ISR_ATTR
+#endif
+
+/* 完成队列深度，需大于最大在途请求数，余量用于 STOP/EXIT 等控制完成 */
+#define ESP_MTP_CQ_DEPTH    8
+
+typedef struct {
+    uint8_t *buffer;        // 对应的提交缓冲区
+    int len;                // 实际传输长度，或 ESP_MTP_STOP_CMD/ESP_MTP_EXIT_CMD
+    bool control;           // 没有对应在途请求的完成（如 deinit 时投递的 EXIT）
+} esp_mtp_completion_t;
+
+/**
+ * @brief 单方向（IN 或 OUT）的完成队列
+ *
+ * 由 MTP 任务提交与回收，传输完成回调（可在中断中）投递完成。
+ * 每个队列使用独立的任务通知位，回收时先检查队列再等待通知，不会丢失唤醒。
+ */
+typedef struct {
+    portMUX_TYPE lock;
+    TaskHandle_t task;
+    uint32_t notify_bit;
+    uint8_t max_outstanding;
+    uint8_t outstanding;    // 已提交、尚未回收的请求数
+    uint8_t submit_head;
+    uint8_t submit_count;
+    uint8_t head;
+    uint8_t count;
+    uint8_t *submitted[ESP_MTP_CQ_DEPTH];
+    esp_mtp_completion_t ring[ESP_MTP_CQ_DEPTH];
+} esp_mtp_cq_t;
+
+void esp_mtp_cq_init(esp_mtp_cq_t *cq, uint32_t notify_bit, uint8_t max_outstanding);
+
+/** @brief 调整在途请求上限，需在没有在途请求时调用
+ */
+void esp_mtp_cq_set_max_outstanding(esp_mtp_cq_t *cq, uint8_t max_outstanding);
+
+/** @brief 绑定回收任务，需在 MTP 任务中调用
+ */
+void esp_mtp_cq_bind_task(esp_mtp_cq_t *cq, TaskHandle_t task);
+
+/** @brief 清空队列，会话重新开始时调用
+ */
+void esp_mtp_cq_reset(esp_mtp_cq_t *cq);
+
+/** @brief 登记一个即将发起的传输，在途请求已达上限时先回收最早的完成
+ *
+ * @return 0，或回收到的完成中第一个小于 0 的长度（ESP_MTP_EXIT_CMD）；
+ *         此时传输仍已登记，调用者不再发起传输，直接以该值投递完成
+ */
+int esp_mtp_cq_submit(esp_mtp_cq_t *cq, uint8_t *buffer);
+
+/** @brief 投递完成，可在中断中调用
+ *
+ * @return 队列已满时返回 false
+ */
+bool esp_mtp_cq_post(esp_mtp_cq_t *cq, int len);
+
+/** @brief 回收最早的一个完成，队列为空时阻塞等待
+ */
+void esp_mtp_cq_reap(esp_mtp_cq_t *cq, esp_mtp_completion_t *completion);
@@ -8,22 +8,40 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define MTP_FILE_LIST_SIZE 64
 
+/* 对象句柄布局：bit0~23 为槽位序号 + 1，bit24~30 为槽位代数，bit31 为虚拟对象标志（不会与保留值 0xFFFFFFFF 冲突） */
+#define MTP_FILE_HANDLE_INDEX_MASK  0x00FFFFFF
+#define MTP_FILE_HANDLE_GEN_SHIFT   24
+#define MTP_FILE_HANDLE_GEN_MASK    0x7F
+
+#define MTP_FILE_FLAG_SCANNED   (1 << 0)    // 目录已遍历过，其子项均已在句柄表中
+
 typedef struct {
     uint16_t storage_id;
-    uint16_t parent;
-    char *name;
+    uint8_t generation;
+    uint8_t flags;
+    uint32_t parent;        // 槽位空闲时复用为空闲链表的下一个槽位（序号 + 1）
+    uint32_t child;         // 第一个子对象（序号 + 1），0 表示没有子对象
+    uint32_t sibling;       // 同一父对象下的下一个对象（序号 + 1）
+    char *name;             // 为 NULL 表示槽位空闲
 }esp_mtp_file_entry_t;
 
 typedef struct esp_mtp_file_list {
     esp_mtp_file_entry_t entry_list[MTP_FILE_LIST_SIZE];
+    uint32_t used;          // 块内有效对象数
     struct esp_mtp_file_list *next;
 }esp_mtp_file_list_t;
 
 typedef struct {
-    uint32_t count;
+    uint32_t count;         // 已分配过的槽位数（含空闲槽位）
+    uint32_t used;          // 有效对象数
+    uint32_t free_slot;     // 空闲链表头（序号 + 1），0 表示无空闲槽位
+    uint8_t generation;     // 新分配块的初始代数
+    bool root_scanned;
+    uint32_t root_child;    // 根目录下第一个对象（序号 + 1）
     esp_mtp_file_list_t list;
 }esp_mtp_file_handle_list_t;
 
@@ -57,6 +75,34 @@ uint32_t esp_mtp_file_list_add(esp_mtp_file_handle_list_t *file_list, uint32_t s
 
 const esp_mtp_file_entry_t *esp_mtp_file_list_find(esp_mtp_file_handle_list_t *file_list, uint32_t handle, char *path, uint32_t max_len);
 
+/** @brief 查找 parent 下名为 name 的对象
+ *
+ * @return 对象句柄，未找到返回 0
+ */
+uint32_t esp_mtp_file_list_find_child(esp_mtp_file_handle_list_t *file_list, uint32_t parent, const char *name);
+
+/** @brief 删除对象及其全部子对象，释放的槽位代数加一后回收复用，旧句柄随即失效
+ */
+void esp_mtp_file_list_remove(esp_mtp_file_handle_list_t *file_list, uint32_t handle);
+
+/** @brief 删除对象的全部子对象并清除已遍历标记，下次获取句柄时重新遍历目录
+ */
+void esp_mtp_file_list_forget_children(esp_mtp_file_handle_list_t *file_list, uint32_t handle);
+
+/** @brief 截掉尾部空闲槽位并释放空块，重建空闲链表使低序号槽位优先复用
+ *
+ * 删除对象后若尾块已全部空闲会自动调用
+ */
+void esp_mtp_file_list_compact(esp_mtp_file_handle_list_t *file_list);
+
+bool esp_mtp_file_list_is_scanned(esp_mtp_file_handle_list_t *file_list, uint32_t parent);
+
+void esp_mtp_file_list_set_scanned(esp_mtp_file_handle_list_t *file_list, uint32_t parent);
+
 void esp_mtp_file_list_clean(esp_mtp_file_handle_list_t *file_list);
 
+/** @brief 清空全部对象但保留已分配的块，供下次会话直接复用
+ */
+void esp_mtp_file_list_reset(esp_mtp_file_handle_list_t *file_list);
+
 uint8_t *esp_mtp_file_list_fill_handle_array(esp_mtp_file_handle_list_t *file_list, uint32_t parent, uint8_t *out, uint32_t *len);
\ No newline at end of file
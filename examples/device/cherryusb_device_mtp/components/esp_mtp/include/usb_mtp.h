@@ -6,7 +6,13 @@
 
 #pragma once
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "usbd_core.h"
+#include "esp_err.h"
+#include "esp_mtp_virtual_object.h"
+#include "esp_mtp_stats.h"
+#include <stdio.h>
 
 #define USB_MTP_CLASS 0x06
 
@@ -49,9 +55,56 @@
 // clang-format on
 
 
-struct usbd_interface *usbd_mtp_init_intf(struct usbd_interface *intf,
+typedef struct {
+    const char *base_path;              /*!< 存储挂载点, NULL 时为 "/sdcard" */
+    const char *storage_description;    /*!< 主机显示的存储名称, 需在实例生命周期内保持有效 */
+    uint32_t buffer_size;               /*!< 传输缓冲区大小, 0 时为 4096; 开启 CONFIG_CHERRYUSB_MEMPOOL 且动态分配时含 12 字节容器头, 宜取缓冲池块大小 */
+    UBaseType_t task_priority;          /*!< MTP 任务优先级, 0 时为 5 */
+    bool keep_on_deinit;                /*!< deinit 时保留任务、缓冲区与句柄表, 再次 init 同一 intf 时直接复用 */
+    /* 静态分配, 需开启 CONFIG_ESP_MTP_STATIC_ALLOCATION, buffer 非 NULL 时生效 */
+    uint8_t *buffer;                    /*!< 长度为 USBD_MTP_STATIC_BUFFER_LEN(buffer_size), 4 字节对齐 */
+    StaticTask_t *task_buffer;
+    StackType_t *task_stack;
+    uint32_t task_stack_size;           /*!< 0 时为 4096 */
+} usbd_mtp_config_t;
+
+#define USBD_MTP_STATIC_BUFFER_LEN(buffer_size) (12 + (buffer_size))
+
+/** @brief 初始化一个 MTP 接口实例，实例数量上限由 CONFIG_ESP_MTP_MAX_INSTANCES 决定
+ *
+ * @param mtp_config 实例配置, 传 NULL 使用默认配置
+ *
+ * @return intf，失败返回 NULL
+ */
+struct usbd_interface *usbd_mtp_init_intf(uint8_t busid,
+    struct usbd_interface *intf,
     const uint8_t out_ep,
     const uint8_t in_ep,
-    const uint8_t int_ep);
+    const uint8_t int_ep,
+    const usbd_mtp_config_t *mtp_config);
+
+/** @brief 停止 MTP 接口实例，keep_on_deinit 时仅挂起实例，不释放资源
+ */
+void usbd_mtp_deinit(struct usbd_interface *intf);
+
+/** @brief 彻底释放 MTP 接口实例（包括已挂起的实例），引擎任务退出后才归还实例槽位，此时静态缓冲区才可重用
+ */
+void usbd_mtp_release(struct usbd_interface *intf);
+
+/** @brief 在 MTP 存储根目录下注册一个虚拟对象，需在 usbd_mtp_init_intf 之后调用
+ *
+ * @return 对象句柄，失败返回 0
+ */
+uint32_t usbd_mtp_add_virtual_object(struct usbd_interface *intf, const esp_mtp_virtual_object_t *object);
+
+void usbd_mtp_remove_virtual_object(struct usbd_interface *intf, uint32_t object_handle);
+
+/** @brief 获取 MTP 操作统计，需开启 CONFIG_ESP_MTP_STATS
+ *
+ * @param opcode MTP 操作码，如 MTP_OPERATION_GET_OBJECT（0x1009），非标准操作码返回合并统计的索引 0
+ */
+esp_err_t usbd_mtp_get_op_stats(struct usbd_interface *intf, uint16_t opcode, esp_mtp_op_stats_t *stats);
+
+void usbd_mtp_reset_stats(struct usbd_interface *intf);
 
-void usbd_mtp_deinit(void);
\ No newline at end of file
+void usbd_mtp_dump_stats(struct usbd_interface *intf, FILE *stream);
@@ -7,6 +7,8 @@
 #include "usb_mtp.h"
 #include "esp_mtp_def.h"
 #include "esp_mtp.h"
+#include "usbd_ep_queue.h"
+#include "sdkconfig.h"
 
  /* Max USB packet size */
 #ifndef CONFIG_USB_HS
@@ -19,6 +21,9 @@
 #define MTP_IN_EP_IDX  1
 #define MTP_INT_EP_IDX 2
 
+//每个方向可同时排队的传输数，与引擎最大在途写数一致
+#define MTP_XFER_NUM   2
+
 typedef enum {
     USB_MTP_CLOSE,
     USB_MTP_INIT,
@@ -26,14 +31,52 @@ typedef enum {
     USB_MTP_STOPPING,
 } usb_mtp_status_t;
 
-/* Describe EndPoints configuration */
-static struct usbd_endpoint mtp_ep_data[3];
-static TaskHandle_t s_mtp_task_handle;
-esp_mtp_handle_t s_handle;
-static usb_mtp_status_t s_mtp_status = USB_MTP_CLOSE;
-static portMUX_TYPE s_spinlock = portMUX_INITIALIZER_UNLOCKED;
+typedef struct {
+    struct usbd_interface *intf;
+    uint8_t busid;
+    /* Describe EndPoints configuration */
+    struct usbd_endpoint ep_data[3];
+    TaskHandle_t task_handle;
+    esp_mtp_handle_t handle;
+    usb_mtp_status_t status;
+    portMUX_TYPE spinlock;
+    bool keep_on_deinit;
+    bool parked;        //已 deinit 但保留任务与缓冲区，等待再次 init
+    bool closing;       //已 release，引擎任务退出后才归还槽位
+    usbd_ep_queue_t out_q;
+    usbd_ep_queue_t in_q;
+    usbd_ep_xfer_t out_xfer[MTP_XFER_NUM];
+    usbd_ep_xfer_t in_xfer[MTP_XFER_NUM];
+    uint8_t out_xfer_idx;
+    uint8_t in_xfer_idx;
+} usb_mtp_instance_t;
+
+static usb_mtp_instance_t s_mtp_instances[CONFIG_ESP_MTP_MAX_INSTANCES];
+static portMUX_TYPE s_instances_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static USB_ISR_ATTR usb_mtp_instance_t *mtp_find_instance_by_ep(uint8_t busid, uint8_t ep)
+{
+    for (int i = 0; i < CONFIG_ESP_MTP_MAX_INSTANCES; i++) {
+        usb_mtp_instance_t *mtp = &s_mtp_instances[i];
+        if (mtp->intf && !mtp->closing && mtp->busid == busid &&
+            (mtp->ep_data[MTP_OUT_EP_IDX].ep_addr == ep || mtp->ep_data[MTP_IN_EP_IDX].ep_addr == ep)) {
+            return mtp;
+        }
+    }
+    return NULL;
+}
 
-static int mtp_class_interface_request_handler(uint8_t busid, struct usb_setup_packet *setup, uint8_t **data, uint32_t *len)
+static usb_mtp_instance_t *mtp_find_instance_by_intf(struct usbd_interface *intf)
+{
+    for (int i = 0; i < CONFIG_ESP_MTP_MAX_INSTANCES; i++) {
+        if (s_mtp_instances[i].intf == intf && !s_mtp_instances[i].closing) {
+            return &s_mtp_instances[i];
+        }
+    }
+    return NULL;
+}
+
+static int USB_ISR_ATTR mtp_class_interface_request_handler(uint8_t busid, struct usb_setup_packet *setup, uint8_t **data, uint32_t *len)
 {
     USB_LOG_DBG("MTP Class request: "
         "bRequest 0x%02x\r\n",
@@ -62,41 +105,91 @@ static int mtp_class_interface_request_handler(uint8_t busid, struct usb_setup_p
     return 0;
 }
 
-static void usbd_mtp_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
+static void USB_ISR_ATTR usbd_mtp_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_ep(busid, ep);
+    if (mtp) {
+        usbd_ep_queue_handle_cb(&mtp->out_q, nbytes);
+    }
+}
+
+static void USB_ISR_ATTR usbd_mtp_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
 {
-    esp_mtp_read_async_cb(s_handle, nbytes);
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_ep(busid, ep);
+    if (mtp) {
+        usbd_ep_queue_handle_cb(&mtp->in_q, nbytes);
+    }
 }
 
-static void usbd_mtp_bulk_in(uint8_t busid, uint8_t ep, uint32_t nbytes)
+/* 被复位/断开清掉的传输按 STOP 完成，引擎退回等待状态 */
+static inline int USB_ISR_ATTR mtp_xfer_result(usb_mtp_instance_t *mtp, usbd_ep_xfer_t *xfer)
 {
-    esp_mtp_write_async_cb(s_handle, nbytes);
+    if (xfer->status == 0) {
+        return xfer->actual;
+    }
+    return (mtp->status != USB_MTP_CLOSE) ? ESP_MTP_STOP_CMD : ESP_MTP_EXIT_CMD;
+}
+
+static void USB_ISR_ATTR usbd_mtp_read_done(uint8_t busid, usbd_ep_xfer_t *xfer)
+{
+    usb_mtp_instance_t *mtp = xfer->arg;
+    if (mtp->handle) {
+        esp_mtp_read_async_cb(mtp->handle, mtp_xfer_result(mtp, xfer));
+    }
+}
+
+static void USB_ISR_ATTR usbd_mtp_write_done(uint8_t busid, usbd_ep_xfer_t *xfer)
+{
+    usb_mtp_instance_t *mtp = xfer->arg;
+    if (mtp->handle) {
+        esp_mtp_write_async_cb(mtp->handle, mtp_xfer_result(mtp, xfer));
+    }
 }
 
-static void mtp_notify_handler(uint8_t busid, uint8_t event, void *arg)
+static void USB_ISR_ATTR mtp_notify_handler(usb_mtp_instance_t *mtp, uint8_t event)
 {
     BaseType_t high_task_wakeup = pdFALSE;
     switch (event) {
     case USBD_EVENT_RESET:
-        portENTER_CRITICAL_ISR(&s_spinlock);
-        if (s_mtp_status != USB_MTP_CLOSE && s_mtp_status != USB_MTP_INIT) {
-            s_mtp_status = USB_MTP_STOPPING;
+        portENTER_CRITICAL_ISR(&mtp->spinlock);
+        if (mtp->status != USB_MTP_CLOSE && mtp->status != USB_MTP_INIT) {
+            mtp->status = USB_MTP_STOPPING;
         }
-        portEXIT_CRITICAL_ISR(&s_spinlock);
+        portEXIT_CRITICAL_ISR(&mtp->spinlock);
+        //复位后控制器丢弃了进行中的传输，不会再有回调
+        usbd_ep_queue_flush(&mtp->out_q);
+        usbd_ep_queue_flush(&mtp->in_q);
         break;
     case USBD_EVENT_CONFIGURED:
         bool need_wake = false;
-        portENTER_CRITICAL_ISR(&s_spinlock);
-        if (s_mtp_status == USB_MTP_INIT) {
+        portENTER_CRITICAL_ISR(&mtp->spinlock);
+        if (mtp->status == USB_MTP_INIT) {
             need_wake = true;
-            s_mtp_status = USB_MTP_RUN;
+            mtp->status = USB_MTP_RUN;
         }
-        portEXIT_CRITICAL_ISR(&s_spinlock);
+        portEXIT_CRITICAL_ISR(&mtp->spinlock);
         if (need_wake) {
-            vTaskNotifyGiveFromISR(s_mtp_task_handle, &high_task_wakeup);
+            vTaskNotifyGiveFromISR(mtp->task_handle, &high_task_wakeup);
         }
         break;
     case USBD_EVENT_DISCONNECTED:
-        vTaskNotifyGiveFromISR(s_mtp_task_handle, &high_task_wakeup);
+        //未经复位直接断开时，让引擎退回等待状态
+        bool need_stop = false;
+        portENTER_CRITICAL_ISR(&mtp->spinlock);
+        if (mtp->status == USB_MTP_RUN) {
+            mtp->status = USB_MTP_STOPPING;
+            need_stop = true;
+        }
+        portEXIT_CRITICAL_ISR(&mtp->spinlock);
+        if (need_stop) {
+            //有挂起的读时由清空队列投递 STOP，避免重复
+            bool read_pending = !usbd_ep_queue_idle(&mtp->out_q);
+            usbd_ep_queue_flush(&mtp->out_q);
+            usbd_ep_queue_flush(&mtp->in_q);
+            if (!read_pending) {
+                esp_mtp_read_async_cb(mtp->handle, ESP_MTP_STOP_CMD);
+            }
+        }
         break;
     default:
         break;
@@ -106,95 +199,321 @@ static void mtp_notify_handler(uint8_t busid, uint8_t event, void *arg)
     }
 }
 
+/* notify_handler 不带接口上下文，每个实例使用独立的入口函数 */
+#define MTP_NOTIFY_HANDLER_DEFINE(n)                                                         \
+    static void USB_ISR_ATTR mtp_notify_handler_##n(uint8_t busid, uint8_t event, void *arg) \
+    {                                                                                        \
+        mtp_notify_handler(&s_mtp_instances[n], event);                                      \
+    }
+
+MTP_NOTIFY_HANDLER_DEFINE(0)
+#if CONFIG_ESP_MTP_MAX_INSTANCES > 1
+MTP_NOTIFY_HANDLER_DEFINE(1)
+#endif
+#if CONFIG_ESP_MTP_MAX_INSTANCES > 2
+MTP_NOTIFY_HANDLER_DEFINE(2)
+#endif
+#if CONFIG_ESP_MTP_MAX_INSTANCES > 3
+MTP_NOTIFY_HANDLER_DEFINE(3)
+#endif
+
+static void (*const s_mtp_notify_handlers[CONFIG_ESP_MTP_MAX_INSTANCES])(uint8_t busid, uint8_t event, void *arg) = {
+    mtp_notify_handler_0,
+#if CONFIG_ESP_MTP_MAX_INSTANCES > 1
+    mtp_notify_handler_1,
+#endif
+#if CONFIG_ESP_MTP_MAX_INSTANCES > 2
+    mtp_notify_handler_2,
+#endif
+#if CONFIG_ESP_MTP_MAX_INSTANCES > 3
+    mtp_notify_handler_3,
+#endif
+};
+
 static void usb_wait_start(void *pipe_context)
 {
-    portENTER_CRITICAL(&s_spinlock);
-    if (s_mtp_status != USB_MTP_STOPPING) {
-        portEXIT_CRITICAL(&s_spinlock);
-        return;
+    usb_mtp_instance_t *mtp = pipe_context;
+    //通知值与读写完成位共用，被残留的完成位唤醒时重新检查状态
+    while (1) {
+        portENTER_CRITICAL(&mtp->spinlock);
+        if (mtp->status == USB_MTP_RUN || mtp->status == USB_MTP_CLOSE) {
+            portEXIT_CRITICAL(&mtp->spinlock);
+            return;
+        }
+        mtp->status = USB_MTP_INIT;
+        portEXIT_CRITICAL(&mtp->spinlock);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
-    s_mtp_status = USB_MTP_INIT;
-    portEXIT_CRITICAL(&s_spinlock);
-    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 }
 
 static int usb_write(void *pipe_context, const uint8_t *data, int data_size)
 {
-    if (s_mtp_status != USB_MTP_RUN) {
-        data_size = (s_mtp_status != USB_MTP_CLOSE) ? ESP_MTP_STOP_CMD : ESP_MTP_EXIT_CMD;
-        esp_mtp_write_async_cb(s_handle, data_size);
+    usb_mtp_instance_t *mtp = pipe_context;
+    if (mtp->status != USB_MTP_RUN) {
+        data_size = (mtp->status != USB_MTP_CLOSE) ? ESP_MTP_STOP_CMD : ESP_MTP_EXIT_CMD;
+        esp_mtp_write_async_cb(mtp->handle, data_size);
+        return data_size;
+    }
+    //完成按提交顺序到达，引擎在途写不超过 MTP_XFER_NUM，轮转使用即可
+    usbd_ep_xfer_t *xfer = &mtp->in_xfer[mtp->in_xfer_idx];
+    mtp->in_xfer_idx = (mtp->in_xfer_idx + 1) % MTP_XFER_NUM;
+    usbd_ep_xfer_init(xfer, (uint8_t *)data, data_size, usbd_mtp_write_done, mtp);
+    int ret = usbd_ep_queue_submit(&mtp->in_q, xfer);
+    if (ret < 0) {
+        //端点未能启动，传输未入队，按中止处理
+        xfer->status = ret;
+        usbd_mtp_write_done(mtp->busid, xfer);
         return data_size;
     }
-    usbd_ep_start_write(0, mtp_ep_data[MTP_IN_EP_IDX].ep_addr, data, data_size);
+    //与 release 的清空交错时由这里补清，传输不会滞留在已关闭的实例上
+    if (mtp->status == USB_MTP_CLOSE) {
+        usbd_ep_queue_flush(&mtp->in_q);
+    }
     return data_size;
 }
 
 static int usb_read(void *pipe_context, uint8_t *data, int data_size)
 {
-    if (s_mtp_status != USB_MTP_RUN) {
-        data_size = (s_mtp_status != USB_MTP_CLOSE) ? ESP_MTP_STOP_CMD : ESP_MTP_EXIT_CMD;
-        esp_mtp_read_async_cb(s_handle, data_size);
+    usb_mtp_instance_t *mtp = pipe_context;
+    if (mtp->status != USB_MTP_RUN) {
+        data_size = (mtp->status != USB_MTP_CLOSE) ? ESP_MTP_STOP_CMD : ESP_MTP_EXIT_CMD;
+        esp_mtp_read_async_cb(mtp->handle, data_size);
+        return data_size;
+    }
+    usbd_ep_xfer_t *xfer = &mtp->out_xfer[mtp->out_xfer_idx];
+    mtp->out_xfer_idx = (mtp->out_xfer_idx + 1) % MTP_XFER_NUM;
+    usbd_ep_xfer_init(xfer, data, data_size, usbd_mtp_read_done, mtp);
+    int ret = usbd_ep_queue_submit(&mtp->out_q, xfer);
+    if (ret < 0) {
+        xfer->status = ret;
+        usbd_mtp_read_done(mtp->busid, xfer);
         return data_size;
     }
-    usbd_ep_start_read(0, mtp_ep_data[MTP_OUT_EP_IDX].ep_addr, data, data_size);
+    if (mtp->status == USB_MTP_CLOSE) {
+        usbd_ep_queue_flush(&mtp->out_q);
+    }
     return data_size;
 }
 
-struct usbd_interface *usbd_mtp_init_intf(struct usbd_interface *intf,
+static void usb_closed(void *pipe_context)
+{
+    usb_mtp_instance_t *mtp = pipe_context;
+    //引擎任务不再访问实例，归还槽位
+    portENTER_CRITICAL(&s_instances_lock);
+    mtp->handle = NULL;
+    mtp->task_handle = NULL;
+    mtp->parked = false;
+    mtp->closing = false;
+    mtp->intf = NULL;
+    portEXIT_CRITICAL(&s_instances_lock);
+}
+
+struct usbd_interface *usbd_mtp_init_intf(uint8_t busid,
+    struct usbd_interface *intf,
     const uint8_t out_ep,
     const uint8_t in_ep,
-    const uint8_t int_ep)
+    const uint8_t int_ep,
+    const usbd_mtp_config_t *mtp_config)
 {
+    usb_mtp_instance_t *mtp = NULL;
+    bool warm = false;
+    int index;
+
+    portENTER_CRITICAL(&s_instances_lock);
+    //优先复用该接口保留下来的实例
+    for (index = 0; index < CONFIG_ESP_MTP_MAX_INSTANCES; index++) {
+        if (s_mtp_instances[index].intf == intf && s_mtp_instances[index].parked && !s_mtp_instances[index].closing) {
+            mtp = &s_mtp_instances[index];
+            mtp->parked = false;
+            warm = true;
+            break;
+        }
+    }
+    if (mtp == NULL) {
+        for (index = 0; index < CONFIG_ESP_MTP_MAX_INSTANCES; index++) {
+            if (s_mtp_instances[index].intf == NULL) {
+                mtp = &s_mtp_instances[index];
+                mtp->intf = intf;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&s_instances_lock);
+    if (mtp == NULL) {
+        USB_LOG_ERR("No free MTP instance\r\n");
+        return NULL;
+    }
+
     intf->class_interface_handler = mtp_class_interface_request_handler;
     intf->class_endpoint_handler = NULL;
     intf->vendor_handler = NULL;
-    intf->notify_handler = mtp_notify_handler;
+    intf->notify_handler = s_mtp_notify_handlers[index];
+
+    mtp->busid = busid;
+    portMUX_INITIALIZE(&mtp->spinlock);
 
-    mtp_ep_data[MTP_OUT_EP_IDX].ep_addr = out_ep;
-    mtp_ep_data[MTP_OUT_EP_IDX].ep_cb = usbd_mtp_bulk_out;
-    mtp_ep_data[MTP_IN_EP_IDX].ep_addr = in_ep;
-    mtp_ep_data[MTP_IN_EP_IDX].ep_cb = usbd_mtp_bulk_in;
+    mtp->ep_data[MTP_OUT_EP_IDX].ep_addr = out_ep;
+    mtp->ep_data[MTP_OUT_EP_IDX].ep_cb = usbd_mtp_bulk_out;
+    mtp->ep_data[MTP_IN_EP_IDX].ep_addr = in_ep;
+    mtp->ep_data[MTP_IN_EP_IDX].ep_cb = usbd_mtp_bulk_in;
 
     //EVENT 通道
-    mtp_ep_data[MTP_INT_EP_IDX].ep_addr = int_ep;
-    mtp_ep_data[MTP_INT_EP_IDX].ep_cb = NULL;
+    mtp->ep_data[MTP_INT_EP_IDX].ep_addr = int_ep;
+    mtp->ep_data[MTP_INT_EP_IDX].ep_cb = NULL;
 
-    usbd_add_endpoint(0, &mtp_ep_data[MTP_OUT_EP_IDX]);
-    usbd_add_endpoint(0, &mtp_ep_data[MTP_IN_EP_IDX]);
-    usbd_add_endpoint(0, &mtp_ep_data[MTP_INT_EP_IDX]);
+    usbd_add_endpoint(busid, &mtp->ep_data[MTP_OUT_EP_IDX]);
+    usbd_add_endpoint(busid, &mtp->ep_data[MTP_IN_EP_IDX]);
+    usbd_add_endpoint(busid, &mtp->ep_data[MTP_INT_EP_IDX]);
 
-    s_mtp_status = USB_MTP_STOPPING;
+    usbd_ep_queue_init(&mtp->out_q, busid, out_ep, MTP_BULK_EP_MPS);
+    usbd_ep_queue_init(&mtp->in_q, busid, in_ep, MTP_BULK_EP_MPS);
+    mtp->out_xfer_idx = 0;
+    mtp->in_xfer_idx = 0;
+
+    if (warm) {
+        //引擎任务仍在等待启动，CONFIGURED 事件到来后即可继续
+        return intf;
+    }
+
+    mtp->status = USB_MTP_STOPPING;
+    mtp->keep_on_deinit = mtp_config ? mtp_config->keep_on_deinit : false;
 
     esp_mtp_config_t config = {
+        .pipe_context = mtp,
         .wait_start = usb_wait_start,
         .read = usb_read,
         .write = usb_write,
-        .flags = ESP_MTP_FLAG_ASYNC_READ | ESP_MTP_FLAG_ASYNC_WRITE,
+        .closed = usb_closed,
+        .flags = ESP_MTP_FLAG_ASYNC_READ | ESP_MTP_FLAG_ASYNC_WRITE | ESP_MTP_FLAG_QUEUED_WRITE,
         .buffer_size = 4096,
     };
+    if (mtp_config) {
+        if (mtp_config->buffer_size) {
+            config.buffer_size = mtp_config->buffer_size;
+        }
+        config.base_path = mtp_config->base_path;
+        config.storage_description = mtp_config->storage_description;
+        config.task_priority = mtp_config->task_priority;
+        config.buffer = mtp_config->buffer;
+        config.task_buffer = mtp_config->task_buffer;
+        config.task_stack = mtp_config->task_stack;
+        config.task_stack_size = mtp_config->task_stack_size;
+    }
 #ifndef CONFIG_USB_HS
     config.flags |= ESP_MTP_FLAG_USB_FS;
 #else
     config.flags |= ESP_MTP_FLAG_USB_HS;
 #endif
 
-    s_handle = esp_mtp_init(&config);
+    mtp->handle = esp_mtp_init(&config);
+    if (mtp->handle == NULL) {
+        mtp->status = USB_MTP_CLOSE;
+        mtp->intf = NULL;
+        return NULL;
+    }
 
-    s_mtp_task_handle = esp_mtp_get_task_handle(s_handle);
+    mtp->task_handle = esp_mtp_get_task_handle(mtp->handle);
 
     return intf;
 }
 
-void usbd_mtp_deinit(void)
+static void mtp_park(usb_mtp_instance_t *mtp)
 {
     usb_mtp_status_t mtp_status;
-    portENTER_CRITICAL(&s_spinlock);
-    mtp_status = s_mtp_status;
-    s_mtp_status = USB_MTP_CLOSE;
-    portEXIT_CRITICAL(&s_spinlock);
+    portENTER_CRITICAL(&mtp->spinlock);
+    mtp_status = mtp->status;
+    if (mtp_status == USB_MTP_RUN) {
+        mtp->status = USB_MTP_STOPPING;
+    }
+    portEXIT_CRITICAL(&mtp->spinlock);
     if (mtp_status == USB_MTP_RUN) {
-        esp_mtp_read_async_cb(s_handle, ESP_MTP_EXIT_CMD);
-    } else if (mtp_status == USB_MTP_INIT) {
-        xTaskNotifyGive(s_mtp_task_handle);
+        esp_mtp_read_async_cb(mtp->handle, ESP_MTP_STOP_CMD);
+    }
+    mtp->parked = true;
+}
+
+void usbd_mtp_deinit(struct usbd_interface *intf)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp == NULL || mtp->parked) {
+        return;
+    }
+    if (mtp->keep_on_deinit) {
+        mtp_park(mtp);
+        return;
+    }
+    usbd_mtp_release(intf);
+}
+
+void usbd_mtp_release(struct usbd_interface *intf)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp == NULL) {
+        return;
     }
-}
\ No newline at end of file
+    usb_mtp_status_t mtp_status;
+    //之后同一接口的 init 另取槽位；handle 与槽位保留到引擎任务退出(usb_closed)
+    portENTER_CRITICAL(&s_instances_lock);
+    mtp->closing = true;
+    portEXIT_CRITICAL(&s_instances_lock);
+    portENTER_CRITICAL(&mtp->spinlock);
+    mtp_status = mtp->status;
+    mtp->status = USB_MTP_CLOSE;
+    portEXIT_CRITICAL(&mtp->spinlock);
+    if (mtp_status == USB_MTP_INIT) {
+        xTaskNotifyGive(mtp->task_handle);
+        return;
+    }
+    //挂起的传输按 EXIT 完成；没有挂起的读时单独投递 EXIT，停止中的引擎也会在下次读写时看到 CLOSE
+    bool read_pending = !usbd_ep_queue_idle(&mtp->out_q);
+    //总线仍在时端点可能已布防，先关闭端点使控制器不再访问缓冲区，再把传输交还引擎
+    usbd_ep_close(mtp->out_q.busid, mtp->out_q.ep);
+    usbd_ep_close(mtp->in_q.busid, mtp->in_q.ep);
+    usbd_ep_queue_flush(&mtp->out_q);
+    usbd_ep_queue_flush(&mtp->in_q);
+    if (mtp_status == USB_MTP_RUN && !read_pending) {
+        esp_mtp_read_async_cb(mtp->handle, ESP_MTP_EXIT_CMD);
+    }
+}
+
+uint32_t usbd_mtp_add_virtual_object(struct usbd_interface *intf, const esp_mtp_virtual_object_t *object)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp == NULL) {
+        return 0;
+    }
+    return esp_mtp_add_virtual_object(mtp->handle, object);
+}
+
+void usbd_mtp_remove_virtual_object(struct usbd_interface *intf, uint32_t object_handle)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp) {
+        esp_mtp_remove_virtual_object(mtp->handle, object_handle);
+    }
+}
+
+esp_err_t usbd_mtp_get_op_stats(struct usbd_interface *intf, uint16_t opcode, esp_mtp_op_stats_t *stats)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return esp_mtp_get_op_stats(mtp->handle, opcode, stats);
+}
+
+void usbd_mtp_reset_stats(struct usbd_interface *intf)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp) {
+        esp_mtp_reset_stats(mtp->handle);
+    }
+}
+
+void usbd_mtp_dump_stats(struct usbd_interface *intf, FILE *stream)
+{
+    usb_mtp_instance_t *mtp = mtp_find_instance_by_intf(intf);
+    if (mtp) {
+        esp_mtp_dump_stats(mtp->handle, stream);
+    }
+}
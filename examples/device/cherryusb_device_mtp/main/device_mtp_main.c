@@ -5,10 +5,13 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
 #include "usbd_core.h"
 #include "usb_mtp.h"
@@ -139,24 +142,133 @@ void usbd_event_handler(uint8_t busid, uint8_t event)
 
 struct usbd_interface intf0;
 
+/*
+ * 虚拟对象示例：heap_info.txt 的内容不经过 SD 卡，由回调直接填入传输缓冲区。
+ * 内容只在接口未运行时生成快照，同一句柄的 GetObjectInfo 与 GetObject 看到的大小和字节一致。
+ */
+static char s_heap_info[96];
+static uint32_t s_heap_info_len;
+
+static void heap_info_snapshot(void)
+{
+    int len = snprintf(s_heap_info, sizeof(s_heap_info), "free: %"PRIu32"\nminimum free: %"PRIu32"\n",
+                       esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+    s_heap_info_len = len < sizeof(s_heap_info) ? len : sizeof(s_heap_info) - 1;
+}
+
+static uint32_t heap_info_get_size(void *user_ctx)
+{
+    return s_heap_info_len;
+}
+
+static int heap_info_produce(void *user_ctx, uint32_t offset, uint8_t *buffer, uint32_t len)
+{
+    if (offset + len > s_heap_info_len) {
+        return 0;
+    }
+    memcpy(buffer, s_heap_info + offset, len);
+    return len;
+}
+
+static const esp_mtp_virtual_object_t s_heap_info_object = {
+    .name = "heap_info.txt",
+    .get_size = heap_info_get_size,
+    .produce = heap_info_produce,
+};
+
+#define MTP_BUFFER_SIZE 4096
+
+/* 静态分配 MTP 引擎，反复 deinit/init 不占用堆 */
+static uint8_t s_mtp_buffer[USBD_MTP_STATIC_BUFFER_LEN(MTP_BUFFER_SIZE)] __attribute__((aligned(4)));
+static StaticTask_t s_mtp_task_buffer;
+static StackType_t s_mtp_task_stack[4096];
+
+static const usbd_mtp_config_t s_mtp_config = {
+    .buffer_size = MTP_BUFFER_SIZE,
+    .keep_on_deinit = true,
+    .buffer = s_mtp_buffer,
+    .task_buffer = &s_mtp_task_buffer,
+    .task_stack = s_mtp_task_stack,
+    .task_stack_size = sizeof(s_mtp_task_stack),
+};
+
+#if CONFIG_EXAMPLE_MTP_UPLOAD_BENCH
+#define MTP_OPERATION_SEND_OBJECT_INFO  0x100C
+#define UPLOAD_BENCH_POLL_MS            100
+#define UPLOAD_BENCH_IDLE_MS            2000
+
+/*
+ * 上传测速：文件数据在 SendObjectInfo 中一并接收，每上传一个文件计数加一。
+ * 计数停止增长 UPLOAD_BENCH_IDLE_MS 后视为一批结束并输出结果，墙钟起点取首次看到计数时减去已耗时间，
+ * 误差约 UPLOAD_BENCH_POLL_MS，批量越大越准。每批只拷贝同一大小的文件即可得到该大小的每秒文件数。
+ */
+static void upload_bench_run(void)
+{
+    esp_mtp_op_stats_t stats;
+    uint32_t last_count = 0;
+    int64_t first_us = 0;
+    int64_t last_us = 0;
+
+    usbd_mtp_reset_stats(&intf0);
+    while (1) {
+        vTaskDelay(UPLOAD_BENCH_POLL_MS / portTICK_PERIOD_MS);
+        if (usbd_mtp_get_op_stats(&intf0, MTP_OPERATION_SEND_OBJECT_INFO, &stats) != ESP_OK) {
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        if (stats.count != last_count) {
+            if (last_count == 0) {
+                first_us = now - stats.total_us;
+            }
+            last_count = stats.count;
+            last_us = now;
+            continue;
+        }
+        if (last_count == 0 || now - last_us < UPLOAD_BENCH_IDLE_MS * 1000) {
+            continue;
+        }
+        int64_t wall_us = last_us - first_us;
+        // bytes 只含文件内容，不含容器头、ObjectInfo 数据集、命令及响应
+        ESP_LOGI(TAG, "upload %"PRIu32" files, %"PRIu64" bytes/file: %.1f files/s, %.1f files/s in SendObjectInfo, %.2f MB/s",
+                 stats.count, stats.bytes / stats.count,
+                 wall_us > 0 ? stats.count * 1000000.0 / wall_us : 0.0,
+                 stats.total_us ? stats.count * 1000000.0 / stats.total_us : 0.0,
+                 wall_us > 0 ? (double)stats.bytes / wall_us : 0.0);
+        usbd_mtp_dump_stats(&intf0, stdout);
+        usbd_mtp_reset_stats(&intf0);
+        last_count = 0;
+    }
+}
+#endif
+
 void app_main(void)
 {
     void sd_main(void);
     sd_main();
     uint32_t before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
     usbd_desc_register(0, mtp_descriptor);
-    usbd_add_interface(0, usbd_mtp_init_intf(&intf0, CDC_OUT_EP, CDC_IN_EP, CDC_INT_EP));
+    usbd_add_interface(0, usbd_mtp_init_intf(0, &intf0, CDC_OUT_EP, CDC_IN_EP, CDC_INT_EP, &s_mtp_config));
+    heap_info_snapshot();
+    usbd_mtp_add_virtual_object(&intf0, &s_heap_info_object);
     usbd_initialize(0, ESP_USBD_BASE, usbd_event_handler);
+#if CONFIG_EXAMPLE_MTP_UPLOAD_BENCH
+    upload_bench_run();
+#endif
     while (1){
         vTaskDelay(10000 / portTICK_PERIOD_MS);
-        usbd_mtp_deinit();
+        usbd_mtp_deinit(&intf0);
         usbd_deinitialize(0);
         vTaskDelay(500 / portTICK_PERIOD_MS);
         uint32_t now;
         now = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
         ESP_LOGW(TAG, "use %"PRIu32, before - now);
+        // 接口停止期间刷新快照，主机重新连接后读到新内容
+        heap_info_snapshot();
+        // keep_on_deinit 时实例及虚拟对象保留，重新注册接口即可
+        int64_t start = esp_timer_get_time();
         usbd_desc_register(0, mtp_descriptor);
-        usbd_add_interface(0, usbd_mtp_init_intf(&intf0, CDC_OUT_EP, CDC_IN_EP, CDC_INT_EP));
+        usbd_add_interface(0, usbd_mtp_init_intf(0, &intf0, CDC_OUT_EP, CDC_IN_EP, CDC_INT_EP, &s_mtp_config));
         usbd_initialize(0, ESP_USBD_BASE, usbd_event_handler);
+        ESP_LOGI(TAG, "reinit %"PRId64" us", esp_timer_get_time() - start);
     }
-}
\ No newline at end of file
+}
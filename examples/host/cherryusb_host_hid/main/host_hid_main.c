@@ -10,11 +10,43 @@
 
 #include "usbh_core.h"
 #include "usbh_hid.h"
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+#include "usbh_dispatch.h"
+#endif
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+#include "usbh_urb_queue.h"
+#endif
 
 static char *TAG = "host_main";
 
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t hid_buffer[128];
 
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+#define HID_URB_NUM         2
+#define HID_URB_BUFFER_LEN  64
+
+typedef struct hid_in_queue hid_in_queue_t;
+
+typedef struct {
+    struct usbh_urb urb;
+    hid_in_queue_t *owner;
+} hid_in_urb_t;
+
+/*
+ * Two URBs per interrupt IN endpoint: when a report arrives the queue has already armed the
+ * other one from the interrupt, so a slow callback does not make the device wait for a poll.
+ */
+struct hid_in_queue {
+    usbh_urb_queue_t queue;
+    struct usbh_hid *hid_class;
+    volatile bool stopping;
+    hid_in_urb_t in[HID_URB_NUM];
+};
+
+static hid_in_queue_t s_hid_in[CONFIG_USBHOST_MAX_HID_CLASS];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t hid_queue_buffer[CONFIG_USBHOST_MAX_HID_CLASS][HID_URB_NUM][HID_URB_BUFFER_LEN];
+#endif
+
 /**
  * @brief Key event
  */
@@ -197,7 +229,7 @@ static inline bool key_found(const uint8_t *const src,
 
 static void usbh_hid_keyboard_report_callback(void *arg, int nbytes)
 {
-    struct usb_hid_kbd_report *kb_report = (struct usb_hid_kbd_report *)hid_buffer;
+    struct usb_hid_kbd_report *kb_report = (struct usb_hid_kbd_report *)arg;
     if(nbytes < sizeof(struct usb_hid_kbd_report)){
         return;
     }
@@ -230,7 +262,7 @@ static void usbh_hid_keyboard_report_callback(void *arg, int nbytes)
 
 static void usbh_hid_mouse_report_callback(void *arg, int nbytes)
 {
-    struct usb_hid_mouse_report *mouse_report = (struct usb_hid_mouse_report *)hid_buffer;
+    struct usb_hid_mouse_report *mouse_report = (struct usb_hid_mouse_report *)arg;
     if(nbytes < sizeof(struct usb_hid_mouse_report)){
         return;
     }
@@ -251,20 +283,14 @@ static void usbh_hid_mouse_report_callback(void *arg, int nbytes)
 static void usbh_hid_generic_report_callback(void *arg, int nbytes)
 {
     for (size_t i = 0; i < nbytes; i++) {
-        USB_LOG_RAW("0x%02x ", hid_buffer[i]);
+        USB_LOG_RAW("0x%02x ", ((uint8_t *)arg)[i]);
     }
     USB_LOG_RAW("nbytes:%d\r\n", nbytes);
 }
 
-static void usbh_hid_report_callback(void *arg, int nbytes)
+// The report callbacks above get the report buffer as their argument
+static void usbh_hid_report_handle(struct usbh_hid *hid_class, uint8_t *report, int nbytes)
 {
-    struct usbh_hid *hid_class = (struct usbh_hid *)arg;
-    if(nbytes <= 0){
-        if(nbytes == -USB_ERR_NAK){
-            usbh_submit_urb(&hid_class->intin_urb);
-        }
-        return;
-    }
     uint8_t sub_class = hid_class->hport->config.intf[hid_class->intf].altsetting[0].intf_desc.bInterfaceSubClass;
     uint8_t protocol = hid_class->hport->config.intf[hid_class->intf].altsetting[0].intf_desc.bInterfaceProtocol;
 
@@ -276,10 +302,61 @@ static void usbh_hid_report_callback(void *arg, int nbytes)
             complete_cb = usbh_hid_mouse_report_callback;
         }
     }
-    complete_cb(arg, nbytes);
+    complete_cb(report, nbytes);
+}
+
+static void usbh_hid_report_callback(void *arg, int nbytes)
+{
+    struct usbh_hid *hid_class = (struct usbh_hid *)arg;
+    if(nbytes <= 0){
+        if(nbytes == -USB_ERR_NAK){
+            usbh_submit_urb(&hid_class->intin_urb);
+        }
+        return;
+    }
+    usbh_hid_report_handle(hid_class, hid_buffer, nbytes);
     usbh_submit_urb(&hid_class->intin_urb);
 }
 
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+static void usbh_hid_queue_callback(void *arg, int nbytes)
+{
+    hid_in_urb_t *in = (hid_in_urb_t *)arg;
+    hid_in_queue_t *q = in->owner;
+
+    if (nbytes > 0) {
+        usbh_hid_report_handle(q->hid_class, in->urb.transfer_buffer, nbytes);
+    } else if (q->stopping || (nbytes != -USB_ERR_NAK && nbytes != -USB_ERR_SHUTDOWN)) {
+        return;
+    }
+    // A NAK stops the queue and completes the URB behind it with -USB_ERR_SHUTDOWN, both go back in
+    usbh_urb_queue_submit(&q->queue, &in->urb);
+}
+
+static int usbh_hid_queue_start(struct usbh_hid *hid_class)
+{
+    hid_in_queue_t *q = &s_hid_in[hid_class->minor];
+    uint16_t mps = hid_class->intin->wMaxPacketSize;
+    int ret;
+
+    if (mps > HID_URB_BUFFER_LEN) {
+        mps = HID_URB_BUFFER_LEN;
+    }
+    usbh_urb_queue_init(&q->queue);
+    q->hid_class = hid_class;
+    q->stopping = false;
+    for (int i = 0; i < HID_URB_NUM; i++) {
+        q->in[i].owner = q;
+        usbh_int_urb_fill(&q->in[i].urb, hid_class->hport, hid_class->intin, hid_queue_buffer[hid_class->minor][i], mps, 0, usbh_hid_queue_callback, &q->in[i]);
+        ret = usbh_urb_queue_submit(&q->queue, &q->in[i].urb);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+#endif
+
 static void usbh_hid_thread(void *argument)
 {
     int ret;
@@ -304,8 +381,12 @@ static void usbh_hid_thread(void *argument)
         goto delete;
     }
 
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+    ret = usbh_hid_queue_start(hid_class);
+#else
     usbh_int_urb_fill(&hid_class->intin_urb, hid_class->hport, hid_class->intin, hid_buffer, hid_class->intin->wMaxPacketSize, 0, usbh_hid_report_callback, hid_class);
     ret = usbh_submit_urb(&hid_class->intin_urb);
+#endif
     if (ret < 0) {
         goto delete;
     }
@@ -322,6 +403,15 @@ void usbh_hid_run(struct usbh_hid *hid_class)
 
 void usbh_hid_stop(struct usbh_hid *hid_class)
 {
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+    // The class driver only kills its own intin_urb on disconnect
+    hid_in_queue_t *q = &s_hid_in[hid_class->minor];
+    if (q->hid_class == hid_class) {
+        q->stopping = true;
+        usbh_urb_queue_kill(&q->queue);
+        q->hid_class = NULL;
+    }
+#endif
 }
 
 
@@ -352,4 +442,32 @@ void app_main()
     // Initialize the USB driver and CDC interface
     usbh_initialize(0, ESP_USBH_BASE);
     ESP_LOGI(TAG, "usb host init done");
+
+#ifdef CONFIG_CHERRYUSBH_COMPLETION_TASK
+    // The report callbacks above log, so they run in the completion task instead of the interrupt
+    while (1) {
+        usbh_dispatch_stats_t stats;
+        vTaskDelay(pdMS_TO_TICKS(10000));
+        usbh_dispatch_get_stats(&stats);
+        if (stats.isr_count == 0 || stats.deferred == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "isr: %u, avg %u max %u cycles; callbacks: %u in %u wakeups (max %u), latency avg %u max %u us",
+                 (unsigned)stats.isr_count, (unsigned)(stats.isr_total_cycles / stats.isr_count), (unsigned)stats.isr_max_cycles,
+                 (unsigned)stats.deferred, (unsigned)stats.wakeups, (unsigned)stats.max_batch,
+                 (unsigned)(stats.latency_total_us / stats.deferred), (unsigned)stats.latency_max_us);
+        usbh_dispatch_reset_stats();
+#ifdef CONFIG_CHERRYUSBH_URB_QUEUE
+        for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++) {
+            usbh_urb_queue_stats_t queue_stats;
+            if (s_hid_in[i].hid_class == NULL) {
+                continue;
+            }
+            usbh_urb_queue_get_stats(&s_hid_in[i].queue, &queue_stats);
+            ESP_LOGI(TAG, "input%d: %u reports, %u URBs submitted from the interrupt", i,
+                     (unsigned)queue_stats.completed, (unsigned)queue_stats.chained);
+        }
+#endif
+    }
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,305 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "dwc2_fifo_plan.h"
+
+#define LO(x) ((x) & 0xff)
+#define HI(x) (((x) >> 8) & 0xff)
+
+#define DEVICE_DESC() \
+    18, 0x01, 0x00, 0x02, 0xef, 0x02, 0x01, 0x40, 0xfc, 0x303a & 0xff, 0x03, 0x40, 0x00, 0x01, 0x01, 0x02, 0x03, 0x01
+#define CONFIG_DESC(total, intf_num) \
+    9, 0x02, LO(total), HI(total), (intf_num), 0x01, 0x00, 0x80, 0x32
+#define INTF_DESC(num, alt, ep_num) \
+    9, 0x04, (num), (alt), (ep_num), 0xff, 0x00, 0x00, 0x00
+#define EP_DESC(addr, type, mps, interval) \
+    7, 0x05, (addr), (type), LO(mps), HI(mps), (interval)
+#define STRING_DESC_LANGID() \
+    4, 0x03, 0x09, 0x04
+
+#define EP_ISO  0x01
+#define EP_BULK 0x02
+#define EP_INT  0x03
+
+static const dwc2_fifo_plan_limits_t s_limits = {
+    .total_words = 800 / 4,
+    .tx_fifo_num = 5,
+    .ep0_mps = 64,
+};
+
+static int s_failures;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);         \
+            s_failures++;                                                    \
+        }                                                                    \
+    } while (0)
+
+static uint32_t plan_total(const struct dwc2_fifo_plan *plan)
+{
+    uint32_t total = plan->rx_words;
+    for (int i = 0; i < DWC2_FIFO_PLAN_TX_NUM; i++) {
+        total += plan->tx_words[i];
+    }
+    return total;
+}
+
+static int run_plan(const char *name, const uint8_t *desc, uint32_t len, struct dwc2_fifo_plan *plan)
+{
+    int ret = dwc2_fifo_plan(desc, len, &s_limits, plan);
+    printf("%s: %s\n", name, ret == 0 ? "ok" : "no fit");
+    if (ret == 0) {
+        dwc2_fifo_plan_dump(plan, stdout);
+        CHECK(plan_total(plan) == s_limits.total_words);
+        CHECK(plan->tx_words[0] >= 16);
+    }
+    return ret;
+}
+
+/* CDC ACM: interrupt IN 0x83/8, bulk OUT 0x02/64, bulk IN 0x81/64, followed by a string descriptor */
+static void test_cdc_acm(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 7 + 9 + 7 + 7, 2),
+        INTF_DESC(0, 0, 1),
+        EP_DESC(0x83, EP_INT, 8, 0x10),
+        INTF_DESC(1, 0, 2),
+        EP_DESC(0x02, EP_BULK, 64, 0),
+        EP_DESC(0x81, EP_BULK, 64, 0),
+        STRING_DESC_LANGID(),
+        0x00
+    };
+    struct dwc2_fifo_plan plan;
+
+    CHECK(run_plan("cdc_acm", desc, sizeof(desc), &plan) == 0);
+    CHECK(plan.tx_words[1] == 2 * 64 / 4);  // bulk IN double buffered
+    CHECK(plan.tx_words[3] == 8 / 4);       // interrupt IN single packet
+    CHECK(plan.tx_words[2] == 0);
+    CHECK(plan.rx_words >= 10 + 2 * (64 / 4 + 1) + 2 * 2 + 1);
+}
+
+/* Four bulk IN endpoints all get two packets, RX still gets double buffering */
+static void test_four_bulk_in(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 5 * 7, 1),
+        INTF_DESC(0, 0, 5),
+        EP_DESC(0x01, EP_BULK, 64, 0),
+        EP_DESC(0x81, EP_BULK, 64, 0),
+        EP_DESC(0x82, EP_BULK, 64, 0),
+        EP_DESC(0x83, EP_BULK, 64, 0),
+        EP_DESC(0x84, EP_BULK, 64, 0),
+        0x00
+    };
+    struct dwc2_fifo_plan plan;
+
+    CHECK(run_plan("four_bulk_in", desc, sizeof(desc), &plan) == 0);
+    for (int i = 1; i <= 4; i++) {
+        CHECK(plan.tx_words[i] == 2 * 64 / 4);
+    }
+    CHECK(plan.rx_words >= 10 + 2 * (64 / 4 + 1) + 2 * 2 + 1);
+}
+
+/* Isochronous endpoints in alternate setting 1 only: sized by their largest packet, iso IN wins over RX double buffering */
+static void test_iso_alt_setting(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 9 + 7 + 9 + 9 + 7, 2),
+        INTF_DESC(0, 0, 0),
+        INTF_DESC(0, 1, 1),
+        EP_DESC(0x81, EP_ISO, 192, 1),
+        INTF_DESC(1, 0, 0),
+        INTF_DESC(1, 1, 1),
+        EP_DESC(0x02, EP_ISO, 192, 1),
+        0x00
+    };
+    struct dwc2_fifo_plan plan;
+
+    CHECK(run_plan("iso_alt_setting", desc, sizeof(desc), &plan) == 0);
+    CHECK(plan.tx_words[1] == 2 * 192 / 4);
+    CHECK(plan.rx_words >= 10 + (192 / 4 + 1) + 2 * 2 + 1);
+}
+
+/* Same endpoint declared with a larger packet in a later alternate setting */
+static void test_alt_setting_max_mps(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 7 + 9 + 7, 1),
+        INTF_DESC(0, 0, 1),
+        EP_DESC(0x81, EP_INT, 16, 1),
+        INTF_DESC(0, 1, 1),
+        EP_DESC(0x81, EP_INT, 64, 1),
+        0x00
+    };
+    struct dwc2_fifo_plan plan;
+
+    CHECK(run_plan("alt_setting_max_mps", desc, sizeof(desc), &plan) == 0);
+    CHECK(plan.tx_words[1] == 64 / 4);
+}
+
+/* IN endpoint 5 has no TX FIFO on this controller */
+static void test_in_endpoint_out_of_range(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 7, 1),
+        INTF_DESC(0, 0, 1),
+        EP_DESC(0x85, EP_BULK, 64, 0),
+        0x00
+    };
+    struct dwc2_fifo_plan plan = { 0 };
+
+    CHECK(run_plan("in_endpoint_out_of_range", desc, sizeof(desc), &plan) != 0);
+    CHECK(plan.rx_words == 0);  // untouched on failure
+}
+
+/* A single 1023 byte isochronous packet does not fit at all */
+static void test_does_not_fit(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 7, 1),
+        INTF_DESC(0, 0, 1),
+        EP_DESC(0x81, EP_ISO, 1023, 1),
+        0x00
+    };
+    struct dwc2_fifo_plan plan;
+
+    CHECK(run_plan("does_not_fit", desc, sizeof(desc), &plan) != 0);
+}
+
+/* Truncated blob: parsing stops at len instead of reading past it */
+static void test_truncated(void)
+{
+    static const uint8_t desc[] = {
+        DEVICE_DESC(),
+        CONFIG_DESC(9 + 9 + 7, 1),
+        INTF_DESC(0, 0, 1),
+        EP_DESC(0x81, EP_BULK, 64, 0),
+    };
+    struct dwc2_fifo_plan plan;
+
+    CHECK(run_plan("truncated", desc, sizeof(desc) - 7, &plan) == 0);
+    CHECK(plan.tx_words[1] == 0);
+}
+
+/* ---------------- host mode ---------------- */
+
+#define HOST_TOTAL_WORDS (800 / 4)
+
+static uint32_t host_plan_total(const struct dwc2_host_fifo_plan *plan)
+{
+    return plan->rx_words + plan->nptx_words + plan->ptx_words;
+}
+
+static int run_host_plan(const char *name, const dwc2_fifo_plan_ep_t *eps, uint32_t ep_num, struct dwc2_host_fifo_plan *plan)
+{
+    int ret = dwc2_host_fifo_plan(eps, ep_num, HOST_TOTAL_WORDS, plan);
+    printf("host %s: %s\n", name, ret == 0 ? "ok" : "no fit");
+    if (ret == 0) {
+        dwc2_host_fifo_plan_dump(plan, stdout);
+        CHECK(host_plan_total(plan) == HOST_TOTAL_WORDS);
+        CHECK(plan->nptx_words >= 64 / 4);  // EP0
+        CHECK(plan->ptx_words >= 16);
+    }
+    return ret;
+}
+
+/* Keyboard: a single 8 byte interrupt IN endpoint, nothing to double buffer */
+static void test_host_keyboard(void)
+{
+    static const dwc2_fifo_plan_ep_t eps[] = {
+        { 0x81, EP_INT, 8 },
+    };
+    struct dwc2_host_fifo_plan plan;
+
+    CHECK(run_host_plan("keyboard", eps, 1, &plan) == 0);
+    CHECK(plan.nptx_words == 16);
+    CHECK(plan.ptx_words == 16);
+}
+
+/* MSC stick behind a hub: RX and non-periodic TX both double buffered */
+static void test_host_msc_behind_hub(void)
+{
+    static const dwc2_fifo_plan_ep_t eps[] = {
+        { 0x81, EP_INT, 1 },    // hub status change
+        { 0x81, EP_BULK, 64 },
+        { 0x02, EP_BULK, 64 },
+    };
+    struct dwc2_host_fifo_plan plan;
+
+    CHECK(run_host_plan("msc_behind_hub", eps, 3, &plan) == 0);
+    CHECK(plan.rx_words >= 2 * (64 / 4) + 2 + 2);
+    CHECK(plan.nptx_words == 2 * 64 / 4);
+    // Fixed split in usb_config.h leaves RX with (200 - 60 - 60) / 4 words
+    CHECK(plan.rx_words > (200 - 240 / 4 - 240 / 4) / 4);
+}
+
+/* USB audio: isochronous IN wins the second RX packet, isochronous OUT keeps one packet */
+static void test_host_audio(void)
+{
+    static const dwc2_fifo_plan_ep_t eps[] = {
+        { 0x81, EP_ISO, 192 },
+        { 0x02, EP_ISO, 192 },
+    };
+    struct dwc2_host_fifo_plan plan;
+
+    CHECK(run_host_plan("audio", eps, 2, &plan) == 0);
+    CHECK(plan.rx_words >= 2 * (192 / 4) + 2 + 1);
+    CHECK(plan.ptx_words == 192 / 4);
+}
+
+/* Out-only bulk device: spare room goes to the non-periodic TX FIFO */
+static void test_host_bulk_out_only(void)
+{
+    static const dwc2_fifo_plan_ep_t eps[] = {
+        { 0x01, EP_BULK, 64 },
+    };
+    struct dwc2_host_fifo_plan plan;
+
+    CHECK(run_host_plan("bulk_out_only", eps, 1, &plan) == 0);
+    CHECK(plan.rx_words == 64 / 4 + 1 + 1 + 1);
+    CHECK(plan.nptx_words > 2 * 64 / 4);
+}
+
+/* A 1023 byte isochronous packet does not fit next to the TX FIFOs */
+static void test_host_does_not_fit(void)
+{
+    static const dwc2_fifo_plan_ep_t eps[] = {
+        { 0x81, EP_ISO, 1023 },
+    };
+    struct dwc2_host_fifo_plan plan = { 0 };
+
+    CHECK(run_host_plan("does_not_fit", eps, 1, &plan) != 0);
+    CHECK(plan.rx_words == 0);
+}
+
+int main(void)
+{
+    test_cdc_acm();
+    test_four_bulk_in();
+    test_iso_alt_setting();
+    test_alt_setting_max_mps();
+    test_in_endpoint_out_of_range();
+    test_does_not_fit();
+    test_truncated();
+    test_host_keyboard();
+    test_host_msc_behind_hub();
+    test_host_audio();
+    test_host_bulk_out_only();
+    test_host_does_not_fit();
+    printf("%d failure(s)\n", s_failures);
+    return s_failures ? 1 : 0;
+}
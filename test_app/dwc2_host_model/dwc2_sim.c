@@ -0,0 +1,532 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dwc2_sim.h"
+
+#define REG(offset)                 s_sim.regs[(offset) / 4]
+
+/* Full speed: 12 Mbit/s */
+#define FS_BIT_NS(bits)             ((uint64_t)(bits) * 1000 / 12)
+/* Token, data packet with sync/PID/CRC, handshake and the two inter-packet gaps */
+#define XACT_DATA_NS(len)           FS_BIT_NS(32 + ((len) + 3) * 8 + 16 + 2 * 16)
+#define XACT_NAK_NS                 FS_BIT_NS(32 + 16 + 16)
+#define FRAME_NS                    1000000ULL
+/* AHB master moving the packet between FIFO and DRAM, 32 bits per 80 MHz cycle */
+#define DMA_NS(len)                 (200 + (uint64_t)(len) * 125 / 40)
+/* Simulated CPU time taken away from the bus by each interrupt entry */
+#define IRQ_LATENCY_NS              2000
+/* RX FIFO entry per packet: data plus the status words */
+#define RX_ENTRY_BYTES(mps)         ((mps) + 8)
+#define IRQ_STORM_LIMIT             16
+
+#define GINTSTS_W1C                 (DWC2_GINTSTS_SOF | DWC2_GINTSTS_DISCINT | (1UL << 1))
+#define HPRT_RW                     (DWC2_HPRT_PRST | DWC2_HPRT_PPWR)
+
+typedef struct {
+    uint64_t ready_ns;      // NAKed non-periodic channels retry from here
+    uint32_t last_frame;    // periodic channels get one transaction per frame
+} sim_channel_t;
+
+static struct {
+    uint32_t regs[DWC2_SIM_REG_SPACE / 4];
+    dwc2_sim_peer_t *peer;
+    uint64_t now_ns;
+    uint64_t next_sof_ns;
+    uint64_t deadline_ns;       // idle time is not skipped past this, 0 for none
+    uint32_t frame;
+    sim_channel_t ch[DWC2_SIM_CHANNEL_NUM];
+    uint32_t rr;
+    void (*irq_handler)(void *arg);
+    void *irq_arg;
+    bool in_irq;
+    size_t dram_used;
+    dwc2_sim_stats_t stats;
+    uint8_t dram[DWC2_SIM_DRAM_SIZE] __attribute__((aligned(4)));
+} s_sim;
+
+static uint64_t cpu_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void core_reset(void)
+{
+    memset(s_sim.regs, 0, sizeof(s_sim.regs));
+    memset(s_sim.ch, 0, sizeof(s_sim.ch));
+    for (int ch = 0; ch < DWC2_SIM_CHANNEL_NUM; ch++) {
+        s_sim.ch[ch].last_frame = UINT32_MAX;
+    }
+    REG(DWC2_GRSTCTL) = DWC2_GRSTCTL_AHBIDL;
+    REG(DWC2_GSNPSID) = 0x4f54400a;
+    REG(DWC2_GRXFSIZ) = DWC2_SIM_FIFO_TOTAL_WORDS;
+    REG(DWC2_GNPTXFSIZ) = (DWC2_SIM_FIFO_TOTAL_WORDS << 16) | DWC2_SIM_FIFO_TOTAL_WORDS;
+    REG(DWC2_HPTXFSIZ) = (DWC2_SIM_FIFO_TOTAL_WORDS << 16) | (2 * DWC2_SIM_FIFO_TOTAL_WORDS);
+    if (s_sim.peer) {
+        REG(DWC2_HPRT) = DWC2_HPRT_PCSTS | DWC2_HPRT_PCDET;
+    }
+}
+
+void dwc2_sim_reset(void)
+{
+    s_sim.peer = NULL;
+    s_sim.now_ns = 0;
+    s_sim.next_sof_ns = FRAME_NS;
+    s_sim.frame = 0;
+    s_sim.rr = 0;
+    s_sim.in_irq = false;
+    s_sim.dram_used = 0;
+    memset(&s_sim.stats, 0, sizeof(s_sim.stats));
+    core_reset();
+}
+
+void dwc2_sim_attach(dwc2_sim_peer_t *peer)
+{
+    s_sim.peer = peer;
+    REG(DWC2_HPRT) |= DWC2_HPRT_PCSTS | DWC2_HPRT_PCDET;
+}
+
+void dwc2_sim_detach(void)
+{
+    s_sim.peer = NULL;
+    REG(DWC2_HPRT) &= ~(DWC2_HPRT_PCSTS | DWC2_HPRT_PENA);
+    REG(DWC2_HPRT) |= DWC2_HPRT_PCDET | DWC2_HPRT_PENCHNG;
+    REG(DWC2_GINTSTS) |= DWC2_GINTSTS_DISCINT;
+}
+
+void dwc2_sim_set_irq_handler(void (*handler)(void *arg), void *arg)
+{
+    s_sim.irq_handler = handler;
+    s_sim.irq_arg = arg;
+}
+
+static uint32_t haint(void)
+{
+    uint32_t value = 0;
+
+    for (int ch = 0; ch < DWC2_SIM_CHANNEL_NUM; ch++) {
+        if (REG(DWC2_HCINT(ch)) & REG(DWC2_HCINTMSK(ch))) {
+            value |= 1UL << ch;
+        }
+    }
+    return value;
+}
+
+static uint32_t gintsts(void)
+{
+    uint32_t value = REG(DWC2_GINTSTS) | DWC2_GINTSTS_CMOD;
+
+    if (haint() & REG(DWC2_HAINTMSK)) {
+        value |= DWC2_GINTSTS_HCINT;
+    }
+    if (REG(DWC2_HPRT) & (DWC2_HPRT_PCDET | DWC2_HPRT_PENCHNG | DWC2_HPRT_POCCHNG)) {
+        value |= DWC2_GINTSTS_HPRTINT;
+    }
+    return value;
+}
+
+static uint32_t reg_offset(uint32_t addr)
+{
+    uint32_t offset = addr - DWC2_SIM_BASE;
+
+    if (addr < DWC2_SIM_BASE || offset >= DWC2_SIM_REG_SPACE || (offset & 3)) {
+        fprintf(stderr, "dwc2_sim: bad register access 0x%08x\n", (unsigned)addr);
+        abort();
+    }
+    return offset;
+}
+
+uint32_t dwc2_sim_readl(uint32_t addr)
+{
+    uint32_t offset = reg_offset(addr);
+
+    switch (offset) {
+    case DWC2_GINTSTS:
+        return gintsts();
+    case DWC2_HAINT:
+        return haint();
+    case DWC2_HFNUM:
+        return (s_sim.frame & 0x3fff) | (uint32_t)(((s_sim.next_sof_ns - s_sim.now_ns) / FS_BIT_NS(1)) << 16);
+    default:
+        return s_sim.regs[offset / 4];
+    }
+}
+
+static void channel_write_hcchar(int ch, uint32_t value)
+{
+    uint32_t prev = REG(DWC2_HCCHAR(ch));
+
+    if ((value & DWC2_HCCHAR_CHDIS) && (prev & DWC2_HCCHAR_CHENA)) {
+        REG(DWC2_HCCHAR(ch)) = value & ~(DWC2_HCCHAR_CHENA | DWC2_HCCHAR_CHDIS);
+        REG(DWC2_HCINT(ch)) |= DWC2_HCINT_CHH;
+        return;
+    }
+    REG(DWC2_HCCHAR(ch)) = value & ~DWC2_HCCHAR_CHDIS;
+    if ((value & DWC2_HCCHAR_CHENA) && !(prev & DWC2_HCCHAR_CHENA)) {
+        // A periodic channel re-armed in the frame it was just serviced waits for the next one
+        s_sim.ch[ch].ready_ns = s_sim.now_ns;
+    }
+}
+
+static void write_hprt(uint32_t value)
+{
+    uint32_t prev = REG(DWC2_HPRT);
+    uint32_t next = (prev & ~(value & DWC2_HPRT_W1C) & ~HPRT_RW) | (value & HPRT_RW);
+
+    if (value & DWC2_HPRT_PENA) {
+        // Writing PENA disables the port, like on silicon
+        next |= DWC2_HPRT_PENCHNG;
+    }
+    if ((prev & DWC2_HPRT_PRST) && !(value & DWC2_HPRT_PRST) && s_sim.peer) {
+        next |= DWC2_HPRT_PENA | DWC2_HPRT_PENCHNG | (1UL << DWC2_HPRT_PSPD_SHIFT);
+    }
+    REG(DWC2_HPRT) = next;
+}
+
+void dwc2_sim_writel(uint32_t addr, uint32_t value)
+{
+    uint32_t offset = reg_offset(addr);
+
+    if (offset >= DWC2_HCCHAR(0) && offset < DWC2_HCCHAR(DWC2_SIM_CHANNEL_NUM)) {
+        int ch = (offset - DWC2_HCCHAR(0)) / 0x20;
+        switch (offset - DWC2_HCCHAR(ch)) {
+        case 0x00:
+            channel_write_hcchar(ch, value);
+            return;
+        case 0x08:
+            REG(offset) &= ~value;
+            return;
+        default:
+            break;
+        }
+    } else if ((offset >= DWC2_DIEPINT(0) && offset < 0xb00 && (offset & 0x1f) == 0x08) ||
+               (offset >= DWC2_DOEPINT(0) && offset < 0xd00 && (offset & 0x1f) == 0x08)) {
+        REG(offset) &= ~value;
+        return;
+    }
+
+    switch (offset) {
+    case DWC2_GINTSTS:
+        REG(offset) &= ~(value & GINTSTS_W1C);
+        return;
+    case DWC2_GRSTCTL:
+        if (value & DWC2_GRSTCTL_CSRST) {
+            core_reset();
+            return;
+        }
+        if (value & (DWC2_GRSTCTL_TXFFLSH | DWC2_GRSTCTL_RXFFLSH)) {
+            s_sim.stats.fifo_flushes++;
+        }
+        // Flushes and resets complete at once, AHB is always idle between transactions
+        REG(offset) = (value & ~(DWC2_GRSTCTL_CSRST | DWC2_GRSTCTL_TXFFLSH | DWC2_GRSTCTL_RXFFLSH)) | DWC2_GRSTCTL_AHBIDL;
+        return;
+    case DWC2_HPRT:
+        write_hprt(value);
+        return;
+    case DWC2_HAINT:
+    case DWC2_HFNUM:
+    case DWC2_DAINT:
+    case DWC2_GSNPSID:
+        return;
+    default:
+        REG(offset) = value;
+        return;
+    }
+}
+
+void *dwc2_sim_dma_alloc(size_t size)
+{
+    size_t aligned = (size + 3) & ~(size_t)3;
+    void *ptr;
+
+    if (s_sim.dram_used + aligned > DWC2_SIM_DRAM_SIZE) {
+        return NULL;
+    }
+    ptr = &s_sim.dram[s_sim.dram_used];
+    s_sim.dram_used += aligned;
+    memset(ptr, 0, aligned);
+    return ptr;
+}
+
+uint32_t dwc2_sim_dma_addr(const void *ptr)
+{
+    return DWC2_SIM_DRAM_BASE + (uint32_t)((const uint8_t *)ptr - s_sim.dram);
+}
+
+static uint8_t *dram_ptr(uint32_t addr, uint32_t len)
+{
+    if (addr < DWC2_SIM_DRAM_BASE || addr - DWC2_SIM_DRAM_BASE + len > DWC2_SIM_DRAM_SIZE) {
+        return NULL;
+    }
+    return &s_sim.dram[addr - DWC2_SIM_DRAM_BASE];
+}
+
+static bool channel_enabled(int ch)
+{
+    return (REG(DWC2_HCCHAR(ch)) & DWC2_HCCHAR_CHENA) != 0;
+}
+
+static bool channel_periodic(int ch)
+{
+    uint32_t type = (REG(DWC2_HCCHAR(ch)) >> DWC2_HCCHAR_EPTYP_SHIFT) & 0x3;
+    return type == DWC2_EP_TYPE_ISOC || type == DWC2_EP_TYPE_INTR;
+}
+
+static void channel_halt(int ch, uint32_t hcint)
+{
+    REG(DWC2_HCCHAR(ch)) &= ~(DWC2_HCCHAR_CHENA | DWC2_HCCHAR_CHDIS);
+    REG(DWC2_HCINT(ch)) |= hcint | DWC2_HCINT_CHH;
+}
+
+static void sof_catchup(void)
+{
+    while (s_sim.now_ns >= s_sim.next_sof_ns) {
+        s_sim.frame++;
+        s_sim.next_sof_ns += FRAME_NS;
+        REG(DWC2_GINTSTS) |= DWC2_GINTSTS_SOF;
+    }
+}
+
+static int pick_channel(void)
+{
+    for (int ch = 0; ch < DWC2_SIM_CHANNEL_NUM; ch++) {
+        if (channel_enabled(ch) && channel_periodic(ch) && s_sim.ch[ch].last_frame != s_sim.frame) {
+            return ch;
+        }
+    }
+    for (int i = 0; i < DWC2_SIM_CHANNEL_NUM; i++) {
+        int ch = (s_sim.rr + i) % DWC2_SIM_CHANNEL_NUM;
+        if (channel_enabled(ch) && !channel_periodic(ch) && s_sim.ch[ch].ready_ns <= s_sim.now_ns) {
+            s_sim.rr = (ch + 1) % DWC2_SIM_CHANNEL_NUM;
+            return ch;
+        }
+    }
+    return -1;
+}
+
+static uint32_t next_pid(uint32_t pid, uint32_t type)
+{
+    if (type == DWC2_EP_TYPE_ISOC) {
+        return DWC2_PID_DATA0;
+    }
+    return pid == DWC2_PID_DATA1 ? DWC2_PID_DATA0 : DWC2_PID_DATA1;
+}
+
+static void transact(int ch)
+{
+    uint32_t hcchar = REG(DWC2_HCCHAR(ch));
+    uint32_t hctsiz = REG(DWC2_HCTSIZ(ch));
+    uint16_t mps = hcchar & DWC2_HCCHAR_MPSIZ_MASK;
+    uint8_t epnum = (hcchar >> DWC2_HCCHAR_EPNUM_SHIFT) & 0xf;
+    uint32_t type = (hcchar >> DWC2_HCCHAR_EPTYP_SHIFT) & 0x3;
+    bool periodic = channel_periodic(ch);
+    uint32_t xfrsize = hctsiz & DWC2_HCTSIZ_XFRSIZ_MASK;
+    uint32_t pktcnt = (hctsiz >> DWC2_HCTSIZ_PKTCNT_SHIFT) & DWC2_HCTSIZ_PKTCNT_MASK;
+    uint32_t pid = (hctsiz >> DWC2_HCTSIZ_DPID_SHIFT) & DWC2_HCTSIZ_DPID_MASK;
+    uint32_t dma = REG(DWC2_HCDMA(ch));
+    uint32_t rx_bytes = (REG(DWC2_GRXFSIZ) & 0xffff) * 4;
+    uint32_t tx_bytes = (periodic ? REG(DWC2_HPTXFSIZ) : REG(DWC2_GNPTXFSIZ)) >> 16 << 2;
+    dwc2_sim_resp_t resp;
+    uint64_t duration = 0;
+    uint16_t len = 0;
+    bool done = false;
+
+    if (periodic) {
+        s_sim.ch[ch].last_frame = s_sim.frame;
+    }
+    if (!(REG(DWC2_GAHBCFG) & DWC2_GAHBCFG_DMAEN) || pktcnt == 0) {
+        channel_halt(ch, DWC2_HCINT_AHBERR);
+        return;
+    }
+
+    if (hcchar & DWC2_HCCHAR_EPDIR) {
+        uint8_t *buf = dram_ptr(dma, xfrsize);
+        uint8_t packet[DWC2_HCCHAR_MPSIZ_MASK + 1];
+
+        if (buf == NULL) {
+            channel_halt(ch, DWC2_HCINT_AHBERR);
+            return;
+        }
+        if (rx_bytes < RX_ENTRY_BYTES(mps)) {
+            channel_halt(ch, DWC2_HCINT_BBERR);
+            return;
+        }
+        resp = s_sim.peer->in(s_sim.peer, epnum, packet, mps, &len, s_sim.now_ns);
+        if (resp == DWC2_SIM_ACK) {
+            if (len > mps) {
+                channel_halt(ch, DWC2_HCINT_BBERR);
+                return;
+            }
+            if (len > xfrsize) {
+                len = xfrsize;
+            }
+            memcpy(buf, packet, len);
+            duration = XACT_DATA_NS(len);
+            // Single packet RX FIFO: the next IN token waits for the DMA to drain this one
+            if (rx_bytes < 2 * RX_ENTRY_BYTES(mps)) {
+                duration += DMA_NS(len);
+            }
+            s_sim.stats.bytes_in += len;
+            done = len < mps || pktcnt == 1;
+        }
+    } else {
+        uint8_t *buf;
+
+        len = xfrsize < mps ? xfrsize : mps;
+        buf = dram_ptr(dma, len);
+        if (buf == NULL) {
+            channel_halt(ch, DWC2_HCINT_AHBERR);
+            return;
+        }
+        if (tx_bytes < len) {
+            channel_halt(ch, DWC2_HCINT_BBERR);
+            return;
+        }
+        if (type == DWC2_EP_TYPE_CONTROL && pid == DWC2_PID_SETUP) {
+            resp = s_sim.peer->setup(s_sim.peer, buf);
+        } else {
+            resp = s_sim.peer->out(s_sim.peer, epnum, buf, len, s_sim.now_ns);
+        }
+        duration = XACT_DATA_NS(len);
+        // Single packet TX FIFO: the DMA cannot prefetch the next packet during this one
+        if (tx_bytes < 2u * mps) {
+            duration += DMA_NS(len);
+        }
+        if (resp == DWC2_SIM_ACK) {
+            s_sim.stats.bytes_out += len;
+            done = pktcnt == 1;
+        }
+    }
+
+    s_sim.stats.transactions++;
+    if (resp == DWC2_SIM_ACK) {
+        xfrsize -= len;
+        pktcnt--;
+        dma += len;
+        pid = next_pid(pid, type);
+        REG(DWC2_HCTSIZ(ch)) = xfrsize | (pktcnt << DWC2_HCTSIZ_PKTCNT_SHIFT) | (pid << DWC2_HCTSIZ_DPID_SHIFT);
+        REG(DWC2_HCDMA(ch)) = dma;
+        if (done) {
+            channel_halt(ch, DWC2_HCINT_XFRC | DWC2_HCINT_ACK);
+        }
+    } else if (resp == DWC2_SIM_NAK) {
+        s_sim.stats.naks++;
+        if (hcchar & DWC2_HCCHAR_EPDIR) {
+            duration = XACT_NAK_NS;
+        }
+        if (periodic) {
+            channel_halt(ch, DWC2_HCINT_NAK);
+        } else {
+            // Buffer DMA retries non-periodic NAKs in hardware, without an interrupt
+            s_sim.ch[ch].ready_ns = s_sim.now_ns + duration;
+        }
+    } else {
+        duration = XACT_NAK_NS;
+        channel_halt(ch, DWC2_HCINT_STALL);
+    }
+    s_sim.now_ns += duration;
+}
+
+static void dispatch_irq(void)
+{
+    int storm = 0;
+
+    if (s_sim.irq_handler == NULL || s_sim.in_irq) {
+        return;
+    }
+    while ((REG(DWC2_GAHBCFG) & DWC2_GAHBCFG_GINTMSK) && (gintsts() & REG(DWC2_GINTMSK))) {
+        uint64_t start;
+
+        if (++storm > IRQ_STORM_LIMIT) {
+            fprintf(stderr, "dwc2_sim: interrupt 0x%08x not cleared by the handler\n",
+                    (unsigned)(gintsts() & REG(DWC2_GINTMSK)));
+            abort();
+        }
+        s_sim.in_irq = true;
+        start = cpu_now_ns();
+        s_sim.irq_handler(s_sim.irq_arg);
+        s_sim.stats.irq_cpu_ns += cpu_now_ns() - start;
+        s_sim.in_irq = false;
+        s_sim.stats.irq_count++;
+        s_sim.now_ns += IRQ_LATENCY_NS;
+    }
+}
+
+bool dwc2_sim_step(void)
+{
+    bool port_ok = s_sim.peer && (REG(DWC2_HPRT) & DWC2_HPRT_PENA);
+    bool enabled = false;
+    int ch;
+
+    sof_catchup();
+    for (ch = 0; ch < DWC2_SIM_CHANNEL_NUM; ch++) {
+        if (channel_enabled(ch) && !port_ok) {
+            channel_halt(ch, 1UL << 7); // XACTERR, nobody answered
+        }
+    }
+    ch = port_ok ? pick_channel() : -1;
+    if (ch >= 0) {
+        transact(ch);
+    } else {
+        // Idle bus: jump to the next SOF, NAK retry or run_until() deadline, whichever comes first
+        uint64_t next = s_sim.next_sof_ns;
+        if (s_sim.deadline_ns > s_sim.now_ns && s_sim.deadline_ns < next) {
+            next = s_sim.deadline_ns;
+        }
+        for (int i = 0; i < DWC2_SIM_CHANNEL_NUM; i++) {
+            if (channel_enabled(i) && !channel_periodic(i) && s_sim.ch[i].ready_ns > s_sim.now_ns && s_sim.ch[i].ready_ns < next) {
+                next = s_sim.ch[i].ready_ns;
+            }
+        }
+        s_sim.now_ns = next;
+        sof_catchup();
+    }
+    dispatch_irq();
+
+    for (ch = 0; ch < DWC2_SIM_CHANNEL_NUM; ch++) {
+        enabled |= channel_enabled(ch);
+    }
+    return enabled;
+}
+
+bool dwc2_sim_run_until(bool (*done)(void *arg), void *arg, uint64_t timeout_ns)
+{
+    uint64_t start = s_sim.now_ns;
+    bool ret = true;
+
+    s_sim.deadline_ns = start + timeout_ns;
+    // Pending interrupts first, e.g. a connect raised before the handler was enabled
+    dispatch_irq();
+    while (!done(arg)) {
+        if (s_sim.now_ns - start >= timeout_ns) {
+            ret = false;
+            break;
+        }
+        dwc2_sim_step();
+    }
+    s_sim.deadline_ns = 0;
+    return ret;
+}
+
+uint64_t dwc2_sim_now_ns(void)
+{
+    return s_sim.now_ns;
+}
+
+void dwc2_sim_get_stats(dwc2_sim_stats_t *stats)
+{
+    *stats = s_sim.stats;
+}
+
+void dwc2_sim_reset_stats(void)
+{
+    memset(&s_sim.stats, 0, sizeof(s_sim.stats));
+}
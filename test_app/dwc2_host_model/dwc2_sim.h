@@ -0,0 +1,203 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Protocol model of the host side of the ESP32-S2/S3 DWC2 OTG core with
+ * buffer DMA, driven by simulated time. It models the channel, FIFO and
+ * interrupt behaviour that sim_hcd.c relies on, at the register offsets of
+ * the core, reached through dwc2_sim_readl()/dwc2_sim_writel(). It is not a
+ * model of the complete core: device mode has no traffic, and the CherryUSB
+ * port does not run against it.
+ */
+
+#define DWC2_SIM_BASE               0x60080000
+#define DWC2_SIM_REG_SPACE          0x1000
+#define DWC2_SIM_CHANNEL_NUM        8
+#define DWC2_SIM_FIFO_TOTAL_WORDS   (800 / 4)
+
+/* Buffer DMA reaches this window only, like internal DRAM on target */
+#define DWC2_SIM_DRAM_BASE          0x3fc80000
+#define DWC2_SIM_DRAM_SIZE          (256 * 1024)
+
+/* ---------------- Registers (offsets from the base) ---------------- */
+#define DWC2_GAHBCFG                0x008
+#define DWC2_GUSBCFG                0x00c
+#define DWC2_GRSTCTL                0x010
+#define DWC2_GINTSTS                0x014
+#define DWC2_GINTMSK                0x018
+#define DWC2_GRXFSIZ                0x024
+#define DWC2_GNPTXFSIZ              0x028
+#define DWC2_GSNPSID                0x040
+#define DWC2_HPTXFSIZ               0x100
+#define DWC2_HCFG                   0x400
+#define DWC2_HFIR                   0x404
+#define DWC2_HFNUM                  0x408
+#define DWC2_HAINT                  0x414
+#define DWC2_HAINTMSK               0x418
+#define DWC2_HPRT                   0x440
+#define DWC2_HCCHAR(ch)             (0x500 + (ch) * 0x20)
+#define DWC2_HCSPLT(ch)             (0x504 + (ch) * 0x20)
+#define DWC2_HCINT(ch)              (0x508 + (ch) * 0x20)
+#define DWC2_HCINTMSK(ch)           (0x50c + (ch) * 0x20)
+#define DWC2_HCTSIZ(ch)             (0x510 + (ch) * 0x20)
+#define DWC2_HCDMA(ch)              (0x514 + (ch) * 0x20)
+#define DWC2_DAINT                  0x818
+#define DWC2_DIEPINT(ep)            (0x908 + (ep) * 0x20)
+#define DWC2_DOEPINT(ep)            (0xb08 + (ep) * 0x20)
+
+#define DWC2_GAHBCFG_GINTMSK        (1UL << 0)
+#define DWC2_GAHBCFG_DMAEN          (1UL << 5)
+
+#define DWC2_GRSTCTL_CSRST          (1UL << 0)
+#define DWC2_GRSTCTL_RXFFLSH        (1UL << 4)
+#define DWC2_GRSTCTL_TXFFLSH        (1UL << 5)
+#define DWC2_GRSTCTL_AHBIDL         (1UL << 31)
+
+#define DWC2_GINTSTS_CMOD           (1UL << 0)
+#define DWC2_GINTSTS_SOF            (1UL << 3)
+#define DWC2_GINTSTS_HPRTINT        (1UL << 24)
+#define DWC2_GINTSTS_HCINT          (1UL << 25)
+#define DWC2_GINTSTS_DISCINT        (1UL << 29)
+
+#define DWC2_HPRT_PCSTS             (1UL << 0)
+#define DWC2_HPRT_PCDET             (1UL << 1)
+#define DWC2_HPRT_PENA              (1UL << 2)
+#define DWC2_HPRT_PENCHNG           (1UL << 3)
+#define DWC2_HPRT_POCCHNG           (1UL << 5)
+#define DWC2_HPRT_PRST              (1UL << 8)
+#define DWC2_HPRT_PPWR              (1UL << 12)
+#define DWC2_HPRT_PSPD_SHIFT        17
+#define DWC2_HPRT_W1C               (DWC2_HPRT_PCDET | DWC2_HPRT_PENA | DWC2_HPRT_PENCHNG | DWC2_HPRT_POCCHNG)
+
+#define DWC2_HCCHAR_MPSIZ_MASK      0x7ffUL
+#define DWC2_HCCHAR_EPNUM_SHIFT     11
+#define DWC2_HCCHAR_EPDIR           (1UL << 15)
+#define DWC2_HCCHAR_EPTYP_SHIFT     18
+#define DWC2_HCCHAR_DAD_SHIFT       22
+#define DWC2_HCCHAR_CHDIS           (1UL << 30)
+#define DWC2_HCCHAR_CHENA           (1UL << 31)
+
+#define DWC2_HCINT_XFRC             (1UL << 0)
+#define DWC2_HCINT_CHH              (1UL << 1)
+#define DWC2_HCINT_AHBERR           (1UL << 2)
+#define DWC2_HCINT_STALL            (1UL << 3)
+#define DWC2_HCINT_NAK              (1UL << 4)
+#define DWC2_HCINT_ACK              (1UL << 5)
+#define DWC2_HCINT_BBERR            (1UL << 8)
+
+#define DWC2_HCTSIZ_XFRSIZ_MASK     0x7ffffUL
+#define DWC2_HCTSIZ_PKTCNT_SHIFT    19
+#define DWC2_HCTSIZ_PKTCNT_MASK     0x3ffUL
+#define DWC2_HCTSIZ_DPID_SHIFT      29
+#define DWC2_HCTSIZ_DPID_MASK       0x3UL
+
+#define DWC2_PID_DATA0              0
+#define DWC2_PID_DATA2              1
+#define DWC2_PID_DATA1              2
+#define DWC2_PID_SETUP              3
+
+#define DWC2_EP_TYPE_CONTROL        0
+#define DWC2_EP_TYPE_ISOC           1
+#define DWC2_EP_TYPE_BULK           2
+#define DWC2_EP_TYPE_INTR           3
+
+/* ---------------- Virtual peers ---------------- */
+
+typedef enum {
+    DWC2_SIM_ACK,
+    DWC2_SIM_NAK,
+    DWC2_SIM_STALL,
+} dwc2_sim_resp_t;
+
+/**
+ * @brief A device attached to the root port, answering token by token
+ *
+ * Callbacks run inside dwc2_sim_step() with the current simulated time.
+ */
+typedef struct dwc2_sim_peer {
+    const char *name;
+    dwc2_sim_resp_t (*setup)(struct dwc2_sim_peer *peer, const uint8_t setup[8]);
+    dwc2_sim_resp_t (*in)(struct dwc2_sim_peer *peer, uint8_t ep, uint8_t *buf, uint16_t mps, uint16_t *len, uint64_t now_ns);
+    dwc2_sim_resp_t (*out)(struct dwc2_sim_peer *peer, uint8_t ep, const uint8_t *buf, uint16_t len, uint64_t now_ns);
+} dwc2_sim_peer_t;
+
+typedef struct {
+    uint32_t irq_count;         /*!< Interrupt handler invocations */
+    uint32_t transactions;      /*!< Tokens put on the bus */
+    uint32_t naks;              /*!< Tokens answered with NAK */
+    uint32_t fifo_flushes;      /*!< TX or RX FIFO flushes through GRSTCTL */
+    uint64_t bytes_in;          /*!< Data moved device to host */
+    uint64_t bytes_out;         /*!< Data moved host to device */
+    uint64_t irq_cpu_ns;        /*!< Host CPU time spent in the interrupt handler */
+} dwc2_sim_stats_t;
+
+/**
+ * @brief Put the core in its reset state and detach any peer, statistics are cleared
+ */
+void dwc2_sim_reset(void);
+
+/**
+ * @brief Attach a peer to the root port, raising a connect detect
+ */
+void dwc2_sim_attach(dwc2_sim_peer_t *peer);
+
+/**
+ * @brief Detach the peer, raising a disconnect
+ */
+void dwc2_sim_detach(void);
+
+/**
+ * @brief Interrupt handler called when an unmasked interrupt is pending and GAHBCFG.GINTMSK is set
+ */
+void dwc2_sim_set_irq_handler(void (*handler)(void *arg), void *arg);
+
+uint32_t dwc2_sim_readl(uint32_t addr);
+void dwc2_sim_writel(uint32_t addr, uint32_t value);
+
+/**
+ * @brief Allocate from the simulated DRAM window, aligned to 4 bytes, never freed until reset
+ */
+void *dwc2_sim_dma_alloc(size_t size);
+
+/**
+ * @brief Bus address of a buffer from dwc2_sim_dma_alloc(), as written to HCDMA
+ */
+uint32_t dwc2_sim_dma_addr(const void *ptr);
+
+/**
+ * @brief Run one bus transaction, or advance to the next frame if no channel can use the bus
+ *
+ * @return true if a channel is still enabled afterwards
+ */
+bool dwc2_sim_step(void);
+
+/**
+ * @brief Step until @p done returns true or @p timeout_ns of simulated time has passed
+ *
+ * An idle bus advances to the timeout exactly, so this also serves as a plain delay.
+ *
+ * @return true if @p done returned true
+ */
+bool dwc2_sim_run_until(bool (*done)(void *arg), void *arg, uint64_t timeout_ns);
+
+uint64_t dwc2_sim_now_ns(void);
+
+void dwc2_sim_get_stats(dwc2_sim_stats_t *stats);
+void dwc2_sim_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
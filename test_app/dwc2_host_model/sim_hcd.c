@@ -0,0 +1,496 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <time.h>
+#include "sim_hcd.h"
+
+#define HCD_READ(offset)            dwc2_sim_readl(DWC2_SIM_BASE + (offset))
+#define HCD_WRITE(offset, value)    dwc2_sim_writel(DWC2_SIM_BASE + (offset), (value))
+
+#define GUSBCFG_FHMOD               (1UL << 29)
+#define XFER_TIMEOUT_NS             (500ULL * 1000 * 1000)
+#define PORT_RESET_NS               (10ULL * 1000 * 1000)
+
+/* Fixed split from usb_config.h, what the port programs in usb_hc_init() */
+#define DEFAULT_NPTX_WORDS          (240 / 4)
+#define DEFAULT_PTX_WORDS           (240 / 4)
+#define DEFAULT_RX_WORDS            ((200 - DEFAULT_NPTX_WORDS - DEFAULT_PTX_WORDS) / 4)
+
+typedef struct {
+    volatile bool done;
+    int status;
+    uint32_t len;
+    bool in;
+    uint8_t pid;
+    uint8_t ep_addr;
+    uint8_t ep_type;
+    uint16_t mps;
+    /* Queued transfers, the next one is programmed from the ISR */
+    sim_hcd_urb_t *urbs;
+    uint32_t urb_num;
+    uint32_t urb_idx;
+    /* Pipe the scheduler put on this channel */
+    sim_hcd_vpipe_t *vpipe;
+} sim_hcd_chan_t;
+
+typedef struct {
+    bool active;
+    bool dedicated;
+    int channels;
+    uint32_t slice_packets;
+    sim_hcd_vpipe_t **pipes;
+    uint32_t pipe_num;
+    uint32_t seq;
+} sim_hcd_sched_t;
+
+static sim_hcd_chan_t s_chan[DWC2_SIM_CHANNEL_NUM];
+static sim_hcd_sched_t s_sched;
+static volatile bool s_port_connected;
+static volatile bool s_port_enabled;
+static sim_hcd_stats_t s_stats;
+static uint64_t s_task_latency_ns;
+
+static uint64_t cpu_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sim_hcd_port_irq(void)
+{
+    uint32_t hprt = HCD_READ(DWC2_HPRT);
+    uint32_t hprt_dup = hprt & ~DWC2_HPRT_W1C;
+
+    if (hprt & DWC2_HPRT_PCDET) {
+        hprt_dup |= DWC2_HPRT_PCDET;
+        s_port_connected = (hprt & DWC2_HPRT_PCSTS) != 0;
+    }
+    if (hprt & DWC2_HPRT_PENCHNG) {
+        hprt_dup |= DWC2_HPRT_PENCHNG;
+        s_port_enabled = (hprt & DWC2_HPRT_PENA) != 0;
+    }
+    if (hprt & DWC2_HPRT_POCCHNG) {
+        hprt_dup |= DWC2_HPRT_POCCHNG;
+    }
+    HCD_WRITE(DWC2_HPRT, hprt_dup);
+}
+
+static void sim_hcd_chan_start(int ch, void *buf, uint32_t len)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+    uint32_t pktcnt = len ? (len + chan->mps - 1) / chan->mps : 1;
+    uint32_t xfrsize = chan->in ? pktcnt * chan->mps : len;
+    uint64_t start = cpu_now_ns();
+
+    chan->status = -2;
+    chan->len = xfrsize;
+    HCD_WRITE(DWC2_HCINT(ch), 0xffffffff);
+    HCD_WRITE(DWC2_HCINTMSK(ch), DWC2_HCINT_CHH);
+    HCD_WRITE(DWC2_HAINTMSK, HCD_READ(DWC2_HAINTMSK) | (1UL << ch));
+    HCD_WRITE(DWC2_HCTSIZ(ch), xfrsize | (pktcnt << DWC2_HCTSIZ_PKTCNT_SHIFT) | ((uint32_t)chan->pid << DWC2_HCTSIZ_DPID_SHIFT));
+    HCD_WRITE(DWC2_HCDMA(ch), dwc2_sim_dma_addr(buf));
+    HCD_WRITE(DWC2_HCCHAR(ch), chan->mps | ((uint32_t)(chan->ep_addr & 0xf) << DWC2_HCCHAR_EPNUM_SHIFT) |
+              (chan->in ? DWC2_HCCHAR_EPDIR : 0) | ((uint32_t)chan->ep_type << DWC2_HCCHAR_EPTYP_SHIFT) |
+              (1UL << DWC2_HCCHAR_DAD_SHIFT) | DWC2_HCCHAR_CHENA);
+    s_stats.submit_cpu_ns += cpu_now_ns() - start;
+    s_stats.chan_programs++;
+}
+
+static void sim_hcd_sched_chan_done(int ch);
+static void sim_hcd_sched_chan_nak(int ch);
+static void sim_hcd_sched_dispatch(void);
+
+static void sim_hcd_chan_irq(int ch)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+    uint32_t hcint = HCD_READ(DWC2_HCINT(ch));
+    uint32_t hctsiz;
+
+    HCD_WRITE(DWC2_HCINT(ch), hcint);
+    if (!(hcint & DWC2_HCINT_CHH)) {
+        return;
+    }
+    hctsiz = HCD_READ(DWC2_HCTSIZ(ch));
+    if (hcint & DWC2_HCINT_XFRC) {
+        chan->status = 0;
+        if (chan->in) {
+            chan->len -= hctsiz & DWC2_HCTSIZ_XFRSIZ_MASK;
+        }
+        chan->pid = (hctsiz >> DWC2_HCTSIZ_DPID_SHIFT) & DWC2_HCTSIZ_DPID_MASK;
+    } else if (hcint & DWC2_HCINT_NAK) {
+        if (chan->vpipe && !s_sched.dedicated) {
+            sim_hcd_sched_chan_nak(ch);
+            return;
+        }
+        // Periodic IN got no data this frame, try again in the next one
+        HCD_WRITE(DWC2_HCCHAR(ch), HCD_READ(DWC2_HCCHAR(ch)) | DWC2_HCCHAR_CHENA);
+        return;
+    } else if (hcint & DWC2_HCINT_STALL) {
+        chan->status = -1;
+    } else {
+        chan->status = -2;
+    }
+    if (chan->vpipe) {
+        sim_hcd_sched_chan_done(ch);
+        return;
+    }
+    if (chan->urbs) {
+        sim_hcd_urb_t *urb = &chan->urbs[chan->urb_idx];
+        urb->status = chan->status;
+        urb->actual = chan->status == 0 ? chan->len : 0;
+        // Start the next URB with the toggle this one ended on, before anyone is woken up
+        if (chan->status == 0 && ++chan->urb_idx < chan->urb_num) {
+            s_stats.xfers++;
+            sim_hcd_chan_start(ch, chan->urbs[chan->urb_idx].buf, chan->urbs[chan->urb_idx].len);
+            return;
+        }
+    }
+    chan->done = true;
+}
+
+static void sim_hcd_isr(void *arg)
+{
+    uint32_t gintsts = HCD_READ(DWC2_GINTSTS) & HCD_READ(DWC2_GINTMSK);
+
+    if (gintsts & DWC2_GINTSTS_HPRTINT) {
+        sim_hcd_port_irq();
+    }
+    if (gintsts & DWC2_GINTSTS_HCINT) {
+        uint32_t haint = HCD_READ(DWC2_HAINT) & HCD_READ(DWC2_HAINTMSK);
+        for (int ch = 0; ch < DWC2_SIM_CHANNEL_NUM; ch++) {
+            if (haint & (1UL << ch)) {
+                sim_hcd_chan_irq(ch);
+            }
+        }
+    }
+    if (gintsts & DWC2_GINTSTS_SOF) {
+        HCD_WRITE(DWC2_GINTSTS, DWC2_GINTSTS_SOF);
+        sim_hcd_sched_dispatch();
+    }
+    if (gintsts & DWC2_GINTSTS_DISCINT) {
+        HCD_WRITE(DWC2_GINTSTS, DWC2_GINTSTS_DISCINT);
+        s_port_connected = false;
+        s_port_enabled = false;
+    }
+}
+
+static bool flag_set(void *arg)
+{
+    return *(volatile bool *)arg;
+}
+
+static bool never(void *arg)
+{
+    return false;
+}
+
+int sim_hcd_init(void)
+{
+    memset(s_chan, 0, sizeof(s_chan));
+    memset(&s_sched, 0, sizeof(s_sched));
+    s_task_latency_ns = 0;
+    s_port_connected = false;
+    s_port_enabled = false;
+
+    HCD_WRITE(DWC2_GRSTCTL, DWC2_GRSTCTL_CSRST);
+    HCD_WRITE(DWC2_GUSBCFG, GUSBCFG_FHMOD);
+    HCD_WRITE(DWC2_GAHBCFG, DWC2_GAHBCFG_DMAEN | DWC2_GAHBCFG_GINTMSK);
+    sim_hcd_set_fifo(DEFAULT_RX_WORDS, DEFAULT_NPTX_WORDS, DEFAULT_PTX_WORDS);
+    HCD_WRITE(DWC2_GINTMSK, DWC2_GINTSTS_HPRTINT | DWC2_GINTSTS_HCINT | DWC2_GINTSTS_DISCINT);
+    dwc2_sim_set_irq_handler(sim_hcd_isr, NULL);
+
+    HCD_WRITE(DWC2_HPRT, DWC2_HPRT_PPWR);
+    if (!dwc2_sim_run_until(flag_set, (void *)&s_port_connected, PORT_RESET_NS)) {
+        return -1;
+    }
+    HCD_WRITE(DWC2_HPRT, DWC2_HPRT_PPWR | DWC2_HPRT_PRST);
+    dwc2_sim_run_until(never, NULL, PORT_RESET_NS);
+    HCD_WRITE(DWC2_HPRT, DWC2_HPRT_PPWR);
+    return dwc2_sim_run_until(flag_set, (void *)&s_port_enabled, PORT_RESET_NS) ? 0 : -1;
+}
+
+void sim_hcd_set_fifo(uint16_t rx_words, uint16_t nptx_words, uint16_t ptx_words)
+{
+    HCD_WRITE(DWC2_GRXFSIZ, rx_words);
+    HCD_WRITE(DWC2_GNPTXFSIZ, ((uint32_t)nptx_words << 16) | rx_words);
+    HCD_WRITE(DWC2_HPTXFSIZ, ((uint32_t)ptx_words << 16) | (rx_words + nptx_words));
+    HCD_WRITE(DWC2_GRSTCTL, (0x10UL << 6) | DWC2_GRSTCTL_TXFFLSH);
+    HCD_WRITE(DWC2_GRSTCTL, DWC2_GRSTCTL_RXFFLSH);
+}
+
+static void sim_hcd_chan_setup(int ch, uint8_t ep_addr, uint8_t ep_type, uint16_t mps, uint8_t pid)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+
+    chan->done = false;
+    chan->in = (ep_addr & 0x80) != 0;
+    chan->pid = pid;
+    chan->ep_addr = ep_addr;
+    chan->ep_type = ep_type;
+    chan->mps = mps;
+    chan->urbs = NULL;
+    chan->urb_num = 0;
+    chan->urb_idx = 0;
+    chan->vpipe = NULL;
+}
+
+/* Wait for the channel to halt for good, then for the waiting thread to be scheduled */
+static int sim_hcd_chan_wait(int ch)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+
+    if (!dwc2_sim_run_until(flag_set, (void *)&chan->done, XFER_TIMEOUT_NS)) {
+        HCD_WRITE(DWC2_HCCHAR(ch), HCD_READ(DWC2_HCCHAR(ch)) | DWC2_HCCHAR_CHDIS);
+        dwc2_sim_step();
+        return -2;
+    }
+    if (s_task_latency_ns) {
+        dwc2_sim_run_until(never, NULL, s_task_latency_ns);
+    }
+    return 0;
+}
+
+int sim_hcd_xfer(int ch, uint8_t ep_addr, uint8_t ep_type, uint16_t mps, void *buf, uint32_t len, uint8_t *pid, uint32_t *actual)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+
+    sim_hcd_chan_setup(ch, ep_addr, ep_type, mps, *pid);
+    sim_hcd_chan_start(ch, buf, len);
+    if (sim_hcd_chan_wait(ch) < 0) {
+        return -2;
+    }
+    if (chan->status == 0) {
+        *pid = chan->pid;
+        s_stats.xfers++;
+        if (actual) {
+            *actual = chan->len;
+        }
+    }
+    return chan->status;
+}
+
+int sim_hcd_xfer_queued(int ch, uint8_t ep_addr, uint8_t ep_type, uint16_t mps, sim_hcd_urb_t *urbs, uint32_t num, uint8_t *pid)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+    int ret;
+
+    for (uint32_t i = 0; i < num; i++) {
+        urbs[i].status = -2;
+        urbs[i].actual = 0;
+    }
+    sim_hcd_chan_setup(ch, ep_addr, ep_type, mps, *pid);
+    chan->urbs = urbs;
+    chan->urb_num = num;
+    sim_hcd_chan_start(ch, urbs[0].buf, urbs[0].len);
+    ret = sim_hcd_chan_wait(ch);
+    chan->urbs = NULL;
+    if (ret < 0) {
+        return -2;
+    }
+    if (chan->status == 0) {
+        *pid = chan->pid;
+        s_stats.xfers++;
+    }
+    return chan->status;
+}
+
+/* ---------------- Virtual pipe scheduler ---------------- */
+
+static bool sim_hcd_vpipe_periodic(const sim_hcd_vpipe_t *pipe)
+{
+    return pipe->ep_type == DWC2_EP_TYPE_INTR || pipe->ep_type == DWC2_EP_TYPE_ISOC;
+}
+
+static uint32_t sim_hcd_frame(void)
+{
+    return HCD_READ(DWC2_HFNUM) & 0x3fff;
+}
+
+/* HFNUM wraps at 14 bits */
+static bool sim_hcd_frame_due(uint32_t frame, uint32_t next_frame)
+{
+    return ((frame - next_frame) & 0x3fff) < 0x2000;
+}
+
+static void sim_hcd_sched_program(sim_hcd_vpipe_t *pipe, int ch)
+{
+    uint32_t left = pipe->len - pipe->actual;
+    uint32_t chunk = left;
+
+    // A bulk or control pipe holds the channel for one slice, then goes to the back of the line
+    if (!s_sched.dedicated && !sim_hcd_vpipe_periodic(pipe) && chunk > s_sched.slice_packets * pipe->mps) {
+        chunk = s_sched.slice_packets * pipe->mps;
+    }
+    sim_hcd_chan_setup(ch, pipe->ep_addr, pipe->ep_type, pipe->mps, pipe->pid);
+    s_chan[ch].vpipe = pipe;
+    pipe->ch = ch;
+    // Bytes a full slice moves, IN slices are whole packets
+    pipe->chunk = (pipe->ep_addr & 0x80) ? (chunk ? (chunk + pipe->mps - 1) / pipe->mps : 1) * pipe->mps : chunk;
+    sim_hcd_chan_start(ch, pipe->buf + pipe->actual, chunk);
+}
+
+/* Periodic pipe that is due first, else the bulk/control pipe that has waited longest */
+static sim_hcd_vpipe_t *sim_hcd_sched_pick(uint32_t frame)
+{
+    sim_hcd_vpipe_t *best = NULL;
+
+    for (uint32_t i = 0; i < s_sched.pipe_num; i++) {
+        sim_hcd_vpipe_t *pipe = s_sched.pipes[i];
+        if (!pipe->pending || pipe->ch >= 0 || !sim_hcd_vpipe_periodic(pipe) || !sim_hcd_frame_due(frame, pipe->next_frame)) {
+            continue;
+        }
+        if (best == NULL || !sim_hcd_frame_due(pipe->next_frame, best->next_frame)) {
+            best = pipe;
+        }
+    }
+    if (best) {
+        return best;
+    }
+    for (uint32_t i = 0; i < s_sched.pipe_num; i++) {
+        sim_hcd_vpipe_t *pipe = s_sched.pipes[i];
+        if (!pipe->pending || pipe->ch >= 0 || sim_hcd_vpipe_periodic(pipe)) {
+            continue;
+        }
+        if (best == NULL || (int32_t)(pipe->seq - best->seq) < 0) {
+            best = pipe;
+        }
+    }
+    return best;
+}
+
+static void sim_hcd_sched_dispatch(void)
+{
+    uint32_t frame;
+
+    if (!s_sched.active || s_sched.dedicated) {
+        return;
+    }
+    frame = sim_hcd_frame();
+    for (int ch = 0; ch < s_sched.channels; ch++) {
+        sim_hcd_vpipe_t *pipe;
+        if (s_chan[ch].vpipe) {
+            continue;
+        }
+        pipe = sim_hcd_sched_pick(frame);
+        if (pipe == NULL) {
+            break;
+        }
+        sim_hcd_sched_program(pipe, ch);
+    }
+}
+
+/* Periodic IN without data this interval: free the channel until the next one */
+static void sim_hcd_sched_chan_nak(int ch)
+{
+    sim_hcd_vpipe_t *pipe = s_chan[ch].vpipe;
+
+    s_chan[ch].vpipe = NULL;
+    pipe->ch = -1;
+    pipe->next_frame = sim_hcd_frame() + pipe->interval;
+    sim_hcd_sched_dispatch();
+}
+
+static void sim_hcd_sched_chan_done(int ch)
+{
+    sim_hcd_chan_t *chan = &s_chan[ch];
+    sim_hcd_vpipe_t *pipe = chan->vpipe;
+
+    if (!s_sched.dedicated) {
+        chan->vpipe = NULL;
+        pipe->ch = -1;
+    }
+    if (chan->status == 0) {
+        pipe->actual += chan->len;
+        pipe->pid = chan->pid;
+        // A full slice with more to go: requeue behind the other pipes
+        if (!s_sched.dedicated && pipe->actual < pipe->len && chan->len == pipe->chunk) {
+            pipe->seq = ++s_sched.seq;
+            sim_hcd_sched_dispatch();
+            return;
+        }
+        s_stats.xfers++;
+    }
+    pipe->status = chan->status;
+    pipe->pending = false;
+    if (sim_hcd_vpipe_periodic(pipe)) {
+        pipe->next_frame = sim_hcd_frame() + pipe->interval;
+    }
+    if (pipe->complete) {
+        pipe->complete(pipe);
+    }
+    sim_hcd_sched_dispatch();
+}
+
+int sim_hcd_sched_start(sim_hcd_vpipe_t **pipes, uint32_t num, int channels, uint32_t slice_packets)
+{
+    if (slice_packets == 0 && num > (uint32_t)channels) {
+        return -1;
+    }
+    s_sched.active = true;
+    s_sched.dedicated = slice_packets == 0;
+    s_sched.channels = channels;
+    s_sched.slice_packets = slice_packets;
+    s_sched.pipes = pipes;
+    s_sched.pipe_num = num;
+    for (uint32_t i = 0; i < num; i++) {
+        pipes[i]->pid = DWC2_PID_DATA0;
+        pipes[i]->pending = false;
+        pipes[i]->ch = s_sched.dedicated ? (int)i : -1;
+        pipes[i]->next_frame = sim_hcd_frame();
+        pipes[i]->seq = 0;
+    }
+    if (!s_sched.dedicated) {
+        HCD_WRITE(DWC2_GINTMSK, HCD_READ(DWC2_GINTMSK) | DWC2_GINTSTS_SOF);
+    }
+    return 0;
+}
+
+void sim_hcd_vpipe_submit(sim_hcd_vpipe_t *pipe, uint8_t *buf, uint32_t len)
+{
+    pipe->buf = buf;
+    pipe->len = len;
+    pipe->actual = 0;
+    pipe->status = -2;
+    pipe->pending = true;
+    pipe->seq = ++s_sched.seq;
+    if (s_sched.dedicated) {
+        sim_hcd_sched_program(pipe, pipe->ch);
+    } else {
+        sim_hcd_sched_dispatch();
+    }
+}
+
+void sim_hcd_sched_stop(void)
+{
+    HCD_WRITE(DWC2_GINTMSK, HCD_READ(DWC2_GINTMSK) & ~DWC2_GINTSTS_SOF);
+    s_sched.active = false;
+    for (int ch = 0; ch < s_sched.channels; ch++) {
+        if (HCD_READ(DWC2_HCCHAR(ch)) & DWC2_HCCHAR_CHENA) {
+            HCD_WRITE(DWC2_HCCHAR(ch), HCD_READ(DWC2_HCCHAR(ch)) | DWC2_HCCHAR_CHDIS);
+        }
+        HCD_WRITE(DWC2_HCINT(ch), 0xffffffff);
+        s_chan[ch].vpipe = NULL;
+    }
+    s_sched.pipes = NULL;
+    s_sched.pipe_num = 0;
+}
+
+void sim_hcd_set_task_latency(uint64_t ns)
+{
+    s_task_latency_ns = ns;
+}
+
+void sim_hcd_get_stats(sim_hcd_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+void sim_hcd_reset_stats(void)
+{
+    memset(&s_stats, 0, sizeof(s_stats));
+}
@@ -0,0 +1,145 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "dwc2_sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimal buffer-DMA host channel driver for the protocol model, written for
+ * it and separate from the CherryUSB port. It follows the port's pattern (one
+ * channel per transfer, CHH as the only unmasked channel interrupt, interrupt
+ * NAKs re-armed from the ISR), so scheduling schemes can be compared on the
+ * model; its figures are not those of the port.
+ */
+
+typedef struct {
+    void *buf;                  /*!< Buffer from dwc2_sim_dma_alloc(), IN buffers rounded up to the max packet size */
+    uint32_t len;
+    uint32_t actual;            /*!< Bytes transferred */
+    int status;                 /*!< 0, -1 on STALL, -2 on error or when not reached */
+} sim_hcd_urb_t;
+
+typedef struct {
+    uint32_t xfers;             /*!< Completed transfers */
+    uint32_t chan_programs;     /*!< Times a channel was programmed and enabled */
+    uint64_t submit_cpu_ns;     /*!< Host CPU time spent programming channels */
+} sim_hcd_stats_t;
+
+/**
+ * @brief An endpoint scheduled onto the physical channels by sim_hcd_sched_start()
+ *
+ * Fill in the endpoint fields and the callback, then submit transfers with
+ * sim_hcd_vpipe_submit(). The callback runs from the interrupt handler once the
+ * whole transfer is done, and may submit the next one.
+ */
+typedef struct sim_hcd_vpipe {
+    uint8_t ep_addr;            /*!< Endpoint address, bit 7 set for IN */
+    uint8_t ep_type;            /*!< DWC2_EP_TYPE_* */
+    uint16_t mps;
+    uint8_t interval;           /*!< Polling interval in frames, periodic endpoints */
+    void (*complete)(struct sim_hcd_vpipe *pipe);
+    void *arg;
+    /* Current transfer */
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t actual;
+    int status;                 /*!< As for sim_hcd_xfer(), valid in the callback */
+    /* Private */
+    uint8_t pid;
+    bool pending;
+    int ch;
+    uint32_t chunk;
+    uint32_t next_frame;
+    uint32_t seq;
+} sim_hcd_vpipe_t;
+
+/**
+ * @brief Reset the core, enable DMA and interrupts, power the port and reset the attached peer
+ *
+ * @return 0 on success, -1 if no device came up on the port
+ */
+int sim_hcd_init(void);
+
+/**
+ * @brief Reprogram the FIFO split (words) and flush, while no channel is enabled
+ */
+void sim_hcd_set_fifo(uint16_t rx_words, uint16_t nptx_words, uint16_t ptx_words);
+
+/**
+ * @brief Run one transfer on a channel and wait for it in simulated time
+ *
+ * @param ch       Channel, 0 .. DWC2_SIM_CHANNEL_NUM - 1
+ * @param ep_addr  Endpoint address, bit 7 set for IN
+ * @param ep_type  DWC2_EP_TYPE_*
+ * @param mps      Max packet size
+ * @param buf      Buffer from dwc2_sim_dma_alloc(), IN buffers rounded up to @p mps
+ * @param len      Transfer length
+ * @param pid      Data PID to start with, updated to the next one on success
+ * @param actual   Bytes transferred, may be NULL
+ * @return 0, -1 on STALL, -2 on error or timeout
+ */
+int sim_hcd_xfer(int ch, uint8_t ep_addr, uint8_t ep_type, uint16_t mps, void *buf, uint32_t len, uint8_t *pid, uint32_t *actual);
+
+/**
+ * @brief Run several transfers back to back on one channel
+ *
+ * Models per-pipe URB queuing: each following URB is programmed from the
+ * completion interrupt of the previous one, with the data toggle it ended on,
+ * and the caller is only woken once after the last. Stops at the first URB
+ * that fails.
+ *
+ * @return Status of the last URB run, as for sim_hcd_xfer()
+ */
+int sim_hcd_xfer_queued(int ch, uint8_t ep_addr, uint8_t ep_type, uint16_t mps, sim_hcd_urb_t *urbs, uint32_t num, uint8_t *pid);
+
+/**
+ * @brief Simulated time from a transfer's final interrupt until the waiting thread runs
+ *
+ * Stands for the semaphore wake-up and context switch before a class driver can
+ * resubmit. 0 (the default after sim_hcd_init()) resubmits instantly.
+ */
+void sim_hcd_set_task_latency(uint64_t ns);
+
+/**
+ * @brief Run a set of endpoints concurrently on the first @p channels channels
+ *
+ * Dedicated mode (@p slice_packets 0) binds endpoint i to channel i for good, as
+ * the CherryUSB port does: periodic channels stay armed and are re-enabled after
+ * every NAK. It fails if there are more endpoints than channels.
+ *
+ * Otherwise the endpoints are virtual pipes sharing the channels. The scheduler
+ * runs from the SOF interrupt and from every channel halt: periodic pipes are
+ * polled once their bInterval has elapsed (by HFNUM) and give the channel back
+ * on NAK; bulk and control pipes get a channel in round-robin order for at most
+ * @p slice_packets packets at a time.
+ *
+ * @return 0, -1 if the endpoints do not fit in dedicated mode
+ */
+int sim_hcd_sched_start(sim_hcd_vpipe_t **pipes, uint32_t num, int channels, uint32_t slice_packets);
+
+/**
+ * @brief Start a transfer on a pipe, from the test or from a pipe callback
+ *
+ * @param buf  Buffer from dwc2_sim_dma_alloc(), IN buffers rounded up to the max packet size
+ */
+void sim_hcd_vpipe_submit(sim_hcd_vpipe_t *pipe, uint8_t *buf, uint32_t len);
+
+/**
+ * @brief Halt every scheduled channel and stop the scheduler
+ */
+void sim_hcd_sched_stop(void);
+
+void sim_hcd_get_stats(sim_hcd_stats_t *stats);
+void sim_hcd_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,297 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "sim_peers.h"
+
+#define REQ_GET_DESCRIPTOR      0x06
+#define DESC_TYPE_DEVICE        0x01
+
+#define MSC_CBW_SIGNATURE       0x43425355
+#define MSC_CSW_SIGNATURE       0x53425355
+#define MSC_CBW_SIZE            31
+#define MSC_CSW_SIZE            13
+#define SCSI_TEST_UNIT_READY    0x00
+#define SCSI_READ10             0x28
+#define SCSI_WRITE10            0x2a
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* ---------------- EP0 ---------------- */
+
+static void ep0_setup(sim_ep0_t *ep0, const uint8_t setup[8], uint16_t pid, uint8_t dev_class)
+{
+    uint16_t w_length = setup[6] | (setup[7] << 8);
+
+    ep0->len = 0;
+    ep0->pos = 0;
+    if ((setup[0] & 0x80) && setup[1] == REQ_GET_DESCRIPTOR && setup[3] == DESC_TYPE_DEVICE) {
+        const uint8_t desc[18] = {
+            18, DESC_TYPE_DEVICE, 0x00, 0x02, dev_class, 0x00, 0x00, SIM_PEER_MPS,
+            0x3a, 0x30, pid & 0xff, pid >> 8, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+        };
+        memcpy(ep0->buf, desc, sizeof(desc));
+        ep0->len = w_length < sizeof(desc) ? w_length : sizeof(desc);
+    }
+}
+
+static dwc2_sim_resp_t ep0_in(sim_ep0_t *ep0, uint8_t *buf, uint16_t mps, uint16_t *len)
+{
+    uint16_t left = ep0->len - ep0->pos;
+
+    *len = left < mps ? left : mps;
+    memcpy(buf, &ep0->buf[ep0->pos], *len);
+    ep0->pos += *len;
+    return DWC2_SIM_ACK;
+}
+
+/* ---------------- Bulk loopback ---------------- */
+
+static dwc2_sim_resp_t loopback_setup(dwc2_sim_peer_t *peer, const uint8_t setup[8])
+{
+    sim_loopback_t *dev = (sim_loopback_t *)peer;
+    ep0_setup(&dev->ep0, setup, 0x0001, 0xff);
+    return DWC2_SIM_ACK;
+}
+
+static dwc2_sim_resp_t loopback_in(dwc2_sim_peer_t *peer, uint8_t ep, uint8_t *buf, uint16_t mps, uint16_t *len, uint64_t now_ns)
+{
+    sim_loopback_t *dev = (sim_loopback_t *)peer;
+
+    if (ep == 0) {
+        return ep0_in(&dev->ep0, buf, mps, len);
+    }
+    if (ep != 1) {
+        return DWC2_SIM_STALL;
+    }
+    if (dev->count == 0) {
+        return DWC2_SIM_NAK;
+    }
+    *len = dev->count < mps ? dev->count : mps;
+    for (uint16_t i = 0; i < *len; i++) {
+        buf[i] = dev->ring[(dev->head + i) % sizeof(dev->ring)];
+    }
+    dev->head = (dev->head + *len) % sizeof(dev->ring);
+    dev->count -= *len;
+    return DWC2_SIM_ACK;
+}
+
+static dwc2_sim_resp_t loopback_out(dwc2_sim_peer_t *peer, uint8_t ep, const uint8_t *buf, uint16_t len, uint64_t now_ns)
+{
+    sim_loopback_t *dev = (sim_loopback_t *)peer;
+
+    if (ep == 0) {
+        return DWC2_SIM_ACK;
+    }
+    if (ep != 1) {
+        return DWC2_SIM_STALL;
+    }
+    if (sizeof(dev->ring) - dev->count < len) {
+        return DWC2_SIM_NAK;
+    }
+    for (uint16_t i = 0; i < len; i++) {
+        dev->ring[(dev->head + dev->count + i) % sizeof(dev->ring)] = buf[i];
+    }
+    dev->count += len;
+    return DWC2_SIM_ACK;
+}
+
+void sim_loopback_init(sim_loopback_t *dev)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->base.name = "loopback";
+    dev->base.setup = loopback_setup;
+    dev->base.in = loopback_in;
+    dev->base.out = loopback_out;
+}
+
+/* ---------------- Mass storage, bulk-only transport ---------------- */
+
+static dwc2_sim_resp_t msc_setup(dwc2_sim_peer_t *peer, const uint8_t setup[8])
+{
+    sim_msc_t *dev = (sim_msc_t *)peer;
+    ep0_setup(&dev->ep0, setup, 0x0002, 0x00);
+    return DWC2_SIM_ACK;
+}
+
+static void msc_command(sim_msc_t *dev, const uint8_t *cbw, uint64_t now_ns)
+{
+    uint32_t transfer_len = get_le32(&cbw[8]);
+    const uint8_t *cb = &cbw[15];
+    uint32_t lba;
+    uint32_t blocks;
+
+    dev->tag = get_le32(&cbw[4]);
+    dev->status = 0;
+    dev->commands++;
+    dev->ready_ns = now_ns + SIM_MSC_LATENCY_NS;
+
+    switch (cb[0]) {
+    case SCSI_READ10:
+    case SCSI_WRITE10:
+        lba = get_be32(&cb[2]);
+        blocks = (cb[7] << 8) | cb[8];
+        dev->data_pos = (lba % SIM_MSC_BLOCK_NUM) * SIM_MSC_BLOCK_SIZE;
+        dev->data_left = blocks * SIM_MSC_BLOCK_SIZE;
+        if (dev->data_left != transfer_len) {
+            dev->status = 2; // phase error
+            dev->state = SIM_MSC_CSW;
+            return;
+        }
+        dev->state = cb[0] == SCSI_READ10 ? SIM_MSC_DATA_IN : SIM_MSC_DATA_OUT;
+        if (dev->data_left == 0) {
+            dev->state = SIM_MSC_CSW;
+        }
+        return;
+    case SCSI_TEST_UNIT_READY:
+        dev->state = SIM_MSC_CSW;
+        return;
+    default:
+        dev->status = 1;
+        dev->state = SIM_MSC_CSW;
+        return;
+    }
+}
+
+static dwc2_sim_resp_t msc_in(dwc2_sim_peer_t *peer, uint8_t ep, uint8_t *buf, uint16_t mps, uint16_t *len, uint64_t now_ns)
+{
+    sim_msc_t *dev = (sim_msc_t *)peer;
+
+    if (ep == 0) {
+        return ep0_in(&dev->ep0, buf, mps, len);
+    }
+    if (ep != 1) {
+        return DWC2_SIM_STALL;
+    }
+    if (now_ns < dev->ready_ns) {
+        return DWC2_SIM_NAK;
+    }
+    if (dev->state == SIM_MSC_DATA_IN) {
+        *len = dev->data_left < mps ? dev->data_left : mps;
+        memcpy(buf, &dev->disk[dev->data_pos], *len);
+        dev->data_pos = (dev->data_pos + *len) % sizeof(dev->disk);
+        dev->data_left -= *len;
+        if (dev->data_left == 0) {
+            dev->state = SIM_MSC_CSW;
+        }
+        return DWC2_SIM_ACK;
+    }
+    if (dev->state == SIM_MSC_CSW) {
+        put_le32(&buf[0], MSC_CSW_SIGNATURE);
+        put_le32(&buf[4], dev->tag);
+        put_le32(&buf[8], dev->data_left);
+        buf[12] = dev->status;
+        *len = MSC_CSW_SIZE;
+        dev->state = SIM_MSC_CBW;
+        return DWC2_SIM_ACK;
+    }
+    return DWC2_SIM_NAK;
+}
+
+static dwc2_sim_resp_t msc_out(dwc2_sim_peer_t *peer, uint8_t ep, const uint8_t *buf, uint16_t len, uint64_t now_ns)
+{
+    sim_msc_t *dev = (sim_msc_t *)peer;
+
+    if (ep == 0) {
+        return DWC2_SIM_ACK;
+    }
+    if (ep != 2) {
+        return DWC2_SIM_STALL;
+    }
+    if (dev->state == SIM_MSC_CBW) {
+        if (len != MSC_CBW_SIZE || get_le32(buf) != MSC_CBW_SIGNATURE) {
+            return DWC2_SIM_STALL;
+        }
+        msc_command(dev, buf, now_ns);
+        return DWC2_SIM_ACK;
+    }
+    if (dev->state == SIM_MSC_DATA_OUT) {
+        if (now_ns < dev->ready_ns) {
+            return DWC2_SIM_NAK;
+        }
+        if (len > dev->data_left) {
+            len = dev->data_left;
+        }
+        memcpy(&dev->disk[dev->data_pos], buf, len);
+        dev->data_pos = (dev->data_pos + len) % sizeof(dev->disk);
+        dev->data_left -= len;
+        if (dev->data_left == 0) {
+            dev->state = SIM_MSC_CSW;
+        }
+        return DWC2_SIM_ACK;
+    }
+    return DWC2_SIM_NAK;
+}
+
+void sim_msc_init(sim_msc_t *dev)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->base.name = "msc";
+    dev->base.setup = msc_setup;
+    dev->base.in = msc_in;
+    dev->base.out = msc_out;
+    dev->state = SIM_MSC_CBW;
+}
+
+/* ---------------- HID ---------------- */
+
+static dwc2_sim_resp_t hid_setup(dwc2_sim_peer_t *peer, const uint8_t setup[8])
+{
+    sim_hid_t *dev = (sim_hid_t *)peer;
+    ep0_setup(&dev->ep0, setup, 0x0003, 0x00);
+    return DWC2_SIM_ACK;
+}
+
+static dwc2_sim_resp_t hid_in(dwc2_sim_peer_t *peer, uint8_t ep, uint8_t *buf, uint16_t mps, uint16_t *len, uint64_t now_ns)
+{
+    sim_hid_t *dev = (sim_hid_t *)peer;
+
+    if (ep == 0) {
+        return ep0_in(&dev->ep0, buf, mps, len);
+    }
+    if (ep != 1) {
+        return DWC2_SIM_STALL;
+    }
+    if (now_ns < dev->next_report_ns) {
+        return DWC2_SIM_NAK;
+    }
+    memset(buf, 0, 8);
+    put_le32(&buf[4], dev->reports);
+    *len = 8;
+    dev->reports++;
+    dev->next_report_ns = now_ns + SIM_HID_INTERVAL_NS;
+    return DWC2_SIM_ACK;
+}
+
+static dwc2_sim_resp_t hid_out(dwc2_sim_peer_t *peer, uint8_t ep, const uint8_t *buf, uint16_t len, uint64_t now_ns)
+{
+    return ep == 0 ? DWC2_SIM_ACK : DWC2_SIM_STALL;
+}
+
+void sim_hid_init(sim_hid_t *dev)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->base.name = "hid";
+    dev->base.setup = hid_setup;
+    dev->base.in = hid_in;
+    dev->base.out = hid_out;
+}
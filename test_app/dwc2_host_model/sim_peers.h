@@ -0,0 +1,84 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "dwc2_sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_PEER_MPS            64
+
+/* Control endpoint shared by all peers: GET_DESCRIPTOR(device) and no-data requests */
+typedef struct {
+    uint8_t buf[18];
+    uint16_t len;
+    uint16_t pos;
+} sim_ep0_t;
+
+/**
+ * @brief Bulk loopback: whatever is written to EP1 OUT is read back from EP1 IN
+ *
+ * OUT is NAKed while the ring is full, IN is NAKed while it is empty.
+ */
+typedef struct {
+    dwc2_sim_peer_t base;
+    sim_ep0_t ep0;
+    uint8_t ring[4096];
+    uint32_t head;
+    uint32_t count;
+} sim_loopback_t;
+
+/**
+ * @brief Mass storage target, bulk-only transport on EP1 IN / EP2 OUT
+ *
+ * Backed by a RAM disk of 512 byte blocks; the LBA wraps around the disk.
+ * Handles READ(10), WRITE(10) and TEST UNIT READY, anything else fails in the
+ * CSW. The data phase is NAKed for a media latency after each CBW.
+ */
+#define SIM_MSC_BLOCK_SIZE      512
+#define SIM_MSC_BLOCK_NUM       128
+#define SIM_MSC_LATENCY_NS      100000
+
+typedef struct {
+    dwc2_sim_peer_t base;
+    sim_ep0_t ep0;
+    uint8_t disk[SIM_MSC_BLOCK_SIZE * SIM_MSC_BLOCK_NUM];
+    enum {
+        SIM_MSC_CBW,
+        SIM_MSC_DATA_IN,
+        SIM_MSC_DATA_OUT,
+        SIM_MSC_CSW,
+    } state;
+    uint32_t tag;
+    uint32_t data_pos;
+    uint32_t data_left;
+    uint8_t status;
+    uint64_t ready_ns;
+    uint32_t commands;
+} sim_msc_t;
+
+/**
+ * @brief Keyboard-like HID device: 8 byte report on EP1 IN every interval, NAK in between
+ */
+#define SIM_HID_INTERVAL_NS     10000000ULL
+
+typedef struct {
+    dwc2_sim_peer_t base;
+    sim_ep0_t ep0;
+    uint64_t next_report_ns;
+    uint32_t reports;
+} sim_hid_t;
+
+void sim_loopback_init(sim_loopback_t *dev);
+void sim_msc_init(sim_msc_t *dev);
+void sim_hid_init(sim_hid_t *dev);
+
+#ifdef __cplusplus
+}
+#endif
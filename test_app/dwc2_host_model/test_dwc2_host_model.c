@@ -0,0 +1,621 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "dwc2_sim.h"
+#include "sim_hcd.h"
+#include "sim_peers.h"
+
+#define MPS             SIM_PEER_MPS
+#define CH_OUT          0
+#define CH_IN           1
+#define CH_INTR         2
+
+/* Split the host FIFO planner picks for a bulk IN + bulk OUT device, see test_app/dwc2_fifo_plan */
+#define PLANNED_RX      152
+#define PLANNED_NPTX    32
+#define PLANNED_PTX     16
+
+static int s_failures;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);         \
+            s_failures++;                                                    \
+        }                                                                    \
+    } while (0)
+
+#define REG_READ(offset)            dwc2_sim_readl(DWC2_SIM_BASE + (offset))
+#define REG_WRITE(offset, value)    dwc2_sim_writel(DWC2_SIM_BASE + (offset), (value))
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t bytes;
+} run_t;
+
+static void run_begin(run_t *run)
+{
+    dwc2_sim_reset_stats();
+    sim_hcd_reset_stats();
+    run->start_ns = dwc2_sim_now_ns();
+    run->bytes = 0;
+}
+
+/* One result line: simulated throughput, interrupts per MB and host CPU time per transfer */
+static double run_report(const char *name, const run_t *run)
+{
+    dwc2_sim_stats_t sim;
+    sim_hcd_stats_t hcd;
+    double sec = (dwc2_sim_now_ns() - run->start_ns) / 1e9;
+    double kbps = run->bytes / 1024.0 / sec;
+
+    dwc2_sim_get_stats(&sim);
+    sim_hcd_get_stats(&hcd);
+    printf("%-20s %8.1f KB/s %8.0f irq/MB %7.2f us cpu/xfer %6u naks\n", name, kbps,
+           run->bytes ? sim.irq_count * 1048576.0 / run->bytes : 0.0,
+           hcd.xfers ? (sim.irq_cpu_ns + hcd.submit_cpu_ns) / 1000.0 / hcd.xfers : 0.0,
+           (unsigned)sim.naks);
+    return kbps;
+}
+
+static void test_registers(void)
+{
+    dwc2_sim_stats_t stats;
+
+    dwc2_sim_reset();
+    CHECK(REG_READ(DWC2_GSNPSID) == 0x4f54400a);
+    CHECK(REG_READ(DWC2_GRSTCTL) & DWC2_GRSTCTL_AHBIDL);
+
+    // Disabling an enabled channel halts it, HCINT is write-1-to-clear
+    REG_WRITE(DWC2_HCCHAR(3), DWC2_HCCHAR_CHENA);
+    REG_WRITE(DWC2_HCCHAR(3), DWC2_HCCHAR_CHENA | DWC2_HCCHAR_CHDIS);
+    CHECK(!(REG_READ(DWC2_HCCHAR(3)) & DWC2_HCCHAR_CHENA));
+    CHECK(REG_READ(DWC2_HCINT(3)) == DWC2_HCINT_CHH);
+    REG_WRITE(DWC2_HCINTMSK(3), DWC2_HCINT_CHH);
+    REG_WRITE(DWC2_HAINTMSK, 1 << 3);
+    CHECK(REG_READ(DWC2_HAINT) == (1 << 3));
+    CHECK(REG_READ(DWC2_GINTSTS) & DWC2_GINTSTS_HCINT);
+    REG_WRITE(DWC2_HCINT(3), DWC2_HCINT_XFRC);
+    CHECK(REG_READ(DWC2_HCINT(3)) == DWC2_HCINT_CHH);
+    REG_WRITE(DWC2_HCINT(3), DWC2_HCINT_CHH);
+    CHECK(REG_READ(DWC2_HCINT(3)) == 0);
+    CHECK(!(REG_READ(DWC2_GINTSTS) & DWC2_GINTSTS_HCINT));
+
+    // FIFO flushes self-clear
+    REG_WRITE(DWC2_GRSTCTL, (0x10UL << 6) | DWC2_GRSTCTL_TXFFLSH);
+    CHECK(!(REG_READ(DWC2_GRSTCTL) & DWC2_GRSTCTL_TXFFLSH));
+    dwc2_sim_get_stats(&stats);
+    CHECK(stats.fifo_flushes == 1);
+
+    // Writing PENA back disables the port
+    sim_loopback_t dev;
+    sim_loopback_init(&dev);
+    dwc2_sim_attach(&dev.base);
+    CHECK(sim_hcd_init() == 0);
+    CHECK(REG_READ(DWC2_HPRT) & DWC2_HPRT_PENA);
+    REG_WRITE(DWC2_HPRT, REG_READ(DWC2_HPRT));
+    CHECK(!(REG_READ(DWC2_HPRT) & DWC2_HPRT_PENA));
+    printf("registers: done\n");
+}
+
+static void test_control(void)
+{
+    static const uint8_t get_device_desc[8] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 18, 0 };
+    sim_hid_t dev;
+    uint8_t *setup;
+    uint8_t *desc;
+    uint8_t pid = DWC2_PID_SETUP;
+    uint32_t actual = 0;
+
+    dwc2_sim_reset();
+    sim_hid_init(&dev);
+    dwc2_sim_attach(&dev.base);
+    CHECK(sim_hcd_init() == 0);
+    setup = dwc2_sim_dma_alloc(8);
+    desc = dwc2_sim_dma_alloc(2 * MPS);
+    memcpy(setup, get_device_desc, 8);
+
+    CHECK(sim_hcd_xfer(CH_OUT, 0x00, DWC2_EP_TYPE_CONTROL, MPS, setup, 8, &pid, NULL) == 0);
+    CHECK(pid == DWC2_PID_DATA1);
+    CHECK(sim_hcd_xfer(CH_IN, 0x80, DWC2_EP_TYPE_CONTROL, MPS, desc, 18, &pid, &actual) == 0);
+    CHECK(actual == 18);
+    CHECK(desc[0] == 18 && desc[1] == 0x01 && desc[10] == 0x03);
+    pid = DWC2_PID_DATA1;
+    CHECK(sim_hcd_xfer(CH_OUT, 0x00, DWC2_EP_TYPE_CONTROL, MPS, setup, 0, &pid, NULL) == 0);
+    printf("control: done\n");
+}
+
+static double test_loopback(const char *name, bool planned)
+{
+    const uint32_t chunk = 512;
+    const uint32_t total = 64 * 1024;
+    sim_loopback_t dev;
+    uint8_t *tx;
+    uint8_t *rx;
+    uint8_t out_pid = DWC2_PID_DATA0;
+    uint8_t in_pid = DWC2_PID_DATA0;
+    run_t run;
+
+    dwc2_sim_reset();
+    sim_loopback_init(&dev);
+    dwc2_sim_attach(&dev.base);
+    CHECK(sim_hcd_init() == 0);
+    if (planned) {
+        sim_hcd_set_fifo(PLANNED_RX, PLANNED_NPTX, PLANNED_PTX);
+    }
+    tx = dwc2_sim_dma_alloc(chunk);
+    rx = dwc2_sim_dma_alloc(chunk);
+
+    run_begin(&run);
+    for (uint32_t off = 0; off < total; off += chunk) {
+        uint32_t actual = 0;
+        for (uint32_t i = 0; i < chunk; i++) {
+            tx[i] = (uint8_t)((off + i) * 7 + (off >> 9));
+        }
+        CHECK(sim_hcd_xfer(CH_OUT, 0x01, DWC2_EP_TYPE_BULK, MPS, tx, chunk, &out_pid, NULL) == 0);
+        CHECK(sim_hcd_xfer(CH_IN, 0x81, DWC2_EP_TYPE_BULK, MPS, rx, chunk, &in_pid, &actual) == 0);
+        CHECK(actual == chunk);
+        CHECK(memcmp(tx, rx, chunk) == 0);
+        run.bytes += 2 * chunk;
+        if (s_failures) {
+            break;
+        }
+    }
+    // 2 * 8 packets per round trip, the toggle is carried over from transfer to transfer
+    CHECK(out_pid == DWC2_PID_DATA0 && in_pid == DWC2_PID_DATA0);
+    return run_report(name, &run);
+}
+
+/* Semaphore wake-up plus context switch before a class driver resubmits, typical for ESP32-S3 */
+#define TASK_LATENCY_NS     20000
+#define QUEUE_DEPTH         4
+
+typedef struct {
+    double out_kbps;
+    double in_kbps;
+} queue_result_t;
+
+/*
+ * Bulk OUT then bulk IN through the loopback, 4 KB (the loopback ring) per phase, in URBs of
+ * urb_len bytes. Single: the thread waits for each URB before submitting the next. Queued: up
+ * to QUEUE_DEPTH URBs are handed to the channel at once and chained from the ISR.
+ */
+static queue_result_t test_queue(uint32_t urb_len, bool queued)
+{
+    const uint32_t phase = 4096;
+    const uint32_t rounds = 8;
+    sim_loopback_t dev;
+    sim_hcd_urb_t urbs[QUEUE_DEPTH];
+    uint8_t *tx;
+    uint8_t *rx;
+    uint8_t out_pid = DWC2_PID_DATA0;
+    uint8_t in_pid = DWC2_PID_DATA0;
+    uint64_t out_ns = 0;
+    uint64_t in_ns = 0;
+    queue_result_t result;
+    char name[32];
+
+    dwc2_sim_reset();
+    sim_loopback_init(&dev);
+    dwc2_sim_attach(&dev.base);
+    CHECK(sim_hcd_init() == 0);
+    sim_hcd_set_fifo(PLANNED_RX, PLANNED_NPTX, PLANNED_PTX);
+    sim_hcd_set_task_latency(TASK_LATENCY_NS);
+    tx = dwc2_sim_dma_alloc(phase);
+    rx = dwc2_sim_dma_alloc(phase);
+
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (int dir = 0; dir < 2; dir++) {
+            uint8_t *buf = dir ? rx : tx;
+            uint8_t ep = dir ? 0x81 : 0x01;
+            uint8_t *pid = dir ? &in_pid : &out_pid;
+            uint64_t start = dwc2_sim_now_ns();
+
+            if (dir == 0) {
+                for (uint32_t i = 0; i < phase; i++) {
+                    tx[i] = (uint8_t)(i * 5 + r);
+                }
+            } else {
+                memset(rx, 0, phase);
+            }
+            for (uint32_t off = 0; off < phase;) {
+                if (!queued) {
+                    uint32_t actual = 0;
+                    CHECK(sim_hcd_xfer(dir ? CH_IN : CH_OUT, ep, DWC2_EP_TYPE_BULK, MPS, &buf[off], urb_len, pid, &actual) == 0);
+                    CHECK(!dir || actual == urb_len);
+                    off += urb_len;
+                    continue;
+                }
+                uint32_t num = 0;
+                for (; num < QUEUE_DEPTH && off < phase; num++, off += urb_len) {
+                    urbs[num].buf = &buf[off];
+                    urbs[num].len = urb_len;
+                }
+                CHECK(sim_hcd_xfer_queued(dir ? CH_IN : CH_OUT, ep, DWC2_EP_TYPE_BULK, MPS, urbs, num, pid) == 0);
+                for (uint32_t i = 0; i < num; i++) {
+                    CHECK(urbs[i].status == 0 && urbs[i].actual == urb_len);
+                }
+            }
+            if (dir) {
+                in_ns += dwc2_sim_now_ns() - start;
+                CHECK(memcmp(tx, rx, phase) == 0);
+            } else {
+                out_ns += dwc2_sim_now_ns() - start;
+            }
+        }
+        if (s_failures) {
+            break;
+        }
+    }
+    // 64 packets per phase and direction, an even count: the toggle must be back at DATA0
+    CHECK(out_pid == DWC2_PID_DATA0 && in_pid == DWC2_PID_DATA0);
+
+    result.out_kbps = rounds * phase / 1024.0 / (out_ns / 1e9);
+    result.in_kbps = rounds * phase / 1024.0 / (in_ns / 1e9);
+    snprintf(name, sizeof(name), "%s %u B", queued ? "queued" : "single", (unsigned)urb_len);
+    printf("%-20s out %8.1f KB/s  in %8.1f KB/s\n", name, result.out_kbps, result.in_kbps);
+    return result;
+}
+
+typedef struct {
+    uint8_t *cbw;
+    uint8_t *csw;
+    uint8_t pid_out;
+    uint8_t pid_in;
+    uint32_t tag;
+} msc_host_t;
+
+/* One bulk-only transport command: CBW, optional data phase, CSW. Returns the CSW status or -1 */
+static int msc_command(msc_host_t *host, uint8_t opcode, uint32_t lba, uint16_t blocks, uint8_t *data)
+{
+    uint8_t *cbw = host->cbw;
+    uint8_t *csw = host->csw;
+    uint32_t tag = host->tag++;
+    uint32_t len = blocks * SIM_MSC_BLOCK_SIZE;
+    uint32_t actual = 0;
+
+    memset(cbw, 0, 31);
+    cbw[0] = 0x55, cbw[1] = 0x53, cbw[2] = 0x42, cbw[3] = 0x43;
+    memcpy(&cbw[4], &tag, 4);
+    memcpy(&cbw[8], &len, 4);
+    cbw[12] = opcode == 0x28 ? 0x80 : 0x00;
+    cbw[14] = 10;
+    cbw[15] = opcode;
+    cbw[17] = lba >> 24, cbw[18] = lba >> 16, cbw[19] = lba >> 8, cbw[20] = lba;
+    cbw[22] = blocks >> 8, cbw[23] = blocks;
+
+    if (sim_hcd_xfer(CH_OUT, 0x02, DWC2_EP_TYPE_BULK, MPS, cbw, 31, &host->pid_out, NULL) != 0) {
+        return -1;
+    }
+    if (len) {
+        if (opcode == 0x28) {
+            if (sim_hcd_xfer(CH_IN, 0x81, DWC2_EP_TYPE_BULK, MPS, data, len, &host->pid_in, &actual) != 0 || actual != len) {
+                return -1;
+            }
+        } else if (sim_hcd_xfer(CH_OUT, 0x02, DWC2_EP_TYPE_BULK, MPS, data, len, &host->pid_out, NULL) != 0) {
+            return -1;
+        }
+    }
+    if (sim_hcd_xfer(CH_IN, 0x81, DWC2_EP_TYPE_BULK, MPS, csw, 13, &host->pid_in, &actual) != 0 || actual != 13) {
+        return -1;
+    }
+    if (csw[0] != 0x55 || csw[3] != 0x53 || memcmp(&csw[4], &tag, 4) != 0) {
+        return -1;
+    }
+    return csw[12];
+}
+
+static double test_msc(const char *name, bool planned)
+{
+    const uint16_t blocks = 8;
+    const uint32_t chunk = blocks * SIM_MSC_BLOCK_SIZE;
+    const uint32_t total = 32 * 1024;
+    static sim_msc_t dev;
+    msc_host_t host = { .tag = 1 };
+    uint8_t *buf;
+    char label[32];
+    run_t run;
+
+    dwc2_sim_reset();
+    sim_msc_init(&dev);
+    dwc2_sim_attach(&dev.base);
+    CHECK(sim_hcd_init() == 0);
+    if (planned) {
+        sim_hcd_set_fifo(PLANNED_RX, PLANNED_NPTX, PLANNED_PTX);
+    }
+    host.cbw = dwc2_sim_dma_alloc(31);
+    host.csw = dwc2_sim_dma_alloc(MPS);
+    buf = dwc2_sim_dma_alloc(chunk);
+
+    CHECK(msc_command(&host, 0x00, 0, 0, buf) == 0);
+    CHECK(msc_command(&host, 0x12, 0, 0, buf) == 1);  // INQUIRY is not implemented
+
+    run_begin(&run);
+    for (uint32_t off = 0; off < total; off += chunk) {
+        for (uint32_t i = 0; i < chunk; i++) {
+            buf[i] = (uint8_t)(off / chunk + i * 3);
+        }
+        CHECK(msc_command(&host, 0x2a, off / SIM_MSC_BLOCK_SIZE, blocks, buf) == 0);
+        run.bytes += chunk;
+    }
+    snprintf(label, sizeof(label), "%s write", name);
+    run_report(label, &run);
+
+    run_begin(&run);
+    for (uint32_t off = 0; off < total; off += chunk) {
+        CHECK(msc_command(&host, 0x28, off / SIM_MSC_BLOCK_SIZE, blocks, buf) == 0);
+        for (uint32_t i = 0; i < chunk; i++) {
+            if (buf[i] != (uint8_t)(off / chunk + i * 3)) {
+                CHECK(buf[i] == (uint8_t)(off / chunk + i * 3));
+                break;
+            }
+        }
+        run.bytes += chunk;
+    }
+    snprintf(label, sizeof(label), "%s read", name);
+    return run_report(label, &run);
+}
+
+static void test_hid(void)
+{
+    const uint64_t duration_ns = 200ULL * 1000 * 1000;
+    sim_hid_t dev;
+    uint8_t *report;
+    uint8_t pid = DWC2_PID_DATA0;
+    uint32_t received = 0;
+    uint32_t last = 0;
+    run_t run;
+
+    dwc2_sim_reset();
+    sim_hid_init(&dev);
+    dwc2_sim_attach(&dev.base);
+    CHECK(sim_hcd_init() == 0);
+    report = dwc2_sim_dma_alloc(MPS);
+
+    run_begin(&run);
+    while (dwc2_sim_now_ns() - run.start_ns < duration_ns) {
+        uint32_t actual = 0;
+        uint32_t seq;
+        if (sim_hcd_xfer(CH_INTR, 0x81, DWC2_EP_TYPE_INTR, 8, report, 8, &pid, &actual) != 0) {
+            CHECK(0);
+            break;
+        }
+        CHECK(actual == 8);
+        memcpy(&seq, &report[4], 4);
+        CHECK(received == 0 || seq == last + 1);
+        last = seq;
+        received++;
+        run.bytes += actual;
+    }
+    CHECK(received >= 19 && received <= 21);
+    run_report("hid", &run);
+}
+
+#define MUX_HID_MAX         12
+#define MUX_HID_INTERVAL    4           // bInterval of the HID endpoints, frames
+#define MUX_PHASE           4096
+#define MUX_SLICE_PACKETS   16
+#define MUX_DURATION_NS     (200ULL * 1000 * 1000)
+
+/* Stand-in for the devices behind a hub: the loopback on EP1 and one HID per endpoint from EP2 */
+typedef struct {
+    dwc2_sim_peer_t base;
+    sim_loopback_t loopback;
+    sim_hid_t hid[MUX_HID_MAX];
+    uint32_t hid_num;
+} mux_peer_t;
+
+static dwc2_sim_resp_t mux_setup(dwc2_sim_peer_t *peer, const uint8_t setup[8])
+{
+    mux_peer_t *dev = (mux_peer_t *)peer;
+    return dev->loopback.base.setup(&dev->loopback.base, setup);
+}
+
+static dwc2_sim_resp_t mux_in(dwc2_sim_peer_t *peer, uint8_t ep, uint8_t *buf, uint16_t mps, uint16_t *len, uint64_t now_ns)
+{
+    mux_peer_t *dev = (mux_peer_t *)peer;
+
+    if (ep >= 2 && ep < 2 + dev->hid_num) {
+        return dev->hid[ep - 2].base.in(&dev->hid[ep - 2].base, 1, buf, mps, len, now_ns);
+    }
+    return dev->loopback.base.in(&dev->loopback.base, ep, buf, mps, len, now_ns);
+}
+
+static dwc2_sim_resp_t mux_out(dwc2_sim_peer_t *peer, uint8_t ep, const uint8_t *buf, uint16_t len, uint64_t now_ns)
+{
+    mux_peer_t *dev = (mux_peer_t *)peer;
+    return dev->loopback.base.out(&dev->loopback.base, ep, buf, len, now_ns);
+}
+
+typedef struct {
+    mux_peer_t dev;
+    sim_hcd_vpipe_t out;
+    sim_hcd_vpipe_t in;
+    sim_hcd_vpipe_t hid[MUX_HID_MAX];
+    uint8_t *tx;
+    uint8_t *rx;
+    uint8_t *report[MUX_HID_MAX];
+    uint32_t received[MUX_HID_MAX];
+    uint32_t last[MUX_HID_MAX];
+    uint32_t round;
+    uint64_t bytes;
+    bool broken;
+} mux_host_t;
+
+static mux_host_t s_mux;
+
+static bool never_done(void *arg)
+{
+    return false;
+}
+
+static void mux_fill(void)
+{
+    for (uint32_t i = 0; i < MUX_PHASE; i++) {
+        s_mux.tx[i] = (uint8_t)(i * 13 + s_mux.round * 7);
+    }
+}
+
+static void mux_out_done(sim_hcd_vpipe_t *pipe)
+{
+    if (pipe->status != 0 || pipe->actual != MUX_PHASE) {
+        s_mux.broken = true;
+        return;
+    }
+    s_mux.bytes += pipe->actual;
+    sim_hcd_vpipe_submit(&s_mux.in, s_mux.rx, MUX_PHASE);
+}
+
+static void mux_in_done(sim_hcd_vpipe_t *pipe)
+{
+    if (pipe->status != 0 || pipe->actual != MUX_PHASE || memcmp(s_mux.tx, s_mux.rx, MUX_PHASE) != 0) {
+        s_mux.broken = true;
+        return;
+    }
+    s_mux.bytes += pipe->actual;
+    s_mux.round++;
+    mux_fill();
+    sim_hcd_vpipe_submit(&s_mux.out, s_mux.tx, MUX_PHASE);
+}
+
+static void mux_hid_done(sim_hcd_vpipe_t *pipe)
+{
+    uint32_t i = pipe - s_mux.hid;
+    uint32_t seq;
+
+    if (pipe->status != 0 || pipe->actual != 8) {
+        s_mux.broken = true;
+        return;
+    }
+    memcpy(&seq, &s_mux.report[i][4], 4);
+    if (s_mux.received[i] && seq != s_mux.last[i] + 1) {
+        s_mux.broken = true;
+    }
+    s_mux.last[i] = seq;
+    s_mux.received[i]++;
+    sim_hcd_vpipe_submit(pipe, s_mux.report[i], 8);
+}
+
+/*
+ * Loopback traffic alongside hid_num HID endpoints for 200 ms, on the first `channels`
+ * channels. slice_packets 0 gives every endpoint its own channel like the port does,
+ * otherwise they are virtual pipes. Returns the bulk throughput, -1 if they did not fit.
+ */
+static double test_mux(const char *name, uint32_t hid_num, int channels, uint32_t slice_packets)
+{
+    sim_hcd_vpipe_t *pipes[2 + MUX_HID_MAX];
+    uint32_t pipe_num = 0;
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    dwc2_sim_stats_t sim;
+    sim_hcd_stats_t hcd;
+    uint64_t start;
+    double ms;
+    double kbps;
+
+    memset(&s_mux, 0, sizeof(s_mux));
+    dwc2_sim_reset();
+    sim_loopback_init(&s_mux.dev.loopback);
+    for (uint32_t i = 0; i < hid_num; i++) {
+        sim_hid_init(&s_mux.dev.hid[i]);
+        // Spread the reports over the interval
+        s_mux.dev.hid[i].next_report_ns = i * SIM_HID_INTERVAL_NS / hid_num;
+    }
+    s_mux.dev.hid_num = hid_num;
+    s_mux.dev.base.name = "mux";
+    s_mux.dev.base.setup = mux_setup;
+    s_mux.dev.base.in = mux_in;
+    s_mux.dev.base.out = mux_out;
+    dwc2_sim_attach(&s_mux.dev.base);
+    CHECK(sim_hcd_init() == 0);
+
+    s_mux.tx = dwc2_sim_dma_alloc(MUX_PHASE);
+    s_mux.rx = dwc2_sim_dma_alloc(MUX_PHASE);
+    s_mux.out = (sim_hcd_vpipe_t) { .ep_addr = 0x01, .ep_type = DWC2_EP_TYPE_BULK, .mps = MPS, .complete = mux_out_done };
+    s_mux.in = (sim_hcd_vpipe_t) { .ep_addr = 0x81, .ep_type = DWC2_EP_TYPE_BULK, .mps = MPS, .complete = mux_in_done };
+    pipes[pipe_num++] = &s_mux.out;
+    pipes[pipe_num++] = &s_mux.in;
+    for (uint32_t i = 0; i < hid_num; i++) {
+        s_mux.report[i] = dwc2_sim_dma_alloc(8);
+        s_mux.hid[i] = (sim_hcd_vpipe_t) {
+            .ep_addr = 0x82 + i, .ep_type = DWC2_EP_TYPE_INTR, .mps = 8,
+            .interval = MUX_HID_INTERVAL, .complete = mux_hid_done,
+        };
+        pipes[pipe_num++] = &s_mux.hid[i];
+    }
+    if (sim_hcd_sched_start(pipes, pipe_num, channels, slice_packets) < 0) {
+        printf("%-24s needs %u channels, has %d\n", name, (unsigned)pipe_num, channels);
+        return -1;
+    }
+
+    dwc2_sim_reset_stats();
+    sim_hcd_reset_stats();
+    start = dwc2_sim_now_ns();
+    mux_fill();
+    sim_hcd_vpipe_submit(&s_mux.out, s_mux.tx, MUX_PHASE);
+    for (uint32_t i = 0; i < hid_num; i++) {
+        sim_hcd_vpipe_submit(&s_mux.hid[i], s_mux.report[i], 8);
+    }
+    dwc2_sim_run_until(never_done, NULL, MUX_DURATION_NS);
+    sim_hcd_sched_stop();
+
+    dwc2_sim_get_stats(&sim);
+    sim_hcd_get_stats(&hcd);
+    ms = (dwc2_sim_now_ns() - start) / 1e6;
+    kbps = s_mux.bytes / 1024.0 / (ms / 1000);
+    for (uint32_t i = 0; i < hid_num; i++) {
+        // Every report the device handed out arrived, in order
+        CHECK(s_mux.received[i] == s_mux.dev.hid[i].reports);
+        CHECK(s_mux.received[i] >= MUX_DURATION_NS / (SIM_HID_INTERVAL_NS + MUX_HID_INTERVAL * 1000000ULL));
+        sent += s_mux.dev.hid[i].reports;
+        received += s_mux.received[i];
+    }
+    CHECK(!s_mux.broken);
+    printf("%-24s %8.1f KB/s %4u/%-4u reports %6.2f programs/ms %6.2f irq/ms %6.0f ns/program\n", name, kbps,
+           (unsigned)received, (unsigned)sent, hcd.chan_programs / ms, sim.irq_count / ms,
+           hcd.chan_programs ? (double)hcd.submit_cpu_ns / hcd.chan_programs : 0.0);
+    return kbps;
+}
+
+int main(void)
+{
+    double kbps_default;
+    double kbps_planned;
+    double kbps_dedicated;
+    double kbps_vpipe;
+
+    test_registers();
+    test_control();
+
+    kbps_default = test_loopback("loopback default", false);
+    kbps_planned = test_loopback("loopback planned", true);
+    CHECK(kbps_planned > kbps_default);
+
+    kbps_default = test_msc("msc default", false);
+    kbps_planned = test_msc("msc planned", true);
+    CHECK(kbps_planned > kbps_default);
+
+    test_hid();
+
+    for (uint32_t urb_len = 64; urb_len <= 512; urb_len *= 8) {
+        queue_result_t single = test_queue(urb_len, false);
+        queue_result_t queued = test_queue(urb_len, true);
+        CHECK(queued.out_kbps > single.out_kbps);
+        CHECK(queued.in_kbps > single.in_kbps);
+    }
+
+    kbps_dedicated = test_mux("dedicated 4 hid, 8 ch", 4, DWC2_SIM_CHANNEL_NUM, 0);
+    kbps_vpipe = test_mux("vpipe 4 hid, 8 ch", 4, DWC2_SIM_CHANNEL_NUM, MUX_SLICE_PACKETS);
+    CHECK(kbps_vpipe > 0.9 * kbps_dedicated);
+    CHECK(test_mux("vpipe 4 hid, 2 ch", 4, 2, MUX_SLICE_PACKETS) > 0);
+    CHECK(test_mux("dedicated 12 hid, 8 ch", MUX_HID_MAX, DWC2_SIM_CHANNEL_NUM, 0) < 0);
+    CHECK(test_mux("vpipe 12 hid, 8 ch", MUX_HID_MAX, DWC2_SIM_CHANNEL_NUM, MUX_SLICE_PACKETS) > 0);
+
+    printf("%d failure(s)\n", s_failures);
+    return s_failures ? 1 : 0;
+}
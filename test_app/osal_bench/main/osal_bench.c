@@ -0,0 +1,331 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "usb_osal.h"
+#include "usb_osal_ext.h"
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#define BENCH_CORES portNUM_PROCESSORS
+
+static uint64_t bench_now_us(void)
+{
+    return esp_timer_get_time();
+}
+#else
+#define BENCH_CORES 1
+
+#include <time.h>
+
+static uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+#define BENCH_ITERATIONS    2000
+#define BENCH_STACK_SIZE    4096
+#define BENCH_PRIO          4
+
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t count;
+} bench_result_t;
+
+static void bench_result_add(bench_result_t *result, uint32_t us)
+{
+    if (result->count == 0 || us < result->min) {
+        result->min = us;
+    }
+    if (us > result->max) {
+        result->max = us;
+    }
+    result->total += us;
+    result->count++;
+}
+
+static void bench_result_print(const char *name, const bench_result_t *result)
+{
+    printf("%-4s n=%" PRIu32 " min=%" PRIu32 "us avg=%" PRIu64 "us max=%" PRIu32 "us\n",
+           name, result->count, result->min, result->total / result->count, result->max);
+}
+
+typedef usb_osal_mq_t (*bench_mq_create_t)(uint32_t max_msgs);
+
+/* 在目标芯片上把回显线程固定到指定核心，以便对比同核与跨核的唤醒延迟 */
+static void bench_thread_create(const char *name, usb_thread_entry_t entry, void *args, int core)
+{
+#ifdef ESP_PLATFORM
+    xTaskCreatePinnedToCore(entry, name, BENCH_STACK_SIZE, args, configMAX_PRIORITIES - 1 - BENCH_PRIO, NULL, core);
+#else
+    (void)core;
+    usb_osal_thread_create(name, BENCH_STACK_SIZE, BENCH_PRIO, entry, args);
+#endif
+}
+
+static usb_osal_sem_t s_ping_sem;
+static usb_osal_sem_t s_pong_sem;
+static usb_osal_mq_t s_ping_mq;
+static usb_osal_mq_t s_pong_mq;
+static usb_osal_sem_t s_done_sem;
+
+static void sem_echo_thread(void *argument)
+{
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        usb_osal_sem_take(s_ping_sem, USB_OSAL_WAITING_FOREVER);
+        usb_osal_sem_give(s_pong_sem);
+    }
+    usb_osal_sem_give(s_done_sem);
+    usb_osal_thread_delete(NULL);
+}
+
+static void mq_echo_thread(void *argument)
+{
+    uintptr_t msg;
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        usb_osal_mq_recv(s_ping_mq, &msg, USB_OSAL_WAITING_FOREVER);
+        usb_osal_mq_send(s_pong_mq, msg);
+    }
+    usb_osal_sem_give(s_done_sem);
+    usb_osal_thread_delete(NULL);
+}
+
+static void bench_sem(void)
+{
+    bench_result_t result = { 0 };
+
+    s_ping_sem = usb_osal_sem_create(0);
+    s_pong_sem = usb_osal_sem_create(0);
+    bench_thread_create("sem_echo", sem_echo_thread, NULL, 0);
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = bench_now_us();
+        usb_osal_sem_give(s_ping_sem);
+        usb_osal_sem_take(s_pong_sem, USB_OSAL_WAITING_FOREVER);
+        bench_result_add(&result, bench_now_us() - start);
+    }
+    usb_osal_sem_take(s_done_sem, USB_OSAL_WAITING_FOREVER);
+    usb_osal_sem_delete(s_ping_sem);
+    usb_osal_sem_delete(s_pong_sem);
+    printf("core0 ");
+    bench_result_print("sem", &result);
+}
+
+#ifdef ESP_PLATFORM
+#define BENCH_MEM_COUNT 16
+
+static void bench_sem_memory(void)
+{
+    usb_osal_sem_t sems[BENCH_MEM_COUNT];
+    size_t before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+
+    for (int i = 0; i < BENCH_MEM_COUNT; i++) {
+        sems[i] = usb_osal_sem_create(0);
+    }
+    size_t used = before - heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    for (int i = 0; i < BENCH_MEM_COUNT; i++) {
+        usb_osal_sem_delete(sems[i]);
+    }
+    printf("sem  mem=%u bytes each (incl. heap overhead)\n", (unsigned)(used / BENCH_MEM_COUNT));
+}
+#endif
+
+static void bench_mq(const char *name, bench_mq_create_t create, int core)
+{
+    bench_result_t result = { 0 };
+    uintptr_t msg;
+
+    s_ping_mq = create(4);
+    s_pong_mq = create(4);
+    bench_thread_create("mq_echo", mq_echo_thread, NULL, core);
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = bench_now_us();
+        usb_osal_mq_send(s_ping_mq, (uintptr_t)i);
+        usb_osal_mq_recv(s_pong_mq, &msg, USB_OSAL_WAITING_FOREVER);
+        bench_result_add(&result, bench_now_us() - start);
+    }
+    usb_osal_sem_take(s_done_sem, USB_OSAL_WAITING_FOREVER);
+    usb_osal_mq_delete(s_ping_mq);
+    usb_osal_mq_delete(s_pong_mq);
+    printf("core%d ", core);
+    bench_result_print(name, &result);
+}
+
+#define BENCH_TIMER_TICKS 200
+
+static uint64_t s_timer_last_us;
+static uint32_t s_timer_period_us;
+static volatile int s_timer_ticks;
+static bench_result_t s_timer_result;
+
+/* 记录每次回调相对上一次的偏差；该回调在 ISR 派发模式下也只做这些 ISR 安全的操作 */
+static void bench_timer_handler(void *argument)
+{
+    uint64_t now = bench_now_us();
+
+    if (s_timer_ticks > 0 && s_timer_ticks <= BENCH_TIMER_TICKS) {
+        uint32_t interval = now - s_timer_last_us;
+        bench_result_add(&s_timer_result, interval > s_timer_period_us ? interval - s_timer_period_us : s_timer_period_us - interval);
+    }
+    s_timer_last_us = now;
+    if (++s_timer_ticks == BENCH_TIMER_TICKS + 1) {
+        usb_osal_sem_give(s_done_sem);
+    }
+}
+
+static void bench_timer(uint32_t period_ms)
+{
+    struct usb_osal_timer *timer;
+    char name[16];
+
+    memset(&s_timer_result, 0, sizeof(s_timer_result));
+    s_timer_ticks = 0;
+    s_timer_period_us = period_ms * 1000;
+    timer = usb_osal_timer_create("bench_tmr", period_ms, bench_timer_handler, NULL, true);
+    if (timer == NULL) {
+        printf("timer %" PRIu32 "ms create failed\n", period_ms);
+        return;
+    }
+    usb_osal_timer_start(timer);
+    usb_osal_sem_take(s_done_sem, USB_OSAL_WAITING_FOREVER);
+    usb_osal_timer_stop(timer);
+    usb_osal_timer_delete(timer);
+    snprintf(name, sizeof(name), "t%" PRIu32 "ms", period_ms);
+    bench_result_print(name, &s_timer_result);
+}
+
+#define BENCH_LOCK_DEVICES    4
+#define BENCH_LOCK_ITERATIONS 20000
+
+static usb_osal_lock_t s_dev_locks[BENCH_LOCK_DEVICES];
+static usb_osal_sem_t s_dev_done[BENCH_LOCK_DEVICES];
+static volatile uint32_t s_dev_counters[BENCH_LOCK_DEVICES];
+static bool s_lock_global;
+
+/* 模拟 hub 下多个设备各自的 URB 簿记：每次持锁只做少量更新 */
+static void lock_worker_thread(void *argument)
+{
+    int dev = (int)(uintptr_t)argument;
+    size_t flags;
+
+    for (int i = 0; i < BENCH_LOCK_ITERATIONS; i++) {
+        if (s_lock_global) {
+            flags = usb_osal_enter_critical_section();
+        } else {
+            flags = usb_osal_lock_enter(s_dev_locks[dev]);
+        }
+        for (int k = 0; k < 8; k++) {
+            s_dev_counters[dev]++;
+        }
+        if (s_lock_global) {
+            usb_osal_leave_critical_section(flags);
+        } else {
+            usb_osal_lock_leave(s_dev_locks[dev], flags);
+        }
+    }
+    /* OSAL 信号量最大计数为 1，每个线程单独通知完成 */
+    usb_osal_sem_give(s_dev_done[dev]);
+    usb_osal_thread_delete(NULL);
+}
+
+static void bench_lock(bool global)
+{
+    usb_osal_lock_stats_t total = { 0 };
+    usb_osal_lock_stats_t stats;
+    bool has_stats = true;
+    uint64_t start;
+    uint32_t elapsed_us;
+
+    s_lock_global = global;
+    for (int dev = 0; dev < BENCH_LOCK_DEVICES; dev++) {
+        s_dev_locks[dev] = usb_osal_lock_create();
+        s_dev_done[dev] = usb_osal_sem_create(0);
+        s_dev_counters[dev] = 0;
+    }
+    usb_osal_lock_reset_stats(usb_osal_global_lock());
+    start = bench_now_us();
+    for (int dev = 0; dev < BENCH_LOCK_DEVICES; dev++) {
+        bench_thread_create("lock_dev", lock_worker_thread, (void *)(uintptr_t)dev, dev % BENCH_CORES);
+    }
+    for (int dev = 0; dev < BENCH_LOCK_DEVICES; dev++) {
+        usb_osal_sem_take(s_dev_done[dev], USB_OSAL_WAITING_FOREVER);
+    }
+    elapsed_us = bench_now_us() - start;
+
+    for (int dev = 0; dev < BENCH_LOCK_DEVICES; dev++) {
+        usb_osal_lock_t lock = global ? usb_osal_global_lock() : s_dev_locks[dev];
+        if (usb_osal_lock_get_stats(lock, &stats) != 0) {
+            has_stats = false;
+            break;
+        }
+        total.acquisitions += stats.acquisitions;
+        total.contended += stats.contended;
+        total.total_hold_ns += stats.total_hold_ns;
+        if (stats.max_hold_ns > total.max_hold_ns) {
+            total.max_hold_ns = stats.max_hold_ns;
+        }
+        if (global) {
+            break;
+        }
+    }
+    for (int dev = 0; dev < BENCH_LOCK_DEVICES; dev++) {
+        usb_osal_lock_delete(s_dev_locks[dev]);
+        usb_osal_sem_delete(s_dev_done[dev]);
+    }
+
+    printf("%-6s devs=%d elapsed=%" PRIu32 "us", global ? "global" : "perdev", BENCH_LOCK_DEVICES, elapsed_us);
+    if (has_stats && total.acquisitions) {
+        printf(" acq=%" PRIu32 " contended=%" PRIu32 " hold avg=%" PRIu64 "ns max=%" PRIu32 "ns",
+               total.acquisitions, total.contended, total.total_hold_ns / total.acquisitions, total.max_hold_ns);
+    }
+    printf("\n");
+}
+
+static void osal_bench_run(void)
+{
+    s_done_sem = usb_osal_sem_create(0);
+    bench_sem();
+#ifdef ESP_PLATFORM
+    bench_sem_memory();
+#endif
+    for (int core = 0; core < BENCH_CORES; core++) {
+        bench_mq("mq", usb_osal_mq_create, core);
+#ifdef ESP_PLATFORM
+        /* Linux 下 usb_osal_mq_create_spsc() 即普通队列，不单独测量 */
+        bench_mq("spsc", usb_osal_mq_create_spsc, core);
+#endif
+    }
+    for (uint32_t period_ms = 1; period_ms <= 8; period_ms <<= 1) {
+        bench_timer(period_ms);
+    }
+    bench_lock(true);
+    bench_lock(false);
+    usb_osal_sem_delete(s_done_sem);
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void)
+{
+    osal_bench_run();
+}
+#else
+int main(void)
+{
+    osal_bench_run();
+    return 0;
+}
+#endif